@@ -2,6 +2,7 @@
 
 #include <base/assert.h>
 #include <base/attributes.h>
+#include <base/hasher.h>
 
 #include STL(algorithm)
 
@@ -12,12 +13,51 @@
 namespace dist_clang {
 
 namespace {
-auto NoopDeleter = [](const char*) {};
-auto CharArrayDeleter = std::default_delete<const char[]>();
+
+#if !defined(OS_WIN)
+struct Mapping {
+  ~Mapping() { munmap(ptr, size); }
+
+  void* ptr;
+  size_t size;
+};
+#endif
+
 }  // namespace
 
 namespace base {
 
+struct ConstString::Storage {
+  virtual ~Storage() {}
+
+  Atomic<ui32> references = {1};
+};
+
+// The chars follow the header in the same allocation.
+struct ConstString::BufferStorage : public ConstString::Storage {
+  static BufferStorage* New(size_t size) {
+    return new (::operator new(sizeof(BufferStorage) + size + 1))
+        BufferStorage;
+  }
+
+  static void operator delete(void* ptr) { ::operator delete(ptr); }
+
+  char* chars() { return reinterpret_cast<char*>(this + 1); }
+};
+
+// Owns the chars allocated somewhere else.
+template <class Owner>
+struct ConstString::OwnerStorage : public ConstString::Storage {
+  template <class... Args>
+  explicit OwnerStorage(Args&&... args) : owner{std::forward<Args>(args)...} {}
+
+  Owner owner;
+};
+
+struct ConstString::RopeStorage : public ConstString::Storage {
+  Vector<ConstString> parts;
+};
+
 // static
 const Literal Literal::empty = "";
 
@@ -27,43 +67,40 @@ ConstString::ConstString(bool assignable) : assignable_(assignable) {
   DCHECK(assignable);
 }
 
-ConstString::ConstString(Literal str)
-    : internals_(
-          new Internal{.string = {str.str_, NoopDeleter}, .null_end = true}),
-      size_(strlen(str.str_)) {
-  DCHECK(str.str_[size_] == '\0');
+ConstString::ConstString(Literal str) : size_(strlen(str.str_)) {
+  InitStorage(nullptr, str.str_, true);
 }
 
-ConstString::ConstString(UniquePtr<char[]>& str)
-    : internals_(new Internal{.string = {str.release(), CharArrayDeleter},
-                              .null_end = true}),
-      size_(strlen(internals_->string.get())) {}
+ConstString::ConstString(UniquePtr<char[]>& str) : size_(strlen(str.get())) {
+  InitArray(str.release(), true);
+}
 
-ConstString::ConstString(char str[], size_t size)
-    : internals_(new Internal{.string = {str, CharArrayDeleter}}),
-      size_(size) {}
+ConstString::ConstString(char str[], size_t size) : size_(size) {
+  InitArray(str, false);
+}
 
 #if !defined(OS_WIN)
-ConstString::ConstString(void* str, size_t size)
-    : internals_(new Internal{
-          .string = {reinterpret_cast<char*>(str),
-                     [str, size](const char*) { munmap(str, size); }}}),
-      size_(size) {}
+ConstString::ConstString(void* str, size_t size) : size_(size) {
+  InitStorage(new OwnerStorage<Mapping>(str, size),
+              reinterpret_cast<const char*>(str), false);
+}
 #endif
 
-ConstString::ConstString(UniquePtr<char[]>& str, size_t size)
-    : internals_(new Internal{.string = {str.release(), CharArrayDeleter}}),
-      size_(size) {}
+ConstString::ConstString(UniquePtr<char[]>& str, size_t size) : size_(size) {
+  InitArray(str.release(), false);
+}
 
 ConstString::ConstString(String&& str) {
-  SharedPtr<String> medium(new String(std::move(str)));
-  SharedPtr<const char> string(medium->data(), NoopDeleter);
-  size_ = medium->size();
+  DCHECK(str.data()[str.size()] == '\0');
 
-  DCHECK(medium->data()[size_] == '\0');
+  if (str.size() <= kMaxInlineSize) {
+    memcpy(InitBuffer(str.size()), str.data(), str.size());
+    return;
+  }
 
-  internals_.reset(
-      new Internal{.medium = medium, .string = string, .null_end = true});
+  auto* storage = new OwnerStorage<String>(std::move(str));
+  size_ = storage->owner.size();
+  InitStorage(storage, storage->owner.data(), true);
 }
 
 ConstString::ConstString(String* str) : ConstString(std::move(*str)) {
@@ -72,35 +109,50 @@ ConstString::ConstString(String* str) : ConstString(std::move(*str)) {
 }
 
 ConstString::ConstString(Rope&& rope)
-    : internals_(new Internal{.rope = std::move(rope)}) {
-  for (const auto& str : internals_->rope) {
-    size_ += str.size_;
-  }
-}
+    : ConstString(static_cast<const Rope&>(rope)) {}
 
 ConstString::ConstString(Rope&& rope, size_t hint_size)
-    : internals_(new Internal{.rope = std::move(rope)}), size_(hint_size) {}
+    : ConstString(static_cast<const Rope&>(rope), hint_size) {}
 
-ConstString::ConstString(const Rope& rope)
-    : internals_(new Internal{.rope = rope}) {
+ConstString::ConstString(const Rope& rope) : ConstString(rope, String::npos) {}
+
+ConstString::ConstString(const Rope& rope, size_t hint_size) {
+  size_t size = 0;
   for (const auto& str : rope) {
-    size_ += str.size_;
+    size += str.size_;
+  }
+  size = std::min(size, hint_size);
+
+  // The short ropes are collapsed right away.
+  if (size <= kMaxInlineSize) {
+    char* ptr = InitBuffer(size);
+    for (const auto& str : rope) {
+      const size_t part_size = std::min(size, str.size_);
+      str.CopyTo(ptr, part_size);
+      ptr += part_size;
+      size -= part_size;
+    }
+    return;
   }
-}
 
-ConstString::ConstString(const Rope& rope, size_t hint_size)
-    : internals_(new Internal{.rope = rope}), size_(hint_size) {}
+  auto* storage = new RopeStorage;
+  storage->parts.reserve(rope.size());
+  size_t left_size = size;
+  for (const auto& str : rope) {
+    const size_t part_size = std::min(left_size, str.size_);
+    Flatten(str, part_size, &storage->parts);
+    left_size -= part_size;
+  }
+  InitRope(storage, size);
+}
 
-ConstString::ConstString(ConstString& str, size_t size)
-    : internals_(str.internals_), size_(std::min(size, str.size())) {}
+ConstString::ConstString(ConstString& str, size_t size) {
+  CopyFrom(str);
+  Truncate(std::min(size, str.size()));
+}
 
-ConstString::ConstString(const String& str)
-    : internals_(
-          new Internal{.string = {new char[str.size() + 1], CharArrayDeleter},
-                       .null_end = true}),
-      size_(str.size()) {
-  memcpy(const_cast<char*>(internals_->string.get()), str.data(), size_ + 1);
-  DCHECK(str.data()[size_] == '\0');
+ConstString::ConstString(const String& str) {
+  memcpy(InitBuffer(str.size()), str.data(), str.size());
 }
 
 ConstString::ConstString(const Path& path) : ConstString(path.string()) {}
@@ -110,55 +162,42 @@ ConstString ConstString::WrapString(const String& str) {
   return ConstString(str.c_str(), str.size(), true);
 }
 
-String ConstString::string_copy(bool collapse) {
-  auto internals = internals_;
-
-  if (collapse) {
-    internals = CollapseRope();
-    DCHECK(internals->string || !size_);
-    return String(internals->string.get(), size_);
-  }
+ConstString::ConstString(const ConstString& other)
+    : assignable_(other.assignable_), assign_once_(other.assign_once_) {
+  CopyFrom(other);
+}
 
-  if (internals->rope.empty()) {
-    DCHECK(internals->string || !size_);
-    return String(internals->string.get(), size_);
-  }
+ConstString::ConstString(ConstString&& other)
+    : assignable_(other.assignable_), assign_once_(other.assign_once_) {
+  MoveFrom(other);
+}
 
-  String result;
-  result.reserve(size_);
+ConstString::~ConstString() {
+  Release();
+}
 
-  DCHECK(!size_ || !internals->rope.empty());
-  for (const auto& str : internals->rope) {
-    result += str;
+String ConstString::string_copy(bool collapse) {
+  if (collapse) {
+    CollapseRope();
+    return String(chars(), size_);
   }
 
-  return result;
+  return string_copy();
 }
 
 String ConstString::string_copy() const {
-  auto internals = internals_;
-
-  if (internals->rope.empty()) {
-    DCHECK(internals->string || !size_);
-    return String(internals->string.get(), size_);
-  }
-
-  String result;
-  result.reserve(size_);
-
-  DCHECK(!size_ || !internals->rope.empty());
-  for (const auto& str : internals->rope) {
-    result += str;
-  }
-
+  String result(size_, '\0');
+  CopyTo(&result[0], size_);
   return result;
 }
 
 void ConstString::assign(const ConstString& other) {
   DCHECK(assignable_);
 
-  internals_ = other.internals_;
-  size_ = other.size_;
+  // The |other| may be a part of this rope - so keep it alive.
+  ConstString copy(other);
+  Release();
+  MoveFrom(copy);
 
   if (assign_once_) {
     assignable_ = false;
@@ -166,22 +205,23 @@ void ConstString::assign(const ConstString& other) {
 }
 
 const char* ConstString::data() {
-  auto internals = CollapseRope();
-  DCHECK(internals->string || !size_);
-  return internals->string.get();
+  CollapseRope();
+  return chars();
 }
 
 const char* ConstString::c_str() {
   CollapseRope();
-  auto internals = NullTerminate();
-  DCHECK(internals->string);
-  return internals->string.get();
+  NullTerminate();
+  return chars();
 }
 
 bool ConstString::operator==(const ConstString& other) const {
   if (size_ != other.size_) {
     return false;
   }
+  if (kind_ != ROPE && other.kind_ != ROPE) {
+    return memcmp(chars(), other.chars(), size_) == 0;
+  }
   for (size_t i = 0; i < size_; ++i) {
     if (this->operator[](i) != other[i]) {
       return false;
@@ -210,10 +250,8 @@ size_t ConstString::find(const char* str) const {
   size_t sp = 0;
   i64 kp = 0;
 
-  auto internals = internals_;
-
   while (sp < size_) {
-    while (kp != -1 && (kp == str_size || str[kp] != at(internals.get(), sp))) {
+    while (kp != -1 && (kp == str_size || str[kp] != at(sp))) {
       kp = t[kp];
     }
     kp++;
@@ -228,302 +266,242 @@ size_t ConstString::find(const char* str) const {
 
 const char& ConstString::operator[](size_t index) const {
   DCHECK(index < size_);
-
-  auto internals = internals_;
-
-  return at(internals.get(), index);
+  return at(index);
 }
 
 ConstString ConstString::operator+(const ConstString& other) const {
-  auto internals = internals_;
-
-  if (!internals->rope.empty()) {
-    Rope rope = internals->rope;
-    rope.push_back(other);
-    return rope;
+  ConstString result(""_l);
+  const size_t size = size_ + other.size_;
+
+  if (size <= kMaxInlineSize) {
+    char* ptr = result.InitBuffer(size);
+    CopyTo(ptr, size_);
+    other.CopyTo(ptr + size_, other.size_);
+    return result;
   }
 
-  return Rope{*this, other};
+  auto* storage = new RopeStorage;
+  storage->parts.reserve(2);
+  Flatten(*this, size_, &storage->parts);
+  Flatten(other, other.size_, &storage->parts);
+  result.InitRope(storage, size);
+  return result;
 }
 
 ConstString ConstString::Hash(ui8 output_size) const {
-  // Implements the algorithm MurmurHash3 for x64 with 128 bits.
+  // The parts of a rope are hashed in place.
+  Hasher hasher;
+  hasher.Update(*this);
+  return hasher.Digest(output_size);
+}
 
-  if (empty()) {
-    // FIXME: replace with a real value for an empty string.
-    return {new char[16]{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, 16};
-  }
+ConstString::ConstString(const char* WEAK_PTR str, size_t size, bool null_end)
+    : size_(size) {
+  InitStorage(nullptr, str, null_end);
+}
 
-  const ui64 block_size = 8;
+// static
+ConstString ConstString::Copy(const char* str, size_t size) {
+  ConstString result(""_l);
+  memcpy(result.InitBuffer(size), str, size);
+  return result;
+}
 
-  char* buf = new char[16];
-  const ui64 double_blocks = size() / 16;
-  ui64 h1 = 0, h2 = 0;
-  const ui64 c1 = 0x87c37b91114253d5LLU, c2 = 0x4cf5ad432745937fLLU;
+// static
+void ConstString::Flatten(const ConstString& str, size_t size,
+                          Vector<ConstString>* parts) {
+  if (!size) {
+    return;
+  }
 
-  const ui64* ptr = nullptr;
-  Rope::iterator it;
-  ui64 ptr_size = 0;
+  if (str.kind_ == ROPE) {
+    for (const auto& part : str.parts()) {
+      if (!size) {
+        break;
+      }
+      const size_t part_size = std::min(size, part.size_);
+      Flatten(part, part_size, parts);
+      size -= part_size;
+    }
+    return;
+  }
 
-  auto internals = internals_;
-  auto rope = internals->rope;
+  parts->push_back(str);
+  parts->back().Truncate(size);
+}
 
-  if (internals->rope.empty()) {
-    DCHECK(internals->string);
-    ptr = reinterpret_cast<const ui64*>(internals->string.get());
-    it = rope.end();
-    ptr_size = size();
-  } else {
-    it = rope.begin();
-    auto rope_internals = it->CollapseRope();
-    ptr = reinterpret_cast<const ui64*>(rope_internals->string.get());
-    ptr_size = it->size();
+void ConstString::InitArray(char* str, bool null_end) {
+  if (size_ <= kMaxInlineSize) {
+    UniquePtr<char[]> array(str);
+    memcpy(InitBuffer(size_), array.get(), size_);
+    return;
   }
 
-  auto NextBlock = [&rope, &ptr, &it, &ptr_size]() -> ui64 {
-    DCHECK(ptr);
+  InitStorage(new OwnerStorage<UniquePtr<const char[]>>(str), str, null_end);
+}
 
-    // ...[===P=====B==...
-    if (ptr_size > block_size) {
-      ptr_size -= block_size;
-      return *ptr++;
-    }
+char* ConstString::InitBuffer(size_t size) {
+  size_ = size;
+  null_end_ = true;
 
-    // ...[===P======B][===...
-    if (ptr_size == block_size) {
-      ui64 result = *ptr;
+  if (size <= kMaxInlineSize) {
+    kind_ = INLINE;
+    inline_[size] = '\0';
+    return inline_;
+  }
 
-      if (it != rope.end()) {
-        ++it;
-      }
+  auto* storage = BufferStorage::New(size);
+  storage->chars()[size] = '\0';
+  InitStorage(storage, storage->chars(), true);
+  return storage->chars();
+}
 
-      if (it == rope.end()) {
-        ptr_size = 0;
-        ptr = nullptr;
-      } else {
-        auto rope_internals = it->CollapseRope();
-        ptr = reinterpret_cast<const ui64*>(rope_internals->string.get());
-        ptr_size = it->size();
-      }
+void ConstString::InitRope(RopeStorage* storage, size_t size) {
+  kind_ = ROPE;
+  shared_ = {nullptr, storage};
+  size_ = size;
+  null_end_ = false;
+}
 
-      return result;
-    }
+void ConstString::InitStorage(Storage* storage, const char* chars,
+                              bool null_end) {
+  kind_ = PLAIN;
+  shared_ = {chars, storage};
+  null_end_ = null_end;
+}
 
-    // ...[======P===][=B=...
-    DCHECK(it != rope.end());  // FIXME: what if the |rope| is empty?
-
-    union {
-      char str[block_size];
-      ui64 num;
-    } result;
-    ui64 i = ptr_size;
-
-    memcpy(result.str, ptr, ptr_size);
-
-    ++it;
-    DCHECK(it != rope.end());
-    auto rope_internals = it->CollapseRope();
-    ptr = reinterpret_cast<const ui64*>(rope_internals->string.get());
-    ptr_size = it->size();
-
-    while (i < block_size) {
-      if (ptr_size <= block_size - i) {
-        memcpy(result.str + i, ptr, ptr_size);
-        i += ptr_size;
-        ++it;
-        if (it == rope.end()) {
-          ptr_size = 0;
-          ptr = nullptr;
-          DCHECK(i == block_size);
-        } else {
-          auto rope_internals = it->CollapseRope();
-          ptr = reinterpret_cast<const ui64*>(rope_internals->string.get());
-          ptr_size = it->size();
-        }
-      } else {
-        memcpy(result.str + i, ptr, block_size - i);
-        ptr_size -= block_size - i;
-        auto rope_internals = it->internals_;
-        DCHECK(rope_internals->string);
-        ptr = reinterpret_cast<const ui64*>(rope_internals->string.get() +
-                                            block_size - i);
-        i = block_size;
-      }
-    }
+void ConstString::CopyFrom(const ConstString& other) {
+  kind_ = other.kind_;
+  size_ = other.size_;
+  null_end_ = other.null_end_;
 
-    DCHECK(i == block_size);
-
-    return result.num;
-  };
-
-  // Body.
-
-  auto rotl64 = [](ui64 x, i8 r) -> ui64 { return (x << r) | (x >> (64 - r)); };
-
-  auto fmix64 = [](ui64 k) -> ui64 {
-    k ^= k >> 33;
-    k *= 0xff51afd7ed558ccdLLU;
-    k ^= k >> 33;
-    k *= 0xc4ceb9fe1a85ec53LLU;
-    k ^= k >> 33;
-
-    return k;
-  };
-
-  for (ui64 i = 0; i < double_blocks; ++i) {
-    ui64 k1 = NextBlock(), k2 = NextBlock();
-
-    k1 *= c1;
-    k1 = rotl64(k1, 31);
-    k1 *= c2;
-    h1 ^= k1;
-
-    h1 = rotl64(h1, 27);
-    h1 += h2;
-    h1 = h1 * 5 + 0x52dce729;
-
-    k2 *= c2;
-    k2 = rotl64(k2, 33);
-    k2 *= c1;
-    h2 ^= k2;
-
-    h2 = rotl64(h2, 31);
-    h2 += h1;
-    h2 = h2 * 5 + 0x38495ab5;
-  }
-
-  // Tail.
-
-  const ui64 tail = double_blocks * 16;
-
-  ui64 k1 = 0, k2 = 0;
-
-  switch (size() & 15) {
-    case 15:
-      k2 ^= ((ui64)at(internals.get(), tail + 14)) << 48;
-    case 14:
-      k2 ^= ((ui64)at(internals.get(), tail + 13)) << 40;
-    case 13:
-      k2 ^= ((ui64)at(internals.get(), tail + 12)) << 32;
-    case 12:
-      k2 ^= ((ui64)at(internals.get(), tail + 11)) << 24;
-    case 11:
-      k2 ^= ((ui64)at(internals.get(), tail + 10)) << 16;
-    case 10:
-      k2 ^= ((ui64)at(internals.get(), tail + 9)) << 8;
-    case 9:
-      k2 ^= ((ui64)at(internals.get(), tail + 8)) << 0;
-      k2 *= c2;
-      k2 = rotl64(k2, 33);
-      k2 *= c1;
-      h2 ^= k2;
-
-    case 8:
-      k1 ^= ((ui64)at(internals.get(), tail + 7)) << 56;
-    case 7:
-      k1 ^= ((ui64)at(internals.get(), tail + 6)) << 48;
-    case 6:
-      k1 ^= ((ui64)at(internals.get(), tail + 5)) << 40;
-    case 5:
-      k1 ^= ((ui64)at(internals.get(), tail + 4)) << 32;
-    case 4:
-      k1 ^= ((ui64)at(internals.get(), tail + 3)) << 24;
-    case 3:
-      k1 ^= ((ui64)at(internals.get(), tail + 2)) << 16;
-    case 2:
-      k1 ^= ((ui64)at(internals.get(), tail + 1)) << 8;
-    case 1:
-      k1 ^= ((ui64)at(internals.get(), tail + 0)) << 0;
-      k1 *= c1;
-      k1 = rotl64(k1, 31);
-      k1 *= c2;
-      h1 ^= k1;
-  };
-
-  // Finalization.
-
-  h1 ^= size();
-  h2 ^= size();
-
-  h1 += h2;
-  h2 += h1;
-
-  h1 = fmix64(h1);
-  h2 = fmix64(h2);
-
-  h1 += h2;
-  h2 += h1;
-
-  ((ui64*)buf)[0] = h1;
-  ((ui64*)buf)[1] = h2;
-
-  return Immutable(buf, std::min<ui8>(16u, output_size));
+  if (kind_ == INLINE) {
+    memcpy(inline_, other.inline_, size_ + 1);
+    return;
+  }
+
+  shared_ = other.shared_;
+  if (shared_.storage) {
+    shared_.storage->references.fetch_add(1, std::memory_order_relaxed);
+  }
 }
 
-ConstString::ConstString(const char* WEAK_PTR str, size_t size, bool null_end)
-    : internals_(
-          new Internal{.string = {str, NoopDeleter}, .null_end = null_end}),
-      size_(size) {}
+void ConstString::MoveFrom(ConstString& other) {
+  kind_ = other.kind_;
+  size_ = other.size_;
+  null_end_ = other.null_end_;
 
-ConstString::InternalPtr ConstString::CollapseRope() const {
-  auto internals = internals_;
+  if (kind_ == INLINE) {
+    memcpy(inline_, other.inline_, size_ + 1);
+  } else {
+    shared_ = other.shared_;
+  }
 
-  if (internals->rope.empty()) {
-    return internals;
+  other.kind_ = INLINE;
+  other.size_ = 0;
+  other.null_end_ = true;
+  other.inline_[0] = '\0';
+}
+
+void ConstString::Truncate(size_t size) {
+  DCHECK(size <= size_);
+
+  if (size == size_) {
+    return;
   }
 
-  InternalPtr new_internals;
-  if (internals->rope.size() == 1) {
-    new_internals = internals->rope.front().internals_;
+  if (kind_ == INLINE) {
+    inline_[size] = '\0';
   } else {
-    SharedPtr<const char> new_string(new char[size_ + 1], CharArrayDeleter);
-    char* WEAK_PTR ptr = const_cast<char*>(new_string.get());
-    ptr[size_] = '\0';
-    for (const auto& string : internals->rope) {
-      string.CollapseRope();
-      memcpy(ptr, string.internals_->string.get(), string.size_);
-      ptr += string.size_;
-    }
+    null_end_ = false;
+  }
+  size_ = size;
+}
 
-    new_internals.reset(new Internal{.string = new_string, .null_end = true});
+void ConstString::Release() {
+  if (kind_ == INLINE || !shared_.storage) {
+    return;
   }
 
-  internals_ = new_internals;
-  return new_internals;
+  if (shared_.storage->references.fetch_sub(1, std::memory_order_acq_rel) ==
+      1) {
+    delete shared_.storage;
+  }
+  kind_ = INLINE;
 }
 
-ConstString::InternalPtr ConstString::NullTerminate() {
-  auto internals = internals_;
+const char* ConstString::chars() const {
+  DCHECK(kind_ != ROPE);
+  return kind_ == INLINE ? inline_ : shared_.chars;
+}
 
-  DCHECK([internals] { return internals->rope.empty(); }());
+const Vector<ConstString>& ConstString::parts() const {
+  DCHECK(kind_ == ROPE);
+  return static_cast<const RopeStorage*>(shared_.storage)->parts;
+}
+
+void ConstString::CopyTo(char* dest, size_t size) const {
+  DCHECK(size <= size_);
 
-  if (internals->null_end) {
-    return internals;
+  if (kind_ != ROPE) {
+    memcpy(dest, chars(), size);
+    return;
   }
 
-  UniquePtr<char[]> new_string(new char[size_ + 1]);
-  new_string[size_] = '\0';
-  memcpy(new_string.get(), internals->string.get(), size_);
+  for (const auto& part : parts()) {
+    if (!size) {
+      break;
+    }
+    const size_t part_size = std::min(size, part.size_);
+    part.CopyTo(dest, part_size);
+    dest += part_size;
+    size -= part_size;
+  }
+}
+
+void ConstString::CollapseRope() {
+  if (kind_ != ROPE) {
+    return;
+  }
 
-  InternalPtr new_internals(new Internal{
-      .string = {new_string.release(), CharArrayDeleter}, .null_end = true});
-  return internals_ = new_internals;
+  // A single part is simply shared.
+  if (parts().size() == 1) {
+    ConstString part(parts().front());
+    part.Truncate(size_);
+    Release();
+    MoveFrom(part);
+    return;
+  }
+
+  const ConstString rope(std::move(*this));
+  rope.CopyTo(InitBuffer(rope.size_), rope.size_);
 }
 
-const char& ConstString::at(const Internal* internal, size_t index) const {
-  DCHECK(internal);
-  if (!internal->rope.empty()) {
-    for (const auto& str : internal->rope) {
-      if (index < str.size()) {
-        return str[index];
-      }
+void ConstString::NullTerminate() {
+  DCHECK(kind_ != ROPE);
+
+  if (null_end_) {
+    return;
+  }
+
+  const ConstString string(std::move(*this));
+  string.CopyTo(InitBuffer(string.size_), string.size_);
+}
+
+const char& ConstString::at(size_t index) const {
+  if (kind_ != ROPE) {
+    return chars()[index];
+  }
 
-      index -= str.size();
+  for (const auto& part : parts()) {
+    if (index < part.size_) {
+      return part.chars()[index];
     }
+    index -= part.size_;
   }
 
-  DCHECK(internal->string);
-  return *(internal->string.get() + index);
+  NOTREACHED();
+  return inline_[0];
 }
 
 }  // namespace base
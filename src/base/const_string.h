@@ -14,6 +14,8 @@ inline base::Literal operator"" _l(const char* str, size_t);
 
 namespace base {
 
+class Hasher;
+
 class Literal {
  public:
   inline operator const char*() const { return str_; }
@@ -41,10 +43,20 @@ class Literal {
   const char* WEAK_PTR str_ = nullptr;
 };
 
+// The strings up to |kMaxInlineSize| chars are stored inline - copying them is
+// cheaper than sharing them, so they never touch the heap. The longer strings
+// are shared through a single intrusive reference-counted storage, and the
+// nested ropes are flattened into a vector of parts.
+//
+// The object takes 56 bytes on x86-64 instead of the former 32 - but the former
+// one also allocated 130-210 bytes on the heap for each string, so the lists,
+// vectors and maps of strings take less memory overall.
 class ConstString {
  public:
   using Rope = List<ConstString>;
 
+  enum : size_t { kMaxInlineSize = 39 };
+
   ConstString();                                     // 0-copy
   explicit ConstString(bool assignable);             // 0-copy
   ConstString(Literal str);                          // 0-copy
@@ -64,12 +76,19 @@ class ConstString {
   ConstString(const Path& path);                     // 1-copy - for tests
   static ConstString WrapString(const String& str);  // 0-copy
 
+  ConstString(const ConstString& other);  // 0-copy
+  ConstString(ConstString&& other);       // 0-copy
+  ~ConstString();
+
   inline operator String() { return string_copy(); }        // 1-copy
   inline operator String() const { return string_copy(); }  // 1-copy
   String string_copy(bool collapse = true);                 // 1-copy
   String string_copy() const;                               // 1-copy
 
-  // Minimal interface for |std::string| compatibility.
+  // Minimal interface for |std::string| compatibility. The chars of inline
+  // strings are inside the object: |data()| and |c_str()| point there and
+  // don't survive a copy, a move or the end of the object - unlike the shared
+  // chars of longer strings.
   void assign(const ConstString& other) THREAD_UNSAFE;  // 0-copy
   const char* data();                                   // 0,1-copy
   const char* c_str();                                  // 0,1-copy
@@ -89,24 +108,58 @@ class ConstString {
   ConstString Hash(ui8 output_size = 16) const;  // 0-copy
 
  private:
-  struct Internal {
-    SharedPtr<String> medium;
-    SharedPtr<const char> string;
-    Rope rope;
-    bool null_end = false;
+  friend class Hasher;
+
+  struct Storage;
+  struct BufferStorage;
+  template <class Owner>
+  struct OwnerStorage;
+  struct RopeStorage;
+
+  enum Kind : ui8 {
+    INLINE,  // The chars are in |inline_|.
+    PLAIN,   // The chars are pointed by |shared_|.
+    ROPE,    // The parts are in the |RopeStorage| - without nested ropes.
+  };
+
+  struct Shared {
+    const char* WEAK_PTR chars;
+    Storage* storage;  // Null, if the chars aren't owned.
   };
-  using InternalPtr = SharedPtr<const Internal>;
 
   ConstString(const char* WEAK_PTR str, size_t size, bool null_end);  // 0-copy
+  static ConstString Copy(const char* str, size_t size);              // 1-copy
 
-  InternalPtr CollapseRope() const;
-  InternalPtr NullTerminate();
+  static void Flatten(const ConstString& str, size_t size,
+                      Vector<ConstString>* parts);
 
-  const char& at(const Internal* internal, size_t index) const;
+  void InitArray(char* str, bool null_end);
+  char* InitBuffer(size_t size);
+  void InitRope(RopeStorage* storage, size_t size);
+  void InitStorage(Storage* storage, const char* chars, bool null_end);
 
-  mutable InternalPtr internals_ = InternalPtr(new Internal);
+  void CopyFrom(const ConstString& other);
+  void MoveFrom(ConstString& other);
+  void Truncate(size_t size);
+  void Release();
+
+  const char* chars() const;
+  const Vector<ConstString>& parts() const;
+  void CopyTo(char* dest, size_t size) const;
+
+  void CollapseRope();
+  void NullTerminate();
+
+  const char& at(size_t index) const;
+
+  union {
+    char inline_[kMaxInlineSize + 1] = {'\0'};
+    Shared shared_;
+  };
 
   size_t size_ = 0;
+  Kind kind_ = INLINE;
+  bool null_end_ = true;
   bool assignable_ = false;
   const bool assign_once_ = false;
 };
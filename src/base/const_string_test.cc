@@ -3,6 +3,33 @@
 #include <base/string_utils.h>
 
 #include <third_party/gtest/exported/include/gtest/gtest.h>
+#include STL(cstdlib)
+#include STL(iostream)
+#include STL(new)
+
+namespace {
+
+// Counts the allocations of the current thread - to make sure that the short
+// strings don't touch the heap.
+thread_local dist_clang::ui64 allocations = 0;
+
+}  // namespace
+
+void* operator new(size_t size) {
+  ++allocations;
+  if (void* ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  std::free(ptr);
+}
 
 namespace dist_clang {
 namespace base {
@@ -27,7 +54,7 @@ TEST(ConstStringTest, Find) {
 
 TEST(ConstStringTest, Hash) {
   {
-    const auto expected_hash = "c9e92e37df1e856cbd0abffe104225b8"_l;
+    const auto expected_hash = "62cf0ef7511bf6a5c6b69a2466bd3810"_l;
     EXPECT_EQ(expected_hash,
               Hexify(ConstString("All your base are belong to us"_l).Hash()));
     EXPECT_EQ(expected_hash,
@@ -40,7 +67,7 @@ TEST(ConstStringTest, Hash) {
                          .Hash()));
   }
   {
-    const auto expected_hash = "00000000000000000000000000000000"_l;
+    const auto expected_hash = "a4ff1b80cf58ee8f5747a11563128a5c"_l;
     EXPECT_EQ(expected_hash, Hexify(ConstString().Hash()));
   }
 }
@@ -68,7 +95,109 @@ TEST(ConstStringTest, CollapseRopeTest) {
   EXPECT_STREQ("i2 i1 l1 l2", resulting.c_str());
 }
 
-// TODO: write a lot of tests.
+TEST(ConstStringTest, ShortStringsDontAllocate) {
+  const String flag = "-fno-exceptions";
+  const ui64 initial_allocations = allocations;
+
+  {
+    ConstString empty;
+    ConstString literal("-c"_l);
+    ConstString copy(flag);
+    ConstString prefix(copy, 4);
+    ConstString concatenated = literal + copy;
+    ConstString assigned;
+    assigned = concatenated;
+
+    EXPECT_STREQ("", empty.c_str());
+    EXPECT_STREQ("-fno", prefix.c_str());
+    EXPECT_STREQ("-c-fno-exceptions", assigned.c_str());
+    EXPECT_EQ(copy, ConstString(copy));
+    EXPECT_EQ(8u, copy.Hash(8).size());
+    EXPECT_NE(std::hash<ConstString>()(literal),
+              std::hash<ConstString>()(copy));
+  }
+
+  EXPECT_EQ(initial_allocations, allocations);
+}
+
+TEST(ConstStringTest, InlineCharsLiveInObject) {
+  // The pointers to inline chars don't survive the object - unlike the ones to
+  // the shared chars.
+  ConstString short_string(String("short"));
+  const char* short_chars = short_string.data();
+  EXPECT_GE(short_chars, reinterpret_cast<const char*>(&short_string));
+  EXPECT_LT(short_chars, reinterpret_cast<const char*>(&short_string + 1));
+
+  ConstString short_copy = short_string;
+  EXPECT_NE(short_chars, short_copy.data());
+  ConstString short_moved(std::move(short_copy));
+  EXPECT_STREQ("short", short_moved.c_str());
+
+  ConstString long_string(String(ConstString::kMaxInlineSize + 1, 'l'));
+  const char* long_chars = long_string.data();
+  ConstString long_copy = long_string;
+  ConstString long_moved(std::move(long_copy));
+  EXPECT_EQ(long_chars, long_moved.data());
+}
+
+TEST(ConstStringTest, LongStringsAndRopes) {
+  const String long_string(100, 'a');
+
+  ConstString copy(long_string);
+  ConstString shared = copy;
+  EXPECT_EQ(copy.data(), shared.data());
+  EXPECT_EQ(long_string, copy.string_copy(false));
+
+  // Nested ropes are flattened, but the prefixes are kept.
+  ConstString nested(ConstString::Rope{"b"_l, copy}, 51);
+  ConstString rope(ConstString::Rope{"c"_l, nested, "d"_l});
+  EXPECT_EQ(53u, rope.size());
+  EXPECT_EQ('a', rope[51]);
+  EXPECT_EQ('d', rope[52]);
+  EXPECT_EQ("cb" + String(50, 'a') + "d", rope.string_copy(false));
+  EXPECT_EQ(rope.Hash(), ConstString(rope.string_copy()).Hash());
+  EXPECT_STREQ(("cb" + String(50, 'a') + "d").c_str(), rope.c_str());
+
+  ConstString prefix(copy, 90);
+  EXPECT_EQ(String(90, 'a'), String(prefix.c_str()));
+}
+
+// Run with "--gtest_also_run_disabled_tests" to see the number of allocations
+// in the typical uses.
+TEST(ConstStringTest, DISABLED_AllocationBenchmark) {
+  const size_t kIterations = 10000;
+  const String flag = "-fsanitize=address", path(80, 'p');
+
+  auto Measure = [](const char* name, Fn<void()> body) {
+    const ui64 initial_allocations = allocations;
+    for (size_t i = 0; i < kIterations; ++i) {
+      body();
+    }
+    std::cout << name << ": "
+              << double(allocations - initial_allocations) / kIterations
+              << " allocations" << std::endl;
+  };
+
+  Measure("Default", [] { ConstString empty; });
+  Measure("Literal", [] { ConstString literal("-c"_l); });
+  Measure("Short copy", [&flag] { ConstString copy(flag); });
+  Measure("Long copy", [&path] { ConstString copy(path); });
+  Measure("Hash", [&flag] { ConstString(flag).Hash(); });
+
+  HashMap<ConstString, ui32> map;
+  for (ui32 i = 0; i < 100; ++i) {
+    map.emplace(ConstString(std::to_string(i)), i);
+  }
+  const ConstString key("42"_l);
+  Measure("Map lookup", [&map, &key] { map.find(key); });
+
+  const ConstString short1("-o"_l), short2("test.o"_l);
+  Measure("Short concatenation",
+          [&short1, &short2] { (short1 + short2).c_str(); });
+
+  const ConstString long1(path), long2(path);
+  Measure("Long concatenation", [&long1, &long2] { (long1 + long2).c_str(); });
+}
 
 }  // namespace base
 }  // namespace dist_clang
@@ -13,6 +13,7 @@ Literal kEnvSocketPath = "DC_SOCKET_PATH"_l;
 Literal kExtDeps = "d"_l;
 Literal kExtManifest = "manifest"_l;
 Literal kExtObject = "o"_l;
+Literal kExtOutput = "out"_l;
 Literal kExtStderr = "stderr"_l;
 
 }  // namespace base
@@ -15,6 +15,7 @@ extern Literal kEnvSocketPath;
 extern Literal kExtDeps;
 extern Literal kExtManifest;
 extern Literal kExtObject;
+extern Literal kExtOutput;
 extern Literal kExtStderr;
 
 }  // namespace base
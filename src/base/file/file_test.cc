@@ -81,7 +81,7 @@ TEST(FileTest, Size) {
 
 TEST(FileTest, Hash) {
   const auto content = "All your base are belong to us"_l;
-  const auto expected_hash = "c9e92e37df1e856cbd0abffe104225b8"_l;
+  const auto expected_hash = "62cf0ef7511bf6a5c6b69a2466bd3810"_l;
   const TemporaryDir temp_dir;
   const auto file_path = temp_dir.path() / "file";
 
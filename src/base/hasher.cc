@@ -0,0 +1,354 @@
+#include <base/hasher.h>
+
+#include <base/assert.h>
+
+#include STL(algorithm)
+#include STL(cstring)
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace dist_clang {
+namespace base {
+
+namespace {
+
+const ui64 kPrime32_1 = 0x9E3779B1U, kPrime32_2 = 0x85EBCA77U,
+           kPrime32_3 = 0xC2B2AE3DU;
+const ui64 kPrime64_1 = 0x9E3779B185EBCA87ULL,
+           kPrime64_2 = 0xC2B2AE3D27D4EB4FULL,
+           kPrime64_3 = 0x165667B19E3779F9ULL,
+           kPrime64_4 = 0x85EBCA77C2B2AE63ULL,
+           kPrime64_5 = 0x27D4EB2F165667C5ULL;
+
+inline ui64 Read64(const void* ptr) {
+  ui64 result;
+  std::memcpy(&result, ptr, sizeof(result));
+  return result;
+}
+
+inline ui64 Multiply128Fold64(ui64 left, ui64 right) {
+  const auto product = static_cast<unsigned __int128>(left) * right;
+  return static_cast<ui64>(product) ^ static_cast<ui64>(product >> 64);
+}
+
+inline ui64 Avalanche(ui64 hash) {
+  hash ^= hash >> 37;
+  hash *= 0x165667919E3779F9ULL;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+void AccumulateScalar(ui64* acc, const char* input, ui32 stripes,
+                      const ui8* secret) {
+  for (ui32 stripe = 0; stripe < stripes; ++stripe) {
+    for (ui32 i = 0; i < 8; ++i) {
+      const ui64 data = Read64(input + 8 * i);
+      const ui64 key = data ^ Read64(secret + 8 * i);
+      acc[i ^ 1] += data;
+      acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+    input += 64;
+    secret += 8;
+  }
+}
+
+void ScrambleScalar(ui64* acc, const ui8* secret) {
+  for (ui32 i = 0; i < 8; ++i) {
+    ui64 lane = acc[i];
+    lane ^= lane >> 47;
+    lane ^= Read64(secret + 8 * i);
+    lane *= kPrime32_1;
+    acc[i] = lane;
+  }
+}
+
+#if defined(__x86_64__)
+// The vector kernels do exactly the same as the scalar ones: the products of
+// the 32-bit halves and the swapped neighbour lanes.
+
+void AccumulateSSE2(ui64* acc, const char* input, ui32 stripes,
+                    const ui8* secret) {
+  auto* acc_vec = reinterpret_cast<__m128i*>(acc);
+  for (ui32 stripe = 0; stripe < stripes; ++stripe) {
+    for (ui32 i = 0; i < 4; ++i) {
+      const __m128i data = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(input) + i);
+      const __m128i key = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(secret) + i);
+      const __m128i data_key = _mm_xor_si128(data, key);
+      const __m128i data_key_hi =
+          _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+      const __m128i product = _mm_mul_epu32(data_key, data_key_hi);
+      const __m128i data_swap =
+          _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+      acc_vec[i] =
+          _mm_add_epi64(product, _mm_add_epi64(acc_vec[i], data_swap));
+    }
+    input += 64;
+    secret += 8;
+  }
+}
+
+void ScrambleSSE2(ui64* acc, const ui8* secret) {
+  auto* acc_vec = reinterpret_cast<__m128i*>(acc);
+  const __m128i prime = _mm_set1_epi32(static_cast<int>(kPrime32_1));
+  for (ui32 i = 0; i < 4; ++i) {
+    __m128i lane = acc_vec[i];
+    lane = _mm_xor_si128(lane, _mm_srli_epi64(lane, 47));
+    lane = _mm_xor_si128(
+        lane, _mm_loadu_si128(reinterpret_cast<const __m128i*>(secret) + i));
+    const __m128i lane_hi = _mm_shuffle_epi32(lane, _MM_SHUFFLE(0, 3, 0, 1));
+    const __m128i product_lo = _mm_mul_epu32(lane, prime);
+    const __m128i product_hi = _mm_mul_epu32(lane_hi, prime);
+    acc_vec[i] = _mm_add_epi64(product_lo, _mm_slli_epi64(product_hi, 32));
+  }
+}
+
+__attribute__((target("avx2"))) void AccumulateAVX2(ui64* acc,
+                                                    const char* input,
+                                                    ui32 stripes,
+                                                    const ui8* secret) {
+  auto* acc_vec = reinterpret_cast<__m256i*>(acc);
+  for (ui32 stripe = 0; stripe < stripes; ++stripe) {
+    for (ui32 i = 0; i < 2; ++i) {
+      const __m256i data = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(input) + i);
+      const __m256i key = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(secret) + i);
+      const __m256i data_key = _mm256_xor_si256(data, key);
+      const __m256i data_key_hi =
+          _mm256_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+      const __m256i product = _mm256_mul_epu32(data_key, data_key_hi);
+      const __m256i data_swap =
+          _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+      acc_vec[i] = _mm256_add_epi64(product,
+                                    _mm256_add_epi64(acc_vec[i], data_swap));
+    }
+    input += 64;
+    secret += 8;
+  }
+}
+
+__attribute__((target("avx2"))) void ScrambleAVX2(ui64* acc,
+                                                  const ui8* secret) {
+  auto* acc_vec = reinterpret_cast<__m256i*>(acc);
+  const __m256i prime = _mm256_set1_epi32(static_cast<int>(kPrime32_1));
+  for (ui32 i = 0; i < 2; ++i) {
+    __m256i lane = acc_vec[i];
+    lane = _mm256_xor_si256(lane, _mm256_srli_epi64(lane, 47));
+    lane = _mm256_xor_si256(
+        lane,
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(secret) + i));
+    const __m256i lane_hi =
+        _mm256_shuffle_epi32(lane, _MM_SHUFFLE(0, 3, 0, 1));
+    const __m256i product_lo = _mm256_mul_epu32(lane, prime);
+    const __m256i product_hi = _mm256_mul_epu32(lane_hi, prime);
+    acc_vec[i] =
+        _mm256_add_epi64(product_lo, _mm256_slli_epi64(product_hi, 32));
+  }
+}
+#endif  // defined(__x86_64__)
+
+Hasher::Kernel BestKernel() {
+  static const Hasher::Kernel kernel = [] {
+    if (Hasher::IsSupported(Hasher::AVX2)) {
+      return Hasher::AVX2;
+    }
+    if (Hasher::IsSupported(Hasher::SSE2)) {
+      return Hasher::SSE2;
+    }
+    return Hasher::SCALAR;
+  }();
+  return kernel;
+}
+
+}  // namespace
+
+Hasher::Hasher() : Hasher(BestKernel()) {}
+
+Hasher::Hasher(Kernel kernel)
+    : kernels_(GetKernels(kernel)),
+      secret_(GetSecret()),
+      acc_{kPrime32_3, kPrime64_1, kPrime64_2, kPrime64_3,
+           kPrime64_4, kPrime32_2, kPrime64_5, kPrime32_1} {
+  DCHECK(IsSupported(kernel));
+}
+
+// static
+bool Hasher::IsSupported(Kernel kernel) {
+  switch (kernel) {
+    case SCALAR:
+      return true;
+#if defined(__x86_64__)
+    case SSE2:
+      return true;  // Every x86-64 CPU has it.
+    case AVX2:
+      // May be called before the constructors, which initialize the CPU info.
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return false;
+  }
+}
+
+void Hasher::Update(const char* data, size_t size) {
+  total_size_ += size;
+
+  if (buffer_size_) {
+    const size_t part = std::min<size_t>(size, kStripeSize - buffer_size_);
+    std::memcpy(buffer_ + buffer_size_, data, part);
+    buffer_size_ += part;
+    data += part;
+    size -= part;
+
+    if (buffer_size_ < kStripeSize) {
+      return;
+    }
+    ConsumeStripes(buffer_, 1);
+    buffer_size_ = 0;
+  }
+
+  const size_t stripes = size / kStripeSize;
+  ConsumeStripes(data, static_cast<ui32>(stripes));
+  data += stripes * kStripeSize;
+  size -= stripes * kStripeSize;
+
+  std::memcpy(buffer_, data, size);
+  buffer_size_ = size;
+}
+
+void Hasher::Update(const ConstString& str) {
+  Update(str, str.size());
+}
+
+ConstString Hasher::Digest(ui8 output_size) {
+  char buf[16];
+
+  // Short inputs - like most keys of hash maps - are mixed right away, without
+  // padding and accumulating a whole stripe.
+  if (total_size_ <= kShortSize) {
+    ui64 input[2] = {0, 0};
+    std::memcpy(input, buffer_, buffer_size_);
+
+    auto Mix = [this, &input](const ui8* secret) {
+      const ui64 low = input[0] ^ Read64(secret);
+      const ui64 high = input[1] ^ Read64(secret + 8);
+      return Avalanche(total_size_ + __builtin_bswap64(low) + high +
+                       Multiply128Fold64(low, high));
+    };
+
+    const ui64 low = Mix(secret_);
+    const ui64 high = Mix(secret_ + 16);
+    std::memcpy(buf, &low, sizeof(low));
+    std::memcpy(buf + sizeof(low), &high, sizeof(high));
+
+    return ConstString::Copy(buf, std::min<ui8>(16u, output_size));
+  }
+
+  // The tail is padded with zeros - the total size tells it apart.
+  if (buffer_size_) {
+    std::memset(buffer_ + buffer_size_, 0, kStripeSize - buffer_size_);
+    ConsumeStripes(buffer_, 1);
+    buffer_size_ = 0;
+  }
+
+  auto MergeLanes = [this](const ui8* secret, ui64 start) {
+    ui64 result = start;
+    for (ui32 i = 0; i < kLanes / 2; ++i) {
+      const ui8* key = secret + 16 * i;
+      result += Multiply128Fold64(acc_[2 * i] ^ Read64(key),
+                                  acc_[2 * i + 1] ^ Read64(key + 8));
+    }
+    return Avalanche(result);
+  };
+
+  const ui64 low = MergeLanes(secret_ + 11, total_size_ * kPrime64_1);
+  const ui64 high = MergeLanes(secret_ + kSecretSize - kStripeSize - 11,
+                               ~(total_size_ * kPrime64_2));
+  std::memcpy(buf, &low, sizeof(low));
+  std::memcpy(buf + sizeof(low), &high, sizeof(high));
+
+  return ConstString::Copy(buf, std::min<ui8>(16u, output_size));
+}
+
+// static
+const Hasher::Kernels& Hasher::GetKernels(Kernel kernel) {
+  static const Kernels scalar{AccumulateScalar, ScrambleScalar};
+#if defined(__x86_64__)
+  static const Kernels sse2{AccumulateSSE2, ScrambleSSE2};
+  static const Kernels avx2{AccumulateAVX2, ScrambleAVX2};
+
+  switch (kernel) {
+    case SSE2:
+      return sse2;
+    case AVX2:
+      return avx2;
+    default:
+      break;
+  }
+#endif
+
+  return scalar;
+}
+
+// static
+const ui8* Hasher::GetSecret() {
+  // The secret is the same everywhere - it's generated by the SplitMix64 from
+  // a fixed seed.
+  static const struct Secret {
+    Secret() {
+      ui64 state = kPrime64_1;
+      for (ui32 i = 0; i < kSecretSize; i += sizeof(ui64)) {
+        ui64 value = (state += 0x9E3779B97F4A7C15ULL);
+        value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+        value ^= value >> 31;
+        std::memcpy(bytes + i, &value, sizeof(value));
+      }
+    }
+
+    ui8 bytes[kSecretSize];
+  } secret;
+
+  return secret.bytes;
+}
+
+void Hasher::Update(const ConstString& str, size_t size) {
+  if (str.kind_ != ConstString::ROPE) {
+    if (size) {
+      Update(str.chars(), size);
+    }
+    return;
+  }
+
+  // The rope may be longer than the string - if it's a prefix of the rope.
+  for (const auto& part : str.parts()) {
+    if (!size) {
+      break;
+    }
+    const size_t part_size = std::min(size, part.size());
+    Update(part, part_size);
+    size -= part_size;
+  }
+}
+
+void Hasher::ConsumeStripes(const char* input, ui32 stripes) {
+  while (stripes) {
+    const ui32 count = std::min(stripes, kStripesPerBlock - block_stripe_);
+    kernels_.accumulate(acc_, input, count, secret_ + 8 * block_stripe_);
+    input += count * kStripeSize;
+    stripes -= count;
+    block_stripe_ += count;
+
+    if (block_stripe_ == kStripesPerBlock) {
+      kernels_.scramble(acc_, secret_ + kSecretSize - kStripeSize);
+      block_stripe_ = 0;
+    }
+  }
+}
+
+}  // namespace base
+}  // namespace dist_clang
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <base/const_string.h>
+
+namespace dist_clang {
+namespace base {
+
+// Streaming 128-bit non-cryptographic hash of the XXH3 kind: the input is
+// accumulated by 64-byte stripes into 8 lanes mixed with a secret, and the
+// lanes are scrambled after each block of 16 stripes. The stripes are
+// processed by the widest kernel, which the CPU supports - but all kernels
+// give the same digest, so it may be compared between hosts. Inputs up to 16
+// bytes skip the stripes and are mixed with the secret directly.
+//
+// Not thread-safe.
+class Hasher {
+ public:
+  enum Kernel {
+    SCALAR,
+    SSE2,
+    AVX2,
+  };
+
+  Hasher();  // Uses the best supported kernel.
+  explicit Hasher(Kernel kernel);
+
+  static bool IsSupported(Kernel kernel);
+
+  void Update(const char* data, size_t size);
+  void Update(const ConstString& str);
+  // Consumes the parts of a rope in place - without collapsing it.
+
+  ConstString Digest(ui8 output_size = 16);
+  // Finishes the hashing - the |output_size| is up to 16 bytes.
+
+ private:
+  enum : ui32 {
+    kLanes = 8,
+    kStripeSize = 64,
+    kStripesPerBlock = 16,
+    kSecretSize = 192,
+    kShortSize = 16,
+  };
+
+  struct Kernels {
+    void (*accumulate)(ui64* acc, const char* input, ui32 stripes,
+                       const ui8* secret);
+    // Each next stripe is mixed with the |secret| shifted by 8 bytes.
+
+    void (*scramble)(ui64* acc, const ui8* secret);
+  };
+
+  static const Kernels& GetKernels(Kernel kernel);
+  static const ui8* GetSecret();
+
+  void Update(const ConstString& str, size_t size);
+  void ConsumeStripes(const char* input, ui32 stripes);
+
+  const Kernels& kernels_;
+  const ui8* secret_;
+
+  alignas(32) ui64 acc_[kLanes];
+  char buffer_[kStripeSize];
+  ui32 buffer_size_ = 0;
+  ui32 block_stripe_ = 0;  // Index of the next stripe in the current block.
+  ui64 total_size_ = 0;
+};
+
+}  // namespace base
+}  // namespace dist_clang
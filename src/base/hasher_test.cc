@@ -0,0 +1,243 @@
+#include <base/hasher.h>
+
+#include <base/string_utils.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+#include STL(chrono)
+#include STL(cstring)
+#include STL(iostream)
+#include STL(random)
+
+namespace dist_clang {
+namespace base {
+
+namespace {
+
+String RandomString(size_t size, ui32 seed) {
+  std::mt19937 generator(seed);
+  String result(size, '\0');
+  for (auto& c : result) {
+    c = static_cast<char>(generator());
+  }
+  return result;
+}
+
+// The MurmurHash3 for x64 with 128 bits - the hash of |ConstString| before
+// the |Hasher|. Kept only to compare the speed.
+void MurmurHash3(const char* data, size_t size, ui64* out) {
+  const ui64 c1 = 0x87c37b91114253d5LLU, c2 = 0x4cf5ad432745937fLLU;
+  auto rotl64 = [](ui64 x, i8 r) -> ui64 { return (x << r) | (x >> (64 - r)); };
+  auto fmix64 = [](ui64 k) -> ui64 {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdLLU;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53LLU;
+    k ^= k >> 33;
+    return k;
+  };
+
+  ui64 h1 = 0, h2 = 0;
+  const size_t double_blocks = size / 16;
+  for (size_t i = 0; i < double_blocks; ++i) {
+    ui64 k1, k2;
+    std::memcpy(&k1, data + 16 * i, sizeof(k1));
+    std::memcpy(&k2, data + 16 * i + 8, sizeof(k2));
+
+    k1 *= c1;
+    k1 = rotl64(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+    h1 = rotl64(h1, 27);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52dce729;
+
+    k2 *= c2;
+    k2 = rotl64(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+    h2 = rotl64(h2, 31);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  ui64 k1 = 0, k2 = 0;
+  const char* tail = data + double_blocks * 16;
+  for (size_t i = size & 15; i > 8; --i) {
+    k2 ^= ui64(ui8(tail[i - 1])) << (8 * (i - 9));
+  }
+  for (size_t i = std::min<size_t>(size & 15, 8); i > 0; --i) {
+    k1 ^= ui64(ui8(tail[i - 1])) << (8 * (i - 1));
+  }
+  k2 *= c2;
+  k2 = rotl64(k2, 33);
+  k2 *= c1;
+  h2 ^= k2;
+  k1 *= c1;
+  k1 = rotl64(k1, 31);
+  k1 *= c2;
+  h1 ^= k1;
+
+  h1 ^= size;
+  h2 ^= size;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+
+  out[0] = h1;
+  out[1] = h2;
+}
+
+}  // namespace
+
+TEST(HasherTest, AllKernelsGiveSameDigest) {
+  const String input = RandomString(5000, 1);
+  const Hasher::Kernel kernels[] = {Hasher::SCALAR, Hasher::SSE2,
+                                    Hasher::AVX2};
+
+  // Cover the sizes around the stripes and the blocks of stripes.
+  for (size_t size : {0, 1, 16, 17, 63, 64, 65, 1023, 1024, 1025, 2048, 5000}) {
+    Hasher scalar(Hasher::SCALAR);
+    scalar.Update(input.data(), size);
+    const String expected_digest = scalar.Digest();
+
+    for (auto kernel : kernels) {
+      if (!Hasher::IsSupported(kernel)) {
+        continue;
+      }
+      Hasher hasher(kernel);
+      hasher.Update(input.data(), size);
+      EXPECT_EQ(expected_digest, String(hasher.Digest()))
+          << "kernel " << kernel << ", size " << size;
+    }
+  }
+}
+
+TEST(HasherTest, StreamingGivesSameDigest) {
+  const String input = RandomString(3000, 2);
+
+  Hasher hasher;
+  hasher.Update(input.data(), input.size());
+  const String expected_digest = hasher.Digest();
+
+  for (size_t chunk : {1, 7, 64, 100, 1024}) {
+    Hasher chunked_hasher;
+    for (size_t offset = 0; offset < input.size(); offset += chunk) {
+      chunked_hasher.Update(input.data() + offset,
+                            std::min(chunk, input.size() - offset));
+    }
+    EXPECT_EQ(expected_digest, String(chunked_hasher.Digest()))
+        << "chunk " << chunk;
+  }
+
+  // The parts of ropes, including nested ones, are consumed in place.
+  const ConstString rope(ConstString::Rope{
+      ConstString(input.substr(0, 10)),
+      ConstString(ConstString::Rope{ConstString(input.substr(10, 1000)),
+                                    ConstString(input.substr(1010, 90))}),
+      ConstString(input.substr(1100))});
+  EXPECT_EQ(expected_digest, String(rope.Hash()));
+}
+
+TEST(HasherTest, DifferentInputsGiveDifferentDigests) {
+  HashSet<String> digests;
+
+  // The tail is padded with zeros - make sure it doesn't collide.
+  for (size_t size = 0; size < 130; ++size) {
+    const String input(size, '\0');
+    Hasher hasher;
+    hasher.Update(input.data(), input.size());
+    EXPECT_TRUE(digests.insert(String(hasher.Digest())).second)
+        << "size " << size;
+  }
+
+  // Both the short inputs, which skip the stripes, and the longer ones.
+  for (size_t size : {16, 100}) {
+    const String input = RandomString(size, 3);
+    for (size_t i = 0; i < input.size(); ++i) {
+      for (ui8 bit = 1; bit; bit <<= 1) {
+        String modified = input;
+        modified[i] ^= bit;
+        Hasher hasher;
+        hasher.Update(modified.data(), modified.size());
+        EXPECT_TRUE(digests.insert(String(hasher.Digest())).second)
+            << "size " << size << ", byte " << i << ", bit " << ui32(bit);
+      }
+    }
+  }
+
+  EXPECT_EQ(8u, Hasher().Digest(8).size());
+}
+
+// Run with "--gtest_also_run_disabled_tests" to compare the speed with the
+// previous implementation.
+TEST(HasherTest, DISABLED_Benchmark) {
+  const String input = RandomString(64 * 1024 * 1024, 4);
+
+  auto Seconds = [](Fn<void()> hash) {
+    const auto start = std::chrono::steady_clock::now();
+    hash();
+    const std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - start;
+    return seconds.count();
+  };
+  auto Measure = [&input, &Seconds](const char* name, Fn<void()> hash) {
+    std::cout << name << ": " << input.size() / Seconds(hash) / (1 << 30)
+              << " GiB/s" << std::endl;
+  };
+
+  Measure("MurmurHash3", [&input] {
+    ui64 digest[2];
+    MurmurHash3(input.data(), input.size(), digest);
+    EXPECT_NE(0u, digest[0] | digest[1]);
+  });
+
+  const std::pair<Hasher::Kernel, const char*> kernels[] = {
+      {Hasher::SCALAR, "Hasher (scalar)"},
+      {Hasher::SSE2, "Hasher (SSE2)"},
+      {Hasher::AVX2, "Hasher (AVX2)"}};
+  for (const auto& kernel : kernels) {
+    if (!Hasher::IsSupported(kernel.first)) {
+      continue;
+    }
+    Measure(kernel.second, [&input, &kernel] {
+      Hasher hasher(kernel.first);
+      hasher.Update(input.data(), input.size());
+      EXPECT_EQ(16u, hasher.Digest().size());
+    });
+  }
+
+  // Small keys - like the hashes in hash maps. The ones up to 16 bytes skip
+  // the stripes.
+  for (size_t key_size : {8, 32}) {
+    const size_t keys = input.size() / key_size;
+    auto MeasureKeys = [keys, key_size, &Seconds](const char* name,
+                                                  Fn<void()> hash) {
+      std::cout << name << " of " << key_size
+                << " bytes: " << Seconds(hash) * 1e9 / keys << " ns"
+                << std::endl;
+    };
+
+    MeasureKeys("MurmurHash3", [&input, keys, key_size] {
+      ui64 digest[2] = {0, 0}, sum = 0;
+      for (size_t i = 0; i < keys; ++i) {
+        MurmurHash3(input.data() + key_size * i, key_size, digest);
+        sum += digest[0];
+      }
+      EXPECT_NE(0u, sum);
+    });
+
+    MeasureKeys("Hasher", [&input, keys, key_size] {
+      for (size_t i = 0; i < keys; ++i) {
+        Hasher hasher;
+        hasher.Update(input.data() + key_size * i, key_size);
+        hasher.Digest(sizeof(size_t));
+      }
+    });
+  }
+}
+
+}  // namespace base
+}  // namespace dist_clang
@@ -2,6 +2,7 @@
 
 #include <base/assert.h>
 #include <base/attributes.h>
+#include <base/ring_buffer.h>
 #include <base/worker_pool.h>
 
 #include <third_party/gtest/exported/include/gtest/gtest_prod.h>
@@ -20,7 +21,8 @@ template <class T, bool sharded = false>
 class LockedQueue {
  public:
   using Optional = Optional<T>;
-  using Queue = List<T>;
+  using CostFn = Fn<Milliseconds(const T&)>;
+  using WaitFn = Fn<void(const T&, const Clock::duration&)>;
 
   enum : ui32 {
     UNLIMITED = 0u,
@@ -28,14 +30,40 @@ class LockedQueue {
     NOT_STRICT_SHARDING = 0u,
   };
 
+  // The order, in which the workers pop the tasks of their own shards. The
+  // tasks of other shards are stolen from the other end.
+  enum Order {
+    FIFO,
+    LIFO,
+  };
+
   explicit LockedQueue(ui32 capacity = UNLIMITED)
-      : capacity_(capacity), timeout_(Seconds::zero()) {}
-  explicit LockedQueue(Seconds pop_timeout) : timeout_(pop_timeout) {
+      : index_(false, capacity == UNLIMITED ? RingBuffer<T>::UNLIMITED
+                                            : capacity),
+        capacity_(capacity),
+        timeout_(Seconds::zero()) {}
+  explicit LockedQueue(Seconds pop_timeout, Order order = FIFO)
+      : index_(order == LIFO), timeout_(pop_timeout) {
     DCHECK(timeout_ > Seconds::zero());
   }
   ~LockedQueue() {
     DCHECK(closed_);
-    DCHECK(index_.Size() == queue_.size());
+    DCHECK(index_.Size() == size_);
+  }
+
+  // Pops the tasks with the larger predicted |cost| first. Should be called
+  // before the first push.
+  void OrderByCost(CostFn cost) THREAD_UNSAFE {
+    DCHECK(!index_.Size());
+    cost_ = cost;
+    index_.OrderByCost();
+  }
+
+  // Calls |observer| with each task and the time it has waited in this queue -
+  // right when it's popped. Should be called before the first push.
+  void ObserveWait(WaitFn observer) THREAD_UNSAFE {
+    DCHECK(!index_.Size());
+    index_.ObserveWait(observer);
   }
 
   // Should be explicitly closed before destruction.
@@ -43,7 +71,6 @@ class LockedQueue {
     UniqueLock lock(pop_mutex_);
     closed_ = true;
     index_.NotifyAllShards();
-    aggregator_condition_.notify_all();
   }
 
   inline ui32 Size() const THREAD_SAFE { return size_; }
@@ -58,19 +85,28 @@ class LockedQueue {
       return false;
     }
 
+    const Milliseconds cost = cost_ ? cost_(obj) : Milliseconds::zero();
     {
       std::lock_guard<std::mutex> lock(pop_mutex_);
-      if (queue_.size() >= capacity_ && capacity_ != UNLIMITED) {
+      if (index_.Size() >= capacity_ && capacity_ != UNLIMITED) {
+        return false;
+      }
+      if (!index_.Put(std::move(obj), shard, cost)) {
         return false;
       }
-      index_.Put(queue_.insert(queue_.end(), std::move(obj)), shard);
+      ++size_;
+
+      // The waiters and the shards are changed under the lock - so they're
+      // looked through under it too: otherwise a worker, which has just
+      // started to wait, may miss the task till the pop timeout.
+      index_.NotifyShard(shard);
     }
-    ++size_;
-    index_.NotifyShard(shard);
 
-    // See a comment on |aggregator_condition_| to see why two notifications
-    // should be done here.
-    aggregator_condition_.notify_one();
+    // The aggregator doesn't wait on specific shard - so it's notified
+    // separately.
+    if (aggregator_) {
+      aggregator_->NotifyPush();
+    }
 
     return true;
   }
@@ -82,40 +118,53 @@ class LockedQueue {
     return Push(std::move(obj_copy), shard);
   }
 
+  // The workers pop only the tasks of their shards, and steal from the shards
+  // with more than |shard_queue_limit| tasks - unless it's
+  // |NOT_STRICT_SHARDING|. Changing the limit recounts the overloaded shards.
+  void SetShardQueueLimit(const ui32 shard_queue_limit) THREAD_SAFE {
+    static_assert(sharded == true,
+                  "This method makes no sence for non-sharded queue");
+    std::lock_guard<std::mutex> lock(pop_mutex_);
+    index_.SetShardQueueLimit(shard_queue_limit);
+  }
+
+  // Moves all tasks from |shard| to the shards, which |new_shard| gives - see
+  // |Index::Reshard()|.
+  void Reshard(ui32 shard, const Fn<ui32(const T&)>& new_shard) THREAD_SAFE {
+    static_assert(sharded == true,
+                  "This method makes no sence for non-sharded queue");
+    std::lock_guard<std::mutex> lock(pop_mutex_);
+    index_.Reshard(shard, new_shard);
+  }
+
   // Returns disengaged object only when this queue is closed and empty.
-  // TODO: This method is deprecated. It is used by |ThreadPool| and
-  // |QueueAggregator|. While |ThreadPool| is a subject to be removed itself
-  // |QueueAggregator| should be changed to use |PopString| or other internal
-  // members of Queue. Also method is used by caching workers. That's just wrong
-  // and should be reimplemented to use |Pop| version with pool to honor pool
-  // shutting down policy.
+  // TODO: This method is deprecated. It is used by |ThreadPool|, which is a
+  // subject to be removed itself. Also method is used by caching workers.
+  // That's just wrong and should be reimplemented to use |Pop| version with
+  // pool to honor pool shutting down policy.
   Optional Pop() THREAD_SAFE {
     UniqueLock lock(pop_mutex_);
-    index_.WaitDefaultShard(lock,
-                            [this] { return closed_ || !queue_.empty(); });
-    if (closed_ && queue_.empty()) {
+    index_.WaitDefaultShard(lock, [this] { return closed_ || index_.Size(); });
+    if (closed_ && !index_.Size()) {
       return Optional();
     }
 
-    return RemoveTaskFromQueue(
-        index_.GetWithHint(DEFAULT_SHARD, queue_.begin()));
+    return RemoveTask(index_.GetWithHint(DEFAULT_SHARD));
   }
 
   // Returns disengaged object only when this queue is closed and empty, or pool
   // is shutting down.
-  Optional Pop(const WorkerPool& pool,
-               const ui32 shard_queue_limit = NOT_STRICT_SHARDING,
-               const ui32 shard = DEFAULT_SHARD,
+  Optional Pop(const WorkerPool& pool, const ui32 shard = DEFAULT_SHARD,
                const bool no_wait = false) THREAD_SAFE {
     static_assert(sharded == true,
                   "This method makes no sence for non-sharded queue");
     DCHECK(timeout_ > Seconds::zero());
 
     UniqueLock lock(pop_mutex_);
-    if (shard_queue_limit == NOT_STRICT_SHARDING) {
+    if (index_.ShardQueueLimit() == NOT_STRICT_SHARDING) {
       return PopWithHint(pool, lock, shard);
     } else {
-      return PopStrict(pool, lock, shard_queue_limit, shard, no_wait);
+      return PopStrict(pool, lock, shard, no_wait);
     }
   }
 
@@ -125,79 +174,79 @@ class LockedQueue {
     // One can't wait for condition using predicate and timed wait here at once
     // the waiting timed out, the |pool.IsShuttingDown()| should be checked and
     // wait again if pool doesn't shutting down.
-    while (!closed_ && queue_.empty() && !pool.IsShuttingDown()) {
+    while (!closed_ && !index_.Size() && !pool.IsShuttingDown()) {
       index_.WaitShardFor(shard, lock, timeout_);
     }
-    if ((closed_ && queue_.empty()) || pool.IsShuttingDown()) {
+    if ((closed_ && !index_.Size()) || pool.IsShuttingDown()) {
       return Optional();
     }
-    return RemoveTaskFromQueue(index_.GetWithHint(shard, queue_.begin()));
+    return RemoveTask(index_.GetWithHint(shard));
   }
 
+  // The limit may be reset while waiting - then the worker keeps popping only
+  // its own shard till the next call.
   Optional PopStrict(const WorkerPool& pool, UniqueLock& lock,
-                     const ui32 shard_queue_limit,
-                     const ui32 shard,
-                     const bool no_wait) THREAD_UNSAFE {
-    DCHECK(shard_queue_limit != NOT_STRICT_SHARDING);
-    // Check if there's a shard with number of tasks that exceed queue limit
-    // AND current shard has no tasks to do. If so, steal a task from overloaded
-    // shard.
-    const ui32 maybe_overloaded_shard =
-        index_.MaybeOverloadedShard(shard_queue_limit, shard);
-    if (shard != maybe_overloaded_shard) {
+                     const ui32 shard, const bool no_wait) THREAD_UNSAFE {
+    // See comment about while loop in |PopWithHint|. The waiting worker is
+    // woken up as soon as some shard gets overloaded - to steal from it.
+    while (true) {
+      // Check if there's a shard with number of tasks that exceed queue limit
+      // AND current shard has no tasks to do. If so, steal a task from
+      // overloaded shard.
+      const ui32 maybe_overloaded_shard = index_.MaybeOverloadedShard(shard);
+      if (shard != maybe_overloaded_shard) {
+        if (pool.IsShuttingDown()) {
+          return Optional();
+        }
+        return RemoveTask(index_.Steal(maybe_overloaded_shard));
+      }
+
       if (pool.IsShuttingDown()) {
         return Optional();
       }
-      return RemoveTaskFromQueue(index_.GetStrict(maybe_overloaded_shard));
-    }
-
-    if (no_wait) {
-      if (pool.IsShuttingDown() || index_.ShardIsEmpty(shard)) {
+      if (!index_.ShardIsEmpty(shard)) {
+        return RemoveTask(index_.GetStrict(shard));
+      }
+      if (closed_ || no_wait) {
         return Optional();
       }
-      return RemoveTaskFromQueue(index_.GetStrict(shard));
-    }
 
-    // See comment about while loop in |PopWithHint|.
-    while (!closed_ && index_.ShardIsEmpty(shard) && !pool.IsShuttingDown()) {
       index_.WaitShardFor(shard, lock, timeout_);
     }
-
-    if ((closed_ && index_.ShardIsEmpty(shard)) || pool.IsShuttingDown()) {
-      return Optional();
-    }
-    return RemoveTaskFromQueue(index_.GetStrict(shard));
   }
 
-  Optional RemoveTaskFromQueue(typename Queue::iterator task_iterator)
-      THREAD_UNSAFE {
-    Optional&& task = std::move(*task_iterator);
-    queue_.erase(task_iterator);
+  Optional RemoveTask(T&& task) THREAD_UNSAFE {
     --size_;
-    return std::move(task);
+    return Optional(std::move(task));
   }
 
   FRIEND_TEST(LockedQueueIndexTest, BasicUsage);
+  FRIEND_TEST(LockedQueueIndexTest, ShardsAreLimited);
   FRIEND_TEST(LockedQueueIndexTest, GetWithHintFromHead);
+  FRIEND_TEST(LockedQueueIndexTest, GetWithHintFromHeadsOfManyShards);
   FRIEND_TEST(LockedQueueIndexTest, GetStrict);
   FRIEND_TEST(LockedQueueIndexTest, ShardIndexGrowsOnPut);
   FRIEND_TEST(LockedQueueIndexTest, ShardIndexGrowsOnOverloadedSearch);
   FRIEND_TEST(LockedQueueIndexTest, MaybeOverloadedReturnsOverloadedShard);
+  FRIEND_TEST(LockedQueueIndexTest, HintedPopsKeepShardQueueLimit);
+  FRIEND_TEST(LockedQueueIndexTest, ThievesStealFromTheOtherEnd);
+  FRIEND_TEST(LockedQueueIndexTest, OrderByCostWithAging);
+  FRIEND_TEST(LockedQueueIndexTest, OrderByCostHeap);
+  FRIEND_TEST(LockedQueueIndexTest, ReshardKeepsRanks);
   friend class QueueAggregator<T>;
 
   class Index;
 
   std::mutex pop_mutex_;
 
-  // Use a separate condition to allow QueueAggregator to know when new tasks
-  // were pushed to queue to pick one, as it shouldn't wait on specific shard.
-  std::condition_variable aggregator_condition_;
+  // Set once, before the queue is used.
+  QueueAggregator<T>* WEAK_PTR aggregator_ = nullptr;
 
-  Queue queue_;
   Index index_;
 
   const ui64 capacity_ = UNLIMITED;
   const Seconds timeout_ = Seconds::zero();
+  CostFn cost_;
 
   Atomic<ui64> size_ = {0};
   Atomic<bool> closed_ = {false};
@@ -207,3 +256,4 @@ class LockedQueue {
 }  // namespace dist_clang
 
 #include <base/locked_queue_index.h>
+#include <base/queue_aggregator.h>
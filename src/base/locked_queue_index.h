@@ -1,43 +1,106 @@
 #pragma once
 
 #include <base/locked_queue.h>
+#include <base/ring_buffer.h>
 
 #include STL(condition_variable)
 #include STL(deque)
+#include STL(random)
+#include STL(thread)
 
 namespace dist_clang {
 namespace base {
 
+// Keeps the tasks right in the ring buffers of their shards. The global order
+// is restored by the rank of each task - to pop the first one, when any shard
+// will do. The heads of shards have the least ranks there, and the shards are
+// kept in a binary heap by them - so the first task is found in O(1), and the
+// heap is updated in O(log #shards) on each change of a head.
+//
+// The owner of a shard pops its tasks in the FIFO or LIFO order, and thieves
+// steal from the other end - so they don't fight for the same tasks.
+//
+// If ordered by cost, each shard is a binary heap by rank: the push time less
+// the predicted cost. So the longest tasks go first, but a later task gets
+// ahead only if it's more expensive by more than the time between the pushes -
+// no task starves. The thieves take the last leaf of the heap: one of the
+// cheaper tasks, which is removed without sifting.
 template <class T, bool sharded>
 class LockedQueue<T, sharded>::Index {
  public:
-  using QueueIterator = typename LockedQueue<T>::Queue::iterator;
-  using TasksList = List<QueueIterator>;
+  struct Task {
+    i64 rank;
+    T value;
+    TimePoint pushed;  // Only if the wait is observed.
+  };
   struct Shard {
-    TasksList tasks;
+    explicit Shard(size_t max_size) : tasks(8, max_size) {}
+
+    RingBuffer<Task> tasks;
     std::condition_variable pop_condition_;
+    ui32 waiters = 0;
+    size_t head = NO_HEAD;  // The position in |heads_|.
   };
 
-  // Initialize index for LockedQueue<T>::DEFAULT_SHARD.
-  Index() : index_(1u) {}
+  // Initialize index for LockedQueue<T>::DEFAULT_SHARD. A single shard never
+  // holds more than |max_size| tasks.
+  explicit Index(bool lifo = false,
+                 size_t max_size = RingBuffer<Task>::UNLIMITED)
+      : lifo_(lifo), max_size_(max_size) {
+    EnsureShardExists(LockedQueue<T>::DEFAULT_SHARD);
+  }
+
+  inline ui64 Size() const THREAD_UNSAFE { return size_; }
+
+  // Orders the tasks pushed afterwards by their |cost| - the owners pop the
+  // most expensive ones first.
+  void OrderByCost() THREAD_UNSAFE { by_cost_ = true; }
 
-  ~Index() {
-    // Make sure we don't leak iterators.
-    DCHECK(reverse_index_.size() == Size());
+  void ObserveWait(const WaitFn& observer) THREAD_UNSAFE {
+    wait_observer_ = observer;
   }
 
-  ui64 Size() const THREAD_UNSAFE {
-    ui64 index_size = 0u;
-    for (const auto& shard : index_) {
-      index_size += shard.tasks.size();
+  // Returns |false| and leaves the |task| intact, if the |shard| is full.
+  bool Put(T&& task, const ui32 shard,
+           const Milliseconds& cost = Milliseconds::zero()) THREAD_UNSAFE {
+    EnsureShardExists(shard);
+    auto& tasks = index_[shard].tasks;
+    if (tasks.full()) {
+      return false;
     }
-    return index_size;
+
+    const TimePoint pushed = wait_observer_ ? Clock::now() : TimePoint();
+    const i64 rank = by_cost_ ? std::chrono::duration_cast<Milliseconds>(
+                                    Clock::now().time_since_epoch() - cost)
+                                    .count()
+                              : next_rank_++;
+    Insert(Task{rank, std::move(task), pushed}, shard);
+    return true;
   }
 
-  void Put(QueueIterator it, const ui32 shard) {
-    EnsureShardExists(shard);
-    reverse_index_[&*it] = std::make_pair(
-        index_[shard].tasks.insert(index_[shard].tasks.end(), it), shard);
+  // Moves all tasks from |shard| to the shards, which |new_shard| gives. The
+  // tasks keep the time they were pushed, and the ranks by cost - so they don't
+  // lose the time they've waited. Without the cost they're put after the tasks
+  // of their new shards.
+  void Reshard(const ui32 shard,
+               const Fn<ui32(const T&)>& new_shard) THREAD_UNSAFE {
+    if (shard >= index_.size()) {
+      return;
+    }
+
+    Vector<Task> tasks;
+    while (!index_[shard].tasks.empty()) {
+      tasks.push_back(Remove(shard, false));
+    }
+    for (auto& task : tasks) {
+      const ui32 target = new_shard(task.value);
+      EnsureShardExists(target);
+      if (!by_cost_) {
+        task.rank = next_rank_++;
+      }
+      Insert(std::move(task), target);
+      NotifyShard(target);
+    }
   }
 
   bool ShardIsEmpty(const ui32 shard) THREAD_UNSAFE {
@@ -49,7 +112,11 @@ class LockedQueue<T, sharded>::Index {
                     const Seconds& timeout) THREAD_UNSAFE {
     EnsureShardExists(shard);
     DCHECK(shard < index_.size());
+    ++index_[shard].waiters;
+    ++waiters_;
     index_[shard].pop_condition_.wait_for(lock, timeout);
+    --index_[shard].waiters;
+    --waiters_;
   }
 
   template <typename Pred>
@@ -57,9 +124,30 @@ class LockedQueue<T, sharded>::Index {
     index_[LockedQueue<T>::DEFAULT_SHARD].pop_condition_.wait(lock, pred);
   }
 
+  // If nobody waits for the |shard|, while its task may be taken by others,
+  // then wakes up a waiter of a random shard - instead of letting it sleep
+  // till the pop timeout.
   void NotifyShard(const ui32 shard) THREAD_UNSAFE {
     DCHECK(shard < index_.size());
-    index_[shard].pop_condition_.notify_one();
+
+    if (index_[shard].waiters || !waiters_) {
+      index_[shard].pop_condition_.notify_one();
+      return;
+    }
+
+    if (shard_queue_limit_ &&
+        index_[shard].tasks.size() <= shard_queue_limit_) {
+      return;
+    }
+
+    const ui32 start = Random() % index_.size();
+    for (ui32 i = 0; i < index_.size(); ++i) {
+      auto& thief = index_[(start + i) % index_.size()];
+      if (thief.waiters) {
+        thief.pop_condition_.notify_one();
+        return;
+      }
+    }
   }
 
   void NotifyAllShards() THREAD_UNSAFE {
@@ -68,76 +156,258 @@ class LockedQueue<T, sharded>::Index {
     }
   }
 
-  // Returns either |shard| or shard with queue larger than |shard_queue_limit|.
-  ui32 MaybeOverloadedShard(const ui32 shard_queue_limit,
-                            const ui32 shard) THREAD_UNSAFE {
-    DCHECK(shard_queue_limit != LockedQueue<T>::NOT_STRICT_SHARDING);
+  // The overloaded shards are counted - to not look for them in vain. They're
+  // recounted on each change of the limit, so it's set on reload only.
+  void SetShardQueueLimit(const ui32 shard_queue_limit) THREAD_UNSAFE {
+    if (shard_queue_limit == shard_queue_limit_) {
+      return;
+    }
+
+    shard_queue_limit_ = shard_queue_limit;
+    overloaded_shards_ = 0;
+    if (shard_queue_limit_) {
+      for (const auto& shard : index_) {
+        if (shard.tasks.size() > shard_queue_limit_) {
+          ++overloaded_shards_;
+        }
+      }
+    }
+  }
+
+  inline ui32 ShardQueueLimit() const THREAD_UNSAFE {
+    return shard_queue_limit_;
+  }
+
+  // Returns either |shard| or shard with queue larger than the limit. The own
+  // shard is always preferred - it's the one, which caches the results of its
+  // tasks. The overloaded shards are looked up from a random one, so the
+  // thieves don't fall on the same victim. Without the limit none of shards is
+  // overloaded.
+  ui32 MaybeOverloadedShard(const ui32 shard) THREAD_UNSAFE {
     EnsureShardExists(shard);
-    if (!index_[shard].tasks.empty()) {
+
+    if (!index_[shard].tasks.empty() || !overloaded_shards_) {
       return shard;
     }
 
-    for (ui32 current = 0; current < index_.size(); ++current) {
-      if (index_[current].tasks.size() > shard_queue_limit) {
+    const ui32 start = Random() % index_.size();
+    for (ui32 i = 0; i < index_.size(); ++i) {
+      const ui32 current = (start + i) % index_.size();
+      if (index_[current].tasks.size() > shard_queue_limit_) {
         return current;
       }
     }
 
+    NOTREACHED();
     return shard;
   }
 
-  QueueIterator GetWithHint(ui32 shard, QueueIterator begin) THREAD_UNSAFE {
-    DCHECK(!index_.empty());
+  // Takes the next task from |shard|, or the first task at all - if the
+  // |shard| is empty.
+  T GetWithHint(ui32 shard) THREAD_UNSAFE {
+    DCHECK(size_);
 
-    QueueIterator item;
-    if (shard < index_.size() && !index_[shard].tasks.empty()) {
-      item = index_[shard].tasks.front();
-      index_[shard].tasks.pop_front();
-      reverse_index_.erase(&*item);
-    } else {
-      item = begin;
-      shard = reverse_index_[&*begin].second;
-      index_[shard].tasks.erase(reverse_index_[&*begin].first);
-      reverse_index_.erase(&*begin);
+    if (shard >= index_.size() || index_[shard].tasks.empty()) {
+      return Take(FirstShard(), false);
     }
 
-    return item;
+    return Take(shard, lifo_ && !by_cost_);
   }
 
-  QueueIterator GetStrict(const ui32 shard) THREAD_UNSAFE {
+  T GetStrict(const ui32 shard) THREAD_UNSAFE {
     DCHECK(shard < index_.size() && !index_[shard].tasks.empty());
+    return Take(shard, lifo_ && !by_cost_);
+  }
 
-    auto& tasks = index_[shard].tasks;
-    QueueIterator item = tasks.front();
-    tasks.pop_front();
-    reverse_index_.erase(&*item);
-
-    return item;
+  T Steal(const ui32 shard) THREAD_UNSAFE {
+    DCHECK(shard < index_.size() && !index_[shard].tasks.empty());
+    return Take(shard, !lifo_ || by_cost_);
   }
 
  private:
   FRIEND_TEST(LockedQueueIndexTest, BasicUsage);
+  FRIEND_TEST(LockedQueueIndexTest, ShardsAreLimited);
   FRIEND_TEST(LockedQueueIndexTest, GetWithHintFromHead);
+  FRIEND_TEST(LockedQueueIndexTest, GetWithHintFromHeadsOfManyShards);
   FRIEND_TEST(LockedQueueIndexTest, GetStrict);
   FRIEND_TEST(LockedQueueIndexTest, ShardIndexGrowsOnPut);
   FRIEND_TEST(LockedQueueIndexTest, ShardIndexGrowsOnOverloadedSearch);
   FRIEND_TEST(LockedQueueIndexTest, MaybeOverloadedReturnsOverloadedShard);
+  FRIEND_TEST(LockedQueueIndexTest, HintedPopsKeepShardQueueLimit);
+  FRIEND_TEST(LockedQueueIndexTest, ThievesStealFromTheOtherEnd);
+  FRIEND_TEST(LockedQueueIndexTest, OrderByCostWithAging);
+  FRIEND_TEST(LockedQueueIndexTest, OrderByCostHeap);
+  FRIEND_TEST(LockedQueueIndexTest, ReshardKeepsRanks);
+
+  static constexpr size_t NO_HEAD = std::numeric_limits<size_t>::max();
+
+  static ui32 Random() {
+    thread_local std::minstd_rand generator(
+        std::hash<std::thread::id>()(std::this_thread::get_id()));
+    return generator();
+  }
 
   void EnsureShardExists(const ui32 shard) {
     // TODO(ilezhankin): describe rationale for this place.
-    if (shard >= index_.size()) {
-      index_.resize(shard + 1);
+    while (shard >= index_.size()) {
+      index_.emplace_back(max_size_);
+    }
+  }
+
+  ui32 FirstShard() const THREAD_UNSAFE {
+    DCHECK(!heads_.empty());
+    return heads_.front();
+  }
+
+  // Puts the |shard| to its place in |heads_| - after its head has changed.
+  void UpdateHead(const ui32 shard) THREAD_UNSAFE {
+    const size_t position = index_[shard].head;
+
+    if (index_[shard].tasks.empty()) {
+      if (position != NO_HEAD) {
+        SwapHeads(position, heads_.size() - 1);
+        heads_.pop_back();
+        index_[shard].head = NO_HEAD;
+        if (position < heads_.size()) {
+          SiftHead(position);
+        }
+      }
+      return;
+    }
+
+    if (position == NO_HEAD) {
+      index_[shard].head = heads_.size();
+      heads_.push_back(shard);
+    }
+    SiftHead(index_[shard].head);
+  }
+
+  i64 HeadRank(const size_t position) const THREAD_UNSAFE {
+    return index_[heads_[position]].tasks.front().rank;
+  }
+
+  void SwapHeads(const size_t left, const size_t right) THREAD_UNSAFE {
+    std::swap(heads_[left], heads_[right]);
+    index_[heads_[left]].head = left;
+    index_[heads_[right]].head = right;
+  }
+
+  void SiftHead(size_t position) THREAD_UNSAFE {
+    while (position && HeadRank((position - 1) / 2) > HeadRank(position)) {
+      SwapHeads((position - 1) / 2, position);
+      position = (position - 1) / 2;
+    }
+
+    while (true) {
+      size_t least = position;
+      for (size_t child = 2 * position + 1;
+           child <= 2 * position + 2 && child < heads_.size(); ++child) {
+        if (HeadRank(child) < HeadRank(least)) {
+          least = child;
+        }
+      }
+      if (least == position) {
+        return;
+      }
+      SwapHeads(least, position);
+      position = least;
+    }
+  }
+
+  T Take(const ui32 shard, const bool from_back) THREAD_UNSAFE {
+    Task task = Remove(shard, from_back);
+    if (wait_observer_) {
+      wait_observer_(task.value, Clock::now() - task.pushed);
+    }
+    return std::move(task.value);
+  }
+
+  // The |shard| should have a free slot for the |task|.
+  void Insert(Task&& task, const ui32 shard) THREAD_UNSAFE {
+    auto& tasks = index_[shard].tasks;
+    DCHECK_O_EVAL(tasks.push_back(std::move(task)));
+    if (by_cost_) {
+      SiftUp(tasks, tasks.size() - 1);
+    }
+    UpdateHead(shard);
+    ++size_;
+
+    if (shard_queue_limit_ && tasks.size() == shard_queue_limit_ + 1) {
+      ++overloaded_shards_;
+    }
+  }
+
+  Task Remove(const ui32 shard, const bool from_back) THREAD_UNSAFE {
+    auto& tasks = index_[shard].tasks;
+    if (shard_queue_limit_ && tasks.size() == shard_queue_limit_ + 1) {
+      --overloaded_shards_;
+    }
+
+    if (by_cost_ && !from_back) {
+      // The root is swapped with the last leaf, which sinks down afterwards.
+      tasks.swap(0, tasks.size() - 1);
+      Task task = std::move(tasks.back());
+      tasks.pop_back();
+      SiftDown(tasks, 0);
+      UpdateHead(shard);
+      --size_;
+      return task;
+    }
+
+    Task task = std::move(from_back ? tasks.back() : tasks.front());
+    if (from_back) {
+      tasks.pop_back();
+    } else {
+      tasks.pop_front();
+    }
+    UpdateHead(shard);
+    --size_;
+    return task;
+  }
+
+  // The heap of a shard keeps the least rank at the front.
+  static void SiftUp(RingBuffer<Task>& tasks, size_t index) {
+    while (index) {
+      const size_t parent = (index - 1) / 2;
+      if (tasks[parent].rank <= tasks[index].rank) {
+        return;
+      }
+      tasks.swap(parent, index);
+      index = parent;
+    }
+  }
+
+  static void SiftDown(RingBuffer<Task>& tasks, size_t index) {
+    while (true) {
+      size_t least = index;
+      for (size_t child = 2 * index + 1;
+           child <= 2 * index + 2 && child < tasks.size(); ++child) {
+        if (tasks[child].rank < tasks[least].rank) {
+          least = child;
+        }
+      }
+      if (least == index) {
+        return;
+      }
+      tasks.swap(least, index);
+      index = least;
     }
   }
 
   // Use deque as condition variables are not movable.
   std::deque<Shard> index_;
+  // The non-empty shards - in a binary heap by the ranks of their heads.
+  Vector<ui32> heads_;
 
-  // FIXME: use anything more shiny for hashing than |T*|.
-  HashMap<const T*, Pair<typename TasksList::const_iterator, ui32 /* shard */>>
-      reverse_index_;
-  // This index is used to remove items from |index_| in O(1) when
-  // those are picked from the top of the |queue_|.
+  const bool lifo_;
+  const size_t max_size_;
+  bool by_cost_ = false;
+  WaitFn wait_observer_;
+  i64 next_rank_ = 0;
+  ui64 size_ = 0;
+  ui32 waiters_ = 0;
+  ui32 shard_queue_limit_ = LockedQueue<T>::NOT_STRICT_SHARDING;
+  ui32 overloaded_shards_ = 0;
 };
 
 }  // namespace base
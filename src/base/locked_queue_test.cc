@@ -4,6 +4,8 @@
 #include <base/worker_pool.h>
 
 #include <third_party/gtest/exported/include/gtest/gtest.h>
+#include STL(chrono)
+#include STL(iostream)
 
 namespace dist_clang {
 namespace base {
@@ -121,7 +123,7 @@ TEST(LockedQueueTest, BasicMultiThreadedUsage) {
   const int total_number_of_tasks = number_of_tasks_to_process + tasks_to_leave;
   UniquePtr<WorkerPool> workers(new WorkerPool);
   Worker worker = [&queue](const WorkerPool& pool) {
-    EXPECT_TRUE(!!queue.Pop(pool, 0));
+    EXPECT_TRUE(!!queue.Pop(pool));
   };
   workers->AddWorker("Test worker"_l, worker, number_of_tasks_to_process);
 
@@ -149,8 +151,7 @@ TEST(LockedQueueTest, NotStrictSharding) {
       const int tasks_per_shard =
           number_of_tasks_to_process / initial_number_of_shards;
       for (int task = 0; task < tasks_per_shard; ++task) {
-        EXPECT_TRUE(
-            !!queue.Pop(pool, LockedQueue<int>::NOT_STRICT_SHARDING, shard));
+        EXPECT_TRUE(!!queue.Pop(pool, shard));
       }
     };
     workers->AddWorker("Test worker"_l, worker);
@@ -174,6 +175,7 @@ TEST(LockedQueueTest, StrictSharding) {
   const ui32 number_of_tasks = 500u;
   constexpr const size_t number_of_shards = 4u;
   constexpr const size_t shard_with_tasks = 2u;
+  queue.SetShardQueueLimit(number_of_tasks);
 
   static_assert(number_of_shards > shard_with_tasks,
                 "Selected shard should be lower than overall number of shards");
@@ -191,15 +193,15 @@ TEST(LockedQueueTest, StrictSharding) {
     Worker worker = [&, shard](const WorkerPool& pool) {
       if (shard == shard_with_tasks) {
         for (ui32 task = 0u; task < number_of_tasks; ++task) {
-          EXPECT_TRUE(!!queue.Pop(pool, number_of_tasks, shard));
+          EXPECT_TRUE(!!queue.Pop(pool, shard));
           ++tasks_done;
         }
         get_tasks_done.notify_one();
       }
       while (!pool.IsShuttingDown()) {
-        EXPECT_FALSE(!!queue.Pop(pool, number_of_tasks, shard));
+        EXPECT_FALSE(!!queue.Pop(pool, shard));
       }
-      EXPECT_FALSE(!!queue.Pop(pool, number_of_tasks, shard));
+      EXPECT_FALSE(!!queue.Pop(pool, shard));
     };
     workers->AddWorker("Test worker"_l, worker);
   }
@@ -223,6 +225,7 @@ TEST(LockedQueueTest, OverloadedShardSelectedOnQueueLimit) {
   constexpr const size_t number_of_shards = 2u;
   constexpr const size_t shard_without_tasks = 0u;
   constexpr const size_t shard_with_tasks = 1u;
+  queue.SetShardQueueLimit(shard_queue_limit);
 
   static_assert(number_of_shards > shard_with_tasks,
                 "Selected shard should be lower than overall number of shards");
@@ -239,7 +242,7 @@ TEST(LockedQueueTest, OverloadedShardSelectedOnQueueLimit) {
 
   Worker worker = [&](const WorkerPool& pool) {
     for (size_t task = 0u; task < available_tasks; ++task) {
-      EXPECT_TRUE(!!queue.Pop(pool, shard_queue_limit, shard_without_tasks));
+      EXPECT_TRUE(!!queue.Pop(pool, shard_without_tasks));
       ++tasks_done;
     }
     get_tasks_done.notify_one();
@@ -249,11 +252,11 @@ TEST(LockedQueueTest, OverloadedShardSelectedOnQueueLimit) {
     }
 
     // Popping from shard should not work on shutting down pool.
-    EXPECT_FALSE(!!queue.Pop(pool, shard_queue_limit, shard_with_tasks));
+    EXPECT_FALSE(!!queue.Pop(pool, shard_with_tasks));
 
     // Popping from overloaded shard also should not work on shutting down pool.
-    EXPECT_FALSE(!!queue.Pop(
-        pool, shard_queue_limit - 1u, shard_without_tasks));
+    queue.SetShardQueueLimit(shard_queue_limit - 1u);
+    EXPECT_FALSE(!!queue.Pop(pool, shard_without_tasks));
   };
   workers->AddWorker("Test worker"_l, worker);
 
@@ -266,121 +269,295 @@ TEST(LockedQueueTest, OverloadedShardSelectedOnQueueLimit) {
   queue.Close();
 }
 
+TEST(LockedQueueTest, IdleWorkerStealsFromOverloadedShard) {
+  using Worker = WorkerPool::SimpleWorker;
+
+  // The timeout is large enough to notice, if the idle worker isn't woken up.
+  LockedQueue<ui32, true> queue(Seconds(10));
+  const ui32 shard_queue_limit = 2u;
+  constexpr const size_t idle_shard = 0u;
+  constexpr const size_t busy_shard = 1u;
+  queue.SetShardQueueLimit(shard_queue_limit);
+
+  Atomic<bool> stolen = {false};
+  Mutex get_tasks;
+  std::condition_variable get_tasks_done;
+
+  UniquePtr<WorkerPool> workers(new WorkerPool(true));
+  Worker worker = [&](const WorkerPool& pool) {
+    // The last pushed task is stolen - from the other end of FIFO shard.
+    const auto task = queue.Pop(pool, idle_shard);
+    EXPECT_TRUE(!!task);
+    if (task) {
+      EXPECT_EQ(shard_queue_limit, *task);
+    }
+    stolen = true;
+    get_tasks_done.notify_one();
+  };
+  workers->AddWorker("Test worker"_l, worker);
+
+  // Let the worker fall asleep on its empty shard.
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  for (ui32 task = 0u; task <= shard_queue_limit; ++task) {
+    EXPECT_TRUE(queue.Push(task, busy_shard));
+  }
+
+  UniqueLock lock(get_tasks);
+  EXPECT_TRUE(
+      get_tasks_done.wait_for(lock, Seconds(1), [&] { return !!stolen; }));
+  lock.unlock();
+
+  workers.reset();
+  EXPECT_EQ(shard_queue_limit, queue.Size());
+  queue.Close();
+}
+
+TEST(LockedQueueTest, OrderByCost) {
+  LockedQueue<ui32, true> queue;
+  queue.OrderByCost([](const ui32& task) { return Seconds(task); });
+
+  for (ui32 task : {1u, 3u, 2u}) {
+    EXPECT_TRUE(queue.Push(task));
+  }
+  for (ui32 expected : {3u, 2u, 1u}) {
+    auto&& task = queue.Pop();
+    ASSERT_TRUE(!!task);
+    EXPECT_EQ(expected, *task);
+  }
+
+  queue.Close();
+}
+
+TEST(LockedQueueTest, ObserveWait) {
+  LockedQueue<int> queue;
+  List<Clock::duration> waits;
+  queue.ObserveWait([&waits](const int& task, const Clock::duration& wait) {
+    EXPECT_EQ(static_cast<int>(waits.size()) + 1, task);
+    waits.push_back(wait);
+  });
+
+  ASSERT_TRUE(queue.Push(1));
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  ASSERT_TRUE(queue.Push(2));
+  ASSERT_TRUE(!!queue.Pop());
+  ASSERT_TRUE(!!queue.Pop());
+
+  ASSERT_EQ(2u, waits.size());
+  EXPECT_LE(std::chrono::milliseconds(10), waits.front());
+  EXPECT_GT(waits.front(), waits.back());
+
+  queue.Close();
+}
+
+// Run with "--gtest_also_run_disabled_tests" to measure the throughput of the
+// queue under contention.
+TEST(LockedQueueTest, DISABLED_ContentionBenchmark) {
+  using Worker = WorkerPool::SimpleWorker;
+
+  const ui32 number_of_producers = 4u;
+  const ui32 number_of_consumers = 4u;
+  const ui32 number_of_shards = 4u;
+  const ui32 tasks_per_producer = 100000u;
+  const ui32 total_number_of_tasks = number_of_producers * tasks_per_producer;
+
+  for (const ui32 shard_queue_limit : {0u, 100u}) {
+    LockedQueue<ui32, true> queue(Seconds(1));
+    queue.SetShardQueueLimit(shard_queue_limit);
+    Atomic<ui32> tasks_done = {0u};
+
+    const auto start = std::chrono::steady_clock::now();
+    auto finish = start;
+
+    UniquePtr<WorkerPool> consumers(new WorkerPool(true));
+    for (ui32 shard = 0; shard < number_of_consumers; ++shard) {
+      Worker worker = [&, shard](const WorkerPool& pool) {
+        while (!queue.IsClosed()) {
+          if (queue.Pop(pool, shard, true) &&
+              ++tasks_done == total_number_of_tasks) {
+            finish = std::chrono::steady_clock::now();
+            // Wake up the waiting consumers.
+            queue.Close();
+          }
+        }
+      };
+      consumers->AddWorker("Test consumer"_l, worker);
+    }
+
+    UniquePtr<WorkerPool> producers(new WorkerPool);
+    for (ui32 producer = 0; producer < number_of_producers; ++producer) {
+      Worker worker = [&, producer](const WorkerPool&) {
+        for (ui32 task = 0; task < tasks_per_producer; ++task) {
+          EXPECT_TRUE(queue.Push(task, (producer + task) % number_of_shards));
+        }
+      };
+      producers->AddWorker("Test producer"_l, worker);
+    }
+
+    producers.reset();
+    while (!queue.IsClosed()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    consumers.reset();
+
+    const std::chrono::duration<double> seconds = finish - start;
+    std::cout << (shard_queue_limit ? "Strict" : "Not strict")
+              << " sharding: " << total_number_of_tasks / seconds.count()
+              << " tasks/s" << std::endl;
+
+    EXPECT_EQ(total_number_of_tasks, tasks_done);
+    EXPECT_EQ(0u, queue.Size());
+  }
+}
+
 TEST(LockedQueueIndexTest, BasicUsage) {
-  List<int> list;
   LockedQueue<int>::Index index;
 
   const ui32 shard = 4u;
 
-  auto inserted_item = list.insert(list.end(), 1);
-  index.Put(inserted_item, shard);
+  index.Put(1, shard);
   EXPECT_EQ(shard + 1, index.index_.size());
   EXPECT_EQ(1u, index.index_[shard].tasks.size());
-  EXPECT_EQ(1u, index.reverse_index_.size());
-  EXPECT_EQ(1u, index.reverse_index_.count(&*inserted_item));
+  EXPECT_EQ(1u, index.Size());
 
-  EXPECT_EQ(inserted_item, index.GetWithHint(shard, list.begin()));
+  EXPECT_EQ(1, index.GetWithHint(shard));
 
   // Index shouldn't shrink on elements removal.
   EXPECT_EQ(shard + 1, index.index_.size());
   EXPECT_EQ(0u, index.index_[shard].tasks.size());
-  EXPECT_EQ(0u, index.reverse_index_.size());
-  EXPECT_EQ(0u, index.reverse_index_.count(&*inserted_item));
+  EXPECT_EQ(0u, index.Size());
+}
+
+TEST(LockedQueueIndexTest, ShardsAreLimited) {
+  LockedQueue<int>::Index index(false, 2u);
+
+  const ui32 shard = 4u;
+
+  EXPECT_TRUE(index.Put(1, shard));
+  EXPECT_TRUE(index.Put(2, shard));
+  EXPECT_FALSE(index.Put(3, shard));
+  EXPECT_EQ(2u, index.Size());
+
+  EXPECT_TRUE(index.Put(3, shard - 1u));
+  EXPECT_EQ(1, index.GetStrict(shard));
+  EXPECT_TRUE(index.Put(4, shard));
+  EXPECT_EQ(3u, index.Size());
 }
 
 TEST(LockedQueueIndexTest, GetWithHintFromHead) {
-  List<int> list;
   LockedQueue<int>::Index index;
 
-  const ui32 shard = 4u;
+  const ui32 shard1 = 4u;
+  const ui32 shard2 = 3u;
   const ui32 empty_shard = 5u;
 
-  auto inserted_item = list.insert(list.end(), 1);
-  index.Put(inserted_item, shard);
-  EXPECT_EQ(shard + 1, index.index_.size());
-  EXPECT_EQ(1u, index.index_[shard].tasks.size());
-  EXPECT_EQ(1u, index.reverse_index_.size());
-  EXPECT_EQ(1u, index.reverse_index_.count(&*inserted_item));
+  index.Put(1, shard1);
+  index.Put(2, shard2);
+  index.Put(3, shard1);
+  EXPECT_EQ(shard1 + 1, index.index_.size());
+  EXPECT_EQ(2u, index.index_[shard1].tasks.size());
+  EXPECT_EQ(1u, index.index_[shard2].tasks.size());
+  EXPECT_EQ(3u, index.Size());
 
-  EXPECT_EQ(inserted_item, index.GetWithHint(empty_shard, list.begin()));
+  // The tasks from other shards are taken in the global order.
+  EXPECT_EQ(1, index.GetWithHint(empty_shard));
+  EXPECT_EQ(2, index.GetWithHint(empty_shard));
+  EXPECT_EQ(3, index.GetWithHint(shard2));
 
   // Index shouldn't shrink on elements removal.
-  EXPECT_EQ(shard + 1, index.index_.size());
-  EXPECT_EQ(0u, index.index_[shard].tasks.size());
-  EXPECT_EQ(0u, index.reverse_index_.size());
-  EXPECT_EQ(0u, index.reverse_index_.count(&*inserted_item));
+  EXPECT_EQ(shard1 + 1, index.index_.size());
+  EXPECT_EQ(0u, index.index_[shard1].tasks.size());
+  EXPECT_EQ(0u, index.index_[shard2].tasks.size());
+  EXPECT_EQ(0u, index.Size());
+}
+
+TEST(LockedQueueIndexTest, GetWithHintFromHeadsOfManyShards) {
+  LockedQueue<int>::Index index;
+
+  const ui32 shards = 64u;
+  const ui32 empty_shard = shards;
+  const int tasks = 1000;
+
+  for (int task = 0; task < tasks; ++task) {
+    index.Put(int(task), (task * 37) % shards);
+  }
+
+  // The owners and the thieves change the heads of shards - the rest of tasks
+  // are still taken in the global order.
+  Vector<bool> taken(tasks, false);
+  for (ui32 shard = 0; shard < shards; shard += 3) {
+    taken[index.GetStrict(shard)] = true;
+    taken[index.Steal(shard)] = true;
+  }
+
+  int last = -1;
+  while (index.Size()) {
+    const int task = index.GetWithHint(empty_shard);
+    EXPECT_FALSE(taken[task]);
+    EXPECT_LT(last, task);
+    last = task;
+  }
+  EXPECT_TRUE(index.heads_.empty());
 }
 
 TEST(LockedQueueIndexTest, GetStrict) {
-  List<int> list;
   LockedQueue<int>::Index index;
 
   const ui32 shard = 4u;
 
-  auto inserted_item = list.insert(list.end(), 1);
-
   ASSERT_ANY_THROW(index.GetStrict(shard));
 
-  index.Put(inserted_item, shard);
+  index.Put(1, shard);
   EXPECT_EQ(shard + 1, index.index_.size());
   EXPECT_EQ(1u, index.index_[shard].tasks.size());
-  EXPECT_EQ(1u, index.reverse_index_.size());
-  EXPECT_EQ(1u, index.reverse_index_.count(&*inserted_item));
+  EXPECT_EQ(1u, index.Size());
 
-  EXPECT_EQ(inserted_item, index.GetStrict(shard));
+  EXPECT_EQ(1, index.GetStrict(shard));
   ASSERT_ANY_THROW(index.GetStrict(shard - 1u));
 }
 
 TEST(LockedQueueIndexTest, ShardIndexGrowsOnPut) {
-  List<int> list;
   LockedQueue<int>::Index index;
 
   const ui32 shard1 = 4u;
   const ui32 shard2 = 5u;
 
-  auto inserted_item = list.insert(list.end(), 1);
-  index.Put(inserted_item, shard1);
+  index.Put(1, shard1);
   EXPECT_EQ(shard1 + 1, index.index_.size());
   EXPECT_EQ(1u, index.index_[shard1].tasks.size());
-  EXPECT_EQ(1u, index.reverse_index_.count(&*inserted_item));
 
   ASSERT_ANY_THROW(index.NotifyShard(shard2));
 
-  inserted_item = list.insert(list.end(), 5);
-  index.Put(inserted_item, shard2);
+  index.Put(5, shard2);
   EXPECT_EQ(shard2 + 1, index.index_.size());
   EXPECT_EQ(1u, index.index_[shard1].tasks.size());
   EXPECT_EQ(1u, index.index_[shard2].tasks.size());
-  EXPECT_EQ(1u, index.reverse_index_.count(&*inserted_item));
+  EXPECT_EQ(2u, index.Size());
 }
 
 TEST(LockedQueueIndexTest, ShardIndexGrowsOnOverloadedSearch) {
-  List<int> list;
   LockedQueue<int>::Index index;
 
   const ui32 shard1 = 4u;
   const ui32 shard2 = 5u;
 
-  auto inserted_item = list.insert(list.end(), 1);
-  index.Put(inserted_item, shard1);
+  index.Put(1, shard1);
   EXPECT_EQ(shard1 + 1, index.index_.size());
   EXPECT_EQ(1u, index.index_[shard1].tasks.size());
-  EXPECT_EQ(1u, index.reverse_index_.count(&*inserted_item));
 
   ASSERT_ANY_THROW(index.ShardIsEmpty(shard2));
   ASSERT_ANY_THROW(index.GetStrict(shard2));
 
   const ui32 max_queue_size = 3u;
 
-  EXPECT_EQ(shard2, index.MaybeOverloadedShard(max_queue_size, shard2));
+  index.SetShardQueueLimit(max_queue_size);
+  EXPECT_EQ(shard2, index.MaybeOverloadedShard(shard2));
   EXPECT_EQ(shard2 + 1, index.index_.size());
   EXPECT_EQ(1u, index.index_[shard1].tasks.size());
-  EXPECT_EQ(1u, index.reverse_index_.count(&*inserted_item));
   EXPECT_EQ(0u, index.index_[shard2].tasks.size());
+  EXPECT_EQ(1u, index.Size());
 }
 
 TEST(LockedQueueIndexTest, MaybeOverloadedReturnsOverloadedShard) {
-  List<int> list;
   LockedQueue<int>::Index index;
 
   const ui32 shard1 = 4u;
@@ -388,34 +565,176 @@ TEST(LockedQueueIndexTest, MaybeOverloadedReturnsOverloadedShard) {
 
   const ui32 max_queue_size = 3u;
 
-  List<int>::iterator inserted_item;
   for (ui32 task = 1; task < 2 * max_queue_size; ++task) {
-    inserted_item = list.insert(list.end(), task);
-    index.Put(inserted_item, shard1);
+    index.Put(task, shard1);
     EXPECT_EQ(shard1 + 1, index.index_.size());
     EXPECT_EQ(task, index.index_[shard1].tasks.size());
-    EXPECT_EQ(1u, index.reverse_index_.count(&*inserted_item));
   }
 
   ASSERT_ANY_THROW(index.ShardIsEmpty(shard2));
   ASSERT_ANY_THROW(index.GetStrict(shard2));
 
-  EXPECT_EQ(shard1, index.MaybeOverloadedShard(max_queue_size, shard2));
+  index.SetShardQueueLimit(max_queue_size);
+  EXPECT_EQ(shard1, index.MaybeOverloadedShard(shard2));
   // Check that |MaybeOverloadedShard| returns really overloaded shard, even if
   // we hint to |shard2|.
 
   EXPECT_EQ(shard2 + 1, index.index_.size());
   EXPECT_EQ(0u, index.index_[shard2].tasks.size());
 
-  inserted_item = list.insert(list.end(), max_queue_size * 3u);
-  index.Put(inserted_item, shard2);
+  index.Put(max_queue_size * 3u, shard2);
 
-  EXPECT_EQ(shard2, index.MaybeOverloadedShard(max_queue_size, shard2));
+  EXPECT_EQ(shard2, index.MaybeOverloadedShard(shard2));
   // But if there's at least one task in hinted shard, |MaybeOverloadedShard|
   // should favor the hint.
 
   EXPECT_EQ(1u, index.index_[shard2].tasks.size());
 }
 
+TEST(LockedQueueIndexTest, HintedPopsKeepShardQueueLimit) {
+  LockedQueue<int>::Index index;
+  index.SetShardQueueLimit(2u);
+
+  const ui32 shard1 = 1u;
+  const ui32 shard2 = 2u;
+
+  for (int task = 1; task <= 4; ++task) {
+    index.Put(int(task), shard1);
+  }
+  EXPECT_EQ(1u, index.overloaded_shards_);
+
+  // The local workers pop without a limit - it stays for the remote ones, and
+  // the overloaded shards are counted on the way.
+  EXPECT_EQ(1, index.GetWithHint(shard2));
+  EXPECT_EQ(2u, index.ShardQueueLimit());
+  EXPECT_EQ(1u, index.overloaded_shards_);
+  EXPECT_EQ(shard1, index.MaybeOverloadedShard(shard2));
+
+  EXPECT_EQ(2, index.GetWithHint(shard2));
+  EXPECT_EQ(0u, index.overloaded_shards_);
+  EXPECT_EQ(shard2, index.MaybeOverloadedShard(shard2));
+}
+
+TEST(LockedQueueIndexTest, ThievesStealFromTheOtherEnd) {
+  const ui32 shard = 1u;
+
+  for (const bool lifo : {false, true}) {
+    LockedQueue<int>::Index index(lifo);
+    for (int task = 1; task <= 4; ++task) {
+      index.Put(int(task), shard);
+    }
+
+    EXPECT_EQ(lifo ? 4 : 1, index.GetStrict(shard));
+    EXPECT_EQ(lifo ? 1 : 4, index.Steal(shard));
+    EXPECT_EQ(lifo ? 3 : 2, index.GetStrict(shard));
+    EXPECT_EQ(lifo ? 2 : 3, index.Steal(shard));
+    EXPECT_EQ(0u, index.Size());
+    ASSERT_ANY_THROW(index.Steal(shard));
+  }
+}
+
+TEST(LockedQueueIndexTest, OrderByCostWithAging) {
+  LockedQueue<int>::Index index;
+  index.OrderByCost();
+
+  const ui32 shard1 = 1u;
+  const ui32 shard2 = 2u;
+
+  index.Put(1, shard1, Seconds(10));
+  index.Put(2, shard1, Seconds(1000));
+  index.Put(3, shard1, Seconds(100));
+  index.Put(4, shard2, Seconds(500));
+
+  // The owner takes the most expensive task, and the thief - a leaf of the
+  // heap, which is the cheapest one here.
+  EXPECT_EQ(2, index.GetStrict(shard1));
+  EXPECT_EQ(1, index.Steal(shard1));
+  EXPECT_EQ(4, index.GetWithHint(shard1 + shard2));
+  EXPECT_EQ(3, index.GetWithHint(shard2));
+  EXPECT_EQ(0u, index.Size());
+
+  // The waiting task gets ahead of a more expensive one, if it has waited
+  // longer than the difference between their costs.
+  index.Put(5, shard1, Milliseconds(1));
+  std::this_thread::sleep_for(Milliseconds(50));
+  index.Put(6, shard1, Milliseconds(20));
+  index.Put(7, shard1, Milliseconds(100));
+  EXPECT_EQ(7, index.GetStrict(shard1));
+  EXPECT_EQ(5, index.GetStrict(shard1));
+  EXPECT_EQ(6, index.GetStrict(shard1));
+}
+
+TEST(LockedQueueIndexTest, OrderByCostHeap) {
+  LockedQueue<int>::Index index;
+  index.OrderByCost();
+
+  const ui32 shard = 1u;
+  const int tasks = 100;
+
+  // The costs differ by seconds - the time between the pushes doesn't matter.
+  auto cost = [](int task) { return (task * 37) % tasks; };
+  for (int task = 0; task < tasks; ++task) {
+    index.Put(int(task), shard, Seconds(cost(task)));
+  }
+
+  // The thieves don't break the order of the rest.
+  Vector<bool> left(tasks, true);
+  while (index.Size()) {
+    if (index.Size() % 10 == 0) {
+      left[cost(index.Steal(shard))] = false;
+      continue;
+    }
+
+    const int taken = cost(index.GetStrict(shard));
+    for (int more = taken + 1; more < tasks; ++more) {
+      EXPECT_FALSE(left[more]) << "The most expensive task should be taken";
+    }
+    left[taken] = false;
+  }
+}
+
+TEST(LockedQueueIndexTest, ReshardKeepsRanks) {
+  const ui32 shard1 = 1u;
+  const ui32 shard2 = 3u;
+  auto to_shard1 = [](const int&) { return shard1; };
+
+  {
+    LockedQueue<int>::Index index;
+    index.OrderByCost();
+
+    Milliseconds waited = Milliseconds::zero();
+    index.ObserveWait([&](const int& task, const Clock::duration& wait) {
+      if (task == 1) {
+        waited = std::chrono::duration_cast<Milliseconds>(wait);
+      }
+    });
+
+    index.Put(1, shard2, Seconds(100));
+    std::this_thread::sleep_for(Milliseconds(50));
+    index.Put(2, shard1, Seconds(10));
+    index.Put(3, shard1, Seconds(1000));
+
+    index.Reshard(shard2, to_shard1);
+    EXPECT_TRUE(index.ShardIsEmpty(shard2));
+    EXPECT_EQ(3u, index.Size());
+    EXPECT_EQ(3, index.GetStrict(shard1));
+    EXPECT_EQ(1, index.GetStrict(shard1));
+    EXPECT_EQ(2, index.GetStrict(shard1));
+    EXPECT_LE(Milliseconds(50), waited);
+  }
+
+  {
+    LockedQueue<int>::Index index;
+    index.Put(1, shard2);
+    index.Put(2, shard1);
+
+    // Without the cost the moved tasks go after the tasks of the new shard.
+    index.Reshard(shard2, to_shard1);
+    EXPECT_TRUE(index.ShardIsEmpty(shard2));
+    EXPECT_EQ(2, index.GetStrict(shard1));
+    EXPECT_EQ(1, index.GetStrict(shard1));
+  }
+}
+
 }  // namespace base
 }  // namespace dist_clang
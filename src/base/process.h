@@ -21,10 +21,17 @@ FORWARD_TEST(ClientTest, SendPluginPath);
 
 namespace daemon {
 FORWARD_TEST(AbsorberTest, SuccessfulCompilationWithRewriteIncludes);
+FORWARD_TEST(AbsorberTest, SuccessfulCompilationWithOutputs);
 FORWARD_TEST(AbsorberTest, StoreLocalCacheWithoutBlacklist);
 FORWARD_TEST(AbsorberTest, DoNotStoreLocalCacheWhenDisabled);
 FORWARD_TEST(AbsorberTest, StoreLocalCacheWithBlacklist);
 FORWARD_TEST(AbsorberTest, StoreLocalCacheWithAndWithoutBlacklist);
+FORWARD_TEST(AbsorberTest, ProbeBeforeUpload);
+FORWARD_TEST(AbsorberTest, PumpMode);
+FORWARD_TEST(AbsorberTest, IncludedPCHFiles);
+FORWARD_TEST(AbsorberTest, PumpModeModuleBuild);
+FORWARD_TEST(AbsorberTest, FetchFromPeer);
+FORWARD_TEST(AbsorberTest, ServePeers);
 FORWARD_TEST(CollectorTest, SimpleReport);
 FORWARD_TEST(CompilationDaemonTest, CreateProcessFromFlags);
 FORWARD_TEST(EmitterTest, ConfigurationUpdateFromCoordinator);
@@ -36,6 +43,7 @@ FORWARD_TEST(EmitterTest, ConfigurationWithoutVersions);
 FORWARD_TEST(EmitterTest, LocalSuccessfulCompilation);
 FORWARD_TEST(EmitterTest, StoreSimpleCacheForLocalResult);
 FORWARD_TEST(EmitterTest, StoreSimpleCacheForRemoteResult);
+FORWARD_TEST(EmitterTest, TraceSpansFromClientToRemote);
 FORWARD_TEST(EmitterTest,
              StoreDirectCacheForLocalResultWithAndWithoutIncludedHeaders);
 FORWARD_TEST(EmitterTest, FallbackToLocalCompilationAfterRemoteFail);
@@ -47,6 +55,18 @@ FORWARD_TEST(EmitterTest, StoreDirectCacheForRemoteResult);
 FORWARD_TEST(EmitterTest, ConfigurationUpdateCompiler);
 FORWARD_TEST(EmitterTest, HitDirectCacheFromTwoLocations);
 FORWARD_TEST(EmitterTest, DontHitDirectCacheFromTwoRelativeSources);
+FORWARD_TEST(EmitterTest, HitAndUpdateCacheServer);
+FORWARD_TEST(EmitterTest, ProbeRemoteBeforeUpload);
+FORWARD_TEST(EmitterTest, UploadSourceOnceWithPCHFiles);
+FORWARD_TEST(EmitterTest, PumpModeAfterDirectCacheMiss);
+FORWARD_TEST(EmitterTest, ModuleBuildInPumpModeAfterLocalBuild);
+FORWARD_TEST(EmitterTest, HitDependCacheFromAnotherCheckout);
+FORWARD_TEST(EmitterTest, DependEntriesAreEvictedAfterRestart);
+FORWARD_TEST(EmitterTest, DontStoreDependCacheWithoutSystemHeaderDeps);
+FORWARD_TEST(EmitterTest, ReplayCachedLocalFailure);
+FORWARD_TEST(EmitterTest, DoNotCacheLocalEnvironmentFailure);
+FORWARD_TEST(EmitterTest, CacheSyntaxOnlyDiagnostics);
+FORWARD_TEST(EmitterTest, RestoreExtraOutputsFromCache);
 }  // namespace daemon
 
 namespace base {
@@ -81,6 +101,10 @@ class Process
   inline Immutable stdout() const { return stdout_; }
   inline Immutable stderr() const { return stderr_; }
 
+  // Stays negative, unless the process has exited by itself - i.e. wasn't
+  // killed by a signal and was run at all.
+  inline int exit_code() const { return exit_code_; }
+
   // |sec_timeout| specifies the timeout in seconds - for how long we should
   // wait for another portion of the output from a child process.
   virtual bool Run(ui16 sec_timeout, String* error = nullptr) = 0;
@@ -91,6 +115,7 @@ class Process
   const Path exec_path_, cwd_path_;
   List<Immutable> args_, envs_;
   Immutable stdout_, stderr_;
+  int exit_code_ = -1;
   const ui32 uid_;
 
  private:
@@ -103,10 +128,17 @@ class Process
   FRIEND_TEST(client::ClientTest, FailedCompilation);
   FRIEND_TEST(client::ClientTest, SendPluginPath);
   FRIEND_TEST(daemon::AbsorberTest, SuccessfulCompilationWithRewriteIncludes);
+  FRIEND_TEST(daemon::AbsorberTest, SuccessfulCompilationWithOutputs);
   FRIEND_TEST(daemon::AbsorberTest, StoreLocalCacheWithoutBlacklist);
   FRIEND_TEST(daemon::AbsorberTest, DoNotStoreLocalCacheWhenDisabled);
   FRIEND_TEST(daemon::AbsorberTest, StoreLocalCacheWithBlacklist);
   FRIEND_TEST(daemon::AbsorberTest, StoreLocalCacheWithAndWithoutBlacklist);
+  FRIEND_TEST(daemon::AbsorberTest, ProbeBeforeUpload);
+  FRIEND_TEST(daemon::AbsorberTest, PumpMode);
+  FRIEND_TEST(daemon::AbsorberTest, IncludedPCHFiles);
+  FRIEND_TEST(daemon::AbsorberTest, PumpModeModuleBuild);
+  FRIEND_TEST(daemon::AbsorberTest, FetchFromPeer);
+  FRIEND_TEST(daemon::AbsorberTest, ServePeers);
   FRIEND_TEST(daemon::CollectorTest, SimpleReport);
   FRIEND_TEST(daemon::CompilationDaemonTest, CreateProcessFromFlags);
   FRIEND_TEST(daemon::EmitterTest, ConfigurationUpdateFromCoordinator);
@@ -118,6 +150,7 @@ class Process
   FRIEND_TEST(daemon::EmitterTest, LocalSuccessfulCompilation);
   FRIEND_TEST(daemon::EmitterTest, StoreSimpleCacheForLocalResult);
   FRIEND_TEST(daemon::EmitterTest, StoreSimpleCacheForRemoteResult);
+  FRIEND_TEST(daemon::EmitterTest, TraceSpansFromClientToRemote);
   FRIEND_TEST(daemon::EmitterTest, FallbackToLocalCompilationAfterRemoteFail);
   FRIEND_TEST(daemon::EmitterTest,
               FallbackToLocalCompilationAfterRemoteRejects);
@@ -130,6 +163,18 @@ class Process
   FRIEND_TEST(daemon::EmitterTest, ConfigurationUpdateCompiler);
   FRIEND_TEST(daemon::EmitterTest, HitDirectCacheFromTwoLocations);
   FRIEND_TEST(daemon::EmitterTest, DontHitDirectCacheFromTwoRelativeSources);
+  FRIEND_TEST(daemon::EmitterTest, HitAndUpdateCacheServer);
+  FRIEND_TEST(daemon::EmitterTest, ProbeRemoteBeforeUpload);
+  FRIEND_TEST(daemon::EmitterTest, UploadSourceOnceWithPCHFiles);
+  FRIEND_TEST(daemon::EmitterTest, PumpModeAfterDirectCacheMiss);
+  FRIEND_TEST(daemon::EmitterTest, ModuleBuildInPumpModeAfterLocalBuild);
+  FRIEND_TEST(daemon::EmitterTest, HitDependCacheFromAnotherCheckout);
+  FRIEND_TEST(daemon::EmitterTest, DependEntriesAreEvictedAfterRestart);
+  FRIEND_TEST(daemon::EmitterTest, DontStoreDependCacheWithoutSystemHeaderDeps);
+  FRIEND_TEST(daemon::EmitterTest, ReplayCachedLocalFailure);
+  FRIEND_TEST(daemon::EmitterTest, DoNotCacheLocalEnvironmentFailure);
+  FRIEND_TEST(daemon::EmitterTest, CacheSyntaxOnlyDiagnostics);
+  FRIEND_TEST(daemon::EmitterTest, RestoreExtraOutputsFromCache);
 };
 
 }  // namespace base
@@ -90,7 +90,8 @@ bool ProcessImpl::WaitPid(int pid, ui64 sec_timeout, String* error) {
   CHECK(result == pid);
 
   if (WIFEXITED(status)) {
-    return !WEXITSTATUS(status);
+    exit_code_ = WEXITSTATUS(status);
+    return !exit_code_;
   } else if (WIFSIGNALED(status)) {
     if (error) {
       std::ostringstream ss;
@@ -1,7 +1,6 @@
 #pragma once
 
 #include <base/locked_queue.h>
-#include <base/thread.h>
 
 #include STL(condition_variable)
 
@@ -10,6 +9,11 @@ namespace base {
 
 // Queue aggregator doesn't work with shards and uses default zero shard -
 // like if with shardless queues.
+//
+// The tasks are taken right from the aggregated queues in the order of their
+// aggregation - i.e. the earlier queue has the higher priority. The queues
+// notify their aggregator on each push, so the waiting |Pop| doesn't need any
+// relay threads.
 template <class T>
 class QueueAggregator {
  public:
@@ -21,10 +25,8 @@ class QueueAggregator {
     {
       UniqueLock lock(orders_mutex_);
       closed_ = true;
-      order_count_ = 0;
-      pop_condition_.notify_all();
-      done_condition_.notify_all();
     }
+    push_condition_.notify_all();
 
     // All aggregated queues should be closed before aggregator do.
     // Also should be explicitly closed before destruction.
@@ -32,89 +34,74 @@ class QueueAggregator {
       // Evaluate to prevent "unused variable" warning.
       DCHECK_O_EVAL(queue->closed_);
     }
-
-    for (auto& thread : threads_) {
-      thread.join();
-    }
-
-    threads_.clear();
   }
 
   void Aggregate(LockedQueue<T, true>* WEAK_PTR queue) THREAD_UNSAFE {
+    DCHECK(!queue->aggregator_);
+    queue->aggregator_ = this;
     queues_.push_back(queue);
-    threads_.emplace_back("Queue Aggregator"_l, &QueueAggregator<T>::DoPop,
-                          this, queue);
   }
 
+  // Returns disengaged object only when this aggregator is closed and all the
+  // aggregated queues are empty.
   Optional Pop() THREAD_SAFE {
     UniqueLock lock(orders_mutex_);
-    if (!closed_) {
-      ++order_count_;
-    }
-    pop_condition_.notify_all();
-
-    done_condition_.wait(lock, [this] { return closed_ || !orders_.empty(); });
-
-    if (closed_ && orders_.empty()) {
+    while (true) {
+      // Any push after this point changes the |pushes_| - so we don't fall
+      // asleep, while there is a task to take.
+      const ui64 pushes = pushes_;
+      const bool closed = closed_;
       lock.unlock();
 
       for (auto queue : queues_) {
-        Optional&& obj = queue->Pop();
+        Optional&& obj = TryPop(queue);
         if (obj) {
           return std::move(obj);
         }
       }
 
-      return Optional();
-    }
+      if (closed) {
+        return Optional();
+      }
 
-    Optional&& obj = std::move(orders_.front());
-    orders_.pop_front();
-    return std::move(obj);
+      lock.lock();
+      push_condition_.wait(
+          lock, [this, pushes] { return closed_ || pushes_ != pushes; });
+    }
   }
 
  private:
-  void DoPop(LockedQueue<T, true>* WEAK_PTR queue) {
-    while (!closed_) {
-      {
-        UniqueLock lock(orders_mutex_);
-        pop_condition_.wait(lock, [this] { return order_count_ || closed_; });
-      }
+  template <class, bool>
+  friend class LockedQueue;
 
-      UniqueLock lock(queue->pop_mutex_);
-      queue->aggregator_condition_.wait(
-          lock, [queue] { return queue->closed_ || !queue->queue_.empty(); });
-      if (queue->closed_ && queue->queue_.empty()) {
-        break;
-      }
+  static Optional TryPop(LockedQueue<T, true>* WEAK_PTR queue) THREAD_SAFE {
+    if (!queue->size_) {
+      return Optional();
+    }
 
-      {
-        UniqueLock lock(orders_mutex_);
-
-        if (order_count_) {
-          auto item = queue->index_.GetWithHint(
-              LockedQueue<T, true>::DEFAULT_SHARD,
-              queue->queue_.begin());
-          orders_.push_back(std::move(*item));
-          queue->queue_.erase(item);
-          --queue->size_;
-          --order_count_;
-          lock.unlock();
-          done_condition_.notify_one();
-        }
-      }
+    UniqueLock lock(queue->pop_mutex_);
+    if (!queue->index_.Size()) {
+      return Optional();
+    }
+    return queue->RemoveTask(
+        queue->index_.GetWithHint(LockedQueue<T, true>::DEFAULT_SHARD));
+  }
+
+  // Called by the aggregated queues after each push.
+  void NotifyPush() THREAD_SAFE {
+    {
+      UniqueLock lock(orders_mutex_);
+      ++pushes_;
     }
+    push_condition_.notify_one();
   }
 
-  List<Thread> threads_;
   List<LockedQueue<T, true> * WEAK_PTR> queues_;
 
   std::mutex orders_mutex_;
-  Atomic<bool> closed_ = {false};
-  size_t order_count_ = 0;
-  List<T> orders_;
-  std::condition_variable pop_condition_;
-  std::condition_variable done_condition_;
+  bool closed_ = false;
+  ui64 pushes_ = 0;
+  std::condition_variable push_condition_;
 };
 
 }  // namespace base
@@ -1,6 +1,9 @@
 #include <base/queue_aggregator.h>
 
 #include <third_party/gtest/exported/include/gtest/gtest.h>
+#include STL(chrono)
+#include STL(iostream)
+#include STL(thread)
 
 namespace dist_clang {
 namespace base {
@@ -78,5 +81,98 @@ TEST(QueueAggregatorTest, SharedPtrFriendliness) {
     EXPECT_EQ(2, actual->use_count());
   }
 }
+
+TEST(QueueAggregatorTest, EarlierQueuesGoFirst) {
+  QueueAggregator<int> aggregator;
+  LockedQueue<int, true> failed_queue, all_queue;
+  aggregator.Aggregate(&failed_queue);
+  aggregator.Aggregate(&all_queue);
+
+  ASSERT_TRUE(all_queue.Push(1));
+  ASSERT_TRUE(all_queue.Push(2));
+  ASSERT_TRUE(failed_queue.Push(3));
+
+  for (int expected : {3, 1, 2}) {
+    auto&& actual = aggregator.Pop();
+    ASSERT_TRUE(!!actual);
+    EXPECT_EQ(expected, *actual);
+  }
+  EXPECT_EQ(0u, failed_queue.Size());
+  EXPECT_EQ(0u, all_queue.Size());
+
+  failed_queue.Close();
+  all_queue.Close();
+  aggregator.Close();
+  EXPECT_FALSE(!!aggregator.Pop());
 }
+
+TEST(QueueAggregatorTest, PopWaitsForPush) {
+  QueueAggregator<int> aggregator;
+  LockedQueue<int, true> failed_queue, all_queue;
+  aggregator.Aggregate(&failed_queue);
+  aggregator.Aggregate(&all_queue);
+
+  const int number_of_tasks = 100;
+  Atomic<int> sum = {0};
+  std::thread consumer([&] {
+    while (auto&& task = aggregator.Pop()) {
+      sum += *task;
+    }
+  });
+
+  for (int task = 1; task <= number_of_tasks; ++task) {
+    EXPECT_TRUE((task % 2 ? failed_queue : all_queue).Push(int(task)));
+  }
+  while (failed_queue.Size() || all_queue.Size()) {
+    std::this_thread::yield();
+  }
+
+  failed_queue.Close();
+  all_queue.Close();
+  aggregator.Close();
+  consumer.join();
+
+  EXPECT_EQ(number_of_tasks * (number_of_tasks + 1) / 2, sum);
+}
+
+// Run with "--gtest_also_run_disabled_tests" to measure the time between the
+// push of a task and the moment, when the waiting consumer gets it.
+TEST(QueueAggregatorTest, DISABLED_HandOffLatencyBenchmark) {
+  using Clock = std::chrono::steady_clock;
+
+  const ui32 number_of_tasks = 10000u;
+  QueueAggregator<Clock::time_point> aggregator;
+  LockedQueue<Clock::time_point, true> failed_queue, all_queue;
+  aggregator.Aggregate(&failed_queue);
+  aggregator.Aggregate(&all_queue);
+
+  Atomic<ui32> tasks_done = {0u};
+  Clock::duration total_latency = Clock::duration::zero();
+  std::thread consumer([&] {
+    while (auto&& task = aggregator.Pop()) {
+      total_latency += Clock::now() - *task;
+      ++tasks_done;
+    }
+  });
+
+  for (ui32 task = 0; task < number_of_tasks; ++task) {
+    // Let the consumer fall asleep - like an idle local worker.
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+    EXPECT_TRUE((task % 2 ? failed_queue : all_queue).Push(Clock::now()));
+    while (tasks_done <= task) {
+      std::this_thread::yield();
+    }
+  }
+
+  failed_queue.Close();
+  all_queue.Close();
+  aggregator.Close();
+  consumer.join();
+
+  const std::chrono::duration<double, std::micro> latency = total_latency;
+  std::cout << "Hand-off latency: " << latency.count() / number_of_tasks
+            << " us" << std::endl;
 }
+
+}  // namespace base
+}  // namespace dist_clang
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <base/assert.h>
+#include <base/types.h>
+
+#include STL(limits)
+
+namespace dist_clang {
+namespace base {
+
+// Queue on a single contiguous array, which may be popped from both ends: the
+// elements aren't allocated one by one and stay close to each other in memory.
+// The capacity is a power of two and doubles, when the buffer is full - but
+// the buffer never holds more than |max_size| elements: the pushes fail then,
+// and the |value| isn't moved.
+//
+// Not thread-safe.
+template <class T>
+class RingBuffer {
+ public:
+  static constexpr size_t UNLIMITED = std::numeric_limits<size_t>::max();
+
+  explicit RingBuffer(size_t capacity = 8, size_t max_size = UNLIMITED)
+      : slots_(RoundUp(capacity)), max_size_(max_size) {
+    DCHECK(max_size_);
+  }
+
+  bool push_back(T&& value) {
+    if (full()) {
+      return false;
+    }
+    if (size_ == slots_.size()) {
+      Grow();
+    }
+    slots_[Slot(size_)].emplace(std::move(value));
+    ++size_;
+    return true;
+  }
+
+  // Shifts the elements from |index| to the back - to keep them sorted.
+  bool insert(size_t index, T&& value) {
+    DCHECK(index <= size_);
+    if (full()) {
+      return false;
+    }
+    if (size_ == slots_.size()) {
+      Grow();
+    }
+    for (size_t i = size_; i > index; --i) {
+      slots_[Slot(i)].emplace(std::move(*slots_[Slot(i - 1)]));
+      slots_[Slot(i - 1)].reset();
+    }
+    slots_[Slot(index)].emplace(std::move(value));
+    ++size_;
+    return true;
+  }
+
+  // Swaps the elements at the |first| and the |second| indices - they only
+  // need to be move-constructible.
+  void swap(size_t first, size_t second) {
+    DCHECK(first < size_ && second < size_);
+    if (first == second) {
+      return;
+    }
+    auto& first_slot = slots_[Slot(first)];
+    auto& second_slot = slots_[Slot(second)];
+    T value(std::move(*first_slot));
+    first_slot.emplace(std::move(*second_slot));
+    second_slot.emplace(std::move(value));
+  }
+
+  void pop_front() {
+    DCHECK(size_);
+    slots_[head_].reset();
+    head_ = Slot(1);
+    --size_;
+  }
+
+  void pop_back() {
+    DCHECK(size_);
+    slots_[Slot(size_ - 1)].reset();
+    --size_;
+  }
+
+  inline T& front() { return (*this)[0]; }
+  inline const T& front() const { return (*this)[0]; }
+  inline T& back() { return (*this)[size_ - 1]; }
+  inline const T& back() const { return (*this)[size_ - 1]; }
+
+  // The |index| is counted from the front.
+  inline T& operator[](size_t index) {
+    DCHECK(index < size_);
+    return *slots_[Slot(index)];
+  }
+  inline const T& operator[](size_t index) const {
+    DCHECK(index < size_);
+    return *slots_[Slot(index)];
+  }
+
+  inline size_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+  inline bool full() const { return size_ == max_size_; }
+  inline size_t capacity() const { return slots_.size(); }
+
+ private:
+  static size_t RoundUp(size_t capacity) {
+    size_t result = 1;
+    while (result < capacity) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  inline size_t Slot(size_t index) const {
+    return (head_ + index) & (slots_.size() - 1);
+  }
+
+  // The slots are doubled only while there are less than |max_size_| of them,
+  // so they never outgrow its next power of two.
+  void Grow() {
+    Vector<Optional<T>> slots(slots_.size() * 2);
+    for (size_t i = 0; i < size_; ++i) {
+      slots[i].emplace(std::move(*slots_[Slot(i)]));
+    }
+    slots_.swap(slots);
+    head_ = 0;
+  }
+
+  Vector<Optional<T>> slots_;
+  const size_t max_size_;
+  size_t head_ = 0, size_ = 0;
+};
+
+}  // namespace base
+}  // namespace dist_clang
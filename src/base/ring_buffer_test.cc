@@ -0,0 +1,142 @@
+#include <base/ring_buffer.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+namespace dist_clang {
+namespace base {
+
+TEST(RingBufferTest, BasicUsage) {
+  RingBuffer<int> buffer(4);
+  EXPECT_TRUE(buffer.empty());
+  EXPECT_EQ(4u, buffer.capacity());
+
+  // Move the head to the middle - to wrap around the end.
+  buffer.push_back(0);
+  buffer.push_back(1);
+  buffer.pop_front();
+  buffer.pop_front();
+
+  for (int i = 0; i < 4; ++i) {
+    buffer.push_back(int(i));
+  }
+  EXPECT_EQ(4u, buffer.size());
+  EXPECT_EQ(4u, buffer.capacity());
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(i, buffer[i]);
+  }
+
+  // The order is kept, when the buffer grows.
+  buffer.push_back(4);
+  EXPECT_EQ(5u, buffer.size());
+  EXPECT_EQ(8u, buffer.capacity());
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(i, buffer.front());
+    buffer.pop_front();
+  }
+  EXPECT_TRUE(buffer.empty());
+}
+
+TEST(RingBufferTest, PopBothEnds) {
+  RingBuffer<int> buffer(2);
+  for (int i = 0; i < 5; ++i) {
+    buffer.push_back(int(i));
+  }
+
+  EXPECT_EQ(0, buffer.front());
+  EXPECT_EQ(4, buffer.back());
+  buffer.pop_back();
+  buffer.pop_front();
+  EXPECT_EQ(1, buffer.front());
+  EXPECT_EQ(3, buffer.back());
+  EXPECT_EQ(3u, buffer.size());
+
+  // The freed slot at the back is reused.
+  buffer.push_back(5);
+  EXPECT_EQ(5, buffer.back());
+  EXPECT_EQ(4u, buffer.size());
+  EXPECT_EQ(8u, buffer.capacity());
+
+  buffer.pop_back();
+  buffer.pop_back();
+  buffer.pop_back();
+  buffer.pop_back();
+  EXPECT_TRUE(buffer.empty());
+}
+
+TEST(RingBufferTest, Insert) {
+  RingBuffer<int> buffer(4);
+  buffer.push_back(0);
+  buffer.push_back(1);
+  buffer.pop_front();
+
+  // Wrap around the end and grow in the middle of inserts.
+  buffer.insert(1, 4);
+  buffer.insert(0, 0);
+  buffer.insert(2, 3);
+  buffer.insert(2, 2);
+  buffer.insert(5, 5);
+  EXPECT_EQ(6u, buffer.size());
+  EXPECT_EQ(8u, buffer.capacity());
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_EQ(i, buffer[i]);
+  }
+
+  ASSERT_ANY_THROW(buffer.insert(7, 7));
+}
+
+TEST(RingBufferTest, Swap) {
+  RingBuffer<UniquePtr<int>> buffer(4);
+  buffer.push_back(UniquePtr<int>(new int(0)));
+  buffer.pop_front();
+
+  // Wrap around the end.
+  for (int i = 0; i < 4; ++i) {
+    buffer.push_back(UniquePtr<int>(new int(i)));
+  }
+  buffer.swap(0, 3);
+  buffer.swap(1, 1);
+  EXPECT_EQ(3, *buffer[0]);
+  EXPECT_EQ(1, *buffer[1]);
+  EXPECT_EQ(2, *buffer[2]);
+  EXPECT_EQ(0, *buffer[3]);
+
+  ASSERT_ANY_THROW(buffer.swap(0, 4));
+}
+
+TEST(RingBufferTest, MaxSize) {
+  RingBuffer<UniquePtr<int>> buffer(2, 5);
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_TRUE(buffer.push_back(UniquePtr<int>(new int(i))));
+  }
+  EXPECT_TRUE(buffer.full());
+  EXPECT_EQ(8u, buffer.capacity());
+
+  // The failed pushes don't take the value.
+  UniquePtr<int> value(new int(5));
+  EXPECT_FALSE(buffer.push_back(std::move(value)));
+  EXPECT_FALSE(buffer.insert(0, std::move(value)));
+  ASSERT_TRUE(!!value);
+  EXPECT_EQ(5u, buffer.size());
+  EXPECT_EQ(8u, buffer.capacity());
+
+  buffer.pop_front();
+  EXPECT_FALSE(buffer.full());
+  EXPECT_TRUE(buffer.push_back(std::move(value)));
+  EXPECT_EQ(5, *buffer.back());
+}
+
+TEST(RingBufferTest, MoveOnlyElements) {
+  RingBuffer<UniquePtr<int>> buffer(1);
+
+  for (int i = 0; i < 10; ++i) {
+    buffer.push_back(UniquePtr<int>(new int(i)));
+  }
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(!!buffer.front());
+    EXPECT_EQ(i, *buffer.front());
+    buffer.pop_front();
+  }
+}
+
+}  // namespace base
+}  // namespace dist_clang
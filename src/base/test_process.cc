@@ -19,7 +19,13 @@ bool TestProcess::Run(ui16 sec_timeout, String* error) {
     (*run_attempts_)++;
   }
 
-  return on_run_(sec_timeout, String(), error);
+  // A failed run is a normal exit, unless the callback changes the exit code.
+  exit_code_ = 1;
+  if (!on_run_(sec_timeout, String(), error)) {
+    return false;
+  }
+  exit_code_ = 0;
+  return true;
 }
 
 bool TestProcess::Run(ui16 sec_timeout, Immutable input, String* error) {
@@ -27,7 +33,13 @@ bool TestProcess::Run(ui16 sec_timeout, Immutable input, String* error) {
     (*run_attempts_)++;
   }
 
-  return on_run_(sec_timeout, input, error);
+  // A failed run is a normal exit, unless the callback changes the exit code.
+  exit_code_ = 1;
+  if (!on_run_(sec_timeout, input, error)) {
+    return false;
+  }
+  exit_code_ = 0;
+  return true;
 }
 
 String TestProcess::PrintArgs() const {
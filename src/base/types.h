@@ -61,6 +61,10 @@ using List = std::list<T>;
 
 using Literal = base::Literal;
 
+using Microseconds = std::chrono::microseconds;
+
+using Milliseconds = std::chrono::milliseconds;
+
 template <class U, class V>
 using MultiMap = std::multimap<U, V>;
 
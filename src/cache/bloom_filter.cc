@@ -0,0 +1,82 @@
+#include <cache/bloom_filter.h>
+
+#include <base/assert.h>
+
+#include STL(cstring)
+
+namespace dist_clang {
+namespace cache {
+
+BloomFilter::BloomFilter(ui32 size, ui32 hashes)
+    : bits_(size, '\0'), hashes_(hashes) {
+  DCHECK(hashes_ > 0);
+}
+
+template <class Visitor>
+void BloomFilter::ForEachBit(const string::Hash& hash, Visitor visitor) const {
+  if (bits_.empty()) {
+    return;
+  }
+
+  // Use the MurmurHash3 - it gives the same bits on all hosts, unlike
+  // |std::hash|. Then the double hashing is good enough to get all the bits.
+  auto digest = hash.str.Hash(16);
+  ui64 h1, h2;
+  std::memcpy(&h1, digest.data(), sizeof(h1));
+  std::memcpy(&h2, digest.data() + sizeof(h1), sizeof(h2));
+
+  const ui64 total_bits = bits_.size() * 8;
+  for (ui32 i = 0; i < hashes_; ++i) {
+    visitor((h1 + i * h2) % total_bits);
+  }
+}
+
+void BloomFilter::Add(const string::Hash& hash) {
+  ForEachBit(hash, [this](ui64 bit) { bits_[bit / 8] |= 1 << (bit % 8); });
+  ++count_;
+}
+
+bool BloomFilter::MayContain(const string::Hash& hash) const {
+  if (bits_.empty()) {
+    return false;
+  }
+
+  bool result = true;
+  ForEachBit(hash, [this, &result](ui64 bit) {
+    result = result && (bits_[bit / 8] & (1 << (bit % 8)));
+  });
+  return result;
+}
+
+bool BloomFilter::Merge(const BloomFilter& other) {
+  if (other.bits_.size() != bits_.size() || other.hashes_ != hashes_) {
+    return false;
+  }
+
+  for (size_t i = 0; i < bits_.size(); ++i) {
+    bits_[i] |= other.bits_[i];
+  }
+  count_ += other.count_;
+
+  return true;
+}
+
+String BloomFilter::Serialize() const {
+  return bits_;
+}
+
+bool BloomFilter::Parse(const String& bits, ui32 hashes) {
+  if (!hashes) {
+    return false;
+  }
+
+  bits_ = bits;
+  hashes_ = hashes;
+  // We don't know the real number - just mark the filter as non-empty.
+  count_ = bits_.find_first_not_of('\0') == String::npos ? 0 : 1;
+
+  return true;
+}
+
+}  // namespace cache
+}  // namespace dist_clang
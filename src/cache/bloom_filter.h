@@ -0,0 +1,46 @@
+#pragma once
+
+#include <base/const_string.h>
+#include <cache/file_cache.h>
+
+namespace dist_clang {
+namespace cache {
+
+// Compact probabilistic set of hashes to exchange between daemons: it may
+// answer "maybe" for a hash which was never added, but never answers "no" for
+// a hash which was added.
+//
+// Not thread-safe.
+class BloomFilter {
+ public:
+  // |size| is in bytes. The |hashes| is a number of bits per single key.
+  explicit BloomFilter(ui32 size = 0, ui32 hashes = 4);
+
+  void Add(const string::Hash& hash);
+  bool MayContain(const string::Hash& hash) const;
+
+  bool Merge(const BloomFilter& other);
+  // Returns |false| if the filters have different parameters.
+
+  String Serialize() const;
+  bool Parse(const String& bits, ui32 hashes);
+
+  inline bool empty() const { return !count_; }
+  inline ui32 count() const { return count_; }
+  // Number of added hashes - may be more than unique ones.
+
+  inline ui32 hashes() const { return hashes_; }
+  inline ui32 size() const { return bits_.size(); }
+
+ private:
+  // Calls |visitor| with the index of each bit for the |hash|.
+  template <class Visitor>
+  void ForEachBit(const string::Hash& hash, Visitor visitor) const;
+
+  String bits_;
+  ui32 hashes_;
+  ui32 count_ = 0;
+};
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -0,0 +1,67 @@
+#include <cache/bloom_filter.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+namespace dist_clang {
+namespace cache {
+
+using namespace string;
+
+TEST(BloomFilterTest, AddedHashesAreFound) {
+  BloomFilter filter(1024);
+  EXPECT_TRUE(filter.empty());
+
+  for (ui32 i = 0; i < 100; ++i) {
+    filter.Add(HandledHash("hash" + std::to_string(i)));
+  }
+  EXPECT_EQ(100u, filter.count());
+
+  for (ui32 i = 0; i < 100; ++i) {
+    EXPECT_TRUE(filter.MayContain(HandledHash("hash" + std::to_string(i))));
+  }
+
+  ui32 false_positives = 0;
+  for (ui32 i = 100; i < 1100; ++i) {
+    false_positives +=
+        filter.MayContain(HandledHash("hash" + std::to_string(i)));
+  }
+  // 8192 bits and 4 hashes for 100 keys give about 0.02% of false positives.
+  EXPECT_GT(10u, false_positives);
+}
+
+TEST(BloomFilterTest, EmptyFilterContainsNothing) {
+  BloomFilter filter;
+  filter.Add(HandledHash("hash"_l));
+  EXPECT_FALSE(filter.MayContain(HandledHash("hash"_l)));
+  EXPECT_FALSE(BloomFilter(16).MayContain(HandledHash("hash"_l)));
+}
+
+TEST(BloomFilterTest, SerializeAndParse) {
+  BloomFilter filter(64, 3);
+  filter.Add(HandledHash("hash1"_l));
+  filter.Add(HandledHash("hash2"_l));
+
+  BloomFilter parsed;
+  ASSERT_FALSE(parsed.Parse(filter.Serialize(), 0));
+  ASSERT_TRUE(parsed.Parse(filter.Serialize(), filter.hashes()));
+  EXPECT_FALSE(parsed.empty());
+  EXPECT_EQ(64u, parsed.size());
+  EXPECT_TRUE(parsed.MayContain(HandledHash("hash1"_l)));
+  EXPECT_TRUE(parsed.MayContain(HandledHash("hash2"_l)));
+}
+
+TEST(BloomFilterTest, Merge) {
+  BloomFilter filter1(64), filter2(64);
+  filter1.Add(HandledHash("hash1"_l));
+  filter2.Add(HandledHash("hash2"_l));
+
+  ASSERT_FALSE(filter1.Merge(BloomFilter(32)));
+  ASSERT_FALSE(filter1.Merge(BloomFilter(64, 2)));
+  ASSERT_TRUE(filter1.Merge(filter2));
+  EXPECT_EQ(2u, filter1.count());
+  EXPECT_TRUE(filter1.MayContain(HandledHash("hash1"_l)));
+  EXPECT_TRUE(filter1.MayContain(HandledHash("hash2"_l)));
+}
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -9,10 +9,13 @@
 #include <perf/stat_service.h>
 
 #include <third_party/snappy/exported/snappy.h>
+#include STL(algorithm)
+#include STL(numeric)
 #include STL(regex)
 
 #include <clang/Basic/Version.h>
 
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <utime.h>
 
@@ -44,14 +47,123 @@ String HashCombine(const Immutable& source, const cache::ExtraFiles& files) {
   return base::Hexify(Immutable(hashes_string).Hash());
 }
 
+// Moves the obsolete list of headers to variants.
+void UpgradeDirect(cache::proto::Direct* direct) {
+  if (direct->headers_size()) {
+    direct->add_variants()->mutable_headers()->Swap(direct->mutable_headers());
+  }
+}
+
+bool SameHeaders(const cache::proto::Direct::Variant& left,
+                 const cache::proto::Direct::Variant& right) {
+  return left.headers_size() == right.headers_size() &&
+         std::equal(left.headers().begin(), left.headers().end(),
+                    right.headers().begin());
+}
+
+// Puts the |variant| first and evicts the least recently used ones, if there
+// are more than |max_variants|.
+void PutVariantFirst(cache::proto::Direct* direct,
+                     const cache::proto::Direct::Variant& variant,
+                     ui32 max_variants) {
+  UpgradeDirect(direct);
+
+  cache::proto::Direct result;
+  *result.add_variants() = variant;
+  for (const auto& other : direct->variants()) {
+    if (ui32(result.variants_size()) >= max_variants) {
+      break;
+    }
+    if (!SameHeaders(other, variant)) {
+      *result.add_variants() = other;
+    }
+  }
+  direct->Swap(&result);
+}
+
+// Output names become parts of file names in the cache.
+bool IsValidOutputName(const String& name) {
+  return !name.empty() &&
+         name.find_first_not_of("abcdefghijklmnopqrstuvwxyz0123456789_") ==
+             String::npos;
+}
+
+// Reads the contents, which are packed with Snappy if |snappy| is set. Adds
+// the size on disk to |size|.
+bool ReadContent(const Path& path, bool snappy, Immutable* content,
+                 ui64* size) {
+  String error;
+  Immutable packed_content;
+  if (!base::File::Read(path, &packed_content, &error)) {
+    LOG(CACHE_ERROR) << "Failed to read " << path << " : " << error;
+    return false;
+  }
+  *size += packed_content.size();
+
+  if (!snappy) {
+    *content = packed_content;
+    return true;
+  }
+
+  String unpacked_content;
+  if (!snappy::Uncompress(packed_content.data(), packed_content.size(),
+                          &unpacked_content)) {
+    LOG(CACHE_ERROR) << "Failed to unpack contents of " << path;
+    return false;
+  }
+  *content = std::move(unpacked_content);
+  return true;
+}
+
+// Writes the contents packed with Snappy if |snappy| is set. Adds the size on
+// disk to |size|.
+bool WriteContent(const Path& path, Immutable content, bool snappy,
+                  ui64* size) {
+  String error;
+  if (!snappy) {
+    *size += content.size();
+    if (!base::File::Write(path, content, &error)) {
+      LOG(CACHE_ERROR) << "Failed to save " << path << ": " << error;
+      return false;
+    }
+    return true;
+  }
+
+  String packed_content;
+  if (!snappy::Compress(content.data(), content.size(), &packed_content)) {
+    LOG(CACHE_ERROR) << "Failed to pack contents for " << path;
+    return false;
+  }
+  *size += packed_content.size();
+
+  if (!base::File::Write(path, std::move(packed_content), &error)) {
+    LOG(CACHE_ERROR) << "Failed to write to " << path << ": " << error;
+    return false;
+  }
+  return true;
+}
+
+// The blobs are shared via hard links - the number of links is the number of
+// entries, which refer to the blob, plus one for the blob itself.
+ui64 LinkCount(const Path& path) {
+  struct stat buffer;
+  if (stat(path.c_str(), &buffer) == -1) {
+    return 0;
+  }
+  return buffer.st_nlink;
+}
+
 }  // namespace
 
 namespace cache {
 
-FileCache::FileCache(const Path& path, ui64 size, bool snappy, bool store_index)
+FileCache::FileCache(const Path& path, ui64 size, bool snappy, bool store_index,
+                     ui64 failure_ttl, bool dedup)
     : path_(ReplaceTildeInPath(path)),
       snappy_(snappy),
       store_index_(store_index),
+      failure_ttl_(failure_ttl),
+      dedup_(dedup),
       max_size_(size) {}
 
 FileCache::FileCache(const Path& path)
@@ -79,9 +191,26 @@ bool FileCache::Run(ui64 clean_period) {
 
   CHECK(clean_period > 0);
 
+  // Count the blobs before the entries - the broken entries release them.
+  base::WalkDirectory(path_ / "blobs", [this](const Path& blob_path, ui64,
+                                              ui64 size) {
+    if (LinkCount(blob_path) > 1) {
+      blobs_size_ += size;
+      return;
+    }
+
+    // Nothing refers to the blob - e.g. the storing of an entry has failed.
+    String error;
+    if (!base::File::Delete(blob_path, &error)) {
+      LOG(CACHE_WARNING) << "Failed to delete " << blob_path << ": " << error;
+    }
+  });
+
   entries_->BeginTransaction();
   base::WalkDirectory(path_, [this](const String& file_path, ui64 mtime, ui64) {
-    std::regex regex("([a-f0-9]{32}-[a-f0-9]{8}-[a-f0-9]{8})\\.manifest$");
+    // The narrower keys are from before the version 3 - they're removed.
+    std::regex regex(
+        "([a-f0-9]{32}-[a-f0-9]{8,16}-[a-f0-9]{8,16})\\.manifest$");
     std::cmatch match;
     if (!std::regex_search(file_path.c_str(), match, regex) ||
         match.size() < 2 || !match[1].matched) {
@@ -132,8 +261,8 @@ using namespace string;
 HandledHash FileCache::Hash(HandledSource code, const ExtraFiles& extra_files,
                             CommandLine command_line, Version version) {
   return HandledHash(HashCombine(code.str, extra_files) + "-" +
-                     base::Hexify(command_line.str.Hash(4)) + "-" +
-                     base::Hexify(version.str.Hash(4)));
+                     base::Hexify(command_line.str.Hash(8)) + "-" +
+                     base::Hexify(version.str.Hash(8)));
 }
 
 // static
@@ -142,9 +271,9 @@ UnhandledHash FileCache::Hash(UnhandledSource code,
                               CommandLine command_line, Version version) {
   return UnhandledHash(
       HashCombine(code.str, extra_files) + "-" +
-      base::Hexify(command_line.str.Hash(4)) + "-" +
+      base::Hexify(command_line.str.Hash(8)) + "-" +
       base::Hexify(
-          (version.str + "\n"_l + clang::getClangFullVersion()).Hash(4)));
+          (version.str + "\n"_l + clang::getClangFullVersion()).Hash(8)));
 }
 
 bool FileCache::Find(UnhandledSource code, const ExtraFiles& extra_files,
@@ -155,7 +284,7 @@ bool FileCache::Find(UnhandledSource code, const ExtraFiles& extra_files,
   auto unhandled_hash = Hash(code, extra_files, command_line, version);
   const auto manifest_path =
       AppendExtension(CommonPath(unhandled_hash), base::kExtManifest);
-  const ReadLock lock(this, manifest_path);
+  ReadLock lock(this, manifest_path);
 
   if (!lock) {
     return false;
@@ -169,27 +298,114 @@ bool FileCache::Find(UnhandledSource code, const ExtraFiles& extra_files,
   utime(manifest_path.c_str(), nullptr);
   new_entries_->Append({time(nullptr), unhandled_hash});
 
-  Immutable::Rope hash_rope = {unhandled_hash};
-  for (const auto& header : manifest.direct().headers()) {
-    Immutable header_hash;
-    const Path header_path =
-        Path(header).is_absolute() ? Path(header) : current_dir / header;
-    if (!base::File::Hash(header_path, &header_hash)) {
-      return false;
+  auto* direct = manifest.mutable_direct();
+  UpgradeDirect(direct);
+
+  // Try variants with less headers first - they're cheaper to hash. Headers,
+  // which are shared between variants, are hashed only once.
+  Vector<int> order(direct->variants_size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [direct](int left, int right) {
+    return direct->variants(left).headers_size() <
+           direct->variants(right).headers_size();
+  });
+
+  HashMap<String, Immutable> header_hashes;
+  auto HashHeaders = [&](const proto::Direct::Variant& variant,
+                         Immutable::Rope* hash_rope) {
+    for (const auto& header : variant.headers()) {
+      auto it = header_hashes.find(header);
+      if (it == header_hashes.end()) {
+        Immutable header_hash;
+        const Path header_path =
+            Path(header).is_absolute() ? Path(header) : current_dir / header;
+        if (!base::File::Hash(header_path, &header_hash)) {
+          return false;
+        }
+        it = header_hashes.emplace(header, header_hash).first;
+      }
+      hash_rope->push_back(it->second);
     }
-    hash_rope.push_back(header_hash);
-  }
-  Immutable hash_with_headers = base::Hexify(Immutable(hash_rope).Hash());
-  Immutable handled_hash;
+    return true;
+  };
 
   DCHECK(database_);
-  if (database_->Get(hash_with_headers, &handled_hash)) {
-    return Find(HandledHash(handled_hash), entry);
+  for (int index : order) {
+    Immutable::Rope hash_rope = {unhandled_hash};
+    if (!HashHeaders(direct->variants(index), &hash_rope)) {
+      continue;
+    }
+
+    // Don't spoil the |entry| with a broken one - we may try another variant.
+    Immutable hash_with_headers = base::Hexify(Immutable(hash_rope).Hash());
+    Immutable handled_hash;
+    Entry found;
+    if (!database_->Get(hash_with_headers, &handled_hash) ||
+        !Find(HandledHash(handled_hash), &found)) {
+      continue;
+    }
+    *entry = found;
+
+    if (index == 0) {
+      return true;
+    }
+
+    // Keep the variants in the LRU order. It's the best effort - so don't
+    // wait for a concurrent writer.
+    const auto variant = direct->variants(index);
+    lock.Unlock();
+
+    const WriteLock write_lock(this, manifest_path);
+    proto::Manifest fresh_manifest;
+    if (write_lock && base::LoadFromFile(manifest_path, &fresh_manifest) &&
+        fresh_manifest.has_direct()) {
+      PutVariantFirst(fresh_manifest.mutable_direct(), variant,
+                      kMaxDirectVariants);
+      base::SaveToFile(manifest_path, fresh_manifest);
+    }
+
+    return true;
   }
 
   return false;
 }
 
+bool FileCache::FindHeaders(UnhandledSource code, const ExtraFiles& extra_files,
+                            CommandLine command_line, Version version,
+                            List<String>* headers) const {
+  DCHECK(headers);
+
+  auto unhandled_hash = Hash(code, extra_files, command_line, version);
+  const auto manifest_path =
+      AppendExtension(CommonPath(unhandled_hash), base::kExtManifest);
+  const ReadLock lock(this, manifest_path);
+
+  if (!lock) {
+    return false;
+  }
+
+  proto::Manifest manifest;
+  if (!base::LoadFromFile(manifest_path, &manifest) || !manifest.has_direct()) {
+    return false;
+  }
+
+  auto* direct = manifest.mutable_direct();
+  UpgradeDirect(direct);
+  if (!direct->variants_size()) {
+    return false;
+  }
+
+  // The most recently used variant is the most likely one.
+  headers->assign(direct->variants(0).headers().begin(),
+                  direct->variants(0).headers().end());
+  return true;
+}
+
+bool FileCache::Contains(HandledHash hash) const {
+  return base::File::Exists(
+      AppendExtension(CommonPath(hash), base::kExtManifest));
+}
+
 bool FileCache::Find(HandledHash hash, Entry* entry) const {
   DCHECK(entry);
 
@@ -206,6 +422,14 @@ bool FileCache::Find(HandledHash hash, Entry* entry) const {
     return false;
   }
 
+  // Don't prolong the life of an expired failure - it will be overwritten.
+  if (manifest.v1().has_failed_until()) {
+    if (ui64(time(nullptr)) >= manifest.v1().failed_until()) {
+      return false;
+    }
+    entry->failed = true;
+  }
+
   utime(manifest_path.c_str(), nullptr);
   new_entries_->Append({time(nullptr), hash});
 
@@ -221,32 +445,13 @@ bool FileCache::Find(HandledHash hash, Entry* entry) const {
   }
 
   if (manifest.v1().obj()) {
+    // The shared blob isn't a part of the entry size.
+    ui64 blob_size = 0;
     const auto object_path =
         AppendExtension(CommonPath(hash), base::kExtObject);
-
-    if (manifest.v1().snappy()) {
-      String error;
-
-      Immutable packed_content;
-      if (!base::File::Read(object_path, &packed_content, &error)) {
-        LOG(CACHE_ERROR) << "Failed to read " << object_path << " : " << error;
-        return false;
-      }
-      size += packed_content.size();
-
-      String object_str;
-      if (!snappy::Uncompress(packed_content.data(), packed_content.size(),
-                              &object_str)) {
-        LOG(CACHE_ERROR) << "Failed to unpack contents of " << object_path;
-        return false;
-      }
-
-      entry->object = std::move(object_str);
-    } else {
-      if (!base::File::Read(object_path, &entry->object)) {
-        return false;
-      }
-      size += entry->object.size();
+    if (!ReadContent(object_path, manifest.v1().snappy(), &entry->object,
+                     manifest.v1().has_blob() ? &blob_size : &size)) {
+      return false;
     }
   }
 
@@ -258,6 +463,13 @@ bool FileCache::Find(HandledHash hash, Entry* entry) const {
     size += entry->deps.size();
   }
 
+  for (const auto& name : manifest.v1().outputs()) {
+    if (!ReadContent(OutputPath(hash, name), manifest.v1().snappy(),
+                     &entry->outputs[name], &size)) {
+      return false;
+    }
+  }
+
   return manifest.v1().has_size() && manifest.v1().size() == size;
 }
 
@@ -271,6 +483,10 @@ void FileCache::Store(UnhandledSource code, const ExtraFiles& extra_files,
 }
 
 void FileCache::Store(string::HandledHash hash, Entry entry) {
+  if (entry.failed && !failure_ttl_) {
+    return;
+  }
+
   const auto manifest_path =
       AppendExtension(CommonPath(hash), base::kExtManifest);
   WriteLock lock(this, manifest_path);
@@ -280,6 +496,12 @@ void FileCache::Store(string::HandledHash hash, Entry entry) {
     return;
   }
 
+  // The overwritten entry may be the last one, which refers to its blob.
+  proto::Manifest old_manifest;
+  if (base::File::Exists(manifest_path)) {
+    base::LoadFromFile(manifest_path, &old_manifest);
+  }
+
   if (!base::CreateDirectory(SecondPath(hash))) {
     LOG(CACHE_ERROR) << "Failed to create directory " << SecondPath(hash);
     return;
@@ -288,6 +510,11 @@ void FileCache::Store(string::HandledHash hash, Entry entry) {
   proto::Manifest manifest;
   manifest.set_version(kManifestVersion);
 
+  if (entry.failed) {
+    DCHECK(entry.object.empty() && entry.deps.empty());
+    manifest.mutable_v1()->set_failed_until(time(nullptr) + failure_ttl_);
+  }
+
   manifest.mutable_v1()->set_err(!entry.stderr.empty());
   if (!entry.stderr.empty()) {
     const auto stderr_path =
@@ -301,41 +528,20 @@ void FileCache::Store(string::HandledHash hash, Entry entry) {
     }
   }
 
-  ui64 object_size = 0;
+  ui64 packed_size = 0;
 
+  if (snappy_) {
+    manifest.mutable_v1()->set_snappy(true);
+  }
   manifest.mutable_v1()->set_obj(!entry.object.empty());
   if (!entry.object.empty()) {
     const auto object_path =
         AppendExtension(CommonPath(hash), base::kExtObject);
-
-    if (!snappy_) {
-      object_size = entry.object.size();
-
-      if (!base::File::Write(object_path, entry.object, &error)) {
-        RemoveEntry(hash);
-        LOG(CACHE_ERROR) << "Failed to save object to " << object_path << ": "
-                         << error;
-        return;
-      }
-    } else {
-      String packed_content;
-      if (!snappy::Compress(entry.object.data(), entry.object.size(),
-                            &packed_content)) {
-        RemoveEntry(hash);
-        LOG(CACHE_ERROR) << "Failed to pack contents for " << object_path;
-        return;
-      }
-
-      object_size = packed_content.size();
-
-      if (!base::File::Write(object_path, std::move(packed_content), &error)) {
-        RemoveEntry(hash);
-        LOG(CACHE_ERROR) << "Failed to write to " << object_path << ": "
-                         << error;
-        return;
-      }
-
-      manifest.mutable_v1()->set_snappy(true);
+    if (!(dedup_ &&
+          StoreBlob(object_path, entry.object, manifest.mutable_v1())) &&
+        !WriteContent(object_path, entry.object, snappy_, &packed_size)) {
+      RemoveEntry(hash);
+      return;
     }
   }
 
@@ -351,11 +557,27 @@ void FileCache::Store(string::HandledHash hash, Entry entry) {
     }
   }
 
-  manifest.mutable_v1()->set_size(entry.stderr.size() + object_size +
+  for (const auto& output : entry.outputs) {
+    if (!IsValidOutputName(output.first)) {
+      RemoveEntry(hash, manifest);
+      LOG(CACHE_ERROR) << "Invalid output name: " << output.first;
+      return;
+    }
+
+    // Add the name first - to remove the file along with the entry on error.
+    manifest.mutable_v1()->add_outputs(output.first);
+    if (!WriteContent(OutputPath(hash, output.first), output.second, snappy_,
+                      &packed_size)) {
+      RemoveEntry(hash, manifest);
+      return;
+    }
+  }
+
+  manifest.mutable_v1()->set_size(entry.stderr.size() + packed_size +
                                   entry.deps.size());
 
   if (!base::SaveToFile(manifest_path, manifest, &error)) {
-    RemoveEntry(hash);
+    RemoveEntry(hash, manifest);
     LOG(CACHE_ERROR) << "Failed to save manifest to " << manifest_path << ": "
                      << error;
     return;
@@ -364,9 +586,96 @@ void FileCache::Store(string::HandledHash hash, Entry entry) {
   utime(manifest_path.c_str(), nullptr);
   new_entries_->Append({time(nullptr), hash});
 
+  if (old_manifest.v1().has_blob() &&
+      old_manifest.v1().blob() != manifest.v1().blob()) {
+    ReleaseBlob(old_manifest.v1().blob());
+  }
+
   LOG(CACHE_VERBOSE) << "File is cached on path " << CommonPath(hash);
 }
 
+bool FileCache::StoreBlob(const Path& object_path, Immutable object,
+                          proto::Simple_Version1* manifest) {
+  // The blob is named after the contents on disk - so the packed and unpacked
+  // blobs never mix up.
+  String packed_object;
+  if (snappy_ &&
+      !snappy::Compress(object.data(), object.size(), &packed_object)) {
+    LOG(CACHE_ERROR) << "Failed to pack contents for " << object_path;
+    return false;
+  }
+  const Immutable contents =
+      snappy_ ? Immutable(std::move(packed_object)) : object;
+
+  const String blob = base::Hexify(contents.Hash());
+  const auto blob_path = BlobPath(blob);
+  const WriteLock lock(this, blob_path);
+  String error;
+
+  // Don't wait for a concurrent writer - just store a separate copy.
+  if (!lock) {
+    return false;
+  }
+
+  if (base::File::Exists(blob_path)) {
+    // The hash isn't cryptographic - and the stores may come from the clients
+    // of a shared cache. Link only to the same bytes, otherwise keep a copy.
+    Immutable blob_contents;
+    if (base::File::Size(blob_path) != contents.size() ||
+        !base::File::Read(blob_path, &blob_contents, &error) ||
+        blob_contents != contents) {
+      LOG(CACHE_WARNING) << "Blob " << blob_path << " differs from "
+                         << object_path << " with the same hash";
+      return false;
+    }
+    STAT(OBJECT_DEDUP_HIT);
+    STAT(OBJECT_DEDUP_SAVED, contents.size());
+  } else {
+    if (!base::CreateDirectory(blob_path.parent_path(), &error) ||
+        !base::File::Write(blob_path, contents, &error)) {
+      LOG(CACHE_ERROR) << "Failed to save blob " << blob_path << ": " << error;
+      return false;
+    }
+    blobs_size_ += contents.size();
+    STAT(OBJECT_DEDUP_MISS);
+    STAT(CACHE_SIZE_ADDED, contents.size());
+  }
+
+  if (!base::File::Link(blob_path, object_path, &error)) {
+    LOG(CACHE_ERROR) << "Failed to link " << object_path << " to blob "
+                     << blob_path << ": " << error;
+    if (LinkCount(blob_path) == 1) {
+      base::File::Delete(blob_path);
+      blobs_size_ -= contents.size();
+    }
+    return false;
+  }
+
+  manifest->set_blob(blob);
+  return true;
+}
+
+void FileCache::ReleaseBlob(const String& blob) {
+  const auto blob_path = BlobPath(blob);
+  const WriteLock lock(this, blob_path);
+
+  // The blob, which is still referred or locked, is removed on the next run -
+  // if it becomes unreferenced.
+  if (!lock || LinkCount(blob_path) != 1) {
+    return;
+  }
+
+  String error;
+  const auto blob_size = base::File::Size(blob_path);
+  if (!base::File::Delete(blob_path, &error)) {
+    LOG(CACHE_WARNING) << "Failed to delete " << blob_path << ": " << error;
+    return;
+  }
+
+  blobs_size_ -= blob_size;
+  STAT(CACHE_SIZE_CLEANED, blob_size);
+}
+
 bool FileCache::GetEntrySize(string::Hash hash, ui64* size) const {
   DCHECK(size);
 
@@ -391,6 +700,15 @@ bool FileCache::GetEntrySize(string::Hash hash, ui64* size) const {
 }
 
 bool FileCache::RemoveEntry(string::Hash hash) {
+  // Only the manifest knows the extra outputs of the entry.
+  proto::Manifest manifest;
+  base::LoadFromFile(AppendExtension(CommonPath(hash), base::kExtManifest),
+                     &manifest);
+  return RemoveEntry(hash, manifest);
+}
+
+bool FileCache::RemoveEntry(string::Hash hash,
+                            const proto::Manifest& manifest) {
   String error;
   SQLite::Value entry;
   bool has_entry = entries_->Get(hash.str, &entry);
@@ -410,12 +728,18 @@ bool FileCache::RemoveEntry(string::Hash hash) {
 
   if (base::File::Exists(object_path)) {
     if (!base::File::Delete(object_path, &error)) {
-      entry_size -= base::File::Size(object_path);
+      if (!manifest.v1().has_blob()) {
+        entry_size -= base::File::Size(object_path);
+      }
       result = false;
       LOG(CACHE_WARNING) << "Failed to delete " << object_path << ": " << error;
     }
   }
 
+  if (manifest.v1().has_blob()) {
+    ReleaseBlob(manifest.v1().blob());
+  }
+
   if (base::File::Exists(deps_path)) {
     if (!base::File::Delete(deps_path, &error)) {
       entry_size -= base::File::Size(deps_path);
@@ -432,6 +756,18 @@ bool FileCache::RemoveEntry(string::Hash hash) {
     }
   }
 
+  for (const auto& name : manifest.v1().outputs()) {
+    const auto output_path = OutputPath(hash, name);
+    if (base::File::Exists(output_path)) {
+      if (!base::File::Delete(output_path, &error)) {
+        entry_size -= base::File::Size(output_path);
+        result = false;
+        LOG(CACHE_WARNING) << "Failed to delete " << output_path << ": "
+                           << error;
+      }
+    }
+  }
+
   if (!base::File::Delete(manifest_path, &error)) {
     entry_size -= base::File::Size(manifest_path);
     result = false;
@@ -451,9 +787,9 @@ void FileCache::DoStore(UnhandledHash orig_hash, const List<String>& headers,
                         const Path& current_dir, const HandledHash& hash) {
   // We have to store manifest on the path based only on the hash of unhandled
   // source code. Otherwise, we won't be able to get list of the dependent
-  // headers, while checking the direct cache. Such approach has a little
-  // drawback, because the changes in the dependent headers will make a
-  // false-positive direct cache hit, followed by true cache miss.
+  // headers, while checking the direct cache. Since the changes in the
+  // dependent headers may change the list itself, the manifest keeps a few
+  // recently used lists - so switching between branches doesn't rewrite it.
   const auto manifest_path =
       AppendExtension(CommonPath(orig_hash), base::kExtManifest);
   WriteLock lock(this, manifest_path);
@@ -469,9 +805,7 @@ void FileCache::DoStore(UnhandledHash orig_hash, const List<String>& headers,
   }
 
   Immutable::Rope hash_rope = {orig_hash};
-
-  proto::Manifest manifest;
-  manifest.set_version(kManifestVersion);
+  proto::Direct::Variant variant;
 
   auto hash_headers = [&](const List<String>& headers,
                           const List<Literal>& skip_list) {
@@ -485,7 +819,7 @@ void FileCache::DoStore(UnhandledHash orig_hash, const List<String>& headers,
         return;
       }
       hash_rope.push_back(header_hash);
-      manifest.mutable_direct()->add_headers(header);
+      variant.add_headers(header);
     }
   };
 
@@ -498,6 +832,15 @@ void FileCache::DoStore(UnhandledHash orig_hash, const List<String>& headers,
     return;
   }
 
+  // Keep other variants - unless the manifest is broken.
+  proto::Manifest manifest;
+  if (!base::File::Exists(manifest_path) ||
+      !base::LoadFromFile(manifest_path, &manifest) || !manifest.has_direct()) {
+    manifest.Clear();
+  }
+  manifest.set_version(kManifestVersion);
+  PutVariantFirst(manifest.mutable_direct(), variant, kMaxDirectVariants);
+
   String error;
   if (!base::SaveToFile(manifest_path, manifest, &error)) {
     RemoveEntry(orig_hash);
@@ -540,16 +883,21 @@ void FileCache::Clean(UniquePtr<EntryList> list) {
     return;
   }
 
-  while (cache_size_ > max_size_) {
+  while (cache_size_ + blobs_size_ > max_size_) {
     string::Hash hash;
     SQLite::Value entry;
-    CHECK(entries_->First(&hash.str, &entry));
+    if (!entries_->First(&hash.str, &entry)) {
+      // Only the orphaned blobs may remain without entries - they're removed
+      // on the next run.
+      break;
+    }
 
     const auto manifest_path =
         AppendExtension(CommonPath(hash), base::kExtManifest);
     WriteLock lock(this, manifest_path);
     if (lock) {
-      LOG(CACHE_VERBOSE) << "Cache overuse is " << (cache_size_ - max_size_)
+      LOG(CACHE_VERBOSE) << "Cache overuse is "
+                         << (cache_size_ + blobs_size_ - max_size_)
                          << " bytes: removing " << hash.str;
       DCHECK_O_EVAL(RemoveEntry(hash));
     }
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <base/const_string.h>
+#include <base/constants.h>
 #include <base/locked_list.h>
+#include <base/path_utils.h>
 #include <base/thread_pool.h>
 #include <cache/database_leveldb.h>
 #include <cache/database_sqlite.h>
@@ -12,20 +14,35 @@
 namespace dist_clang {
 namespace cache {
 
+FORWARD_TEST(FileCacheTest, DeduplicateObjects);
+FORWARD_TEST(FileCacheTest, DirectEntry_HeaderVariants);
 FORWARD_TEST(FileCacheTest, DoubleLocks);
 FORWARD_TEST(FileCacheTest, ExceedCacheSize);
 FORWARD_TEST(FileCacheTest, ExceedCacheSize_Sync);
 FORWARD_TEST(FileCacheTest, LockNonExistentFile);
 FORWARD_TEST(FileCacheTest, RemoveEntry);
 FORWARD_TEST(FileCacheTest, RestoreEntryWithMissingFile);
+FORWARD_TEST(FileCacheTest, RestoreEntryWithOutputs);
 FORWARD_TEST(FileCacheTest, UseIndexFromDisk);
 FORWARD_TEST(FileCacheMigratorTest, Version_0_to_1_Direct);
 FORWARD_TEST(FileCacheMigratorTest, Version_0_to_1_Simple);
 FORWARD_TEST(FileCacheMigratorTest, Version_1_to_2_Direct);
 FORWARD_TEST(FileCacheMigratorTest, Version_1_to_2_Simple);
+FORWARD_TEST(FileCacheMigratorTest, Version_2_to_3);
 
 enum ExtraFileType {
   SANITIZE_BLACKLIST = 0,
+
+  INCLUDED_FILES = 1,
+  // Hashes of the explicitly included PCH files - not the contents, since
+  // they're too big to hash them again.
+
+  MODULE_FILES = 2,
+  // Hashes of the PCM files of explicit modules - the same way.
+
+  DEPEND_HEADERS = 3,
+  // Hashes of the headers from the deps of the last compilation - in the keys
+  // of the depend entries.
 };
 
 using ExtraFiles = HashMap<ExtraFileType, Immutable>;
@@ -94,9 +111,19 @@ class FileCache {
     Immutable object;
     Immutable deps;
     Immutable stderr;
+
+    HashMap<String, Immutable> outputs;
+    // Extra outputs of the compiler by their names - see |Flags.outputs|.
+
+    bool failed = false;
+    // The compiler has failed - there is only |stderr|.
   };
 
-  FileCache(const Path& path, ui64 size, bool snappy, bool store_index);
+  FileCache(const Path& path, ui64 size, bool snappy, bool store_index,
+            ui64 failure_ttl = 0, bool dedup = false);
+  // Failed entries are kept for |failure_ttl| seconds - or not stored at all,
+  // if it's zero. With |dedup| the identical objects of different entries are
+  // hard links to a single blob.
   explicit FileCache(const Path& path);
   ~FileCache();
 
@@ -117,8 +144,17 @@ class FileCache {
             string::CommandLine command_line, string::Version version,
             const Path& current_dir, Entry* entry) const;
 
+  bool FindHeaders(string::UnhandledSource code, const ExtraFiles& extra_files,
+                   string::CommandLine command_line, string::Version version,
+                   List<String>* headers) const;
+  // Returns headers from the direct manifest as is - without checking that
+  // they are still the same.
+
   bool Find(string::HandledHash hash, Entry* entry) const;
 
+  bool Contains(string::HandledHash hash) const;
+  // Checks only that there is a manifest - without reading the entry.
+
   void Store(string::UnhandledSource code, const ExtraFiles& extra_files,
              string::CommandLine command_line, string::Version version,
              const List<String>& headers,
@@ -128,18 +164,24 @@ class FileCache {
   void Store(string::HandledHash hash, Entry entry);
 
  private:
+  FRIEND_TEST(FileCacheTest, DeduplicateObjects);
+  FRIEND_TEST(FileCacheTest, DirectEntry_HeaderVariants);
+  FRIEND_TEST(FileCacheTest, DontDeduplicateCollidingObjects);
   FRIEND_TEST(FileCacheTest, DoubleLocks);
   FRIEND_TEST(FileCacheTest, ExceedCacheSize);
   FRIEND_TEST(FileCacheTest, LockNonExistentFile);
   FRIEND_TEST(FileCacheTest, RemoveEntry);
   FRIEND_TEST(FileCacheTest, RestoreEntryWithMissingFile);
+  FRIEND_TEST(FileCacheTest, RestoreEntryWithOutputs);
   FRIEND_TEST(FileCacheTest, UseIndexFromDisk);
   FRIEND_TEST(FileCacheMigratorTest, Version_0_to_1_Direct);
   FRIEND_TEST(FileCacheMigratorTest, Version_0_to_1_Simple);
   FRIEND_TEST(FileCacheMigratorTest, Version_1_to_2_Direct);
   FRIEND_TEST(FileCacheMigratorTest, Version_1_to_2_Simple);
+  FRIEND_TEST(FileCacheMigratorTest, Version_2_to_3);
 
-  enum : ui32 { kManifestVersion = 2 };
+  enum : ui32 { kManifestVersion = 3 };
+  enum : ui32 { kMaxDirectVariants = 4 };
 
   class ReadLock {
    public:
@@ -181,6 +223,16 @@ class FileCache {
     return SecondPath(hash) / hash.str.string_copy();
   }
 
+  inline Path OutputPath(string::Hash hash, const String& name) const {
+    return base::AppendExtension(CommonPath(hash), base::kExtOutput).string() +
+           "." + name;
+  }
+
+  inline Path BlobPath(const String& blob) const {
+    DCHECK(blob.size() >= 2);
+    return path_ / "blobs" / String(1, blob[0]) / String(1, blob[1]) / blob;
+  }
+
   void DoStore(string::UnhandledHash orig_hash, const List<String>& headers,
                const List<String>& preprocessed_headers,
                const Path& current_dir, const string::HandledHash& hash);
@@ -196,7 +248,18 @@ class FileCache {
   // Returns |true| if the entry is from index.
 
   bool RemoveEntry(string::Hash hash);
+  bool RemoveEntry(string::Hash hash, const proto::Manifest& manifest);
   // Returns |false| only if some part of entry can't be physically removed.
+  // The |manifest| lists the extra outputs - it's loaded from disk otherwise.
+
+  bool StoreBlob(const Path& object_path, Immutable object,
+                 proto::Simple_Version1* manifest);
+  // Links the |object_path| to the blob with the same contents - the blob is
+  // created, if there is none yet. Returns |false| if the object should be
+  // written as a separate file.
+
+  void ReleaseBlob(const String& blob);
+  // Removes the blob, if no entry refers to it anymore.
 
   void Clean(UniquePtr<EntryList> list);
 
@@ -206,10 +269,15 @@ class FileCache {
 
   const Path path_;
   bool snappy_, store_index_;
+  const ui64 failure_ttl_;
+  const bool dedup_;
   UniquePtr<LevelDB> database_;
   UniquePtr<SQLite> entries_;
 
   ui64 max_size_, cache_size_ = {0u};
+  std::atomic<ui64> blobs_size_ = {0u};
+  // The blobs aren't in the index - they're counted only once and removed
+  // along with the last entry, which refers to them.
   const EntryListDeleter new_entries_deleter_ = [this](EntryList* list) {
     auto task = [this, list] { Clean(UniquePtr<EntryList>(list)); };
     cleaner_.Push(task);
@@ -90,6 +90,18 @@ bool Version_1_to_2(const Path& common_prefix, ui32 to_version,
   return true;
 }
 
+// Remove all old entries since the hashes of the keys are computed differently
+// and the keys are wider. The old entries can't be found anymore.
+bool Version_2_to_3(const Path& common_prefix, ui32 to_version,
+                    proto::Manifest& manifest, bool& modified) {
+  if (manifest.version() != 2 || to_version < 3) {
+    return true;
+  }
+
+  // Expect that the entry will be removed.
+  return false;
+}
+
 }  // namespace
 
 bool FileCache::Migrate(string::Hash hash, ui32 to_version) const {
@@ -126,6 +138,7 @@ bool FileCache::Migrate(string::Hash hash, ui32 to_version) const {
 
   MIGRATE(0, 1);
   MIGRATE(1, 2);
+  MIGRATE(2, 3);
 
 #undef MIGRATE
 
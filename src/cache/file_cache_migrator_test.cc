@@ -122,5 +122,33 @@ TEST(FileCacheMigratorTest, Version_1_to_2_Direct) {
   EXPECT_FALSE(cache.Migrate(hash, 2));
 }
 
+TEST(FileCacheMigratorTest, Version_2_to_3) {
+  const base::TemporaryDir temp_dir;
+  string::Hash hash1{"12345678901234567890123456789012-12345678-00000001"_l};
+  string::Hash hash2{"12345678901234567890123456789012-12345678-00000002"_l};
+  FileCache cache(temp_dir);
+  const auto manifest_path1 =
+      AppendExtension(cache.CommonPath(hash1), base::kExtManifest);
+  const auto manifest_path2 =
+      AppendExtension(cache.CommonPath(hash2), base::kExtManifest);
+
+  proto::Manifest manifest;
+  manifest.set_version(2);
+  manifest.mutable_v1()->set_err(true);
+
+  ASSERT_TRUE(base::CreateDirectory(cache.SecondPath(hash1)));
+  ASSERT_TRUE(base::SaveToFile(manifest_path1, manifest));
+  manifest.Clear();
+  manifest.set_version(2);
+  manifest.mutable_direct()->add_variants()->add_headers("text.h");
+  ASSERT_TRUE(base::SaveToFile(manifest_path2, manifest));
+
+  // The keys of both kinds of entries are obsolete.
+  EXPECT_TRUE(cache.Migrate(hash1, 2));
+  EXPECT_TRUE(cache.Migrate(hash2, 2));
+  EXPECT_FALSE(cache.Migrate(hash1, 3));
+  EXPECT_FALSE(cache.Migrate(hash2, 3));
+}
+
 }  // namespace cache
 }  // namespace dist_clang
@@ -16,7 +16,7 @@ namespace cache {
 using namespace string;
 
 TEST(FileCacheTest, HashCompliesWithRegex) {
-  std::regex hash_regex("[a-f0-9]{32}-[a-f0-9]{8}-[a-f0-9]{8}");
+  std::regex hash_regex("[a-f0-9]{32}-[a-f0-9]{16}-[a-f0-9]{16}");
   EXPECT_TRUE(
       std::regex_match(FileCache::Hash(HandledSource("1"_l), {},
                                        CommandLine("3"_l), Version("4"_l))
@@ -105,7 +105,7 @@ TEST(FileCacheTest, RemoveEntry) {
     const auto stderr_path = AppendExtension(common_prefix, base::kExtStderr);
 
     proto::Manifest manifest;
-    manifest.set_version(1);
+    manifest.set_version(FileCache::kManifestVersion);
     manifest.mutable_v1()->set_obj(true);
     manifest.mutable_v1()->set_dep(true);
     manifest.mutable_v1()->set_err(true);
@@ -125,7 +125,7 @@ TEST(FileCacheTest, RemoveEntry) {
     const auto deps_path = AppendExtension(common_prefix, base::kExtDeps);
 
     proto::Manifest manifest;
-    manifest.set_version(1);
+    manifest.set_version(FileCache::kManifestVersion);
     manifest.mutable_v1()->set_obj(true);
     manifest.mutable_v1()->set_dep(true);
     manifest.mutable_v1()->set_err(true);
@@ -198,6 +198,153 @@ TEST(FileCacheTest, RestoreSingleEntry) {
   EXPECT_EQ(expected_stderr, entry2.stderr);
 }
 
+TEST(FileCacheTest, RestoreFailedEntry) {
+  const base::TemporaryDir temp_dir;
+  const auto expected_stderr = "some error"_l;
+  FileCache::Entry entry1, entry2, entry3;
+
+  const HandledSource code("int main() { return 0 }"_l);
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const auto hash = FileCache::Hash(code, {}, cl, version);
+
+  entry1.stderr = expected_stderr;
+  entry1.failed = true;
+
+  {
+    // Failures aren't stored without TTL.
+    FileCache cache(temp_dir.path() / "no_ttl");
+    ASSERT_TRUE(cache.Run(1));
+    cache.Store(hash, entry1);
+    EXPECT_FALSE(cache.Find(hash, &entry2));
+  }
+
+  FileCache cache(temp_dir.path() / "ttl", FileCache::UNLIMITED, false, false,
+                  60);
+  ASSERT_TRUE(cache.Run(1));
+  cache.Store(hash, entry1);
+
+  ASSERT_TRUE(cache.Find(hash, &entry3));
+  EXPECT_TRUE(entry3.failed);
+  EXPECT_TRUE(entry3.object.empty());
+  EXPECT_EQ(expected_stderr, entry3.stderr);
+}
+
+TEST(FileCacheTest, RestoreEntryWithOutputs) {
+  const base::TemporaryDir temp_dir;
+  const auto expected_object_code = "some object code"_l;
+  const auto expected_notes = "some coverage notes"_l;
+  FileCache::Entry entry1, entry2, entry3, entry4;
+
+  const HandledSource code("int main() { return 0; }"_l);
+  const CommandLine cl("-c -femit-coverage-notes"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const auto hash1 = FileCache::Hash(code, {}, cl, version);
+  const auto hash2 = FileCache::Hash(code, {}, CommandLine("-c"_l), version);
+
+  FileCache cache(temp_dir, FileCache::UNLIMITED, true, false);
+  ASSERT_TRUE(cache.Run(1));
+
+  entry1.object = expected_object_code;
+  entry1.outputs.emplace("gcno", expected_notes);
+  cache.Store(hash1, entry1);
+
+  const auto output_path = cache.OutputPath(hash1, "gcno");
+  EXPECT_TRUE(base::File::Exists(output_path));
+
+  ASSERT_TRUE(cache.Find(hash1, &entry2));
+  EXPECT_EQ(expected_object_code, entry2.object);
+  ASSERT_EQ(1u, entry2.outputs.size());
+  EXPECT_EQ(expected_notes, entry2.outputs["gcno"]);
+
+  // The names become parts of paths - so they're checked.
+  entry3.object = expected_object_code;
+  entry3.outputs.emplace("../gcno", expected_notes);
+  cache.Store(hash2, entry3);
+  EXPECT_FALSE(cache.Find(hash2, &entry4));
+
+  EXPECT_TRUE(cache.RemoveEntry(hash1));
+  EXPECT_FALSE(base::File::Exists(output_path));
+}
+
+TEST(FileCacheTest, DeduplicateObjects) {
+  const base::TemporaryDir temp_dir;
+  const auto expected_object_code = "some object code"_l;
+  FileCache::Entry entry1, entry2, entry3;
+
+  const HandledSource code("int main() { return 0; }"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const auto hash1 = FileCache::Hash(code, {}, CommandLine("-c"_l), version);
+  const auto hash2 =
+      FileCache::Hash(code, {}, CommandLine("-c -DNDEBUG"_l), version);
+
+  FileCache cache(temp_dir, FileCache::UNLIMITED, true, false, 0, true);
+  ASSERT_TRUE(cache.Run(1));
+
+  entry1.object = expected_object_code;
+  cache.Store(hash1, entry1);
+  cache.Store(hash2, entry1);
+
+  proto::Manifest manifest;
+  ASSERT_TRUE(base::LoadFromFile(
+      AppendExtension(cache.CommonPath(hash1), base::kExtManifest), &manifest));
+  ASSERT_TRUE(manifest.v1().has_blob());
+  const auto blob_path = cache.BlobPath(manifest.v1().blob());
+  const auto blob_size = base::File::Size(blob_path);
+  EXPECT_LT(0u, blob_size);
+  EXPECT_EQ(blob_size, cache.blobs_size_);
+
+  ASSERT_TRUE(cache.Find(hash1, &entry2));
+  EXPECT_EQ(expected_object_code, entry2.object);
+
+  // The blob stays while some entry refers to it.
+  EXPECT_TRUE(cache.RemoveEntry(hash1));
+  EXPECT_TRUE(base::File::Exists(blob_path));
+  ASSERT_TRUE(cache.Find(hash2, &entry3));
+  EXPECT_EQ(expected_object_code, entry3.object);
+
+  EXPECT_TRUE(cache.RemoveEntry(hash2));
+  EXPECT_FALSE(base::File::Exists(blob_path));
+  EXPECT_EQ(0u, cache.blobs_size_);
+}
+
+TEST(FileCacheTest, DontDeduplicateCollidingObjects) {
+  const base::TemporaryDir temp_dir;
+  const auto expected_object_code = "some object code"_l;
+  const auto colliding_object_code = "other object code"_l;
+  FileCache::Entry entry1, entry2;
+
+  const HandledSource code("int main() { return 0; }"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const auto hash1 = FileCache::Hash(code, {}, CommandLine("-c"_l), version);
+  const auto hash2 =
+      FileCache::Hash(code, {}, CommandLine("-c -DNDEBUG"_l), version);
+
+  FileCache cache(temp_dir, FileCache::UNLIMITED, true, false, 0, true);
+  ASSERT_TRUE(cache.Run(1));
+
+  entry1.object = expected_object_code;
+  cache.Store(hash1, entry1);
+
+  proto::Manifest manifest;
+  ASSERT_TRUE(base::LoadFromFile(
+      AppendExtension(cache.CommonPath(hash1), base::kExtManifest), &manifest));
+  ASSERT_TRUE(manifest.v1().has_blob());
+  const auto blob_path = cache.BlobPath(manifest.v1().blob());
+
+  // Pretend that other contents have the same hash.
+  ASSERT_TRUE(base::File::Delete(blob_path));
+  ASSERT_TRUE(base::File::Write(blob_path, colliding_object_code));
+
+  cache.Store(hash2, entry1);
+  ASSERT_TRUE(base::LoadFromFile(
+      AppendExtension(cache.CommonPath(hash2), base::kExtManifest), &manifest));
+  EXPECT_FALSE(manifest.v1().has_blob());
+
+  ASSERT_TRUE(cache.Find(hash2, &entry2));
+  EXPECT_EQ(expected_object_code, entry2.object);
+}
+
 TEST(FileCacheTest, RestoreSingleEntryWithExtraFile) {
   const base::TemporaryDir temp_dir;
   const auto object_path = temp_dir.path() / "test.o";
@@ -585,6 +732,63 @@ TEST(FileCacheTest, DirectEntry_RewriteManifest) {
   EXPECT_TRUE(cache.Find(orig_code, {}, cl, version, temp_dir, &entry2));
 }
 
+TEST(FileCacheTest, DirectEntry_HeaderVariants) {
+  const base::TemporaryDir temp_dir;
+  const auto header1_path = temp_dir.path() / "test1.h";
+  const auto header2_path = temp_dir.path() / "test2.h";
+  FileCache cache(temp_dir);
+  ASSERT_TRUE(cache.Run(1));
+  FileCache::Entry entry1, entry2, entry3, entry4, entry5;
+
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const auto hash1 =
+      FileCache::Hash(HandledSource("int a;"_l), {}, cl, version);
+  const auto hash2 =
+      FileCache::Hash(HandledSource("int b;"_l), {}, cl, version);
+
+  entry1.object = "object code 1"_l;
+  entry2.object = "object code 2"_l;
+  cache.Store(hash1, entry1);
+  cache.Store(hash2, entry2);
+
+  ASSERT_TRUE(base::File::Write(header2_path, "#define B"_l));
+
+  // The first header includes the second one only on some branch.
+  const UnhandledSource orig_code("int main() {}"_l);
+  const List<String> headers1 = {header1_path};
+  const List<String> headers2 = {header1_path, header2_path};
+
+  ASSERT_TRUE(base::File::Write(header1_path, "#define A"_l));
+  cache.Store(orig_code, {}, cl, version, headers1, {}, temp_dir, hash1);
+  ASSERT_TRUE(base::File::Write(header1_path, "#include \"test2.h\""_l));
+  cache.Store(orig_code, {}, cl, version, headers2, {}, temp_dir, hash2);
+
+  ASSERT_TRUE(cache.Find(orig_code, {}, cl, version, temp_dir, &entry3));
+  EXPECT_EQ(entry2.object, entry3.object);
+
+  // Switching back doesn't lose the first variant - and makes it recent.
+  ASSERT_TRUE(base::File::Write(header1_path, "#define A"_l));
+  ASSERT_TRUE(cache.Find(orig_code, {}, cl, version, temp_dir, &entry4));
+  EXPECT_EQ(entry1.object, entry4.object);
+
+  List<String> headers;
+  ASSERT_TRUE(cache.FindHeaders(orig_code, {}, cl, version, &headers));
+  EXPECT_EQ(headers1, headers);
+
+  // Too many variants evict the least recently used ones.
+  for (ui32 i = 0; i < FileCache::kMaxDirectVariants; ++i) {
+    const auto header_path =
+        temp_dir.path() / ("other" + std::to_string(i) + ".h");
+    ASSERT_TRUE(base::File::Write(header_path, "#define C"_l));
+    cache.Store(orig_code, {}, cl, version, {header_path}, {}, temp_dir,
+                hash2);
+    ASSERT_TRUE(base::File::Write(header_path, "#define D"_l));
+  }
+
+  EXPECT_FALSE(cache.Find(orig_code, {}, cl, version, temp_dir, &entry5));
+}
+
 TEST(FileCacheTest, DirectEntry_ChangedOriginalCode) {
   const base::TemporaryDir temp_dir;
   const auto object_path = temp_dir.path() / "test.o";
@@ -670,6 +874,40 @@ TEST(FileCacheTest, DirectEntry_ChangedExtraFile) {
                           version, temp_dir, &entry));
 }
 
+TEST(FileCacheTest, DirectEntry_FindHeaders) {
+  const base::TemporaryDir temp_dir;
+  const auto header1_path = temp_dir.path() / "test1.h";
+  const auto header2_path = temp_dir.path() / "test2.h";
+  const auto header2_rel_path = Path("test2.h");
+  FileCache cache(temp_dir);
+  ASSERT_TRUE(cache.Run(1));
+  FileCache::Entry entry;
+
+  const HandledSource code("int main() { return 0; }"_l);
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const auto hash = FileCache::Hash(code, {}, cl, version);
+
+  ASSERT_TRUE(base::File::Write(header1_path, "#define A"_l));
+  ASSERT_TRUE(base::File::Write(header2_path, "#define B"_l));
+
+  entry.object = "some object code"_l;
+  cache.Store(hash, entry);
+
+  const UnhandledSource orig_code("int main() {}"_l);
+  List<String> headers;
+  EXPECT_FALSE(cache.FindHeaders(orig_code, {}, cl, version, &headers));
+
+  const List<String> expected_headers = {header1_path, header2_rel_path};
+  cache.Store(orig_code, {}, cl, version, expected_headers, {}, temp_dir, hash);
+
+  // Headers are returned even if they're changed.
+  ASSERT_TRUE(base::File::Write(header2_path, "#define C"_l));
+  EXPECT_FALSE(cache.Find(orig_code, {}, cl, version, temp_dir, &entry));
+  ASSERT_TRUE(cache.FindHeaders(orig_code, {}, cl, version, &headers));
+  EXPECT_EQ(expected_headers, headers);
+}
+
 TEST(FileCacheTest, RestoreAndMigrateSnappyEntry) {
   const base::TemporaryDir temp_dir;
   const auto object_path = temp_dir.path() / "test.o";
@@ -734,9 +972,8 @@ TEST(FileCacheTest, UseIndexFromDisk) {
     ASSERT_TRUE(base::CreateDirectory(cache.SecondPath(hash)));
 
     proto::Manifest manifest;
-    manifest.set_stderr(false);
-    manifest.set_object(false);
-    manifest.set_deps(false);
+    manifest.set_version(FileCache::kManifestVersion);
+    manifest.mutable_v1()->set_err(false);
 
     ASSERT_TRUE(base::SaveToFile(manifest_path, manifest));
     manifest.Clear();
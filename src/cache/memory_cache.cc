@@ -0,0 +1,169 @@
+#include <cache/memory_cache.h>
+
+#include <base/assert.h>
+#include <perf/stat_service.h>
+
+#include STL(algorithm)
+#include STL(cstring)
+
+namespace dist_clang {
+namespace cache {
+
+namespace {
+
+// An average object is assumed to be about 64KiB - it gives the number of
+// entries to count per shard.
+constexpr ui64 kAverageEntrySize = 64 * 1024;
+
+}  // namespace
+
+MemoryCache::FrequencySketch::FrequencySketch(ui32 width)
+    : counters_(kRows * width, 0), width_(width) {
+  DCHECK(width_ > 0);
+}
+
+template <class Visitor>
+void MemoryCache::FrequencySketch::ForEachCounter(const Immutable& key,
+                                                  Visitor visitor) const {
+  // The keys are hashes already - any bits of them are good enough. Though
+  // the shard is chosen by the first bits - so they go second here.
+  auto digest = key.Hash(16);
+  ui64 h1, h2;
+  std::memcpy(&h1, digest.data(), sizeof(h1));
+  std::memcpy(&h2, digest.data() + sizeof(h1), sizeof(h2));
+
+  for (ui32 row = 0; row < kRows; ++row) {
+    visitor(row * width_ + (h2 + row * h1) % width_);
+  }
+}
+
+void MemoryCache::FrequencySketch::Increment(const Immutable& key) {
+  ForEachCounter(key, [this](ui64 index) {
+    if (counters_[index] < kMaxCount) {
+      ++counters_[index];
+    }
+  });
+
+  // Age all counters after a sample of uses - ten per counter in a row.
+  if (++additions_ >= 10 * width_) {
+    for (auto& counter : counters_) {
+      counter /= 2;
+    }
+    additions_ /= 2;
+  }
+}
+
+ui32 MemoryCache::FrequencySketch::Frequency(const Immutable& key) const {
+  ui32 result = kMaxCount;
+  ForEachCounter(key, [this, &result](ui64 index) {
+    result = std::min<ui32>(result, counters_[index]);
+  });
+  return result;
+}
+
+MemoryCache::MemoryCache(ui64 size, ui32 shards)
+    : shard_capacity_(size / std::max(shards, 1u)) {
+  const ui32 width = std::max<ui64>(shard_capacity_ / kAverageEntrySize, 64);
+  for (ui32 i = 0; i < std::max(shards, 1u); ++i) {
+    shards_.emplace_back(new Shard(width));
+  }
+}
+
+bool MemoryCache::Find(const string::HandledHash& hash,
+                       FileCache::Entry* entry) {
+  DCHECK(entry);
+
+  auto& shard = GetShard(hash.str);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  shard.sketch.Increment(hash.str);
+
+  auto it = shard.index.find(hash.str);
+  if (it == shard.index.end()) {
+    STAT(MEMORY_CACHE_MISS);
+    return false;
+  }
+
+  shard.items.splice(shard.items.begin(), shard.items, it->second);
+  *entry = it->second->second;
+  STAT(MEMORY_CACHE_HIT);
+  return true;
+}
+
+void MemoryCache::Store(const string::HandledHash& hash,
+                        const FileCache::Entry& entry) {
+  Item item{hash.str, entry};
+  const ui64 item_size = EntrySize(item);
+
+  auto& shard = GetShard(hash.str);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  // Don't serve the older entry, which is replaced by one not kept here.
+  if (entry.failed || item_size > shard_capacity_) {
+    auto it = shard.index.find(hash.str);
+    if (it != shard.index.end()) {
+      Evict(shard, it->second);
+    }
+    return;
+  }
+
+  // The entry, which is already here, is simply updated.
+  auto it = shard.index.find(hash.str);
+  const bool present = it != shard.index.end();
+  if (present) {
+    Evict(shard, it->second);
+  }
+
+  // Admit a new entry only if it's more frequent than every victim.
+  const ui32 frequency = shard.sketch.Frequency(hash.str);
+  ui64 free_size = shard_capacity_ - shard.size;
+  auto victim = shard.items.end();
+  while (free_size < item_size) {
+    DCHECK(victim != shard.items.begin());
+    --victim;
+    if (!present && shard.sketch.Frequency(victim->first) >= frequency) {
+      return;
+    }
+    free_size += EntrySize(*victim);
+  }
+
+  while (victim != shard.items.end()) {
+    Evict(shard, victim++);
+  }
+
+  shard.items.emplace_front(std::move(item));
+  shard.index.emplace(hash.str, shard.items.begin());
+  shard.size += item_size;
+}
+
+ui64 MemoryCache::size() const {
+  ui64 result = 0;
+  for (const auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    result += shard->size;
+  }
+  return result;
+}
+
+// static
+ui64 MemoryCache::EntrySize(const Item& item) {
+  ui64 result = item.first.size() + item.second.object.size() +
+                item.second.deps.size() + item.second.stderr.size();
+  for (const auto& output : item.second.outputs) {
+    result += output.first.size() + output.second.size();
+  }
+  return result;
+}
+
+MemoryCache::Shard& MemoryCache::GetShard(const Immutable& key) {
+  return *shards_[std::hash<Immutable>()(key) % shards_.size()];
+}
+
+void MemoryCache::Evict(Shard& shard, List<Item>::iterator it) {
+  shard.size -= EntrySize(*it);
+  shard.index.erase(it->first);
+  shard.items.erase(it);
+}
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cache/file_cache.h>
+
+#include STL(mutex)
+
+namespace dist_clang {
+namespace cache {
+
+// Size-bounded in-memory tier in front of the |FileCache| - keeps the recently
+// used entries unpacked. Each shard is an LRU list with its own lock. A new
+// entry is admitted only if it's used more frequently than the ones it would
+// evict, according to a small frequency sketch (TinyLFU) - so a stream of
+// one-off entries doesn't wash out the hot ones.
+//
+// Thread-safe.
+class MemoryCache {
+ public:
+  // |size| is in bytes - it's split evenly between |shards|.
+  explicit MemoryCache(ui64 size, ui32 shards = 16);
+
+  bool Find(const string::HandledHash& hash, FileCache::Entry* entry);
+  void Store(const string::HandledHash& hash, const FileCache::Entry& entry);
+  // The failed entries expire - so they're never stored, and only drop the
+  // former entry of the |hash|.
+
+  ui64 size() const;
+
+ private:
+  // Counts the uses of the keys approximately in 4 rows of saturating
+  // counters. All counters are halved periodically to forget the old uses.
+  class FrequencySketch {
+   public:
+    explicit FrequencySketch(ui32 width);
+
+    void Increment(const Immutable& key);
+    ui32 Frequency(const Immutable& key) const;
+
+   private:
+    enum : ui32 { kRows = 4, kMaxCount = 15 };
+
+    template <class Visitor>
+    void ForEachCounter(const Immutable& key, Visitor visitor) const;
+
+    Vector<ui8> counters_;
+    const ui32 width_;
+    ui32 additions_ = 0;
+  };
+
+  using Item = Pair<Immutable /* key */, FileCache::Entry>;
+
+  struct Shard {
+    explicit Shard(ui32 width) : sketch(width) {}
+
+    std::mutex mutex;
+    List<Item> items;  // The most recently used go first.
+    HashMap<Immutable, List<Item>::iterator> index;
+    FrequencySketch sketch;
+    ui64 size = 0;
+  };
+
+  static ui64 EntrySize(const Item& item);
+
+  Shard& GetShard(const Immutable& key);
+  void Evict(Shard& shard, List<Item>::iterator it);
+
+  Vector<UniquePtr<Shard>> shards_;
+  const ui64 shard_capacity_;
+};
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -0,0 +1,82 @@
+#include <cache/memory_cache.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+namespace dist_clang {
+namespace cache {
+
+using namespace string;
+
+TEST(MemoryCacheTest, StoreAndFind) {
+  const HandledHash hash("hash"_l);
+  FileCache::Entry entry1, entry2, entry3, entry4;
+  MemoryCache cache(1024);
+
+  EXPECT_FALSE(cache.Find(hash, &entry2));
+
+  entry1.object = "some object code"_l;
+  entry1.deps = "some deps"_l;
+  entry1.stderr = "some warning"_l;
+  entry1.outputs.emplace("gcno", "some coverage notes"_l);
+  cache.Store(hash, entry1);
+
+  ASSERT_TRUE(cache.Find(hash, &entry2));
+  EXPECT_EQ(entry1.object, entry2.object);
+  EXPECT_EQ(entry1.deps, entry2.deps);
+  EXPECT_EQ(entry1.stderr, entry2.stderr);
+  EXPECT_EQ(entry1.outputs, entry2.outputs);
+
+  // The failures expire in the cache on disk - so they aren't kept here.
+  const HandledHash failed_hash("failed hash"_l);
+  entry3.stderr = "some error"_l;
+  entry3.failed = true;
+  cache.Store(failed_hash, entry3);
+  EXPECT_FALSE(cache.Find(failed_hash, &entry4));
+
+  // The failure replaces the former success.
+  cache.Store(hash, entry3);
+  EXPECT_FALSE(cache.Find(hash, &entry4));
+  EXPECT_EQ(0u, cache.size());
+}
+
+TEST(MemoryCacheTest, FrequentEntriesAreAdmitted) {
+  const HandledHash hash1("hash1"_l), hash2("hash2"_l), hash3("hash3"_l);
+  FileCache::Entry entry1, entry2, entry3, entry4;
+  MemoryCache cache(40, 1);
+
+  auto Find = [&cache](const HandledHash& hash) {
+    FileCache::Entry entry;
+    return cache.Find(hash, &entry);
+  };
+
+  entry1.object = String(30, '1');
+  entry2.object = String(30, '2');
+  entry3.object = String(40, '3');
+
+  EXPECT_FALSE(Find(hash1));
+  EXPECT_FALSE(Find(hash1));
+  cache.Store(hash1, entry1);
+  EXPECT_EQ(35u, cache.size());
+
+  // The one-off entry doesn't evict the more frequent one.
+  EXPECT_FALSE(Find(hash2));
+  cache.Store(hash2, entry2);
+  EXPECT_TRUE(Find(hash1));
+  EXPECT_FALSE(Find(hash2));
+
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_FALSE(Find(hash2));
+  }
+  cache.Store(hash2, entry2);
+  ASSERT_TRUE(cache.Find(hash2, &entry4));
+  EXPECT_EQ(entry2.object, entry4.object);
+  EXPECT_FALSE(Find(hash1));
+  EXPECT_EQ(35u, cache.size());
+
+  // Too big entries are never stored.
+  cache.Store(hash3, entry3);
+  EXPECT_FALSE(Find(hash3));
+}
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -12,6 +12,8 @@
 
 #include <clang/Basic/Version.h>
 
+#include STL(random)
+
 #include <base/using_log.h>
 
 namespace dist_clang {
@@ -23,6 +25,12 @@ bool DoMain(int argc, const char* const argv[], Immutable socket_path,
             ui32 send_timeout_secs, ui32 read_min_bytes,
             const HashMap<String, String>& plugins, bool disabled,
             bool rewrite_includes) {
+  // The client's own span starts here - the daemon ends it on receipt.
+  const ui64 trace_start =
+      std::chrono::duration_cast<Microseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count();
+
   if (clang_path.empty() || disabled) {
     return true;
   }
@@ -98,10 +106,14 @@ bool DoMain(int argc, const char* const argv[], Immutable socket_path,
     major_version = CLANG_VERSION_STRING;
   }
 
+  std::random_device random_device;
+  std::uniform_int_distribution<ui64> trace_ids(1);
   for (const auto& command : commands) {
     UniquePtr<base::proto::Local> message(new base::proto::Local);
     message->set_user_id(getuid());
     message->set_current_dir(current_dir);
+    message->set_trace_id(trace_ids(random_device));
+    message->set_trace_start(trace_start);
 
     auto* flags = message->mutable_flags();
     if (!command->CanFillFlags()) {
@@ -85,10 +85,23 @@ bool ClangCommand::FillFlags(base::proto::Flags* flags,
                   other_list.emplace_back(index, ArgStringList()).second);
       flags->mutable_compiler()->add_plugins()->set_name(arg->getValue());
     } else if (arg->getOption().matches(OPT_emit_obj) ||
+               arg->getOption().matches(OPT_emit_llvm) ||
+               arg->getOption().matches(OPT_emit_llvm_bc) ||
                arg->getOption().matches(OPT_E) ||
                arg->getOption().matches(OPT_S) ||
                arg->getOption().matches(OPT_fsyntax_only)) {
       flags->set_action(arg->getSpelling());
+    } else if (arg->getOption().matches(OPT_emit_module)) {
+      // Explicit module build - the input is a module map.
+      flags->set_action(arg->getSpelling());
+    } else if (arg->getOption().matches(OPT_analyze)) {
+      // The HTML reports are whole directories - only a single plist file may
+      // be cached.
+      const auto output =
+          arg_list_.getLastArgValue(OPT_analyzer_output, "plist");
+      if (output.find("html") == llvm::StringRef::npos) {
+        flags->set_action(arg->getSpelling());
+      }
     } else if (arg->getOption().matches(OPT_dependency_file)) {
       flags->set_deps_file(arg->getValue());
     } else if (arg->getOption().matches(OPT_load)) {
@@ -103,6 +116,12 @@ bool ClangCommand::FillFlags(base::proto::Flags* flags,
       flags->set_language(arg->getValue());
     } else if (arg->getOption().matches(OPT_fsanitize_blacklist)) {
       flags->set_sanitize_blacklist(arg->getValue());
+    } else if (arg->getOption().matches(OPT_coverage_notes_file) &&
+               arg_list_.hasArg(OPT_femit_coverage_notes)) {
+      auto* output = flags->add_outputs();
+      output->set_name("gcno");
+      output->set_flag("-coverage-notes-file");
+      output->set_path(arg->getValue());
     }
 
     // Non-cacheable flags.
@@ -133,9 +152,20 @@ bool ClangCommand::FillFlags(base::proto::Flags* flags,
       //        type.
       arg->render(arg_list_,
                   non_cached_list.emplace_back(index, ArgStringList()).second);
+    } else if (arg->getOption().matches(OPT_fmodule_file)) {
+      flags->add_module_files(arg->getValue());
+
+      // FIXME: the same as above.
+      arg->render(arg_list_,
+                  non_cached_list.emplace_back(index, ArgStringList()).second);
+    } else if (arg->getOption().matches(OPT_fmodule_map_file)) {
+      // The explicitly built modules know everything from their module maps.
+      arg->render(arg_list_,
+                  non_cached_list.emplace_back(index, ArgStringList()).second);
     } else if (arg->getOption().matches(OPT_coverage_data_file) ||
                arg->getOption().matches(OPT_coverage_notes_file) ||
                arg->getOption().matches(OPT_fdebug_compilation_dir) ||
+               arg->getOption().matches(OPT_fdebug_prefix_map_EQ) ||
                arg->getOption().matches(OPT_ferror_limit) ||
                arg->getOption().matches(OPT_main_file_name) ||
                arg->getOption().matches(OPT_MF) ||
@@ -215,6 +245,13 @@ bool ClangCommand::FillFlags(base::proto::Flags* flags,
   }
   flags->set_rewrite_includes(rewrite_includes);
 
+  // Implicitly built modules come from the module cache, which is neither
+  // shipped to remotes nor a part of the hash - only explicit ones are safe.
+  if (arg_list_.hasArg(OPT_fmodules) &&
+      !arg_list_.hasArg(OPT_fno_implicit_modules)) {
+    flags->clear_action();
+  }
+
   for (const auto& arg_list : non_direct_list) {
     auto* new_arg = flags->add_non_direct();
     new_arg->set_index(arg_list.first);
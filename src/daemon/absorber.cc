@@ -5,14 +5,29 @@
 #include <base/logging.h>
 #include <base/process.h>
 #include <base/protobuf_utils.h>
+#include <base/string_utils.h>
 #include <base/temporary_dir.h>
 #include <net/connection.h>
+#include <net/end_point.h>
+#include <perf/counter.h>
+#include <perf/stat_reporter.h>
+#include <perf/stat_service.h>
+#include <perf/trace.pb.h>
+#include <perf/trace_reporter.h>
+#include <perf/trace_service.h>
 
 #include <base/using_log.h>
 
 using namespace std::placeholders;
 
 namespace dist_clang {
+
+using perf::proto::Metric;
+
+template <bool ReportByDefault = true>
+using Counter = perf::Counter<perf::StatReporter, ReportByDefault>;
+using Span = perf::Counter<perf::TraceReporter>;
+
 namespace daemon {
 
 namespace {
@@ -29,6 +44,43 @@ void AdjustFlags(proto::Remote* incoming) {
     plugin.clear_path();
   }
 }
+
+bool ReadOutputs(const base::proto::Flags& flags,
+                 cache::FileCache::Entry* entry, String* error) {
+  for (const auto& output : flags.outputs()) {
+    if (!base::File::Read(output.path(), &entry->outputs[output.name()],
+                          error)) {
+      *error = "Failed to read output " + output.name() + ": " + *error;
+      return false;
+    }
+  }
+  return true;
+}
+
+// PCH and PCM files are compiler-specific - so the version is a part of the
+// key.
+cache::string::HandledHash PCHCacheHash(const cache::string::Version& version,
+                                        const String& hash) {
+  using namespace cache::string;
+  return cache::FileCache::Hash(HandledSource(Immutable(hash)), {},
+                                CommandLine("-include-pch"_l), version);
+}
+
+// Shipped sources and headers aren't compiler-specific - the key has only the
+// hash of contents.
+cache::string::HandledHash PumpCacheHash(const String& hash) {
+  using namespace cache::string;
+  return cache::FileCache::Hash(HandledSource(Immutable(hash)), {},
+                                CommandLine(), Version());
+}
+
+// The emitter merges the spans of its task from the result.
+void SetTrace(ui64 trace_id, proto::Result* result) {
+  if (trace_id) {
+    base::Singleton<perf::TraceService>::Get().Dump(trace_id,
+                                                   result->mutable_trace());
+  }
+}
 }  // namespace
 
 Absorber::Absorber(const Configuration& conf) : CompilationDaemon(conf) {
@@ -39,6 +91,20 @@ Absorber::Absorber(const Configuration& conf) : CompilationDaemon(conf) {
   cache_tasks_ = std::make_unique<Queue>();
   tasks_ = std::make_unique<Queue>(conf.pool_capacity());
 
+  auto wait = [](Literal name, Metric::Name metric) {
+    return [name, metric](const Task& task, const Clock::duration& wait) {
+      base::Singleton<perf::StatService>::Get().Record(
+          metric, std::chrono::duration_cast<Milliseconds>(wait).count());
+
+      const auto now = Clock::now();
+      base::Singleton<perf::TraceService>::Get().Add(
+          name, std::get<MESSAGE>(task)->trace_id(), now - wait, now);
+    };
+  };
+  cache_tasks_->ObserveWait(
+      wait("Absorber cache queue"_l, Metric::CACHE_QUEUE_WAIT_TIME));
+  tasks_->ObserveWait(wait("Absorber queue"_l, Metric::LOCAL_QUEUE_WAIT_TIME));
+
   if (conf.has_cache() && !conf.cache().disabled()) {
     Worker worker = std::bind(&Absorber::DoCheckCache, this, _1);
     const auto threads_number = conf.cache().has_threads()
@@ -51,11 +117,20 @@ Absorber::Absorber(const Configuration& conf) : CompilationDaemon(conf) {
     workers_->AddWorker("Execute Worker"_l, worker,
                         conf.absorber().local().threads());
   }
+
+  const bool has_peers = conf.absorber().peers_size() > 0 ||
+                         conf.absorber().coordinators_size() > 0;
+  if (conf.has_cache() && !conf.cache().disabled() && has_peers) {
+    peer_workers_ = std::make_unique<base::WorkerPool>(true);
+    Worker worker = std::bind(&Absorber::DoExchangeDigests, this, _1);
+    peer_workers_->AddWorker("Digest Exchange Worker"_l, worker);
+  }
 }
 
 Absorber::~Absorber() {
   tasks_->Close();
   cache_tasks_->Close();
+  peer_workers_.reset();
   workers_.reset();
 }
 
@@ -76,9 +151,59 @@ bool Absorber::Initialize() {
                     "\"cache.direct\" will be ignored";
   }
 
+  if (conf->absorber().has_pch_cache() &&
+      !conf->absorber().pch_cache().disabled()) {
+    const auto& pch_cache = conf->absorber().pch_cache();
+    pch_cache_ = std::make_unique<cache::FileCache>(
+        pch_cache.path(), pch_cache.size(), pch_cache.snappy(),
+        pch_cache.store_index());
+    if (!pch_cache_->Run(pch_cache.clean_period())) {
+      pch_cache_.reset();
+    }
+  }
+
+  if (conf->absorber().has_pump_cache() &&
+      !conf->absorber().pump_cache().disabled()) {
+    const auto& pump_cache = conf->absorber().pump_cache();
+    pump_cache_ = std::make_unique<cache::FileCache>(
+        pump_cache.path(), pump_cache.size(), pump_cache.snappy(),
+        pump_cache.store_index());
+    if (!pump_cache_->Run(pump_cache.clean_period())) {
+      pump_cache_.reset();
+    }
+  }
+
   return CompilationDaemon::Initialize();
 }
 
+bool Absorber::Check(const Configuration& conf) const {
+  if (!CompilationDaemon::Check(conf)) {
+    return false;
+  }
+
+  if (!conf.has_absorber()) {
+    return false;
+  }
+
+  if (!conf.absorber().digest_interval()) {
+    LOG(ERROR) << "Interval for exchanging cache digests can't be zero";
+    return false;
+  }
+
+  if (!conf.absorber().peer_timeout()) {
+    LOG(ERROR) << "Timeout for fetching results from peers can't be zero";
+    return false;
+  }
+
+  if (conf.absorber().has_pch_cache() && conf.has_cache() &&
+      conf.absorber().pch_cache().path() == conf.cache().path()) {
+    LOG(ERROR) << "PCH cache can't share the path with the main cache";
+    return false;
+  }
+
+  return true;
+}
+
 bool Absorber::HandleNewMessage(net::ConnectionPtr connection,
                                 Universal message,
                                 const net::proto::Status& status) {
@@ -97,11 +222,22 @@ bool Absorber::HandleNewMessage(net::ConnectionPtr connection,
   if (message->HasExtension(proto::Remote::extension)) {
     Message execute(message->ReleaseExtension(proto::Remote::extension));
     DCHECK(!execute->flags().compiler().has_path());
-    if (execute->has_source()) {
+    if (!execute->has_source() && execute->has_handled_hash()) {
+      // Probe without a cache is always a miss.
+      if (!conf->has_cache() || conf->cache().disabled()) {
+        return ReportProbeMiss(connection, *execute);
+      }
+
+      cache_tasks_->Push(
+          Task{connection, std::move(execute), HandledHash(), Immutable(),
+               nullptr});
+      return true;
+    } else if (execute->has_source() || execute->files_size()) {
       // TODO(matthewtff): check several releases that handled hashes calculated
       // on emitters and on absorbers match. Then stop calculating hashes on
       // absorber and re-use hashes received from emitters to save cpu cycles.
-      Task task{connection, std::move(execute), HandledHash()};
+      Task task{connection, std::move(execute), HandledHash(), Immutable(),
+                nullptr};
       if (conf->has_cache() && !conf->cache().disabled()) {
         cache_tasks_->Push(std::move(task));
       } else if (!tasks_->Push(std::move(task))) {
@@ -115,10 +251,146 @@ bool Absorber::HandleNewMessage(net::ConnectionPtr connection,
     }
   }
 
+  if (message->HasExtension(proto::CacheRequest::extension)) {
+    UniquePtr<proto::CacheRequest> request(
+        message->ReleaseExtension(proto::CacheRequest::extension));
+    if (request->has_result()) {
+      net::proto::Status bad_message;
+      bad_message.set_code(net::proto::Status::BAD_MESSAGE);
+      bad_message.set_description("Absorber doesn't store results of others");
+      return connection->ReportStatus(bad_message);
+    }
+
+    if (!conf->has_cache() || conf->cache().disabled()) {
+      net::proto::Status miss;
+      miss.set_code(net::proto::Status::OK);
+      return connection->ReportStatus(miss);
+    }
+
+    // Lookup from a peer is a task without a message.
+    cache_tasks_->Push(Task{connection, Message(new proto::Remote),
+                            HandledHash(request->handled_hash()), Immutable(),
+                            nullptr});
+    return true;
+  }
+
+  if (message->HasExtension(perf::proto::TraceDump::extension)) {
+    return DumpTrace(connection,
+                     message->GetExtension(perf::proto::TraceDump::extension));
+  }
+
+  if (message->HasExtension(proto::CacheDigest::extension)) {
+    const auto digest = GetDigest();
+
+    auto reply = std::make_unique<proto::CacheDigest>();
+    reply->set_bloom(digest.Serialize());
+    reply->set_hashes(digest.hashes());
+    return connection->SendAsync(std::move(reply));
+  }
+
   NOTREACHED();
   return false;
 }
 
+void Absorber::AddToDigest(const cache::string::HandledHash& hash) {
+  UniqueLock lock(digest_mutex_);
+
+  if (digest_.count() >= kDigestCapacity) {
+    old_digest_ = std::move(digest_);
+    digest_ = cache::BloomFilter(kDigestSize, kDigestHashes);
+  }
+  digest_.Add(hash);
+}
+
+cache::BloomFilter Absorber::GetDigest() const {
+  UniqueLock lock(digest_mutex_);
+
+  cache::BloomFilter digest = digest_;
+  CHECK(digest.Merge(old_digest_));
+  return digest;
+}
+
+bool Absorber::SearchPeers(const cache::string::HandledHash& hash,
+                           cache::FileCache::Entry* entry) {
+  DCHECK(entry);
+
+  auto peers = this->peers();
+  if (!peers) {
+    return false;
+  }
+
+  const auto deadline =
+      Clock::now() + Seconds(conf()->absorber().peer_timeout());
+
+  // Count only lookups that really cost us something.
+  Counter<false> counter(Metric::PEER_CACHE_LOOKUP_TIME);
+  bool asked_peers = false;
+
+  for (const auto& peer : *peers) {
+    if (!peer.digest.MayContain(hash)) {
+      continue;
+    }
+
+    const auto now = Clock::now();
+    if (now >= deadline) {
+      LOG(CACHE_VERBOSE) << "Out of time to fetch " << hash.str
+                         << " from peers";
+      break;
+    }
+    counter.ReportOnDestroy(true);
+    asked_peers = true;
+
+    String error;
+    auto connection = Connect(peer.end_point, &error);
+    if (!connection) {
+      LOG(WARNING) << "Failed to connect to peer " << peer.end_point->Print()
+                   << ": " << error;
+      continue;
+    }
+
+    // Don't wait for the peer longer than the rest of the budget.
+    const ui32 timeout = std::chrono::ceil<Seconds>(deadline - now).count();
+    if (!connection->SendTimeout(timeout, &error) ||
+        !connection->ReadTimeout(timeout, &error)) {
+      LOG(WARNING) << "Failed to set timeouts for peer "
+                   << peer.end_point->Print() << ": " << error;
+      continue;
+    }
+
+    auto request = std::make_unique<proto::CacheRequest>();
+    request->set_handled_hash(hash.str);
+    if (!connection->SendSync(std::move(request))) {
+      continue;
+    }
+
+    auto reply = std::make_unique<net::proto::Universal>();
+    if (!connection->ReadSync(reply.get()) ||
+        !reply->HasExtension(proto::Result::extension)) {
+      continue;
+    }
+
+    auto* result = reply->MutableExtension(proto::Result::extension);
+    entry->object = result->release_obj();
+    if (result->has_deps()) {
+      entry->deps = result->release_deps();
+    }
+    GetOutputs(result, entry);
+    if (reply->HasExtension(net::proto::Status::extension)) {
+      const auto& status = reply->GetExtension(net::proto::Status::extension);
+      entry->stderr = Immutable(status.description());
+    }
+
+    STAT(PEER_CACHE_HIT);
+    return true;
+  }
+
+  if (asked_peers) {
+    STAT(PEER_CACHE_MISS);
+  }
+
+  return false;
+}
+
 cache::ExtraFiles Absorber::GetExtraFiles(const proto::Remote* message) {
   DCHECK(message);
 
@@ -129,6 +401,23 @@ cache::ExtraFiles Absorber::GetExtraFiles(const proto::Remote* message) {
                         Immutable::WrapString(message->sanitize_blacklist()));
   }
 
+  auto AddHashes = [&extra_files](cache::ExtraFileType type,
+                                  const auto& files) {
+    if (files.empty()) {
+      return;
+    }
+
+    List<String> hashes;
+    for (const auto& file : files) {
+      hashes.push_back(file.hash());
+    }
+    extra_files.emplace(type,
+                        base::JoinString<' '>(hashes.begin(), hashes.end()));
+  };
+
+  AddHashes(cache::INCLUDED_FILES, message->included_files());
+  AddHashes(cache::MODULE_FILES, message->module_files());
+
   return extra_files;
 }
 
@@ -156,6 +445,333 @@ bool Absorber::PrepareExtraFilesForCompiler(
   return true;
 }
 
+bool Absorber::PreprocessPumpSource(Task* task) {
+  using namespace cache::string;
+
+  DCHECK(task);
+  auto& connection = std::get<CONNECTION>(*task);
+  proto::Remote* incoming = std::get<MESSAGE>(*task).get();
+  DCHECK(incoming->files_size() && !incoming->has_source());
+  Span span("Preprocess"_l, incoming->trace_id());
+
+  net::proto::Status status;
+  auto ReportError = [&](net::proto::Status::Code code,
+                         const String& description) {
+    LOG(WARNING) << "Pump mode failed: " << description;
+    status.set_code(code);
+    status.set_description(description);
+    connection->ReportStatus(status);
+    return false;
+  };
+
+  const String& current_dir = incoming->current_dir();
+  if (current_dir.empty() || current_dir[0] != '/') {
+    return ReportError(net::proto::Status::BAD_MESSAGE,
+                       "Current directory isn't absolute: " + current_dir);
+  }
+
+  // Shipped files are kept in a separate cache by the hash of their contents -
+  // so they don't take the memory cache and the size of the main cache.
+  Vector<Immutable> contents;
+  auto missing = std::make_unique<proto::MissingFiles>();
+  for (auto& file : *incoming->mutable_files()) {
+    const auto& hash = file.hash();
+    if (hash.size() != 32 ||
+        hash.find_first_not_of("0123456789abcdef") != String::npos) {
+      return ReportError(net::proto::Status::BAD_MESSAGE,
+                         "Malformed hash of " + file.path());
+    }
+
+    cache::FileCache::Entry entry;
+    contents.emplace_back();
+    if (file.has_content()) {
+      contents.back() = Immutable(file.release_content());
+      if (base::Hexify(contents.back().Hash()) != hash) {
+        return ReportError(net::proto::Status::BAD_MESSAGE,
+                           "Contents don't match the hash of " + file.path());
+      }
+      if (pump_cache_) {
+        entry.object = contents.back();
+        pump_cache_->Store(PumpCacheHash(hash), entry);
+      }
+    } else if (pump_cache_ && pump_cache_->Find(PumpCacheHash(hash), &entry)) {
+      contents.back() = entry.object;
+    } else {
+      missing->add_hashes(hash);
+    }
+  }
+
+  if (missing->hashes_size()) {
+    connection->SendAsync(std::move(missing), ReadAfterSend());
+    return false;
+  }
+
+  // The virtual filesystem mirrors the paths on the emitter, and doesn't
+  // expose the real ones - so the output is the same as on the emitter.
+  auto Quote = [](String str) {
+    base::Replace(str, "'", "''");
+    return "'" + str + "'";
+  };
+
+  auto temp_dir = std::make_shared<base::TemporaryDir>();
+  String error;
+  String overlay = "{ 'version': 0, 'use-external-names': false, 'roots': [";
+  HashSet<String> shipped_files;
+  for (int i = 0; i < incoming->files_size(); ++i) {
+    const auto& path = incoming->files(i).path();
+    const Path real_path = temp_dir->path() / std::to_string(i);
+    if (!base::File::Write(real_path, contents[i], &error)) {
+      return ReportError(net::proto::Status::EXECUTION,
+                         "Failed to write " + real_path.string() + ": " +
+                             error);
+    }
+
+    const Path virtual_path =
+        Path(path).is_absolute() ? Path(path) : Path(current_dir) / path;
+    shipped_files.insert(path);
+    shipped_files.insert(virtual_path.string());
+    overlay += String(i ? "," : "") + " { 'type': 'file', 'name': " +
+               Quote(virtual_path.string()) + ", 'external-contents': " +
+               Quote(real_path.string()) + " }";
+  }
+  overlay += " ] }\n";
+
+  const Path overlay_path = temp_dir->path() / "overlay.yaml";
+  const Path deps_path = temp_dir->path() / "deps";
+  if (!base::File::Write(overlay_path, Immutable(std::move(overlay)),
+                         &error)) {
+    return ReportError(net::proto::Status::EXECUTION,
+                       "Failed to write " + overlay_path.string() + ": " +
+                           error);
+  }
+
+  auto AddVirtualFilesystem = [&](base::proto::Flags* flags) {
+    // Put the virtual filesystem after all other indexed flags.
+    auto* vfs_flags = flags->add_non_direct();
+    vfs_flags->set_index(std::numeric_limits<ui32>::max());
+    vfs_flags->add_values("-ivfsoverlay");
+    vfs_flags->add_values(overlay_path);
+    vfs_flags->add_values("-working-directory");
+    vfs_flags->add_values(current_dir);
+  };
+
+  if (IsModuleBuild(incoming->flags())) {
+    AddVirtualFilesystem(incoming->mutable_flags());
+
+    Vector<Pair<String, String>> inputs;
+    for (const auto& file : incoming->files()) {
+      inputs.emplace_back(file.path(), file.hash());
+    }
+    incoming->set_source(
+        GenerateModuleSource(current_dir, std::move(inputs)).str.string_copy());
+    std::get<VIRTUAL_FILES>(*task) = temp_dir;
+
+    return true;
+  }
+
+  base::proto::Flags pp_flags;
+  pp_flags.CopyFrom(incoming->flags());
+  pp_flags.clear_cc_only();
+  pp_flags.set_output("-");
+  pp_flags.set_action("-E");
+  pp_flags.set_deps_file(deps_path);
+  pp_flags.mutable_compiler()->clear_plugins();
+  pp_flags.clear_sanitize_blacklist();
+  pp_flags.clear_outputs();
+
+  AddVirtualFilesystem(&pp_flags);
+
+  if (!SetupCompiler(&pp_flags, &status)) {
+    connection->ReportStatus(status);
+    return false;
+  }
+
+  base::ProcessPtr process = CreateProcess(pp_flags);
+  if (!process->Run(conf()->absorber().run_timeout(), &error)) {
+    return ReportError(net::proto::Status::EXECUTION,
+                       process->stderr().empty() ? error : process->stderr());
+  }
+
+  // The headers from the direct cache of the emitter may be outdated - and
+  // anything not shipped comes from the real filesystem.
+  Immutable deps;
+  List<String> inputs;
+  if (!base::File::Read(deps_path, &deps, &error) ||
+      !ParseDeps(deps, inputs)) {
+    return ReportError(net::proto::Status::EXECUTION,
+                       "Failed to read deps: " + error);
+  }
+  for (const auto& input : inputs) {
+    if (!shipped_files.count(input)) {
+      return ReportError(net::proto::Status::EXECUTION,
+                         "File isn't shipped: " + input);
+    }
+  }
+
+  incoming->set_source(process->stdout());
+  std::get<DEPS>(*task) = deps;
+
+  // Include paths can't affect the preprocessed source.
+  incoming->mutable_flags()->clear_non_cached();
+
+  return true;
+}
+
+bool Absorber::ReadModuleDeps(Task* task, String* error) {
+  DCHECK(task);
+  DCHECK(error);
+  const auto& virtual_files = std::get<VIRTUAL_FILES>(*task);
+  DCHECK(virtual_files);
+  const proto::Remote* incoming = std::get<MESSAGE>(*task).get();
+
+  Immutable deps;
+  List<String> inputs;
+  if (!base::File::Read(virtual_files->path() / "deps", &deps, error) ||
+      !ParseDeps(deps, inputs)) {
+    *error = "Failed to read deps of module: " + *error;
+    return false;
+  }
+
+  HashSet<String> shipped_files;
+  for (const auto& file : incoming->files()) {
+    shipped_files.insert(file.path());
+    shipped_files.insert(Path(file.path()).is_absolute()
+                             ? file.path()
+                             : (Path(incoming->current_dir()) / file.path())
+                                   .string());
+  }
+  for (const auto& input : inputs) {
+    if (!shipped_files.count(input)) {
+      *error = "File isn't shipped: " + input;
+      return false;
+    }
+  }
+
+  std::get<DEPS>(*task) = deps;
+  return true;
+}
+
+bool Absorber::PrepareIncludedFiles(Task* task, const Path& temp_dir) {
+  using namespace cache::string;
+
+  DCHECK(task);
+  auto& connection = std::get<CONNECTION>(*task);
+  proto::Remote* incoming = std::get<MESSAGE>(*task).get();
+  DCHECK(incoming->included_files_size() || incoming->module_files_size());
+
+  auto ReportError = [&](net::proto::Status::Code code,
+                         const String& description) {
+    LOG(WARNING) << "Failed to prepare PCH or PCM files: " << description;
+    net::proto::Status status;
+    status.set_code(code);
+    status.set_description(description);
+    connection->ReportStatus(status);
+    return false;
+  };
+
+  const Version version(incoming->flags().compiler().version());
+
+  // Both kinds of files are rendered the same way after the contents.
+  struct IncludedFile {
+    String name;
+    String flag;
+    Immutable contents;
+  };
+
+  Vector<IncludedFile> files;
+  auto missing = std::make_unique<proto::MissingFiles>();
+  auto AddFiles = [&](google::protobuf::RepeatedPtrField<proto::File>* fields,
+                      const String& name, const String& flag) {
+    for (auto& file : *fields) {
+      const auto& hash = file.hash();
+      if (hash.size() != 32 ||
+          hash.find_first_not_of("0123456789abcdef") != String::npos) {
+        return ReportError(net::proto::Status::BAD_MESSAGE,
+                           "Malformed hash of " + file.path());
+      }
+
+      cache::FileCache::Entry entry;
+      files.push_back({name + std::to_string(files.size()), flag, {}});
+      auto& contents = files.back().contents;
+      if (file.has_content()) {
+        contents = Immutable(file.release_content());
+        if (base::Hexify(contents.Hash()) != hash) {
+          return ReportError(
+              net::proto::Status::BAD_MESSAGE,
+              "Contents don't match the hash of " + file.path());
+        }
+        if (pch_cache_) {
+          entry.object = contents;
+          pch_cache_->Store(PCHCacheHash(version, hash), entry);
+        }
+      } else if (pch_cache_ &&
+                 pch_cache_->Find(PCHCacheHash(version, hash), &entry)) {
+        contents = entry.object;
+      } else {
+        missing->add_hashes(hash);
+      }
+    }
+    return true;
+  };
+
+  if (!AddFiles(incoming->mutable_included_files(), "pch", "-include-pch") ||
+      !AddFiles(incoming->mutable_module_files(), "module", "-fmodule-file=")) {
+    return false;
+  }
+
+  if (missing->hashes_size()) {
+    connection->SendAsync(std::move(missing), ReadAfterSend());
+    return false;
+  }
+
+  // The PCH and PCM files know about the headers on the emitter only - so
+  // don't let the compiler look for them.
+  auto* pch_flags = incoming->mutable_flags()->add_non_cached();
+  pch_flags->set_index(std::numeric_limits<ui32>::max());
+  pch_flags->add_values("-fno-validate-pch");
+
+  String error;
+  for (const auto& file : files) {
+    const Path path = temp_dir / file.name;
+    if (!base::File::Write(path, file.contents, &error)) {
+      return ReportError(net::proto::Status::EXECUTION,
+                         "Failed to write " + path.string() + ": " + error);
+    }
+
+    // The joined flags take the path right after the "=".
+    if (file.flag.back() == '=') {
+      pch_flags->add_values(file.flag + path.string());
+    } else {
+      pch_flags->add_values(file.flag);
+      pch_flags->add_values(path.string());
+    }
+  }
+
+  return true;
+}
+
+bool Absorber::ReportProbeMiss(net::ConnectionPtr connection,
+                               const proto::Remote& probe) {
+  Universal reply(new net::proto::Universal);
+  reply->MutableExtension(net::proto::Status::extension)
+      ->set_code(net::proto::Status::OK);
+
+  if (probe.included_files_size() || probe.module_files_size()) {
+    const cache::string::Version version(probe.flags().compiler().version());
+    auto* missing = reply->MutableExtension(proto::MissingFiles::extension);
+    for (const auto* files : {&probe.included_files(), &probe.module_files()}) {
+      for (const auto& file : *files) {
+        if (!pch_cache_ ||
+            !pch_cache_->Contains(PCHCacheHash(version, file.hash()))) {
+          missing->add_hashes(file.hash());
+        }
+      }
+    }
+  }
+
+  return connection->SendAsync(std::move(reply), ReadAfterSend());
+}
+
 void Absorber::DoCheckCache(const base::WorkerPool& pool) {
   using namespace cache::string;
 
@@ -170,6 +786,55 @@ void Absorber::DoCheckCache(const base::WorkerPool& pool) {
     }
 
     proto::Remote* incoming = std::get<MESSAGE>(*task).get();
+
+    if (incoming->files_size() && !PreprocessPumpSource(&*task)) {
+      continue;
+    }
+
+    if (!incoming->has_source()) {
+      // Trust the hash of a probe, since there is no source to check it.
+      // Lookups from peers have the hash in the task already.
+      const bool is_probe = incoming->has_handled_hash();
+      const HandledHash remote_hash =
+          is_probe ? HandledHash(Immutable(incoming->release_handled_hash()))
+                   : std::get<HANDLED_HASH>(*task);
+
+      cache::FileCache::Entry entry;
+      Span lookup_span("Cache lookup"_l, incoming->trace_id());
+      const bool found = SearchSimpleCache(remote_hash, &entry);
+      lookup_span.Report();
+      if (found) {
+        AddToDigest(remote_hash);
+
+        Universal outgoing(new net::proto::Universal);
+
+        auto* result = outgoing->MutableExtension(proto::Result::extension);
+        result->set_obj(entry.object);
+        result->set_from_cache(true);
+        if (!entry.deps.empty()) {
+          result->set_deps(entry.deps.string_copy());
+        }
+        SetOutputs(entry, result);
+        SetTrace(incoming->trace_id(), result);
+
+        auto status = outgoing->MutableExtension(net::proto::Status::extension);
+        status->set_code(net::proto::Status::OK);
+        status->set_description(entry.stderr);
+
+        std::get<CONNECTION>(*task)->SendAsync(std::move(outgoing));
+      } else {
+        // The emitter uploads a source after a probe miss.
+        if (is_probe) {
+          ReportProbeMiss(std::get<CONNECTION>(*task), *incoming);
+        } else {
+          net::proto::Status miss;
+          miss.set_code(net::proto::Status::OK);
+          std::get<CONNECTION>(*task)->ReportStatus(miss);
+        }
+      }
+      continue;
+    }
+
     auto source = Immutable::WrapString(incoming->source());
     auto extra_files = GetExtraFiles(incoming);
 
@@ -180,17 +845,37 @@ void Absorber::DoCheckCache(const base::WorkerPool& pool) {
         GenerateHash(incoming->flags(), HandledSource(source), extra_files);
 
     cache::FileCache::Entry entry;
-    if (SearchSimpleCache(local_hash, &entry)) {
+    Span lookup_span("Cache lookup"_l, incoming->trace_id());
+    bool found = SearchSimpleCache(local_hash, &entry);
+    if (!found && SearchPeers(local_hash, &entry)) {
+      UpdateSimpleCache(local_hash, entry);
+      found = true;
+    }
+    lookup_span.Report();
+
+    if (found) {
+      AddToDigest(local_hash);
+
       Universal outgoing(new net::proto::Universal);
 
       auto* result = outgoing->MutableExtension(proto::Result::extension);
 
       result->set_obj(entry.object);
       result->set_from_cache(true);
+      SetOutputs(entry, result);
       if (incoming->has_handled_hash()) {
         auto remote_hash = Immutable::WrapString(incoming->handled_hash());
         result->set_hash_match(HandledHash(remote_hash) == local_hash);
       }
+      if (incoming->files_size()) {
+        // Modules aren't preprocessed - their deps come from the cache.
+        Immutable deps = std::get<VIRTUAL_FILES>(*task)
+                             ? entry.deps
+                             : std::get<DEPS>(*task);
+        result->set_handled_hash(local_hash.str.string_copy());
+        result->set_deps(deps.string_copy());
+      }
+      SetTrace(incoming->trace_id(), result);
 
       auto status = outgoing->MutableExtension(net::proto::Status::extension);
       status->set_code(net::proto::Status::OK);
@@ -221,6 +906,22 @@ void Absorber::DoExecute(const base::WorkerPool& pool) {
     }
 
     proto::Remote* incoming = std::get<Message>(*task).get();
+    if (incoming->files_size() && !incoming->has_source() &&
+        !PreprocessPumpSource(&*task)) {
+      continue;
+    }
+
+    // Module maps can't be preprocessed - so modules are built only in pump
+    // mode, right in the virtual filesystem.
+    const auto& virtual_files = std::get<VIRTUAL_FILES>(*task);
+    if (IsModuleBuild(incoming->flags()) && !virtual_files) {
+      net::proto::Status status;
+      status.set_code(net::proto::Status::BAD_MESSAGE);
+      status.set_description("Modules are built only in pump mode");
+      std::get<CONNECTION>(*task)->ReportStatus(status);
+      continue;
+    }
+
     auto source = Immutable::WrapString(incoming->source());
     auto extra_files = GetExtraFiles(incoming);
     AdjustFlags(incoming);
@@ -230,11 +931,20 @@ void Absorber::DoExecute(const base::WorkerPool& pool) {
           GenerateHash(incoming->flags(), HandledSource(source), extra_files);
     }
 
+    // The module map is the first shipped file - the emitter puts it there.
+    if (virtual_files) {
+      incoming->mutable_flags()->set_input(incoming->files(0).path());
+      incoming->mutable_flags()->set_deps_file(
+          (virtual_files->path() / "deps").string());
+    }
+
     const bool preprocessed_with_rewrite_includes =
         incoming->flags().has_rewrite_includes() &&
         incoming->flags().rewrite_includes();
 
-    if (!preprocessed_with_rewrite_includes) {
+    // The language of a PCH or PCM file has to match the one of the source.
+    if (!preprocessed_with_rewrite_includes && !virtual_files &&
+        !incoming->included_files_size() && !incoming->module_files_size()) {
       // Optimize compilation for preprocessed code for some languages, but only
       // if it was fully preprocessed (without frewrite-includes flag enabled).
       if (incoming->flags().has_language()) {
@@ -261,14 +971,34 @@ void Absorber::DoExecute(const base::WorkerPool& pool) {
       std::get<CONNECTION>(*task)->ReportStatus(status);
       continue;
     }
+    if ((incoming->included_files_size() || incoming->module_files_size()) &&
+        !PrepareIncludedFiles(&*task, temp_dir)) {
+      continue;
+    }
+
+    // The extra outputs can't go to stdout - write them to the temporary
+    // directory instead of the paths on the emitter.
+    auto& outputs = *incoming->mutable_flags()->mutable_outputs();
+    for (int i = 0; i < outputs.size(); ++i) {
+      const auto path = temp_dir.path() / ("output" + std::to_string(i));
+      outputs.Mutable(i)->set_path(path.string());
+    }
 
     Universal outgoing(new net::proto::Universal);
+    cache::FileCache::Entry entry;
 
     // Pipe the input file to the compiler and read output file from the
     // compiler's stdout.
     String error;
     base::ProcessPtr process = CreateProcess(incoming->flags());
-    if (!process->Run(conf()->absorber().run_timeout(), source, &error)) {
+    const auto run_start = Clock::now();
+    Span compile_span("Compile"_l, incoming->trace_id());
+    const bool ran =
+        virtual_files
+            ? process->Run(conf()->absorber().run_timeout(), &error)
+            : process->Run(conf()->absorber().run_timeout(), source, &error);
+    compile_span.Report();
+    if (!ran) {
       status.set_code(net::proto::Status::EXECUTION);
       if (!process->stderr().empty()) {
         status.set_description(process->stderr());
@@ -289,6 +1019,11 @@ void Absorber::DoExecute(const base::WorkerPool& pool) {
       // We lose atomicity, but the WARNING level will be less verbose.
       LOG(VERBOSE) << static_cast<const google::protobuf::Message&>(
           incoming->flags());
+    } else if (!ReadOutputs(incoming->flags(), &entry, &error) ||
+               (virtual_files && !ReadModuleDeps(&*task, &error))) {
+      status.set_code(net::proto::Status::EXECUTION);
+      status.set_description(error);
+      LOG(WARNING) << error;
     } else {
       status.set_code(net::proto::Status::OK);
       status.set_description(process->stderr());
@@ -297,26 +1032,164 @@ void Absorber::DoExecute(const base::WorkerPool& pool) {
       auto* result = outgoing->MutableExtension(proto::Result::extension);
       result->set_obj(process->stdout());
       result->set_from_cache(false);
+      result->set_compilation_time(
+          std::chrono::duration_cast<Milliseconds>(Clock::now() - run_start)
+              .count());
+      SetOutputs(entry, result);
       if (incoming->has_handled_hash()) {
         auto remote_hash = Immutable::WrapString(incoming->handled_hash());
         result->set_hash_match(HandledHash(remote_hash) == local_hash);
       }
+      if (incoming->files_size()) {
+        result->set_handled_hash(local_hash.str.string_copy());
+        result->set_deps(std::get<DEPS>(*task).string_copy());
+      }
     }
 
     outgoing->MutableExtension(net::proto::Status::extension)->CopyFrom(status);
 
     if (status.code() == net::proto::Status::OK) {
-      cache::FileCache::Entry entry;
-
       entry.object = process->stdout();
       entry.stderr = Immutable(status.description());
 
+      // Nothing but the build gives the deps of a module - keep them for hits.
+      // The deps of other pump tasks go to the probes and peers with the hits.
+      if (incoming->files_size()) {
+        entry.deps = std::get<DEPS>(*task);
+      }
+
+      Span store_span("Cache store"_l, incoming->trace_id());
       UpdateSimpleCache(local_hash, entry);
+      AddToDigest(local_hash);
+      store_span.Report();
+
+      SetTrace(incoming->trace_id(),
+               outgoing->MutableExtension(proto::Result::extension));
     }
 
     std::get<CONNECTION>(*task)->SendAsync(std::move(outgoing));
   }
 }
 
+bool Absorber::GetMembersFromCoordinators(const Configuration& conf,
+                                          List<proto::Host>* members) {
+  DCHECK(members);
+
+  for (const auto& coordinator : conf.absorber().coordinators()) {
+    if (coordinator.disabled()) {
+      continue;
+    }
+
+    auto optional = resolver_->Resolve(coordinator.host(), coordinator.port(),
+                                       coordinator.ipv6());
+    DCHECK(optional);
+    optional->Wait();
+    auto end_point = optional->GetValue();
+    if (!end_point) {
+      continue;
+    }
+
+    String error;
+    auto connection = Connect(end_point, &error);
+    if (!connection) {
+      LOG(WARNING) << "Failed to connect to " << end_point->Print() << ": "
+                   << error;
+      continue;
+    }
+
+    // Coordinators reply with the configuration for emitters - and all
+    // absorbers are the remotes there.
+    if (!connection->SendSync(std::make_unique<Configuration>())) {
+      continue;
+    }
+
+    auto reply = std::make_unique<net::proto::Universal>();
+    if (!connection->ReadSync(reply.get()) ||
+        !reply->HasExtension(Configuration::extension)) {
+      LOG(WARNING) << "Failed to get members from " << end_point->Print();
+      continue;
+    }
+
+    const auto& remotes =
+        reply->GetExtension(Configuration::extension).emitter().remotes();
+    members->insert(members->end(), remotes.begin(), remotes.end());
+    return true;
+  }
+
+  return false;
+}
+
+void Absorber::DoExchangeDigests(const base::WorkerPool& pool) {
+  do {
+    auto conf = this->conf();
+    const auto& local = conf->absorber().local();
+
+    List<proto::Host> members(conf->absorber().peers().begin(),
+                              conf->absorber().peers().end());
+    if (conf->absorber().coordinators_size() &&
+        !GetMembersFromCoordinators(*conf, &members)) {
+      LOG(WARNING) << "Failed to get members from coordinators";
+    }
+
+    auto new_peers = std::make_shared<Peers>();
+    HashSet<String> visited_members;
+    for (const auto& member : members) {
+      const String name = member.host() + ":" + std::to_string(member.port());
+      if (member.disabled() || !visited_members.insert(name).second ||
+          (member.host() == local.host() && member.port() == local.port())) {
+        continue;
+      }
+
+      auto optional =
+          resolver_->Resolve(member.host(), member.port(), member.ipv6());
+      DCHECK(optional);
+      optional->Wait();
+      Peer peer{optional->GetValue(), cache::BloomFilter()};
+      if (!peer.end_point) {
+        continue;
+      }
+
+      // The absorber usually listens on a wildcard address, so it may be
+      // named differently in the list of members.
+      if (member.port() == local.port() && peer.end_point->IsLocal()) {
+        continue;
+      }
+
+      String error;
+      auto connection = Connect(peer.end_point, &error);
+      if (!connection) {
+        LOG(WARNING) << "Failed to connect to peer " << name << ": " << error;
+        continue;
+      }
+
+      if (!connection->SendSync(std::make_unique<proto::CacheDigest>())) {
+        continue;
+      }
+
+      auto reply = std::make_unique<net::proto::Universal>();
+      if (!connection->ReadSync(reply.get()) ||
+          !reply->HasExtension(proto::CacheDigest::extension)) {
+        LOG(WARNING) << "Failed to get cache digest from peer " << name;
+        continue;
+      }
+
+      const auto& digest = reply->GetExtension(proto::CacheDigest::extension);
+      if (!peer.digest.Parse(digest.bloom(), digest.hashes())) {
+        LOG(WARNING) << "Got malformed cache digest from peer " << name;
+        continue;
+      }
+
+      // Don't bother peers with an empty cache.
+      if (!peer.digest.empty()) {
+        new_peers->push_back(std::move(peer));
+      }
+    }
+
+    UniqueLock lock(peers_mutex_);
+    peers_ = new_peers;
+  } while (!pool.WaitUntilShutdown(
+      Seconds(conf()->absorber().digest_interval())));
+}
+
 }  // namespace daemon
 }  // namespace dist_clang
@@ -1,11 +1,16 @@
 #pragma once
 
 #include <base/locked_queue.h>
+#include <base/temporary_dir.h>
 #include <base/worker_pool.h>
+#include <cache/bloom_filter.h>
 #include <daemon/compilation_daemon.h>
 
+#include <third_party/gtest/exported/include/gtest/gtest_prod.h>
+
 namespace dist_clang {
 namespace daemon {
+FORWARD_TEST(AbsorberTest, FetchFromPeer);
 
 class Absorber : public CompilationDaemon {
  public:
@@ -14,18 +19,46 @@ class Absorber : public CompilationDaemon {
 
   bool Initialize() override;
 
+ protected:
+  bool Check(const Configuration& conf) const override;
+
  private:
+  FRIEND_TEST(daemon::AbsorberTest, FetchFromPeer);
+
   enum TaskIndex {
     CONNECTION = 0,
     MESSAGE = 1,
     HANDLED_HASH = 2,
+
+    DEPS = 3,
+    // Deps of a source preprocessed in pump mode - to return to the emitter.
+
+    VIRTUAL_FILES = 4,
+    // Shipped files of a module built in pump mode - they have to outlive the
+    // compilation.
   };
 
   using Message = UniquePtr<proto::Remote>;
-  using Task = Tuple<net::ConnectionPtr, Message, cache::string::HandledHash>;
+  using Task = Tuple<net::ConnectionPtr, Message, cache::string::HandledHash,
+                     Immutable, SharedPtr<base::TemporaryDir>>;
   using Queue = base::LockedQueue<Task>;
   using Optional = Queue::Optional;
 
+  struct Peer {
+    net::EndPointPtr end_point;
+    cache::BloomFilter digest;
+  };
+  using Peers = Vector<Peer>;
+
+  // Digest of the local cache consists of two generations: the current one
+  // is replaced when it gets full, so that evicted entries don't stay there
+  // forever.
+  enum : ui32 {
+    kDigestSize = 1u << 17,  // in bytes.
+    kDigestHashes = 4u,
+    kDigestCapacity = 1u << 16,
+  };
+
   bool HandleNewMessage(net::ConnectionPtr connection, Universal message,
                         const net::proto::Status& status) override;
 
@@ -36,11 +69,60 @@ class Absorber : public CompilationDaemon {
                                     base::proto::Flags* flags,
                                     net::proto::Status* status);
 
+  // Preprocesses the source of a pump mode task in a virtual filesystem made of
+  // the shipped files. Asks the emitter for the files missing in the cache, or
+  // reports an error - and returns |false| in both cases. Modules aren't
+  // preprocessed: the virtual filesystem is kept for their build.
+  bool PreprocessPumpSource(Task* task);
+
+  // Reads the deps of a module built in pump mode, and checks that it doesn't
+  // depend on anything besides the shipped files.
+  bool ReadModuleDeps(Task* task, String* error);
+
+  // Puts the shipped PCH and PCM files into the |temp_dir| and adds them to the
+  // flags. Asks the emitter for the files missing in the PCH cache, or reports
+  // an error - and returns |false| in both cases.
+  bool PrepareIncludedFiles(Task* task, const Path& temp_dir);
+
+  // Replies to a probe miss and waits for the full task. Lists the PCH and PCM
+  // files of the |probe|, which are missing in the PCH cache - so the emitter
+  // uploads them together with the source.
+  bool ReportProbeMiss(net::ConnectionPtr connection,
+                       const proto::Remote& probe);
+
+  // Remembers that the local cache has an entry for the |hash|.
+  void AddToDigest(const cache::string::HandledHash& hash) THREAD_SAFE;
+  cache::BloomFilter GetDigest() const THREAD_SAFE;
+
+  // Fetches the cached result from the first peer, which may have it, unless
+  // the |peer_timeout| expires.
+  bool SearchPeers(const cache::string::HandledHash& hash,
+                   cache::FileCache::Entry* entry) THREAD_SAFE;
+
+  // Gets the list of all absorbers from coordinators - including this one.
+  bool GetMembersFromCoordinators(const Configuration& conf,
+                                  List<proto::Host>* members);
+
   void DoCheckCache(const base::WorkerPool& pool);
   void DoExecute(const base::WorkerPool& pool);
+  void DoExchangeDigests(const base::WorkerPool& pool);
+
+  inline SharedPtr<const Peers> peers() const THREAD_SAFE {
+    UniqueLock lock(peers_mutex_);
+    return peers_;
+  }
+
+  UniquePtr<cache::FileCache> pch_cache_, pump_cache_;
 
   UniquePtr<Queue> tasks_, cache_tasks_;
-  UniquePtr<base::WorkerPool> workers_;
+  UniquePtr<base::WorkerPool> workers_, peer_workers_;
+
+  mutable Mutex digest_mutex_;
+  cache::BloomFilter digest_{kDigestSize, kDigestHashes};
+  cache::BloomFilter old_digest_{kDigestSize, kDigestHashes};
+
+  mutable Mutex peers_mutex_;
+  SharedPtr<const Peers> peers_;
 };
 
 }  // namespace daemon
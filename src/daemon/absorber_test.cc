@@ -1,5 +1,8 @@
 #include <daemon/absorber.h>
 
+#include <base/file/file.h>
+#include <base/file_utils.h>
+#include <base/string_utils.h>
 #include <base/temporary_dir.h>
 #include <daemon/common_daemon_test.h>
 
@@ -688,6 +691,87 @@ TEST_F(AbsorberTest, SuccessfulCompilationWithBlacklist) {
       << "Daemon must not store references to the connection";
 }
 
+TEST_F(AbsorberTest, SuccessfulCompilationWithOutputs) {
+  const String expected_host = "fake_host";
+  const ui16 expected_port = 12345;
+  const net::proto::Status::Code expected_code = net::proto::Status::OK;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const String emitter_path = "/emitter/test.gcno";
+  const auto notes = "fake_coverage_notes"_l;
+
+  conf.mutable_absorber()->mutable_local()->set_host(expected_host);
+  conf.mutable_absorber()->mutable_local()->set_port(expected_port);
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  listen_callback = [&](const String& host, ui16 port, String*) {
+    EXPECT_EQ(expected_host, host);
+    EXPECT_EQ(expected_port, port);
+    return true;
+  };
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(expected_code, status.code()) << status.description();
+
+      ASSERT_TRUE(message.HasExtension(proto::Result::extension));
+      const auto& result = message.GetExtension(proto::Result::extension);
+      ASSERT_EQ(1, result.outputs_size());
+      EXPECT_EQ("gcno", result.outputs(0).name());
+      EXPECT_EQ(notes, result.outputs(0).content());
+    });
+    return true;
+  };
+  run_callback = [&](base::TestProcess* process) {
+    // The output goes to a temporary path instead of the one on the emitter.
+    bool found = false;
+    for (auto arg = process->args_.begin(); arg != process->args_.end();
+         ++arg) {
+      if (*arg == "-coverage-notes-file"_l && ++arg != process->args_.end()) {
+        EXPECT_NE(emitter_path, arg->string_copy());
+        EXPECT_TRUE(base::File::Write(arg->string_copy(), notes));
+        found = true;
+        break;
+      }
+    }
+    EXPECT_TRUE(found);
+  };
+
+  absorber.reset(new Absorber(conf));
+  ASSERT_TRUE(absorber->Initialize());
+
+  auto connection = test_service->TriggerListen(expected_host, expected_port);
+  {
+    auto message(CreateMessage("fake_source"_l, "fake_action"_l,
+                               compiler_version));
+
+    auto* output = message->MutableExtension(proto::Remote::extension)
+                       ->mutable_flags()
+                       ->add_outputs();
+    output->set_name("gcno");
+    output->set_flag("-coverage-notes-file");
+    output->set_path(emitter_path);
+
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection);
+    EXPECT_TRUE(
+        test_connection->TriggerReadAsync(std::move(message), StatusOK()));
+    absorber.reset();
+  }
+
+  EXPECT_EQ(1u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(1u, connect_count);
+  EXPECT_EQ(1u, connections_created);
+  EXPECT_EQ(1u, read_count);
+  EXPECT_EQ(1u, send_count);
+  EXPECT_EQ(1, connection.use_count())
+      << "Daemon must not store references to the connection";
+}
+
 TEST_F(AbsorberTest, FailedCompilation) {
   const String expected_host = "fake_host";
   const ui16 expected_port = 12345;
@@ -845,6 +929,985 @@ TEST_F(AbsorberTest, StoreLocalCacheWithoutBlacklist) {
   // TODO: check with deps file.
 }
 
+TEST_F(AbsorberTest, ProbeBeforeUpload) {
+  const base::TemporaryDir temp_dir;
+  const String expected_host = "fake_host";
+  const ui16 expected_port = 12345;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const auto object_code = "fake_object_code"_l;
+  const String source1 = "fake_source1";
+  const String source2 = "fake_source2";
+  const auto action = "fake_action"_l;
+
+  conf.mutable_absorber()->mutable_local()->set_host(expected_host);
+  conf.mutable_absorber()->mutable_local()->set_port(expected_port);
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_direct(false);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  listen_callback = [&](const String& host, ui16 port, String*) {
+    EXPECT_EQ(expected_host, host);
+    EXPECT_EQ(expected_port, port);
+    return !::testing::Test::HasNonfatalFailure();
+  };
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    // The absorber waits for the rest of the task after replying.
+    connection->CompleteAsyncSends();
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(net::proto::Status::OK, status.code()) << status.description();
+
+      if (send_count == 3) {
+        // Probe miss.
+        EXPECT_FALSE(message.HasExtension(proto::Result::extension));
+      } else {
+        EXPECT_TRUE(message.HasExtension(proto::Result::extension));
+        const auto& ext = message.GetExtension(proto::Result::extension);
+        EXPECT_EQ(String(object_code), ext.obj());
+        // Probe hit comes from cache, the rest are compiled.
+        EXPECT_EQ(send_count == 2, ext.from_cache());
+      }
+
+      send_condition.notify_all();
+    });
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    process->stdout_ = object_code;
+  };
+
+  auto CreateProbe = [&](const String& source) {
+    auto message(CreateMessage(source, action, compiler_version));
+    auto* extension = message->MutableExtension(proto::Remote::extension);
+    const auto hash = CompilationDaemon::GenerateHash(
+        extension->flags(), cache::string::HandledSource(Immutable(source)),
+        cache::ExtraFiles{});
+    extension->clear_source();
+    extension->set_handled_hash(hash.str);
+    return message;
+  };
+
+  absorber.reset(new Absorber(conf));
+  ASSERT_TRUE(absorber->Initialize());
+
+  auto connection1 = test_service->TriggerListen(expected_host, expected_port);
+  {
+    auto message(CreateMessage(source1, action, compiler_version));
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection1);
+    EXPECT_TRUE(
+        test_connection->TriggerReadAsync(std::move(message), StatusOK()));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 1; }));
+  }
+
+  auto connection2 = test_service->TriggerListen(expected_host, expected_port);
+  {
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection2);
+    EXPECT_TRUE(
+        test_connection->TriggerReadAsync(CreateProbe(source1), StatusOK()));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 2; }));
+  }
+
+  auto connection3 = test_service->TriggerListen(expected_host, expected_port);
+  {
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection3);
+    EXPECT_TRUE(
+        test_connection->TriggerReadAsync(CreateProbe(source2), StatusOK()));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 3; }));
+
+    // Absorber waits for the source on the same connection after a miss.
+    auto message(CreateMessage(source2, action, compiler_version));
+    EXPECT_TRUE(
+        test_connection->TriggerReadAsync(std::move(message), StatusOK()));
+
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 4; }));
+  }
+
+  absorber.reset();
+
+  EXPECT_EQ(2u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(3u, connect_count);
+  EXPECT_EQ(3u, connections_created);
+  EXPECT_EQ(4u, read_count);
+  EXPECT_EQ(4u, send_count);
+  EXPECT_EQ(1, connection1.use_count())
+      << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection2.use_count())
+      << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection3.use_count())
+      << "Daemon must not store references to the connection";
+}
+
+TEST_F(AbsorberTest, PumpMode) {
+  const base::TemporaryDir temp_dir, pump_dir;
+  const String expected_host = "fake_host";
+  const ui16 expected_port = 12345;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const auto object_code = "fake_object_code"_l;
+  const String current_dir = "/fake/dir";
+  const String source = "#include \"a.h\"";
+  const String header = "int a;";
+  const String preprocessed_source = "int a;";
+  const String deps = "test.o: test.cc include/a.h";
+  const auto action = "fake_action"_l;
+  String extra_deps;
+
+  conf.mutable_absorber()->mutable_local()->set_host(expected_host);
+  conf.mutable_absorber()->mutable_local()->set_port(expected_port);
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_direct(false);
+  conf.mutable_cache()->set_clean_period(1);
+  conf.mutable_absorber()->mutable_pump_cache()->set_path(pump_dir);
+  conf.mutable_absorber()->mutable_pump_cache()->set_clean_period(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  listen_callback = [&](const String& host, ui16 port, String*) {
+    EXPECT_EQ(expected_host, host);
+    EXPECT_EQ(expected_port, port);
+    return !::testing::Test::HasNonfatalFailure();
+  };
+
+  const auto header_hash = base::Hexify(Immutable(header).Hash());
+  const auto handled_hash = CompilationDaemon::GenerateHash(
+      CreateMessage(source, action, compiler_version)
+          ->GetExtension(proto::Remote::extension)
+          .flags(),
+      cache::string::HandledSource(Immutable(preprocessed_source)),
+      cache::ExtraFiles{});
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    // The absorber waits for the rest of the task after replying.
+    connection->CompleteAsyncSends();
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      if (send_count == 1) {
+        // The header isn't in the cache yet.
+        EXPECT_FALSE(message.HasExtension(net::proto::Status::extension));
+        ASSERT_TRUE(message.HasExtension(proto::MissingFiles::extension));
+        const auto& missing =
+            message.GetExtension(proto::MissingFiles::extension);
+        ASSERT_EQ(1, missing.hashes_size());
+        EXPECT_EQ(header_hash, missing.hashes(0));
+      } else if (send_count == 4) {
+        // The deps have a header, which isn't shipped.
+        ASSERT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status =
+            message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(net::proto::Status::EXECUTION, status.code());
+      } else if (send_count == 5) {
+        // The probe hit carries the deps of the cached pump task too.
+        ASSERT_TRUE(message.HasExtension(proto::Result::extension));
+        const auto& ext = message.GetExtension(proto::Result::extension);
+        EXPECT_EQ(String(object_code), ext.obj());
+        EXPECT_EQ(deps, ext.deps());
+        EXPECT_TRUE(ext.from_cache());
+      } else {
+        ASSERT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status =
+            message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(net::proto::Status::OK, status.code())
+            << status.description();
+
+        ASSERT_TRUE(message.HasExtension(proto::Result::extension));
+        const auto& ext = message.GetExtension(proto::Result::extension);
+        EXPECT_EQ(String(object_code), ext.obj());
+        EXPECT_EQ(handled_hash.str.string_copy(), ext.handled_hash());
+        EXPECT_EQ(deps, ext.deps());
+        EXPECT_EQ(send_count == 3, ext.from_cache());
+      }
+
+      send_condition.notify_all();
+    });
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    auto arg = std::find(process->args_.begin(), process->args_.end(), "-E"_l);
+    if (arg == process->args_.end()) {
+      process->stdout_ = object_code;
+      return;
+    }
+
+    arg = std::find(process->args_.begin(), process->args_.end(),
+                    "-working-directory"_l);
+    ASSERT_NE(process->args_.end(), arg);
+    EXPECT_EQ(current_dir, String(*std::next(arg)));
+
+    arg = std::find(process->args_.begin(), process->args_.end(),
+                    "-ivfsoverlay"_l);
+    ASSERT_NE(process->args_.end(), arg);
+    Immutable overlay;
+    ASSERT_TRUE(base::File::Read(String(*std::next(arg)), &overlay));
+    EXPECT_NE(String::npos, overlay.find("'/fake/dir/include/a.h'"));
+    EXPECT_NE(String::npos, overlay.find("'/fake/dir/test.cc'"));
+
+    arg = std::find(process->args_.begin(), process->args_.end(),
+                    "-dependency-file"_l);
+    ASSERT_NE(process->args_.end(), arg);
+    ASSERT_TRUE(base::File::Write(String(*std::next(arg)),
+                                  Immutable(deps + extra_deps)));
+    process->stdout_ = Immutable(preprocessed_source);
+  };
+
+  auto CreatePumpMessage = [&](bool with_header) {
+    auto message(CreateMessage(source, action, compiler_version));
+    auto* extension = message->MutableExtension(proto::Remote::extension);
+    extension->clear_source();
+    extension->set_current_dir(current_dir);
+    extension->mutable_flags()->set_input("test.cc");
+
+    auto* file = extension->add_files();
+    file->set_path("test.cc");
+    file->set_hash(base::Hexify(Immutable(source).Hash()));
+    file->set_content(source);
+
+    file = extension->add_files();
+    file->set_path("include/a.h");
+    file->set_hash(header_hash);
+    if (with_header) {
+      file->set_content(header);
+    }
+    return message;
+  };
+
+  absorber.reset(new Absorber(conf));
+  ASSERT_TRUE(absorber->Initialize());
+
+  auto connection1 = test_service->TriggerListen(expected_host, expected_port);
+  {
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection1);
+    EXPECT_TRUE(test_connection->TriggerReadAsync(CreatePumpMessage(false),
+                                                  StatusOK()));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 1; }));
+
+    // Absorber waits for the missing files on the same connection.
+    EXPECT_TRUE(test_connection->TriggerReadAsync(CreatePumpMessage(true),
+                                                  StatusOK()));
+
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 2; }));
+  }
+
+  // The header is in the cache now - and the result too.
+  auto connection2 = test_service->TriggerListen(expected_host, expected_port);
+  {
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection2);
+    EXPECT_TRUE(test_connection->TriggerReadAsync(CreatePumpMessage(false),
+                                                  StatusOK()));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 3; }));
+  }
+
+  extra_deps = " include/b.h";
+  auto connection3 = test_service->TriggerListen(expected_host, expected_port);
+  {
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection3);
+    EXPECT_TRUE(test_connection->TriggerReadAsync(CreatePumpMessage(false),
+                                                  StatusOK()));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 4; }));
+  }
+
+  auto connection4 = test_service->TriggerListen(expected_host, expected_port);
+  {
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection4);
+    auto probe(CreateMessage(source, action, compiler_version));
+    auto* extension = probe->MutableExtension(proto::Remote::extension);
+    extension->clear_source();
+    extension->set_handled_hash(handled_hash.str.string_copy());
+    EXPECT_TRUE(
+        test_connection->TriggerReadAsync(std::move(probe), StatusOK()));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 5; }));
+  }
+
+  absorber.reset();
+
+  // The shipped files are counted after a restart - and evicted, since none
+  // fits.
+  auto CountManifests = [&pump_dir] {
+    ui32 manifests = 0;
+    base::WalkDirectory(pump_dir, [&manifests](const Path& path, ui64, ui64) {
+      if (path.extension() == ".manifest") {
+        ++manifests;
+      }
+    });
+    return manifests;
+  };
+  EXPECT_EQ(2u, CountManifests());
+
+  cache::FileCache pump_cache(pump_dir, 1, false, false);
+  ASSERT_TRUE(pump_cache.Run(1));
+  for (int i = 0; i < 50 && CountManifests(); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  EXPECT_EQ(0u, CountManifests());
+
+  EXPECT_EQ(4u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(4u, connect_count);
+  EXPECT_EQ(4u, connections_created);
+  EXPECT_EQ(5u, read_count);
+  EXPECT_EQ(5u, send_count);
+  EXPECT_EQ(1, connection1.use_count())
+      << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection2.use_count())
+      << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection3.use_count())
+      << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection4.use_count())
+      << "Daemon must not store references to the connection";
+}
+
+TEST_F(AbsorberTest, IncludedPCHFiles) {
+  const base::TemporaryDir temp_dir;
+  const String expected_host = "fake_host";
+  const ui16 expected_port = 12345;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const auto object_code = "fake_object_code"_l;
+  const String pch = "fake_pch_contents";
+  const String pch_hash = base::Hexify(Immutable(pch).Hash());
+
+  conf.mutable_absorber()->mutable_local()->set_host(expected_host);
+  conf.mutable_absorber()->mutable_local()->set_port(expected_port);
+  conf.mutable_absorber()->mutable_pch_cache()->set_path(temp_dir);
+  conf.mutable_absorber()->mutable_pch_cache()->set_clean_period(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  listen_callback = [&](const String& host, ui16 port, String*) {
+    EXPECT_EQ(expected_host, host);
+    EXPECT_EQ(expected_port, port);
+    return !::testing::Test::HasNonfatalFailure();
+  };
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    // The absorber waits for the rest of the task after replying.
+    connection->CompleteAsyncSends();
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      if (send_count == 1 || send_count == 4) {
+        // The probe misses - and lists the PCH, if it isn't in the cache yet.
+        ASSERT_TRUE(message.HasExtension(net::proto::Status::extension));
+        EXPECT_EQ(net::proto::Status::OK,
+                  message.GetExtension(net::proto::Status::extension).code());
+        EXPECT_FALSE(message.HasExtension(proto::Result::extension));
+        ASSERT_TRUE(message.HasExtension(proto::MissingFiles::extension));
+        const auto& missing =
+            message.GetExtension(proto::MissingFiles::extension);
+        if (send_count == 1) {
+          ASSERT_EQ(1, missing.hashes_size());
+          EXPECT_EQ(pch_hash, missing.hashes(0));
+        } else {
+          EXPECT_EQ(0, missing.hashes_size());
+        }
+      } else if (send_count == 2) {
+        // The PCH isn't in the cache yet.
+        EXPECT_FALSE(message.HasExtension(net::proto::Status::extension));
+        ASSERT_TRUE(message.HasExtension(proto::MissingFiles::extension));
+        const auto& missing =
+            message.GetExtension(proto::MissingFiles::extension);
+        ASSERT_EQ(1, missing.hashes_size());
+        EXPECT_EQ(pch_hash, missing.hashes(0));
+      } else {
+        ASSERT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status =
+            message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(net::proto::Status::OK, status.code())
+            << status.description();
+
+        ASSERT_TRUE(message.HasExtension(proto::Result::extension));
+        const auto& ext = message.GetExtension(proto::Result::extension);
+        EXPECT_EQ(String(object_code), ext.obj());
+      }
+
+      send_condition.notify_all();
+    });
+    return true;
+  };
+  run_callback = [&](base::TestProcess* process) {
+    // The PCH is written to a temporary path instead of the one on the emitter.
+    auto arg = std::find(process->args_.begin(), process->args_.end(),
+                         "-include-pch"_l);
+    ASSERT_NE(process->args_.end(), arg);
+    ASSERT_NE(process->args_.end(), std::next(arg));
+    EXPECT_NE("/emitter/test.pch", std::next(arg)->string_copy());
+    Immutable contents;
+    ASSERT_TRUE(base::File::Read(std::next(arg)->string_copy(), &contents));
+    EXPECT_EQ(pch, contents.string_copy());
+
+    EXPECT_NE(process->args_.end(),
+              std::find(process->args_.begin(), process->args_.end(),
+                        "-fno-validate-pch"_l));
+    process->stdout_ = object_code;
+  };
+
+  auto CreatePCHMessage = [&](bool with_content) {
+    auto message(CreateMessage("fake_source"_l, "fake_action"_l,
+                               compiler_version));
+    auto* file = message->MutableExtension(proto::Remote::extension)
+                     ->add_included_files();
+    file->set_path("/emitter/test.pch");
+    file->set_hash(pch_hash);
+    if (with_content) {
+      file->set_content(pch);
+    }
+    return message;
+  };
+
+  auto CreateProbe = [&] {
+    auto message(CreatePCHMessage(false));
+    auto* extension = message->MutableExtension(proto::Remote::extension);
+    extension->clear_source();
+    extension->set_handled_hash("fake_handled_hash");
+    return message;
+  };
+
+  absorber.reset(new Absorber(conf));
+  ASSERT_TRUE(absorber->Initialize());
+
+  auto connection1 = test_service->TriggerListen(expected_host, expected_port);
+  {
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection1);
+    EXPECT_TRUE(
+        test_connection->TriggerReadAsync(CreateProbe(), StatusOK()));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 1; }));
+
+    // Absorber waits for the source on the same connection.
+    EXPECT_TRUE(test_connection->TriggerReadAsync(CreatePCHMessage(false),
+                                                  StatusOK()));
+
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 2; }));
+
+    // Absorber waits for the missing files on the same connection.
+    EXPECT_TRUE(test_connection->TriggerReadAsync(CreatePCHMessage(true),
+                                                  StatusOK()));
+
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 3; }));
+  }
+
+  // The PCH is in the cache now.
+  auto connection2 = test_service->TriggerListen(expected_host, expected_port);
+  {
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection2);
+    EXPECT_TRUE(
+        test_connection->TriggerReadAsync(CreateProbe(), StatusOK()));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 4; }));
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(CreatePCHMessage(false),
+                                                  StatusOK()));
+
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 5; }));
+  }
+
+  absorber.reset();
+
+  EXPECT_EQ(2u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(2u, connect_count);
+  EXPECT_EQ(2u, connections_created);
+  EXPECT_EQ(5u, read_count);
+  EXPECT_EQ(5u, send_count);
+  EXPECT_EQ(1, connection1.use_count())
+      << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection2.use_count())
+      << "Daemon must not store references to the connection";
+}
+
+TEST_F(AbsorberTest, PumpModeModuleBuild) {
+  const base::TemporaryDir temp_dir, pump_dir;
+  const String expected_host = "fake_host";
+  const ui16 expected_port = 12345;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const auto module_code = "fake_module_code"_l;
+  const String current_dir = "/fake/dir";
+  const String module_map = "module A { header \"a.h\" }";
+  const String header = "int a;";
+  const String deps = "-: module.modulemap a.h";
+  const String pcm = "fake_pcm_contents";
+  const auto action = "-emit-module"_l;
+
+  conf.mutable_absorber()->mutable_local()->set_host(expected_host);
+  conf.mutable_absorber()->mutable_local()->set_port(expected_port);
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_direct(false);
+  conf.mutable_cache()->set_clean_period(1);
+  conf.mutable_absorber()->mutable_pump_cache()->set_path(pump_dir);
+  conf.mutable_absorber()->mutable_pump_cache()->set_clean_period(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  listen_callback = [&](const String& host, ui16 port, String*) {
+    EXPECT_EQ(expected_host, host);
+    EXPECT_EQ(expected_port, port);
+    return !::testing::Test::HasNonfatalFailure();
+  };
+
+  // The module depends on another one - it's shipped the same way as a PCH.
+  const auto pcm_hash = base::Hexify(Immutable(pcm).Hash());
+  cache::ExtraFiles extra_files;
+  extra_files.emplace(cache::MODULE_FILES, Immutable(pcm_hash));
+  const auto handled_hash = CompilationDaemon::GenerateHash(
+      CreateMessage(""_l, action, compiler_version)
+          ->GetExtension(proto::Remote::extension)
+          .flags(),
+      CompilationDaemon::GenerateModuleSource(
+          current_dir,
+          {{"module.modulemap", base::Hexify(Immutable(module_map).Hash())},
+           {"a.h", base::Hexify(Immutable(header).Hash())}}),
+      extra_files);
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      ASSERT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(net::proto::Status::OK, status.code()) << status.description();
+
+      ASSERT_TRUE(message.HasExtension(proto::Result::extension));
+      const auto& ext = message.GetExtension(proto::Result::extension);
+      EXPECT_EQ(String(module_code), ext.obj());
+      EXPECT_EQ(handled_hash.str.string_copy(), ext.handled_hash());
+      EXPECT_EQ(deps, ext.deps());
+      EXPECT_EQ(send_count == 2, ext.from_cache());
+
+      send_condition.notify_all();
+    });
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    // Module maps can't be preprocessed - the module is built right away.
+    EXPECT_EQ(process->args_.end(),
+              std::find(process->args_.begin(), process->args_.end(), "-E"_l));
+    EXPECT_EQ("module.modulemap", process->args_.back().string_copy());
+
+    auto arg = std::find(process->args_.begin(), process->args_.end(),
+                         "-ivfsoverlay"_l);
+    ASSERT_NE(process->args_.end(), arg);
+    Immutable overlay;
+    ASSERT_TRUE(base::File::Read(String(*std::next(arg)), &overlay));
+    EXPECT_NE(String::npos, overlay.find("'/fake/dir/module.modulemap'"));
+    EXPECT_NE(String::npos, overlay.find("'/fake/dir/a.h'"));
+
+    arg = std::find_if(process->args_.begin(), process->args_.end(),
+                       [](const Immutable& arg) {
+                         return arg.string_copy().find("-fmodule-file=") == 0;
+                       });
+    ASSERT_NE(process->args_.end(), arg);
+    Immutable contents;
+    ASSERT_TRUE(base::File::Read(arg->string_copy().substr(14), &contents));
+    EXPECT_EQ(pcm, contents.string_copy());
+
+    arg = std::find(process->args_.begin(), process->args_.end(),
+                    "-dependency-file"_l);
+    ASSERT_NE(process->args_.end(), arg);
+    ASSERT_TRUE(base::File::Write(String(*std::next(arg)), Immutable(deps)));
+    process->stdout_ = module_code;
+  };
+
+  auto CreateModuleMessage = [&] {
+    auto message(CreateMessage(""_l, action, compiler_version));
+    auto* extension = message->MutableExtension(proto::Remote::extension);
+    extension->clear_source();
+    extension->set_current_dir(current_dir);
+    extension->mutable_flags()->set_input("module.modulemap");
+
+    auto* file = extension->add_files();
+    file->set_path("module.modulemap");
+    file->set_hash(base::Hexify(Immutable(module_map).Hash()));
+    file->set_content(module_map);
+
+    file = extension->add_files();
+    file->set_path("a.h");
+    file->set_hash(base::Hexify(Immutable(header).Hash()));
+    file->set_content(header);
+
+    file = extension->add_module_files();
+    file->set_path("/emitter/b.pcm");
+    file->set_hash(pcm_hash);
+    file->set_content(pcm);
+    return message;
+  };
+
+  absorber.reset(new Absorber(conf));
+  ASSERT_TRUE(absorber->Initialize());
+
+  auto connection1 = test_service->TriggerListen(expected_host, expected_port);
+  {
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection1);
+    EXPECT_TRUE(
+        test_connection->TriggerReadAsync(CreateModuleMessage(), StatusOK()));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 1; }));
+  }
+
+  // The module is in the cache now - with its deps.
+  auto connection2 = test_service->TriggerListen(expected_host, expected_port);
+  {
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection2);
+    EXPECT_TRUE(
+        test_connection->TriggerReadAsync(CreateModuleMessage(), StatusOK()));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 2; }));
+  }
+
+  absorber.reset();
+
+  EXPECT_EQ(1u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(2u, connect_count);
+  EXPECT_EQ(2u, connections_created);
+  EXPECT_EQ(2u, read_count);
+  EXPECT_EQ(2u, send_count);
+  EXPECT_EQ(1, connection1.use_count())
+      << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection2.use_count())
+      << "Daemon must not store references to the connection";
+}
+
+TEST_F(AbsorberTest, FetchFromPeer) {
+  const base::TemporaryDir temp_dir;
+  const String expected_host = "fake_host";
+  const ui16 expected_port = 12345;
+  const String peer_host = "peer_host";
+  const ui16 peer_port = 12346;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const auto object_code = "fake_object_code"_l;
+  const auto peer_object_code = "fake_peer_object_code"_l;
+  const String source1 = "fake_source1";
+  const String source2 = "fake_source2";
+  const auto action = "fake_action"_l;
+
+  conf.mutable_absorber()->mutable_local()->set_host(expected_host);
+  conf.mutable_absorber()->mutable_local()->set_port(expected_port);
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_direct(false);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* peer = conf.mutable_absorber()->add_peers();
+  peer->set_host(peer_host);
+  peer->set_port(peer_port);
+
+  // The absorber must skip itself in the list of peers - by any name.
+  auto* self = conf.mutable_absorber()->add_peers();
+  self->set_host(expected_host);
+  self->set_port(expected_port);
+  self = conf.mutable_absorber()->add_peers();
+  self->set_host("localhost");
+  self->set_port(expected_port);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  auto GetHash = [&](const String& source) {
+    auto message(CreateMessage(source, action, compiler_version));
+    auto* extension = message->MutableExtension(proto::Remote::extension);
+    extension->mutable_flags()->set_output("-");
+    return CompilationDaemon::GenerateHash(
+        extension->flags(), cache::string::HandledSource(Immutable(source)),
+        cache::ExtraFiles{});
+  };
+
+  listen_callback = [&](const String& host, ui16 port, String*) {
+    EXPECT_EQ(expected_host, host);
+    EXPECT_EQ(expected_port, port);
+    return !::testing::Test::HasNonfatalFailure();
+  };
+
+  ui32 peer_connections = 0;
+  connect_callback = [&](net::TestConnection* connection,
+                         net::EndPointPtr end_point) {
+    if (end_point->Print() == peer_host + ":" + std::to_string(peer_port)) {
+      if (++peer_connections == 1) {
+        // Exchange of digests.
+        connection->CallOnSend([&](const net::Connection::Message& message) {
+          EXPECT_TRUE(message.HasExtension(proto::CacheDigest::extension));
+        });
+        connection->CallOnRead([&](net::Connection::Message* message) {
+          cache::BloomFilter digest(1024);
+          digest.Add(GetHash(source1));
+
+          auto* ext = message->MutableExtension(proto::CacheDigest::extension);
+          ext->set_bloom(digest.Serialize());
+          ext->set_hashes(digest.hashes());
+        });
+      } else {
+        // Lookup of the |source1|.
+        connection->CallOnSend([&](const net::Connection::Message& message) {
+          EXPECT_TRUE(message.HasExtension(proto::CacheRequest::extension));
+          const auto& ext =
+              message.GetExtension(proto::CacheRequest::extension);
+          EXPECT_EQ(GetHash(source1).str.string_copy(), ext.handled_hash());
+        });
+        connection->CallOnRead([&](net::Connection::Message* message) {
+          message->MutableExtension(proto::Result::extension)
+              ->set_obj(peer_object_code);
+          message->MutableExtension(net::proto::Status::extension)
+              ->set_code(net::proto::Status::OK);
+        });
+      }
+      return true;
+    }
+
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(net::proto::Status::OK, status.code()) << status.description();
+
+      EXPECT_TRUE(message.HasExtension(proto::Result::extension));
+      const auto& ext = message.GetExtension(proto::Result::extension);
+      // The first result is fetched from the peer, the second is compiled.
+      EXPECT_EQ(send_count == 3, ext.from_cache());
+      EXPECT_EQ(String(send_count == 3 ? peer_object_code : object_code),
+                ext.obj());
+
+      send_condition.notify_all();
+    });
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    process->stdout_ = object_code;
+  };
+
+  absorber.reset(new Absorber(conf));
+  ASSERT_TRUE(absorber->Initialize());
+
+  // Wait for the first exchange of digests.
+  for (ui32 i = 0; i < 100 && !absorber->peers(); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_TRUE(!!absorber->peers());
+  ASSERT_EQ(1u, absorber->peers()->size());
+
+  auto connection1 = test_service->TriggerListen(expected_host, expected_port);
+  {
+    auto message(CreateMessage(source1, action, compiler_version));
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection1);
+    EXPECT_TRUE(
+        test_connection->TriggerReadAsync(std::move(message), StatusOK()));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 3; }));
+  }
+
+  // Peer doesn't have the |source2| - so the absorber compiles it.
+  auto connection2 = test_service->TriggerListen(expected_host, expected_port);
+  {
+    auto message(CreateMessage(source2, action, compiler_version));
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection2);
+    EXPECT_TRUE(
+        test_connection->TriggerReadAsync(std::move(message), StatusOK()));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 4; }));
+  }
+
+  absorber.reset();
+
+  EXPECT_EQ(1u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(4u, connect_count);
+  EXPECT_EQ(4u, connections_created);
+  EXPECT_EQ(4u, read_count);
+  EXPECT_EQ(4u, send_count);
+  EXPECT_EQ(2u, peer_connections);
+  EXPECT_EQ(1, connection1.use_count())
+      << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection2.use_count())
+      << "Daemon must not store references to the connection";
+
+  perf::proto::Metric metric;
+  metric.set_name(perf::proto::Metric::PEER_CACHE_HIT);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+
+  metric.set_name(perf::proto::Metric::PEER_CACHE_MISS);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(0u, metric.value());
+}
+
+TEST_F(AbsorberTest, ServePeers) {
+  const base::TemporaryDir temp_dir;
+  const String expected_host = "fake_host";
+  const ui16 expected_port = 12345;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const auto object_code = "fake_object_code"_l;
+  const String source1 = "fake_source1";
+  const String source2 = "fake_source2";
+  const auto action = "fake_action"_l;
+
+  conf.mutable_absorber()->mutable_local()->set_host(expected_host);
+  conf.mutable_absorber()->mutable_local()->set_port(expected_port);
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_direct(false);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  auto GetHash = [&](const String& source) {
+    auto message(CreateMessage(source, action, compiler_version));
+    auto* extension = message->MutableExtension(proto::Remote::extension);
+    extension->mutable_flags()->set_output("-");
+    return CompilationDaemon::GenerateHash(
+        extension->flags(), cache::string::HandledSource(Immutable(source)),
+        cache::ExtraFiles{});
+  };
+
+  listen_callback = [&](const String& host, ui16 port, String*) {
+    EXPECT_EQ(expected_host, host);
+    EXPECT_EQ(expected_port, port);
+    return !::testing::Test::HasNonfatalFailure();
+  };
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      if (send_count == 2) {
+        // Digest of the cache.
+        EXPECT_TRUE(message.HasExtension(proto::CacheDigest::extension));
+        const auto& ext = message.GetExtension(proto::CacheDigest::extension);
+        cache::BloomFilter digest;
+        EXPECT_TRUE(digest.Parse(ext.bloom(), ext.hashes()));
+        EXPECT_TRUE(digest.MayContain(GetHash(source1)));
+        EXPECT_FALSE(digest.MayContain(GetHash(source2)));
+      } else {
+        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status =
+            message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(net::proto::Status::OK, status.code())
+            << status.description();
+
+        // Compilation, then a hit and a miss of the lookup.
+        EXPECT_EQ(send_count != 4,
+                  message.HasExtension(proto::Result::extension));
+        if (send_count == 3) {
+          const auto& ext = message.GetExtension(proto::Result::extension);
+          EXPECT_EQ(String(object_code), ext.obj());
+          EXPECT_TRUE(ext.from_cache());
+        }
+      }
+
+      send_condition.notify_all();
+    });
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    process->stdout_ = object_code;
+  };
+
+  auto Request = [&](net::Connection::ScopedMessage message,
+                     ui32 expected_sends) {
+    auto connection = test_service->TriggerListen(expected_host, expected_port);
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection);
+    EXPECT_TRUE(
+        test_connection->TriggerReadAsync(std::move(message), StatusOK()));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [&] {
+      return send_count == expected_sends;
+    }));
+  };
+
+  auto CreateLookup = [&](const String& source) {
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    message->MutableExtension(proto::CacheRequest::extension)
+        ->set_handled_hash(GetHash(source).str);
+    return message;
+  };
+
+  absorber.reset(new Absorber(conf));
+  ASSERT_TRUE(absorber->Initialize());
+
+  Request(CreateMessage(source1, action, compiler_version), 1u);
+
+  {
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    message->MutableExtension(proto::CacheDigest::extension);
+    Request(std::move(message), 2u);
+  }
+
+  Request(CreateLookup(source1), 3u);
+  Request(CreateLookup(source2), 4u);
+
+  absorber.reset();
+
+  EXPECT_EQ(1u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(4u, connect_count);
+  EXPECT_EQ(4u, connections_created);
+  EXPECT_EQ(4u, read_count);
+  EXPECT_EQ(4u, send_count);
+}
+
 TEST_F(AbsorberTest, DoNotStoreLocalCacheWhenDisabled) {
   const base::TemporaryDir temp_dir;
   const String expected_host = "fake_host";
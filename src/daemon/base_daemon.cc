@@ -40,6 +40,19 @@ bool BaseDaemon::Update(const Configuration& conf) {
   return false;
 }
 
+net::Connection::SendCallback BaseDaemon::ReadAfterSend() {
+  return [this](net::ConnectionPtr connection,
+                const net::proto::Status& status) {
+    if (status.code() != net::proto::Status::OK) {
+      LOG(ERROR) << "Failed to send message: " << status.description();
+      return false;
+    }
+
+    HandleNewConnection(connection);
+    return true;
+  };
+}
+
 void BaseDaemon::HandleNewConnection(net::ConnectionPtr connection) {
   using namespace std::placeholders;
 
@@ -3,7 +3,7 @@
 #include <base/types.h>
 #include <daemon/configuration.h>
 #include <daemon/remote.pb.h>
-#include <net/connection_forward.h>
+#include <net/connection.h>
 #include <net/end_point_resolver.h>
 #include <net/network_service.h>
 
@@ -92,6 +92,10 @@ class BaseDaemon {
     return network_service_->Connect(end_point, error);
   }
 
+  // Returns a send callback, that waits for the next message on the same
+  // connection instead of closing it.
+  net::Connection::SendCallback ReadAfterSend();
+
   // Check if new configuration is proper. Chain calls of this method from
   // derived to base classes in the beginning, so that more basic checks are
   // done first.
@@ -0,0 +1,200 @@
+#include <daemon/cache_server.h>
+
+#include <base/assert.h>
+#include <base/logging.h>
+#include <net/connection.h>
+#include <perf/stat_service.h>
+
+#include <base/using_log.h>
+
+#include STL(algorithm)
+
+using namespace std::placeholders;
+
+namespace dist_clang {
+
+namespace {
+const char kOverloadedErrorText[] = "Tasks queue reached limit";
+}  // namespace
+
+namespace daemon {
+
+CacheServer::CacheServer(const Configuration& conf) : BaseDaemon(conf) {
+  using Worker = base::WorkerPool::SimpleWorker;
+  CHECK(conf.has_cache_server() && !conf.cache_server().local().disabled());
+
+  workers_ = std::make_unique<base::WorkerPool>();
+  tasks_ = std::make_unique<Queue>(conf.pool_capacity());
+
+  Worker worker = std::bind(&CacheServer::DoHandle, this, _1);
+  workers_->AddWorker("Cache Server Worker"_l, worker,
+                      conf.cache_server().local().threads());
+}
+
+CacheServer::~CacheServer() {
+  tasks_->Close();
+  workers_.reset();
+}
+
+bool CacheServer::Initialize() {
+  auto conf = this->conf();
+
+  const auto& cache = conf->cache_server().cache();
+  cache_ = std::make_unique<cache::FileCache>(
+      cache.path(), cache.size(), cache.snappy(), cache.store_index(), 0,
+      cache.dedup());
+  if (!cache_->Run(cache.clean_period())) {
+    LOG(ERROR) << "Cache server failed to run cache in " << cache.path();
+    return false;
+  }
+
+  String error;
+  const auto& local = conf->cache_server().local();
+  if (!Listen(local.host(), local.port(), local.ipv6(), &error)) {
+    LOG(ERROR) << "Cache server failed to listen on " << local.host() << ":"
+               << local.port() << " : " << error;
+    return false;
+  }
+
+  return BaseDaemon::Initialize();
+}
+
+bool CacheServer::Check(const Configuration& conf) const {
+  if (!BaseDaemon::Check(conf)) {
+    return false;
+  }
+
+  if (!conf.has_cache_server()) {
+    return false;
+  }
+
+  if (conf.cache_server().cache().disabled()) {
+    LOG(ERROR) << "Cache server can't work with disabled cache";
+    return false;
+  }
+
+  if (conf.has_cache() &&
+      conf.cache().path() == conf.cache_server().cache().path()) {
+    LOG(ERROR) << "Cache server can't share the cache path with the daemon";
+    return false;
+  }
+
+  return true;
+}
+
+bool CacheServer::HandleNewMessage(net::ConnectionPtr connection,
+                                   Universal message,
+                                   const net::proto::Status& status) {
+  if (!message->IsInitialized()) {
+    LOG(INFO) << message->InitializationErrorString();
+    return false;
+  }
+
+  if (status.code() != net::proto::Status::OK) {
+    LOG(ERROR) << status.description();
+    return connection->ReportStatus(status);
+  }
+
+  if (message->HasExtension(proto::CacheRequest::extension)) {
+    Message request(message->ReleaseExtension(proto::CacheRequest::extension));
+    if (!tasks_->Push(Task{connection, std::move(request)})) {
+      net::proto::Status overload;
+      overload.set_code(net::proto::Status::OVERLOAD);
+      overload.set_description(kOverloadedErrorText);
+      connection->ReportStatus(overload);
+      return false;
+    }
+    return true;
+  }
+
+  NOTREACHED();
+  return false;
+}
+
+void CacheServer::DoHandle(const base::WorkerPool& pool) {
+  using namespace cache::string;
+
+  while (!pool.IsShuttingDown()) {
+    Optional&& task = tasks_->Pop();
+    if (!task) {
+      break;
+    }
+
+    if (std::get<CONNECTION>(*task)->IsClosed()) {
+      continue;
+    }
+
+    proto::CacheRequest* incoming = std::get<MESSAGE>(*task).get();
+    const HandledHash hash(Immutable(incoming->release_handled_hash()));
+    cache::FileCache::Entry entry;
+
+    if (incoming->has_result()) {
+      auto conf = this->conf();
+      const auto& writers = conf->cache_server().writers();
+      const String peer = std::get<CONNECTION>(*task)->PeerAddress();
+      if (peer.empty() ||
+          std::find(writers.begin(), writers.end(), peer) == writers.end()) {
+        net::proto::Status status;
+        status.set_code(net::proto::Status::FORBIDDEN);
+        status.set_description("Host \"" + peer +
+                               "\" isn't allowed to store results");
+        LOG(WARNING) << status.description();
+        std::get<CONNECTION>(*task)->ReportStatus(status);
+        continue;
+      }
+
+      auto* result = incoming->mutable_result();
+      entry.object = result->release_obj();
+      if (result->has_deps()) {
+        entry.deps = result->release_deps();
+      }
+      if (incoming->has_stderr()) {
+        entry.stderr = incoming->release_stderr();
+      }
+      for (auto& output : *result->mutable_outputs()) {
+        entry.outputs.emplace(output.name(),
+                              Immutable(output.release_content()));
+      }
+      cache_->Store(hash, entry);
+
+      net::proto::Status status;
+      status.set_code(net::proto::Status::OK);
+      std::get<CONNECTION>(*task)->ReportStatus(status);
+      continue;
+    }
+
+    if (!cache_->Find(hash, &entry)) {
+      STAT(SIMPLE_CACHE_MISS);
+
+      net::proto::Status status;
+      status.set_code(net::proto::Status::OK);
+      std::get<CONNECTION>(*task)->ReportStatus(status);
+      continue;
+    }
+
+    STAT(SIMPLE_CACHE_HIT);
+
+    Universal outgoing(new net::proto::Universal);
+
+    auto* result = outgoing->MutableExtension(proto::Result::extension);
+    result->set_obj(entry.object);
+    if (!entry.deps.empty()) {
+      result->set_deps(entry.deps);
+    }
+    for (const auto& output : entry.outputs) {
+      auto* new_output = result->add_outputs();
+      new_output->set_name(output.first);
+      new_output->set_content(output.second);
+    }
+    result->set_from_cache(true);
+
+    auto* status = outgoing->MutableExtension(net::proto::Status::extension);
+    status->set_code(net::proto::Status::OK);
+    status->set_description(entry.stderr);
+
+    std::get<CONNECTION>(*task)->SendAsync(std::move(outgoing));
+  }
+}
+
+}  // namespace daemon
+}  // namespace dist_clang
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <base/locked_queue.h>
+#include <base/worker_pool.h>
+#include <cache/file_cache.h>
+#include <daemon/base_daemon.h>
+
+namespace dist_clang {
+namespace daemon {
+
+// Serves the simple cache by handled hashes to many emitters, so they can share
+// results of compilation without uploading any sources.
+class CacheServer : public BaseDaemon {
+ public:
+  explicit CacheServer(const Configuration& conf);
+  virtual ~CacheServer();
+
+  bool Initialize() override;
+
+ protected:
+  bool Check(const Configuration& conf) const override;
+
+ private:
+  enum TaskIndex {
+    CONNECTION = 0,
+    MESSAGE = 1,
+  };
+
+  using Message = UniquePtr<proto::CacheRequest>;
+  using Task = Tuple<net::ConnectionPtr, Message>;
+  using Queue = base::LockedQueue<Task>;
+  using Optional = Queue::Optional;
+
+  bool HandleNewMessage(net::ConnectionPtr connection, Universal message,
+                        const net::proto::Status& status) override;
+
+  void DoHandle(const base::WorkerPool& pool);
+
+  UniquePtr<Queue> tasks_;
+  UniquePtr<base::WorkerPool> workers_;
+  UniquePtr<cache::FileCache> cache_;
+};
+
+}  // namespace daemon
+}  // namespace dist_clang
@@ -0,0 +1,188 @@
+#include <daemon/cache_server.h>
+
+#include <base/temporary_dir.h>
+#include <daemon/common_daemon_test.h>
+
+namespace dist_clang {
+namespace daemon {
+
+TEST(CacheServerConfigurationTest, NoCacheServerSection) {
+  ASSERT_ANY_THROW((CacheServer((proto::Configuration()))));
+}
+
+class CacheServerTest : public CommonDaemonTest {
+ protected:
+  CacheServerTest() {
+    auto* cache_server = conf.mutable_cache_server();
+    cache_server->mutable_local()->set_host(expected_host);
+    cache_server->mutable_local()->set_port(expected_port);
+    cache_server->mutable_cache()->set_path(temp_dir);
+    cache_server->mutable_cache()->set_clean_period(1);
+    cache_server->add_writers(writer_address);
+
+    listen_callback = [this](const String& host, ui16 port, String*) {
+      EXPECT_EQ(expected_host, host);
+      EXPECT_EQ(expected_port, port);
+      return true;
+    };
+  }
+
+  // Sends the request to the cache server and waits for a reply.
+  void Request(UniquePtr<proto::CacheRequest> request, ui32 expected_sends) {
+    auto connection = test_service->TriggerListen(expected_host, expected_port);
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection);
+    test_connection->SetPeerAddress(peer_address);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    message->SetAllocatedExtension(proto::CacheRequest::extension, request.release());
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, Seconds(1), [&] { return send_count == expected_sends; }));
+  }
+
+  const base::TemporaryDir temp_dir;
+  const String expected_host = "fake_host";
+  const ui16 expected_port = 12345;
+  const String writer_address = "10.0.0.1";
+  String peer_address = writer_address;
+
+  UniquePtr<CacheServer> cache_server;
+};
+
+TEST_F(CacheServerTest, SharedCachePath) {
+  conf.mutable_cache()->set_path(temp_dir);
+
+  cache_server.reset(new CacheServer(conf));
+  ASSERT_FALSE(cache_server->Initialize());
+}
+
+TEST_F(CacheServerTest, StoreAndFind) {
+  const auto object_code = "fake_object_code"_l;
+  const auto deps = "fake_deps"_l;
+  const auto stderr_output = "fake_stderr"_l;
+  const auto hash =
+      cache::FileCache::Hash(cache::string::HandledSource("fake_source"_l), cache::ExtraFiles{},
+                             cache::string::CommandLine("fake_command_line"_l), cache::string::Version("fake_version"_l));
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(net::proto::Status::OK, status.code()) << status.description();
+
+      if (connect_count == 1 || connect_count == 2) {
+        // Cache miss and update.
+        EXPECT_FALSE(message.HasExtension(proto::Result::extension));
+      } else if (connect_count == 3) {
+        // Cache hit.
+        EXPECT_TRUE(message.HasExtension(proto::Result::extension));
+        const auto& result = message.GetExtension(proto::Result::extension);
+        EXPECT_EQ(object_code, result.obj());
+        EXPECT_EQ(deps, result.deps());
+        EXPECT_TRUE(result.from_cache());
+        EXPECT_EQ(stderr_output, status.description());
+      }
+
+      send_condition.notify_all();
+    });
+    return true;
+  };
+
+  cache_server.reset(new CacheServer(conf));
+  ASSERT_TRUE(cache_server->Initialize());
+
+  {
+    auto request = std::make_unique<proto::CacheRequest>();
+    request->set_handled_hash(hash.str);
+    Request(std::move(request), 1u);
+  }
+
+  {
+    auto request = std::make_unique<proto::CacheRequest>();
+    request->set_handled_hash(hash.str);
+    request->mutable_result()->set_obj(object_code);
+    request->mutable_result()->set_deps(deps);
+    request->set_stderr(stderr_output);
+    Request(std::move(request), 2u);
+  }
+
+  {
+    auto request = std::make_unique<proto::CacheRequest>();
+    request->set_handled_hash(hash.str);
+    Request(std::move(request), 3u);
+  }
+
+  cache_server.reset();
+
+  EXPECT_EQ(0u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(3u, connect_count);
+  EXPECT_EQ(3u, connections_created);
+  EXPECT_EQ(3u, read_count);
+  EXPECT_EQ(3u, send_count);
+
+  perf::proto::Metric metric;
+  metric.set_name(perf::proto::Metric::SIMPLE_CACHE_HIT);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+
+  metric.set_name(perf::proto::Metric::SIMPLE_CACHE_MISS);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+}
+
+TEST_F(CacheServerTest, RejectStoreFromUntrustedPeer) {
+  const auto hash =
+      cache::FileCache::Hash(cache::string::HandledSource("fake_source"_l), cache::ExtraFiles{},
+                             cache::string::CommandLine("fake_command_line"_l), cache::string::Version("fake_version"_l));
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_FALSE(message.HasExtension(proto::Result::extension));
+
+      if (connect_count == 1) {
+        // Rejected update.
+        EXPECT_EQ(net::proto::Status::FORBIDDEN, status.code());
+      } else if (connect_count == 2) {
+        // Cache miss - even for a trusted peer.
+        EXPECT_EQ(net::proto::Status::OK, status.code()) << status.description();
+      }
+
+      send_condition.notify_all();
+    });
+    return true;
+  };
+
+  cache_server.reset(new CacheServer(conf));
+  ASSERT_TRUE(cache_server->Initialize());
+
+  {
+    peer_address = "10.0.0.2";
+    auto request = std::make_unique<proto::CacheRequest>();
+    request->set_handled_hash(hash.str);
+    request->mutable_result()->set_obj("poisoned_object_code");
+    Request(std::move(request), 1u);
+  }
+
+  {
+    peer_address = writer_address;
+    auto request = std::make_unique<proto::CacheRequest>();
+    request->set_handled_hash(hash.str);
+    Request(std::move(request), 2u);
+  }
+
+  cache_server.reset();
+
+  EXPECT_EQ(2u, connect_count);
+  EXPECT_EQ(2u, send_count);
+}
+
+}  // namespace daemon
+}  // namespace dist_clang
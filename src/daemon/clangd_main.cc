@@ -1,6 +1,7 @@
 #include <base/c_utils.h>
 #include <base/logging.h>
 #include <daemon/absorber.h>
+#include <daemon/cache_server.h>
 #include <daemon/collector.h>
 #include <daemon/configuration.h>
 #include <daemon/coordinator.h>
@@ -30,7 +31,7 @@ int main(int argc, char* argv[]) {
   signal(SIGSEGV, signal_handler);
 
   daemon::Configuration configuration(argc, argv);
-  UniquePtr<daemon::BaseDaemon> daemon, collector, coordinator;
+  UniquePtr<daemon::BaseDaemon> daemon, collector, coordinator, cache_server;
 
   if (configuration.daemonize()) {
 // The function |daemon()| is deprecated on Mac. Use launchd instead.
@@ -73,16 +74,28 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  // Initialize cache server, if any.
+  {
+    if (configuration.config().has_cache_server()) {
+      cache_server.reset(new daemon::CacheServer(configuration.config()));
+    }
+
+    if (cache_server && !cache_server->Initialize()) {
+      LOG(FATAL) << "Cache server failed to initialize.";
+    }
+  }
+
   if (configuration.config().has_absorber()) {
     daemon.reset(new daemon::Absorber(configuration.config()));
   } else if (configuration.config().has_emitter()) {
     daemon.reset(new daemon::Emitter(configuration.config()));
-  } else {
+  } else if (!cache_server) {
+    // Cache server may work alone on a dedicated host.
     LOG(FATAL)
         << "Specify exactly one daemon configuration: Absorber or Emitter";
   }
 
-  if (!daemon->Initialize()) {
+  if (daemon && !daemon->Initialize()) {
     LOG(FATAL) << "Daemon failed to initialize.";
   }
 
@@ -44,6 +44,14 @@ bool Collector::HandleNewMessage(net::ConnectionPtr connection,
   if (message->HasExtension(perf::proto::Report::extension)) {
     UniquePtr<perf::proto::Report> report(
         message->ReleaseExtension(perf::proto::Report::extension));
+    if (report->has_host()) {
+      Store(std::move(*report));
+
+      net::proto::Status status;
+      status.set_code(net::proto::Status::OK);
+      return connection->ReportStatus(status);
+    }
+
     for (auto& metric : *report->mutable_metric()) {
       if (metric.has_name()) {
         base::Singleton<perf::StatService>::Get().Dump(metric);
@@ -56,9 +64,85 @@ bool Collector::HandleNewMessage(net::ConnectionPtr connection,
     return true;
   }
 
+  if (message->HasExtension(perf::proto::Query::extension)) {
+    UniquePtr<perf::proto::Query> query(
+        message->ReleaseExtension(perf::proto::Query::extension));
+    Query(query.get());
+    if (!connection->SendSync(std::move(query))) {
+      LOG(WARNING) << "Failed to send query message!";
+    }
+
+    return true;
+  }
+
   NOTREACHED();
   return false;
 }
 
+void Collector::Store(perf::proto::Report&& report) {
+  if (!report.has_time()) {
+    report.set_time(std::chrono::duration_cast<Seconds>(
+                        std::chrono::system_clock::now().time_since_epoch())
+                        .count());
+  }
+
+  const ui32 history = conf()->collector().history();
+  if (!history) {
+    return;
+  }
+
+  UniqueLock lock(series_mutex_);
+  auto it = series_.find(report.host());
+  if (it == series_.end()) {
+    it = series_.emplace(report.host(), TimeSeries(history)).first;
+  }
+
+  auto& series = it->second;
+  while (series.size() >= history) {
+    series.pop_front();
+  }
+
+  // The reports of a host come in order, unless the host has several reporters
+  // - or the clock goes back.
+  size_t index = series.size();
+  while (index > 0 && series[index - 1].time() > report.time()) {
+    --index;
+  }
+  series.insert(index, std::move(report));
+}
+
+void Collector::Query(perf::proto::Query* query) const {
+  DCHECK(query);
+
+  HashSet<int> names(query->name().begin(), query->name().end());
+
+  UniqueLock lock(series_mutex_);
+  for (const auto& it : series_) {
+    if (query->has_host() && query->host() != it.first) {
+      continue;
+    }
+
+    const auto& series = it.second;
+    for (size_t i = 0; i < series.size(); ++i) {
+      const auto& stored = series[i];
+      if (stored.time() < query->from()) {
+        continue;
+      }
+      if (query->has_to() && stored.time() >= query->to()) {
+        break;
+      }
+
+      auto* report = query->add_report();
+      report->set_host(stored.host());
+      report->set_time(stored.time());
+      for (const auto& metric : stored.metric()) {
+        if (names.empty() || names.count(metric.name())) {
+          report->add_metric()->CopyFrom(metric);
+        }
+      }
+    }
+  }
+}
+
 }  // namespace daemon
 }  // namespace dist_clang
@@ -1,10 +1,15 @@
 #pragma once
 
+#include <base/ring_buffer.h>
 #include <daemon/base_daemon.h>
+#include <perf/stat.pb.h>
 
 namespace dist_clang {
 namespace daemon {
 
+// Besides its own metrics, the collector keeps the reports pushed by other
+// daemons - the last |history| ones for each host - and answers the range
+// queries over them.
 class Collector : public BaseDaemon {
  public:
   explicit Collector(const Configuration& conf);
@@ -12,8 +17,16 @@ class Collector : public BaseDaemon {
   bool Initialize() override;
 
  private:
+  using TimeSeries = base::RingBuffer<perf::proto::Report>;
+
   bool HandleNewMessage(net::ConnectionPtr connection, Universal message,
                         const net::proto::Status& status) override;
+
+  void Store(perf::proto::Report&& report) THREAD_SAFE;
+  void Query(perf::proto::Query* query) const THREAD_SAFE;
+
+  mutable Mutex series_mutex_;
+  HashMap<String /* host */, TimeSeries> series_;
 };
 
 }  // namespace daemon
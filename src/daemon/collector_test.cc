@@ -71,5 +71,101 @@ TEST_F(CollectorTest, SimpleReport) {
       << "Daemon must not store references to the connection";
 }
 
+TEST_F(CollectorTest, StoreAndQueryReports) {
+  const String expected_host = "fake_host";
+  const ui16 expected_port = 12345;
+
+  conf.mutable_collector()->mutable_local()->set_host(expected_host);
+  conf.mutable_collector()->mutable_local()->set_port(expected_port);
+  conf.mutable_collector()->set_history(2);
+
+  UniquePtr<net::Connection::Message> reply;
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      reply.reset(new net::Connection::Message(message));
+    });
+    return true;
+  };
+
+  collector.reset(new Collector(conf));
+  ASSERT_TRUE(collector->Initialize());
+
+  auto send = [&](net::Connection::ScopedMessage message) {
+    auto connection = std::static_pointer_cast<net::TestConnection>(
+        test_service->TriggerListen(expected_host, expected_port));
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+    EXPECT_TRUE(connection->TriggerReadAsync(std::move(message), status));
+  };
+
+  auto push = [&](const String& host, ui64 time) {
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* report = message->MutableExtension(perf::proto::Report::extension);
+    report->set_host(host);
+    report->set_time(time);
+    auto* metric = report->add_metric();
+    metric->set_name(perf::proto::Metric::DIRECT_CACHE_HIT);
+    metric->set_value(time);
+    metric = report->add_metric();
+    metric->set_name(perf::proto::Metric::SIMPLE_CACHE_HIT);
+    metric->set_value(1);
+    send(std::move(message));
+
+    ASSERT_TRUE(!!reply);
+    ASSERT_TRUE(reply->HasExtension(net::proto::Status::extension));
+    EXPECT_EQ(net::proto::Status::OK,
+              reply->GetExtension(net::proto::Status::extension).code());
+  };
+
+  push("host1", 1);
+  push("host1", 3);
+  push("host2", 2);
+  push("host1", 2);  // Evicts the oldest report - and keeps the order.
+
+  {
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* query = message->MutableExtension(perf::proto::Query::extension);
+    query->add_name(perf::proto::Metric::DIRECT_CACHE_HIT);
+    query->set_from(2);
+    query->set_to(3);
+    send(std::move(message));
+  }
+
+  ASSERT_TRUE(!!reply);
+  ASSERT_TRUE(reply->HasExtension(perf::proto::Query::extension));
+  const auto& query = reply->GetExtension(perf::proto::Query::extension);
+  ASSERT_EQ(2, query.report_size());
+  HashMap<String, const perf::proto::Report*> reports;
+  for (const auto& report : query.report()) {
+    reports.emplace(report.host(), &report);
+  }
+  for (const String host : {"host1", "host2"}) {
+    ASSERT_EQ(1u, reports.count(host)) << host;
+    const auto& report = *reports[host];
+    EXPECT_EQ(2u, report.time());
+    ASSERT_EQ(1, report.metric_size());
+    EXPECT_EQ(perf::proto::Metric::DIRECT_CACHE_HIT, report.metric(0).name());
+    EXPECT_EQ(2u, report.metric(0).value());
+  }
+
+  {
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* query = message->MutableExtension(perf::proto::Query::extension);
+    query->set_host("host1");
+    send(std::move(message));
+  }
+
+  ASSERT_TRUE(!!reply);
+  const auto& all = reply->GetExtension(perf::proto::Query::extension);
+  ASSERT_EQ(2, all.report_size());
+  EXPECT_EQ(2u, all.report(0).time());
+  EXPECT_EQ(3u, all.report(1).time());
+  EXPECT_EQ(2, all.report(1).metric_size());
+
+  collector.reset();
+
+  EXPECT_EQ(6u, send_count);
+}
+
 }  // namespace daemon
 }  // namespace dist_clang
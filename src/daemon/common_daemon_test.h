@@ -78,7 +78,7 @@ struct CommonDaemonTest : public ::testing::Test {
   void ResetStatistics() {
     perf::proto::Metric metric;
     for (auto metric_name = static_cast<int>(perf::proto::Metric::Name_MIN);
-         metric_name != static_cast<int>(perf::proto::Metric::Name_MAX);
+         metric_name <= static_cast<int>(perf::proto::Metric::Name_MAX);
          ++metric_name) {
       metric.set_name(static_cast<perf::proto::Metric_Name>(metric_name));
       base::Singleton<perf::StatService>::Get().Dump(metric);
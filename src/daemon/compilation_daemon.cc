@@ -1,14 +1,21 @@
 #include <daemon/compilation_daemon.h>
 
 #include <base/assert.h>
+#include <base/c_utils.h>
 #include <base/file/file.h>
 #include <base/logging.h>
 #include <base/process_impl.h>
 #include <base/string_utils.h>
+#include <daemon/remote.pb.h>
 #include <perf/stat_reporter.h>
+#include <perf/stat_service.h>
+#include <perf/trace.pb.h>
+#include <perf/trace_service.h>
 
 #include <base/using_log.h>
 
+#include <unistd.h>
+
 namespace dist_clang {
 
 using cache::ExtraFiles;
@@ -19,6 +26,17 @@ using Counter = perf::Counter<perf::StatReporter>;
 
 namespace {
 
+String HostName() {
+  char name[256] = {0};
+  if (gethostname(name, sizeof(name) - 1) != 0) {
+    String error;
+    base::GetLastError(&error);
+    LOG(WARNING) << "Failed to get the host name: " << error;
+    return "unknown";
+  }
+  return name;
+}
+
 // Returns relative path from |current_dir| to |input|. If |input| does
 // not contain |current_dir| as a prefix or is smaller, returns |input|
 // untouched. If |input| is equal to |current_dir|, returns ".".
@@ -54,12 +72,22 @@ inline auto CreateArgumentList(const Args&... args) {
   return list;
 }
 
+// The results of different actions mustn't be mixed up. Objects keep the
+// keys they had before other actions were cached.
+inline void AppendAction(const base::proto::Flags& flags,
+                         String* command_line) {
+  if (flags.action() != "-emit-obj") {
+    *command_line += " " + flags.action();
+  }
+}
+
 inline CommandLine CommandLineForSimpleCache(const base::proto::Flags& flags) {
   auto arg_list = CreateArgumentList(flags.other(), flags.cc_only());
   auto command_line = base::JoinString<' '>(arg_list.begin(), arg_list.end());
   if (flags.has_language()) {
     command_line += " -x " + flags.language();
   }
+  AppendAction(flags, &command_line);
 
   return CommandLine(command_line);
 }
@@ -72,6 +100,7 @@ inline CommandLine CommandLineForDirectCache(const String& current_dir,
   if (flags.has_language()) {
     command_line += " -x " + flags.language();
   }
+  AppendAction(flags, &command_line);
 
   // Compiler implicitly appends file's directory as an include path - so do we.
   // FIXME: make sure we did it in a proper order - relative to other include
@@ -82,7 +111,73 @@ inline CommandLine CommandLineForDirectCache(const String& current_dir,
   return CommandLine(command_line);
 }
 
-bool ParseDeps(String deps, List<String>& headers) {
+inline String GetFullPath(const String& current_dir, const String& path) {
+  return path[0] == '/' ? path : current_dir + "/" + path;
+}
+
+// Characters, which may surround a path in a command line, a deps file or a
+// preprocessed source.
+inline bool IsPathDelimiter(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '"' ||
+         c == '\'' || c == '=' || c == ':' || c == '<' || c == '>';
+}
+
+// Returns the |base_dir| without trailing slashes, if it contains the
+// |current_dir| - or an empty string otherwise.
+inline String GetBaseDir(const String& base_dir, const String& current_dir) {
+  String base = base_dir;
+  while (base.size() > 1 && base.back() == '/') {
+    base.pop_back();
+  }
+
+  if (base.size() < 2 || base[0] != '/' ||
+      (current_dir != base &&
+       current_dir.compare(0, base.size() + 1, base + "/") != 0)) {
+    return String();
+  }
+  return base;
+}
+
+// The restored deps and debug info are rewritten only against the |base_dir| -
+// so the entries are shared between checkouts only inside it.
+inline CommandLine CommandLineForDependCache(const String& base_dir,
+                                             const String& current_dir,
+                                             const base::proto::Flags& flags) {
+  const auto command_line = CommandLineForDirectCache(current_dir, flags).str;
+  if (GetBaseDir(base_dir, current_dir).empty()) {
+    return CommandLine(command_line.string_copy() + " -working-directory " +
+                       current_dir);
+  }
+
+  return CommandLine(daemon::CompilationDaemon::RewriteBaseDir(
+      base_dir, current_dir, command_line));
+}
+
+// The keys of the depend entries have the shape of the simple ones - so they're
+// counted and evicted along with them. The |headers| are the hashes of the
+// headers, which the input depended on - the list of them itself is keyed
+// without any.
+inline HandledHash DependHash(const String& base_dir, const String& current_dir,
+                              const base::proto::Flags& flags,
+                              UnhandledSource code, ExtraFiles extra_files,
+                              Immutable headers = Immutable()) {
+  const Version version(flags.compiler().version());
+
+  // Don't collide with the direct manifests - they use unhandled hashes too.
+  extra_files[cache::DEPEND_HEADERS] = headers;
+  return HandledHash(
+      cache::FileCache::Hash(
+          code, extra_files,
+          CommandLineForDependCache(base_dir, current_dir, flags), version)
+          .str);
+}
+
+}  // namespace
+
+namespace daemon {
+
+// static
+bool CompilationDaemon::ParseDeps(String deps, List<String>& headers) {
   base::Replace(deps, "\\\n", "");
 
   List<String> lines;
@@ -99,13 +194,28 @@ bool ParseDeps(String deps, List<String>& headers) {
   return true;
 }
 
-inline String GetFullPath(const String& current_dir, const String& path) {
-  return path[0] == '/' ? path : current_dir + "/" + path;
-}
-
-}  // namespace
+bool CompilationDaemon::DumpTrace(net::ConnectionPtr connection,
+                                  const perf::proto::TraceDump& dump) {
+  perf::proto::Trace trace;
+  base::Singleton<perf::TraceService>::Get().Dump(dump.trace_id(), &trace);
+
+  net::proto::Status status;
+  String error;
+  if (!base::File::Write(dump.path(),
+                         Immutable(perf::TraceService::ToChromeTrace(trace)),
+                         &error)) {
+    status.set_code(net::proto::Status::EXECUTION);
+    status.set_description("Failed to dump trace to " + dump.path() + " : " +
+                           error);
+    LOG(WARNING) << status.description();
+  } else {
+    status.set_code(net::proto::Status::OK);
+    LOG(INFO) << "Dumped " << trace.spans_size() << " spans to "
+              << dump.path();
+  }
 
-namespace daemon {
+  return connection->ReportStatus(status);
+}
 
 bool CompilationDaemon::Initialize() {
   auto conf = this->conf();
@@ -113,15 +223,122 @@ bool CompilationDaemon::Initialize() {
   if (conf->has_cache() && !conf->cache().disabled()) {
     cache_ = std::make_unique<cache::FileCache>(
         conf->cache().path(), conf->cache().size(), conf->cache().snappy(),
-        conf->cache().store_index());
+        conf->cache().store_index(), conf->cache().failure_ttl(),
+        conf->cache().dedup());
     if (!cache_->Run(conf->cache().clean_period())) {
       cache_.reset();
+    } else if (conf->cache().memory_size()) {
+      memory_cache_ =
+          std::make_unique<cache::MemoryCache>(conf->cache().memory_size());
     }
   }
 
   return BaseDaemon::Initialize();
 }
 
+bool CompilationDaemon::Reload(const Configuration& conf) {
+  using Worker = base::WorkerPool::SimpleWorker;
+  using namespace std::placeholders;
+
+  // The reporter reads the rest of its configuration before each push - so
+  // it's only started or stopped here. The stopped one pushes the last deltas
+  // to the old collectors, since the configuration isn't replaced yet.
+  UniqueLock lock(reporter_mutex_);
+  if (conf.reporter().collectors_size() && !reporter_workers_) {
+    reporter_workers_ = std::make_unique<base::WorkerPool>(true);
+    Worker worker = std::bind(&CompilationDaemon::DoReport, this, _1);
+    reporter_workers_->AddWorker("Reporter Worker"_l, worker);
+  } else if (!conf.reporter().collectors_size() && reporter_workers_) {
+    reporter_workers_.reset();
+  }
+  lock.unlock();
+
+  return BaseDaemon::Reload(conf);
+}
+
+// static
+void CompilationDaemon::DumpMetrics(perf::proto::Report* report) {
+  DCHECK(report);
+
+  auto& stat_service = base::Singleton<perf::StatService>::Get();
+  for (int name = Metric::Name_MIN; name <= Metric::Name_MAX; ++name) {
+    if (!Metric::Name_IsValid(name)) {
+      continue;
+    }
+
+    Metric metric;
+    metric.set_name(static_cast<Metric::Name>(name));
+    stat_service.Dump(metric);
+    if (metric.value() || metric.has_histogram()) {
+      report->add_metric()->Swap(&metric);
+    }
+  }
+}
+
+void CompilationDaemon::DoReport(const base::WorkerPool& pool) {
+  bool shutting_down;
+  do {
+    shutting_down =
+        pool.WaitUntilShutdown(Seconds(this->conf()->reporter().interval()));
+    PushReport();
+  } while (!shutting_down);
+}
+
+void CompilationDaemon::PushReport() {
+  auto conf = this->conf();
+
+  perf::proto::Report report;
+  report.set_host(conf->reporter().has_host() ? conf->reporter().host()
+                                              : HostName());
+  report.set_time(std::chrono::duration_cast<Seconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count());
+  DumpMetrics(&report);
+
+  // The deltas are taken once - the collectors, which fail, miss them.
+  for (const auto& collector : conf->reporter().collectors()) {
+    if (collector.disabled()) {
+      continue;
+    }
+
+    const String name =
+        collector.host() + ":" + std::to_string(collector.port());
+    auto optional = resolver_->Resolve(collector.host(), collector.port(),
+                                       collector.ipv6());
+    DCHECK(optional);
+    optional->Wait();
+    auto end_point = optional->GetValue();
+    if (!end_point) {
+      LOG(WARNING) << "Failed to resolve collector " << name;
+      continue;
+    }
+
+    String error;
+    auto connection = Connect(end_point, &error);
+    if (!connection) {
+      LOG(WARNING) << "Failed to connect to collector " << name << ": "
+                   << error;
+      continue;
+    }
+
+    net::proto::Status status;
+    if (!connection->SendSync(std::make_unique<perf::proto::Report>(report),
+                              &status)) {
+      LOG(WARNING) << "Failed to push report to collector " << name << ": "
+                   << status.description();
+      continue;
+    }
+
+    auto reply = std::make_unique<net::proto::Universal>();
+    if (!connection->ReadSync(reply.get(), &status) ||
+        !reply->HasExtension(net::proto::Status::extension) ||
+        reply->GetExtension(net::proto::Status::extension).code() !=
+            net::proto::Status::OK) {
+      LOG(WARNING) << "Collector " << name << " didn't accept the report";
+    }
+  }
+}
+
 CompilationDaemon::CompilationDaemon(const Configuration& conf)
     : BaseDaemon(conf) {
   // Setup log verbosity early - even before configuration integrity check.
@@ -168,6 +385,45 @@ HandledHash CompilationDaemon::GenerateHash(const base::proto::Flags& flags,
                                 CommandLineForSimpleCache(flags), version);
 }
 
+// static
+Immutable CompilationDaemon::RewriteBaseDir(const String& base_dir,
+                                            const String& current_dir,
+                                            Immutable text) {
+  const String base = GetBaseDir(base_dir, current_dir);
+  if (base.empty()) {
+    return text;
+  }
+
+  // Every path inside the base directory gets the same relative prefix - it
+  // doesn't depend on the location of the base directory.
+  String relative = ".";
+  if (current_dir.size() > base.size()) {
+    relative = "..";
+    for (auto i = current_dir.find('/', base.size() + 1); i != String::npos;
+         i = current_dir.find('/', i + 1)) {
+      relative += "/..";
+    }
+  }
+
+  String result = text.string_copy();
+  bool rewritten = false;
+  for (size_t pos = result.find(base); pos != String::npos;
+       pos = result.find(base, pos)) {
+    const size_t end = pos + base.size();
+    if ((pos == 0 || IsPathDelimiter(result[pos - 1])) &&
+        (end == result.size() || result[end] == '/' ||
+         IsPathDelimiter(result[end]))) {
+      result.replace(pos, base.size(), relative);
+      pos += relative.size();
+      rewritten = true;
+    } else {
+      pos = end;
+    }
+  }
+
+  return rewritten ? Immutable(std::move(result)) : text;
+}
+
 bool CompilationDaemon::SetupCompiler(base::proto::Flags* flags,
                                       net::proto::Status* status) const {
   // No flags - filled flags.
@@ -234,21 +490,77 @@ bool CompilationDaemon::ReadExtraFiles(const base::proto::Flags& flags,
   DCHECK(extra_files);
   DCHECK(extra_files->empty());
 
-  if (!flags.has_sanitize_blacklist()) {
+  if (flags.has_sanitize_blacklist()) {
+    Immutable sanitize_blacklist_contents;
+    const String sanitize_blacklist =
+        GetFullPath(current_dir, flags.sanitize_blacklist());
+    if (!base::File::Read(sanitize_blacklist, &sanitize_blacklist_contents)) {
+      LOG(CACHE_ERROR) << "Failed to read sanitize blacklist file"
+                       << sanitize_blacklist;
+      return false;
+    }
+    extra_files->emplace(cache::SANITIZE_BLACKLIST,
+                         std::move(sanitize_blacklist_contents));
+  }
+
+  // PCH and PCM files are identified by the hashes of their contents.
+  auto AddHashes = [&](cache::ExtraFileType type, const auto& files) {
+    if (files.empty()) {
+      return true;
+    }
+
+    List<String> hashes;
+    for (const auto& file : files) {
+      const String path = GetFullPath(current_dir, file);
+      Immutable contents;
+      if (!base::File::Read(path, &contents)) {
+        LOG(CACHE_ERROR) << "Failed to read included file " << path;
+        return false;
+      }
+      hashes.push_back(base::Hexify(contents.Hash()));
+    }
+    extra_files->emplace(type,
+                         base::JoinString<' '>(hashes.begin(), hashes.end()));
     return true;
+  };
+
+  return AddHashes(cache::INCLUDED_FILES, flags.included_files()) &&
+         AddHashes(cache::MODULE_FILES, flags.module_files());
+}
+
+// static
+bool CompilationDaemon::IsModuleBuild(const base::proto::Flags& flags) {
+  return flags.action() == "-emit-module";
+}
+
+// static
+bool CompilationDaemon::HasSystemHeaderDeps(const base::proto::Flags& flags) {
+  for (const auto& arg : flags.other()) {
+    for (const auto& value : arg.values()) {
+      if (value == "-sys-header-deps") {
+        return true;
+      }
+    }
   }
+  return false;
+}
 
-  Immutable sanitize_blacklist_contents;
-  const String sanitize_blacklist =
-      GetFullPath(current_dir, flags.sanitize_blacklist());
-  if (!base::File::Read(sanitize_blacklist, &sanitize_blacklist_contents)) {
-    LOG(CACHE_ERROR) << "Failed to read sanitize blacklist file"
-                     << sanitize_blacklist;
-    return false;
+// static
+cache::string::HandledSource CompilationDaemon::GenerateModuleSource(
+    const String& current_dir, Vector<Pair<String, String>> inputs) {
+  // Sort the inputs, since their order depends on who gathers them.
+  for (auto& input : inputs) {
+    input.first = GetFullPath(current_dir, input.first);
   }
-  extra_files->emplace(cache::SANITIZE_BLACKLIST,
-                       std::move(sanitize_blacklist_contents));
-  return true;
+  std::sort(inputs.begin(), inputs.end());
+  inputs.erase(std::unique(inputs.begin(), inputs.end()), inputs.end());
+
+  String source;
+  for (const auto& input : inputs) {
+    source += input.first + " " + input.second + "\n";
+  }
+
+  return HandledSource(Immutable(std::move(source)));
 }
 
 bool CompilationDaemon::SearchSimpleCache(
@@ -257,7 +569,16 @@ bool CompilationDaemon::SearchSimpleCache(
     return false;
   }
   Counter counter(Metric::SIMPLE_CACHE_LOOKUP_TIME);
-  return cache_->Find(hash, entry);
+  if (memory_cache_ && memory_cache_->Find(hash, entry)) {
+    return true;
+  }
+  if (!cache_->Find(hash, entry)) {
+    return false;
+  }
+  if (memory_cache_) {
+    memory_cache_->Store(hash, *entry);
+  }
+  return true;
 }
 
 bool CompilationDaemon::SearchDirectCache(
@@ -298,6 +619,103 @@ bool CompilationDaemon::SearchDirectCache(
   return true;
 }
 
+bool CompilationDaemon::SearchDirectHeaders(const base::proto::Flags& flags,
+                                            const String& current_dir,
+                                            UnhandledHash* hash,
+                                            List<String>* headers) const {
+  auto conf = this->conf();
+
+  DCHECK(conf->has_emitter() && !conf->has_absorber());
+  DCHECK(hash);
+  DCHECK(headers);
+
+  if (!cache_ || !conf->cache().direct()) {
+    return false;
+  }
+
+  DCHECK(flags.has_input());
+
+  const Version version(flags.compiler().version());
+  const String input = GetFullPath(current_dir, flags.input());
+  const CommandLine command_line(CommandLineForDirectCache(current_dir, flags));
+
+  UnhandledSource code;
+  if (!base::File::Read(input, &code.str)) {
+    return false;
+  }
+
+  ExtraFiles extra_files;
+  if (!ReadExtraFiles(flags, current_dir, &extra_files)) {
+    return false;
+  }
+
+  if (!cache_->FindHeaders(code, extra_files, command_line, version,
+                           headers)) {
+    return false;
+  }
+
+  *hash = cache::FileCache::Hash(code, extra_files, command_line, version);
+  return true;
+}
+
+bool CompilationDaemon::SearchDependCache(
+    const base::proto::Flags& flags, const String& current_dir,
+    SearchFn search, cache::FileCache::Entry* entry) const {
+  auto conf = this->conf();
+
+  DCHECK(conf->has_emitter() && !conf->has_absorber());
+  DCHECK(entry);
+
+  // Explicitly included PCH and PCM files aren't in the deps - and with "-MMD"
+  // the system headers aren't either.
+  if (!cache_ || !conf->cache().depend() || flags.included_files_size() ||
+      flags.module_files_size() || !HasSystemHeaderDeps(flags)) {
+    return false;
+  }
+
+  DCHECK(flags.has_input());
+
+  if (!search) {
+    search = [this](const HandledHash& hash, cache::FileCache::Entry* entry) {
+      return SearchSimpleCache(hash, entry);
+    };
+  }
+
+  UnhandledSource code;
+  if (!base::File::Read(GetFullPath(current_dir, flags.input()), &code.str)) {
+    return false;
+  }
+
+  ExtraFiles extra_files;
+  if (!ReadExtraFiles(flags, current_dir, &extra_files)) {
+    return false;
+  }
+
+  const auto headers_hash = DependHash(conf->cache().base_dir(), current_dir,
+                                       flags, code, extra_files);
+  cache::FileCache::Entry headers_entry;
+  if (!search(headers_hash, &headers_entry)) {
+    LOG(CACHE_INFO) << "Depend cache miss: " << flags.input();
+    return false;
+  }
+
+  List<String> headers;
+  base::SplitString<'\n'>(headers_entry.object, headers);
+
+  Immutable::Rope hash_rope;
+  for (const auto& header : headers) {
+    Immutable header_hash;
+    if (!base::File::Hash(GetFullPath(current_dir, header), &header_hash)) {
+      return false;
+    }
+    hash_rope.push_back(header_hash);
+  }
+
+  return search(DependHash(conf->cache().base_dir(), current_dir, flags, code,
+                           extra_files, Immutable(hash_rope)),
+                entry);
+}
+
 void CompilationDaemon::UpdateSimpleCache(
     const cache::string::HandledHash& hash,
     const cache::FileCache::Entry& entry) {
@@ -306,6 +724,9 @@ void CompilationDaemon::UpdateSimpleCache(
   }
   Counter counter(Metric::SIMPLE_CACHE_UPDATE_TIME);
   cache_->Store(hash, entry);
+  if (memory_cache_) {
+    memory_cache_->Store(hash, entry);
+  }
 }
 
 void CompilationDaemon::UpdateDirectCache(
@@ -318,6 +739,20 @@ void CompilationDaemon::UpdateDirectCache(
     return;
   }
 
+  const auto hash = GenerateHash(message->flags(), source, extra_files);
+  UpdateDirectCache(message, hash, extra_files, entry);
+}
+
+void CompilationDaemon::UpdateDirectCache(
+    const base::proto::Local* message, const HandledHash& hash,
+    const ExtraFiles& extra_files, const cache::FileCache::Entry& entry) {
+  auto conf = this->conf();
+  DCHECK(conf->has_emitter() && !conf->has_absorber());
+
+  if (!cache_ || !conf->cache().direct()) {
+    return;
+  }
+
   const auto& flags = message->flags();
   DCHECK(flags.has_input());
 
@@ -329,8 +764,6 @@ void CompilationDaemon::UpdateDirectCache(
   Counter counter(Metric::DIRECT_CACHE_UPDATE_TIME);
 
   const Version version(flags.compiler().version());
-  const auto hash = cache_->Hash(source, extra_files,
-                                 CommandLineForSimpleCache(flags), version);
   const auto command_line =
       CommandLineForDirectCache(message->current_dir(), flags);
   const String input_path = GetFullPath(message->current_dir(), flags.input());
@@ -348,11 +781,79 @@ void CompilationDaemon::UpdateDirectCache(
   }
 }
 
+void CompilationDaemon::UpdateDependCache(const base::proto::Local* message,
+                                          const ExtraFiles& extra_files,
+                                          const cache::FileCache::Entry& entry,
+                                          CacheEntries* entries) {
+  auto conf = this->conf();
+  DCHECK(conf->has_emitter() && !conf->has_absorber());
+
+  const auto& flags = message->flags();
+  if (!cache_ || !conf->cache().depend() || flags.included_files_size() ||
+      flags.module_files_size() || !HasSystemHeaderDeps(flags) ||
+      entry.deps.empty()) {
+    return;
+  }
+
+  DCHECK(flags.has_input());
+
+  const String& current_dir = message->current_dir();
+  const String input_path = GetFullPath(current_dir, flags.input());
+  List<String> headers;
+  UnhandledSource code;
+
+  if (!ParseDeps(entry.deps, headers) ||
+      !base::File::Read(input_path, &code.str)) {
+    LOG(CACHE_ERROR) << "Failed to parse deps or read input " << input_path;
+    return;
+  }
+
+  // The input itself is in the deps too - so the list is never empty.
+  List<String> normalized_headers;
+  Immutable::Rope hash_rope;
+  for (const auto& header : headers) {
+    String error;
+    Immutable header_hash;
+    const String header_path = GetFullPath(current_dir, header);
+    if (!base::File::Hash(header_path, &header_hash,
+                          {"__DATE__"_l, "__TIME__"_l}, &error)) {
+      LOG(CACHE_ERROR) << "Failed to hash " << header_path << ": " << error;
+      return;
+    }
+    hash_rope.push_back(header_hash);
+    normalized_headers.push_back(
+        RewriteBaseDir(conf->cache().base_dir(), current_dir,
+                       Immutable(header_path))
+            .string_copy());
+  }
+
+  cache::FileCache::Entry headers_entry;
+  headers_entry.object = base::JoinString<'\n'>(normalized_headers.begin(),
+                                                normalized_headers.end());
+  const auto headers_hash = DependHash(conf->cache().base_dir(), current_dir,
+                                       flags, code, extra_files);
+  const auto hash = DependHash(conf->cache().base_dir(), current_dir, flags,
+                               code, extra_files, Immutable(hash_rope));
+
+  cache_->Store(headers_hash, headers_entry);
+  cache_->Store(hash, entry);
+
+  if (entries) {
+    entries->emplace_back(headers_hash, headers_entry);
+    entries->emplace_back(hash, entry);
+  }
+}
+
 bool CompilationDaemon::Check(const Configuration& conf) const {
   if (!BaseDaemon::Check(conf)) {
     return false;
   }
 
+  if (conf.reporter().collectors_size() && !conf.reporter().interval()) {
+    LOG(ERROR) << "Interval for pushing reports to collectors can't be zero";
+    return false;
+  }
+
   for (const auto& version : conf.versions()) {
     if (!version.has_path() || version.path().empty()) {
       LOG(ERROR) << "Compiler " << version.version() << " has no path.";
@@ -370,6 +871,29 @@ bool CompilationDaemon::Check(const Configuration& conf) const {
   return true;
 }
 
+// static
+void CompilationDaemon::SetOutputs(const cache::FileCache::Entry& entry,
+                                   proto::Result* result) {
+  DCHECK(result);
+
+  for (const auto& output : entry.outputs) {
+    auto* new_output = result->add_outputs();
+    new_output->set_name(output.first);
+    new_output->set_content(output.second);
+  }
+}
+
+// static
+void CompilationDaemon::GetOutputs(proto::Result* result,
+                                   cache::FileCache::Entry* entry) {
+  DCHECK(result && entry);
+
+  for (auto& output : *result->mutable_outputs()) {
+    entry->outputs.emplace(output.name(),
+                           Immutable(output.release_content()));
+  }
+}
+
 // static
 base::ProcessPtr CompilationDaemon::CreateProcess(
     const base::proto::Flags& flags, ui32 user_id, const Path& cwd_path) {
@@ -398,6 +922,10 @@ base::ProcessPtr CompilationDaemon::CreateProcess(
     process->AppendArg(Immutable("-fsanitize-blacklist="_l) +
                        Immutable(flags.sanitize_blacklist()));
   }
+  for (const auto& output : flags.outputs()) {
+    process->AppendArg(Immutable(output.flag()))
+        .AppendArg(Immutable(output.path()));
+  }
   if (flags.has_output()) {
     process->AppendArg("-o"_l).AppendArg(Immutable(flags.output()));
   }
@@ -1,14 +1,33 @@
 #pragma once
 
 #include <base/process_forward.h>
+#include <base/worker_pool.h>
 #include <cache/file_cache.h>
+#include <cache/memory_cache.h>
 #include <daemon/base_daemon.h>
 
 namespace dist_clang {
+
+namespace perf {
+namespace proto {
+class Report;
+class TraceDump;
+}  // namespace proto
+}  // namespace perf
+
 namespace daemon {
 
+namespace proto {
+class Result;
+}  // namespace proto
+
 class CompilationDaemon : public BaseDaemon {
  public:
+  using SearchFn = Fn<bool(const cache::string::HandledHash&,
+                           cache::FileCache::Entry*)>;
+  using CacheEntries =
+      List<Pair<cache::string::HandledHash, cache::FileCache::Entry>>;
+
   bool Initialize() override;
 
   static base::ProcessPtr CreateProcess(const base::proto::Flags& flags,
@@ -21,6 +40,32 @@ class CompilationDaemon : public BaseDaemon {
       const base::proto::Flags& flags, const cache::string::HandledSource& code,
       const cache::ExtraFiles& extra_files);
 
+  // Explicit module builds take a module map - not a source to preprocess.
+  static bool IsModuleBuild(const base::proto::Flags& flags);
+
+  // Checks that the deps list the system headers too - unlike with "-MMD".
+  static bool HasSystemHeaderDeps(const base::proto::Flags& flags);
+
+  // Module maps can't be preprocessed - instead the handled source of a module
+  // lists the full paths of all its |inputs| with the hex hashes of contents.
+  static cache::string::HandledSource GenerateModuleSource(
+      const String& current_dir, Vector<Pair<String, String>> inputs);
+
+  // Rewrites absolute paths inside the |base_dir| relative to the
+  // |current_dir|, if it's inside the |base_dir| too - so the same checkout at
+  // different locations gives the same text.
+  static Immutable RewriteBaseDir(const String& base_dir,
+                                  const String& current_dir, Immutable text);
+
+  // Move the extra outputs between a cache entry and a remote result.
+  static void SetOutputs(const cache::FileCache::Entry& entry,
+                         proto::Result* result);
+  static void GetOutputs(proto::Result* result,
+                         cache::FileCache::Entry* entry);
+
+  // Moves the deltas of all non-empty metrics into |report|.
+  static void DumpMetrics(perf::proto::Report* report);
+
  protected:
   explicit CompilationDaemon(const Configuration& conf);
 
@@ -38,6 +83,22 @@ class CompilationDaemon : public BaseDaemon {
                          const String& current_dir,
                          cache::FileCache::Entry* entry) const;
 
+  // Gets the source and headers, which the input depended on the last time it
+  // was stored in the direct cache, - without checking that they are still
+  // the same. The |hash| identifies the unpreprocessed input.
+  bool SearchDirectHeaders(const base::proto::Flags& flags,
+                           const String& current_dir,
+                           cache::string::UnhandledHash* hash,
+                           List<String>* headers) const;
+
+  // Looks up the result by the unpreprocessed input, the command line and the
+  // headers from the deps of the last compilation. Both the list of headers
+  // and the result are simple entries with keys independent of the current
+  // directory - the |search| may look them up on other hosts too.
+  bool SearchDependCache(const base::proto::Flags& flags,
+                         const String& current_dir, SearchFn search,
+                         cache::FileCache::Entry* entry) const;
+
   void UpdateSimpleCache(const cache::string::HandledHash& hash,
                          const cache::FileCache::Entry& entry);
 
@@ -45,16 +106,43 @@ class CompilationDaemon : public BaseDaemon {
                          const cache::string::HandledSource& source,
                          const cache::ExtraFiles& extra_files,
                          const cache::FileCache::Entry& entry);
+  void UpdateDirectCache(const base::proto::Local* message,
+                         const cache::string::HandledHash& hash,
+                         const cache::ExtraFiles& extra_files,
+                         const cache::FileCache::Entry& entry);
+
+  // Returns the stored entries in |entries| - to share them with others.
+  void UpdateDependCache(const base::proto::Local* message,
+                         const cache::ExtraFiles& extra_files,
+                         const cache::FileCache::Entry& entry,
+                         CacheEntries* entries = nullptr);
+
+  // Gets the list of input files from the contents of a deps file.
+  static bool ParseDeps(String deps, List<String>& headers);
+
+  // Writes the kept spans in the Chrome trace format to the path from |dump|,
+  // and reports the status.
+  bool DumpTrace(net::ConnectionPtr connection,
+                 const perf::proto::TraceDump& dump);
 
   bool Check(const Configuration& conf) const override;
-  inline bool Reload(const Configuration& conf) override {
-    return BaseDaemon::Reload(conf);
-  }
+  // Starts or stops the reporter - if the collectors appear or disappear.
+  bool Reload(const Configuration& conf) override;
 
  private:
   using PluginNameMap = HashMap<String /* name */, String /* path */>;
 
+  // Pushes the deltas of metrics to the collectors at the interval - and once
+  // more on shutdown, so the last deltas aren't lost.
+  void DoReport(const base::WorkerPool& pool);
+  void PushReport();
+
   UniquePtr<cache::FileCache> cache_;
+  UniquePtr<cache::MemoryCache> memory_cache_;
+  // The hot tier in front of the simple entries of |cache_|.
+
+  Mutex reporter_mutex_;
+  UniquePtr<base::WorkerPool> reporter_workers_;
 };
 
 }  // namespace daemon
@@ -1,6 +1,7 @@
 #include <daemon/compilation_daemon.h>
 
 #include <base/process.h>
+#include <base/string_utils.h>
 
 #include <third_party/gtest/exported/include/gtest/gtest.h>
 
@@ -62,5 +63,75 @@ TEST(CompilationDaemonTest, CreateProcessFromFlags) {
   }
 }
 
+TEST(CompilationDaemonTest, HashDependsOnAction) {
+  using namespace cache::string;
+
+  const HandledSource code("int main() { return 0; }"_l);
+
+  base::proto::Flags flags;
+  flags.mutable_compiler()->set_version("fake_compiler_version");
+  flags.add_other()->add_values("-cc1");
+  flags.set_language("c++");
+
+  flags.set_action("-emit-obj");
+  const auto object_hash = CompilationDaemon::GenerateHash(flags, code, {});
+  flags.set_action("-S");
+  const auto assembly_hash = CompilationDaemon::GenerateHash(flags, code, {});
+  flags.set_action("-fsyntax-only");
+  const auto syntax_hash = CompilationDaemon::GenerateHash(flags, code, {});
+
+  EXPECT_FALSE(object_hash == assembly_hash);
+  EXPECT_FALSE(object_hash == syntax_hash);
+  EXPECT_FALSE(assembly_hash == syntax_hash);
+
+  // Objects keep the keys, which they had before.
+  EXPECT_EQ(cache::FileCache::Hash(code, {}, CommandLine("-cc1 -x c++"_l),
+                                   Version("fake_compiler_version"_l)),
+            object_hash);
+}
+
+TEST(CompilationDaemonTest, RewriteBaseDir) {
+  const String preprocessed =
+      "# 1 \"/home/user/src/test.cc\"\n"
+      "# 1 \"/home/user/src/include/header.h\" 1\n"
+      "const char* f = \"/home/user/src\";\n"
+      "# 1 \"/home/user/src2/other.h\" 1\n"
+      "# 1 \"/usr/include/stdio.h\" 3\n";
+  const String expected =
+      "# 1 \"../../test.cc\"\n"
+      "# 1 \"../../include/header.h\" 1\n"
+      "const char* f = \"../..\";\n"
+      "# 1 \"/home/user/src2/other.h\" 1\n"
+      "# 1 \"/usr/include/stdio.h\" 3\n";
+
+  // Same relative location in different checkouts gives the same text.
+  EXPECT_EQ(expected,
+            CompilationDaemon::RewriteBaseDir("/home/user/src/",
+                                              "/home/user/src/out/debug",
+                                              Immutable(preprocessed))
+                .string_copy());
+
+  String other = preprocessed;
+  base::Replace(other, "/home/user/src/", "/ci/build-1234/");
+  base::Replace(other, "\"/home/user/src\"", "\"/ci/build-1234\"");
+  EXPECT_EQ(expected,
+            CompilationDaemon::RewriteBaseDir("/ci/build-1234",
+                                              "/ci/build-1234/out/debug",
+                                              Immutable(other))
+                .string_copy());
+
+  const auto deps = "test.o: /home/user/src/test.cc header.h"_l;
+  EXPECT_EQ("test.o: ./test.cc header.h",
+            CompilationDaemon::RewriteBaseDir("/home/user/src",
+                                              "/home/user/src", deps)
+                .string_copy());
+
+  // The current directory is outside of the base one.
+  EXPECT_EQ(deps, CompilationDaemon::RewriteBaseDir("/home/user/src",
+                                                    "/home/user", deps));
+  EXPECT_EQ(deps, CompilationDaemon::RewriteBaseDir(String(), "/home/user/src",
+                                                    deps));
+}
+
 }  // namespace daemon
 }  // namespace dist_clang
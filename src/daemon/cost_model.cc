@@ -0,0 +1,171 @@
+#include <daemon/cost_model.h>
+
+#include <base/assert.h>
+#include <base/base.pb.h>
+#include <base/hasher.h>
+#include <base/logging.h>
+#include <base/protobuf_utils.h>
+#include <base/string_utils.h>
+#include <daemon/cost_model.pb.h>
+
+#include <base/using_log.h>
+
+namespace dist_clang {
+namespace daemon {
+
+CostModel::CostModel(const Path& path, ui32 max_size)
+    : path_(path), max_size_(max_size) {
+  DCHECK(max_size_ > 0);
+  if (!path_.empty()) {
+    Load();
+  }
+}
+
+CostModel::~CostModel() {
+  if (!path_.empty()) {
+    Save();
+  }
+}
+
+// static
+String CostModel::MakeKey(const base::proto::Local& message) {
+  const auto& flags = message.flags();
+
+  // Only the flags, which affect the compilation time, are digested - the
+  // compiler path and plugins are set up after the task is queued.
+  base::Hasher hasher;
+  auto Update = [&hasher](const String& str) {
+    hasher.Update(str.data(), str.size() + 1);  // Including the '\0'.
+  };
+  Update(flags.compiler().version());
+  Update(flags.action());
+  Update(flags.language());
+  for (const auto* args : {&flags.other(), &flags.cc_only(),
+                           &flags.non_cached(), &flags.non_direct()}) {
+    for (const auto& arg : *args) {
+      for (const auto& value : arg.values()) {
+        Update(value);
+      }
+    }
+  }
+
+  const String& input = flags.input();
+  const String full_path =
+      input.empty() || input[0] == '/' ? input
+                                       : message.current_dir() + "/" + input;
+  return full_path + " " + base::Hexify(hasher.Digest(8));
+}
+
+Milliseconds CostModel::Predict(const String& key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    return Milliseconds(it->second->second);
+  }
+  return GetAverage();
+}
+
+Milliseconds CostModel::Average() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return GetAverage();
+}
+
+void CostModel::Update(const String& key, const Milliseconds& time) {
+  const ui64 cost = time.count() > 0 ? time.count() : 0;
+  bool save = false;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // The weight of older compilations halves with each new one - the sources
+    // do change.
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      Put(key, cost);
+    } else {
+      const ui64 new_cost = (it->second->second + cost) / 2;
+      total_cost_ += new_cost;
+      total_cost_ -= it->second->second;
+      it->second->second = new_cost;
+      items_.splice(items_.begin(), items_, it->second);
+    }
+
+    if (++updates_ == kSaveInterval) {
+      updates_ = 0;
+      save = !path_.empty();
+    }
+  }
+
+  if (save) {
+    Save();
+  }
+}
+
+bool CostModel::Save() const {
+  proto::CostModel model;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& item : items_) {
+      auto* entry = model.add_entries();
+      entry->set_key(item.first);
+      entry->set_cost(item.second);
+    }
+  }
+
+  String error;
+  if (!base::SaveToFile(path_, model, &error)) {
+    LOG(WARNING) << "Failed to save cost model to " << path_ << " : "
+                 << error;
+    return false;
+  }
+
+  return true;
+}
+
+void CostModel::Load() {
+  // There is no history yet on the first run.
+  proto::CostModel model;
+  String error;
+  if (!base::LoadFromFile(path_, &model, &error)) {
+    LOG(VERBOSE) << "Failed to load cost model from " << path_ << " : "
+                 << error;
+    return;
+  }
+
+  for (const auto& entry : model.entries()) {
+    if (items_.size() == max_size_) {
+      break;
+    }
+    if (!index_.count(entry.key())) {
+      Put(entry.key(), entry.cost());
+      // Keep the order of the file.
+      items_.splice(items_.end(), items_, items_.begin());
+    }
+  }
+
+  LOG(INFO) << "Cost model is loaded with " << items_.size() << " entries";
+}
+
+Milliseconds CostModel::GetAverage() const {
+  if (items_.empty()) {
+    return Milliseconds::zero();
+  }
+  return Milliseconds(total_cost_ / items_.size());
+}
+
+void CostModel::Put(const String& key, ui64 cost) {
+  if (items_.size() == max_size_) {
+    total_cost_ -= items_.back().second;
+    index_.erase(items_.back().first);
+    items_.pop_back();
+  }
+
+  items_.emplace_front(key, cost);
+  index_.emplace(key, items_.begin());
+  total_cost_ += cost;
+  size_ = items_.size();
+}
+
+}  // namespace daemon
+}  // namespace dist_clang
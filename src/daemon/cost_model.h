@@ -0,0 +1,63 @@
+#pragma once
+
+#include <base/attributes.h>
+#include <base/types.h>
+
+#include STL(mutex)
+
+namespace dist_clang {
+
+namespace base {
+namespace proto {
+class Local;
+}  // namespace proto
+}  // namespace base
+
+namespace daemon {
+
+// Predicts the compilation time of a translation unit by the history of its
+// previous compilations - either local or remote ones. The units are told
+// apart by the full path of the input and the digest of flags.
+//
+// The history is bounded: the least recently updated units are forgotten.
+class CostModel {
+ public:
+  // The history is persisted at |path| - if it's not empty.
+  explicit CostModel(const Path& path = Path(), ui32 max_size = 1u << 16);
+  ~CostModel();
+
+  static String MakeKey(const base::proto::Local& message);
+
+  // The unknown units are predicted to take an average time.
+  Milliseconds Predict(const String& key) const THREAD_SAFE;
+  void Update(const String& key, const Milliseconds& time) THREAD_SAFE;
+
+  // The average time of all known units.
+  Milliseconds Average() const THREAD_SAFE;
+
+  bool Save() const THREAD_SAFE;
+
+  inline ui32 size() const THREAD_SAFE { return size_; }
+
+ private:
+  enum : ui32 { kSaveInterval = 1024 };
+
+  using Item = Pair<String /* key */, ui64 /* cost in milliseconds */>;
+
+  void Load() THREAD_UNSAFE;
+  Milliseconds GetAverage() const THREAD_UNSAFE;
+  void Put(const String& key, ui64 cost) THREAD_UNSAFE;
+
+  const Path path_;
+  const ui32 max_size_;
+
+  mutable std::mutex mutex_;
+  List<Item> items_;  // The most recently updated go first.
+  HashMap<String, List<Item>::iterator> index_;
+  ui64 total_cost_ = 0;
+  ui32 updates_ = 0;
+  Atomic<ui32> size_ = {0};
+};
+
+}  // namespace daemon
+}  // namespace dist_clang
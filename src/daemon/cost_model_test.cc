@@ -0,0 +1,87 @@
+#include <daemon/cost_model.h>
+
+#include <base/base.pb.h>
+#include <base/temporary_dir.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+namespace dist_clang {
+namespace daemon {
+
+TEST(CostModelTest, KeyDependsOnInputAndFlags) {
+  base::proto::Local message;
+  message.set_current_dir("/tmp/build");
+  auto* flags = message.mutable_flags();
+  flags->mutable_compiler()->set_version("clang");
+  flags->set_action("-emit-obj");
+  flags->set_input("test.cc");
+  flags->add_other()->add_values("-O2");
+
+  const String key = CostModel::MakeKey(message);
+  EXPECT_EQ(0u, key.find("/tmp/build/test.cc "));
+
+  // The compiler path is set up later - it doesn't change the key.
+  flags->mutable_compiler()->set_path("/usr/bin/clang");
+  flags->set_output("test.o");
+  EXPECT_EQ(key, CostModel::MakeKey(message));
+
+  flags->mutable_other(0)->set_values(0, "-O0");
+  const String other_key = CostModel::MakeKey(message);
+  EXPECT_NE(key, other_key);
+
+  flags->set_input("/tmp/build/test.cc");
+  flags->mutable_other(0)->set_values(0, "-O2");
+  EXPECT_EQ(key, CostModel::MakeKey(message));
+}
+
+TEST(CostModelTest, PredictsFromHistory) {
+  CostModel model(Path(), 2);
+  EXPECT_EQ(Milliseconds::zero(), model.Predict("unknown"));
+
+  model.Update("key1", Milliseconds(1000));
+  EXPECT_EQ(Milliseconds(1000), model.Predict("key1"));
+  model.Update("key1", Milliseconds(3000));
+  EXPECT_EQ(Milliseconds(2000), model.Predict("key1"));
+
+  // The unknown units take an average time.
+  model.Update("key2", Milliseconds(4000));
+  EXPECT_EQ(Milliseconds(3000), model.Predict("unknown"));
+  EXPECT_EQ(Milliseconds(3000), model.Average());
+
+  // The least recently updated unit is forgotten.
+  model.Update("key1", Milliseconds(2000));
+  model.Update("key3", Milliseconds(6000));
+  EXPECT_EQ(2u, model.size());
+  EXPECT_EQ(Milliseconds(2000), model.Predict("key1"));
+  EXPECT_EQ(Milliseconds(6000), model.Predict("key3"));
+  EXPECT_EQ(Milliseconds(4000), model.Predict("key2"));
+}
+
+TEST(CostModelTest, PersistsHistory) {
+  const base::TemporaryDir temp_dir;
+  const Path path = temp_dir.path() / "cost_model";
+
+  {
+    CostModel model(path, 2);
+    model.Update("key1", Milliseconds(1000));
+    model.Update("key2", Milliseconds(2000));
+    model.Update("key3", Milliseconds(3000));
+  }
+
+  {
+    CostModel model(path, 2);
+    EXPECT_EQ(2u, model.size());
+    EXPECT_EQ(Milliseconds(2000), model.Predict("key2"));
+    EXPECT_EQ(Milliseconds(3000), model.Predict("key3"));
+
+    // The most recently updated units are kept, when the history is shrunk.
+    model.Update("key2", Milliseconds(4000));
+  }
+
+  CostModel model(path, 1);
+  EXPECT_EQ(1u, model.size());
+  EXPECT_EQ(Milliseconds(3000), model.Predict("key2"));
+}
+
+}  // namespace daemon
+}  // namespace dist_clang
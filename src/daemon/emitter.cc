@@ -3,14 +3,20 @@
 #include <base/file/file.h>
 #include <base/logging.h>
 #include <base/process.h>
+#include <base/string_utils.h>
+#include <daemon/cost_model.h>
 #include <net/connection.h>
 #include <net/end_point.h>
 #include <perf/counter.h>
 #include <perf/stat_reporter.h>
 #include <perf/stat_service.h>
+#include <perf/trace.pb.h>
+#include <perf/trace_reporter.h>
+#include <perf/trace_service.h>
 
 #include <base/using_log.h>
 
+#include STL(cmath)
 #include STL(random)
 
 using namespace std::placeholders;
@@ -21,9 +27,48 @@ using perf::proto::Metric;
 
 template <bool ReportByDefault = true>
 using Counter = perf::Counter<perf::StatReporter, ReportByDefault>;
+using Span = perf::Counter<perf::TraceReporter>;
 
 namespace {
 
+// Calls |fn| within the span |name| of the task's trace.
+template <class F>
+inline auto Traced(Literal name, ui64 trace_id, F&& fn) {
+  Span span(name, trace_id);
+  return fn();
+}
+
+// Moving average, which forgets the older samples gradually.
+inline void UpdateAverage(double* average, double sample) {
+  *average = *average ? (*average * 3 + sample) / 4 : sample;
+}
+
+inline double ToMilliseconds(const Clock::duration& time) {
+  return std::chrono::duration<double, std::milli>(time).count();
+}
+
+// Only the diagnostics of a compiler, which has exited by itself, are
+// deterministic - unlike the crashes and the failures to run the compiler, to
+// load a plugin or to write the output.
+inline bool IsCacheableFailure(const base::Process& process) {
+  static const char* const kEnvironmentErrors[] = {
+      "Failed to execute",          "unable to execute command",
+      "frontend command failed",    "unable to load plugin",
+      "unable to open output file", "No space left on device",
+      "Cannot allocate memory",     "out of memory",
+  };
+
+  if (process.exit_code() <= 0 || process.stderr().empty()) {
+    return false;
+  }
+  for (const auto* message : kEnvironmentErrors) {
+    if (process.stderr().find(message) != String::npos) {
+      return false;
+    }
+  }
+  return true;
+}
+
 // Select a new shard, different from current.
 inline ui32 FindNewShard(const ui32 total_shards, const ui32 current_shard) {
   thread_local static std::random_device random_device;
@@ -35,6 +80,38 @@ inline ui32 FindNewShard(const ui32 total_shards, const ui32 current_shard) {
   return new_shard;
 }
 
+// Implements "A Fast, Minimal Memory, Consistent Hash Algorithm" by John
+// Lamping and Eric Veach.
+inline ui32 JumpConsistentHash(ui64 key, const ui32 total_buckets) {
+  i64 bucket = -1, next = 0;
+  while (next < static_cast<i64>(total_buckets)) {
+    bucket = next;
+    key = key * 2862933555777941757LLU + 1;
+    next = static_cast<i64>((bucket + 1) *
+                            (static_cast<double>(1LLU << 31) /
+                             static_cast<double>((key >> 33) + 1)));
+  }
+  return static_cast<ui32>(bucket);
+}
+
+// Mixes the key with a bucket number using the MurmurHash3 finalizer.
+inline ui64 MixBucket(ui64 key, const ui32 bucket) {
+  key ^= (bucket + 1) * 0x9e3779b97f4a7c15LLU;
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdLLU;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53LLU;
+  key ^= key >> 33;
+  return key;
+}
+
+inline ui64 ShardKey(const cache::string::HandledHash& handled_hash) {
+  ui64 key;
+  Immutable hash = handled_hash.str.Hash(sizeof(key));
+  memcpy(&key, hash.data(), sizeof(key));
+  return key;
+}
+
 inline String GetOutputPath(const base::proto::Local* WEAK_PTR message) {
   DCHECK(message);
   if (message->flags().output()[0] == '/') {
@@ -53,9 +130,101 @@ inline String GetDepsPath(const base::proto::Local* WEAK_PTR message) {
   }
 }
 
+inline String GetFullPath(const base::proto::Local* WEAK_PTR message,
+                          const String& path) {
+  DCHECK(message);
+  if (path[0] == '/') {
+    return path;
+  } else {
+    return message->current_dir() + "/" + path;
+  }
+}
+
+// Syntax-only compilations have nothing but diagnostics.
+inline bool HasObject(const base::proto::Local* WEAK_PTR message) {
+  DCHECK(message);
+  return message->flags().action() != "-fsyntax-only";
+}
+
+bool WriteObject(const base::proto::Local* WEAK_PTR message,
+                 Immutable object) {
+  if (!HasObject(message)) {
+    return true;
+  }
+
+  const String output_path = GetOutputPath(message);
+  String error;
+  if (!base::File::Write(output_path, object, &error)) {
+    LOG(ERROR) << "Failed to write object " << output_path << " : " << error;
+    return false;
+  }
+  if (message->has_user_id() &&
+      !base::ChangeOwner(output_path, message->user_id(), &error)) {
+    LOG(ERROR) << "Failed to change owner for " << output_path << " : "
+               << error;
+  }
+
+  return true;
+}
+
+// Reads the extra outputs of a finished compilation into the |entry|.
+bool ReadOutputs(const base::proto::Local* WEAK_PTR message,
+                 cache::FileCache::Entry* entry) {
+  DCHECK(message);
+  DCHECK(entry);
+
+  for (const auto& output : message->flags().outputs()) {
+    const String path = GetFullPath(message, output.path());
+    String error;
+    if (!base::File::Read(path, &entry->outputs[output.name()], &error)) {
+      LOG(CACHE_WARNING) << "Can't read output " << path << " : " << error;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// The entries from older caches and remotes may not have all the outputs.
+bool HasOutputs(const base::proto::Local* WEAK_PTR message,
+                const cache::FileCache::Entry& entry) {
+  DCHECK(message);
+
+  for (const auto& output : message->flags().outputs()) {
+    if (!entry.outputs.count(output.name())) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool WriteOutputs(const base::proto::Local* WEAK_PTR message,
+                  const cache::FileCache::Entry& entry) {
+  DCHECK(message);
+  DCHECK(HasOutputs(message, entry));
+
+  for (const auto& output : message->flags().outputs()) {
+    const String path = GetFullPath(message, output.path());
+    String error;
+    if (!base::File::Write(path, entry.outputs.at(output.name()), &error)) {
+      LOG(ERROR) << "Failed to write output " << path << " : " << error;
+      return false;
+    }
+    if (message->has_user_id() &&
+        !base::ChangeOwner(path, message->user_id(), &error)) {
+      LOG(ERROR) << "Failed to change owner for " << path << " : " << error;
+    }
+  }
+
+  return true;
+}
+
 inline bool GenerateSource(const base::proto::Local* WEAK_PTR message,
+                           const String& base_dir,
                            cache::string::HandledSource* source) {
   Counter<> preprocess_time_counter(Metric::PREPROCESS_TIME);
+  Span span("Preprocess"_l, message->trace_id());
   base::proto::Flags pp_flags;
 
   DCHECK(message);
@@ -70,6 +239,9 @@ inline bool GenerateSource(const base::proto::Local* WEAK_PTR message,
   // Sanitizer blacklist can't affect source code
   pp_flags.clear_sanitize_blacklist();
 
+  // The extra outputs are written only by the compilation.
+  pp_flags.clear_outputs();
+
   base::ProcessPtr process;
   if (message->has_user_id()) {
     process = daemon::CompilationDaemon::CreateProcess(
@@ -84,7 +256,8 @@ inline bool GenerateSource(const base::proto::Local* WEAK_PTR message,
   }
 
   if (source) {
-    source->str.assign(process->stdout());
+    source->str.assign(daemon::CompilationDaemon::RewriteBaseDir(
+        base_dir, message->current_dir(), process->stdout()));
   }
 
   return true;
@@ -94,7 +267,91 @@ inline bool GenerateSource(const base::proto::Local* WEAK_PTR message,
 
 namespace daemon {
 
-const ui32 Emitter::max_total_shards = 1024u;
+const ui32 Emitter::max_total_shards = 1u << 16;
+
+bool Emitter::ProbeHistory::ShouldProbe(
+    const cache::string::HandledHash& handled_hash) {
+  UniqueLock lock(mutex_);
+
+  // The same task may come back to the remote after a failure.
+  if (misses_.count(handled_hash.str)) {
+    return false;
+  }
+
+  // Keep probing from time to time - to notice when the remote gets warm.
+  if (consecutive_misses_ >= kMaxConsecutiveMisses) {
+    return ++skipped_probes_ % kMaxConsecutiveMisses == 0;
+  }
+
+  return true;
+}
+
+void Emitter::ProbeHistory::Update(
+    const cache::string::HandledHash& handled_hash, bool hit) {
+  UniqueLock lock(mutex_);
+
+  if (hit) {
+    consecutive_misses_ = 0;
+    skipped_probes_ = 0;
+    return;
+  }
+
+  ++consecutive_misses_;
+  if (misses_.insert(handled_hash.str).second) {
+    misses_order_.push_back(handled_hash.str);
+    if (misses_order_.size() > kMaxRememberedMisses) {
+      misses_.erase(misses_order_.front());
+      misses_order_.pop_front();
+    }
+  }
+}
+
+bool Emitter::RemoteEstimate::Predict(ui64 upload_size,
+                                      const Milliseconds& cost,
+                                      Milliseconds* time) {
+  DCHECK(time);
+  UniqueLock lock(mutex_);
+
+  if (!slowdown_ || ++predictions_ % kExplorationPeriod == 0) {
+    return false;
+  }
+
+  // The small uploads may be not measured yet - they're cheap anyway.
+  double total = round_trip_ + cost.count() * slowdown_;
+  if (throughput_) {
+    total += upload_size / throughput_;
+  }
+  *time = Milliseconds(static_cast<Milliseconds::rep>(total));
+  return true;
+}
+
+void Emitter::RemoteEstimate::UpdateConnect(const Clock::duration& time) {
+  UniqueLock lock(mutex_);
+  UpdateAverage(&round_trip_, ToMilliseconds(time));
+}
+
+void Emitter::RemoteEstimate::UpdateUpload(ui64 size,
+                                           const Clock::duration& time) {
+  // The small messages just get into the socket buffer - they tell nothing
+  // about the link.
+  const double milliseconds = ToMilliseconds(time);
+  if (size < kMinUploadSize || milliseconds <= 0) {
+    return;
+  }
+
+  UniqueLock lock(mutex_);
+  UpdateAverage(&throughput_, size / milliseconds);
+}
+
+void Emitter::RemoteEstimate::UpdateReply(const Milliseconds& cost,
+                                          const Clock::duration& time) {
+  if (cost <= Milliseconds::zero()) {
+    return;
+  }
+
+  UniqueLock lock(mutex_);
+  UpdateAverage(&slowdown_, ToMilliseconds(time) / cost.count());
+}
 
 Emitter::Emitter(const proto::Configuration& conf) : CompilationDaemon(conf) {
   using Worker = base::WorkerPool::SimpleWorker;
@@ -103,10 +360,47 @@ Emitter::Emitter(const proto::Configuration& conf) : CompilationDaemon(conf) {
 
   workers_ = std::make_unique<base::WorkerPool>();
   coordinator_workers_ = std::make_unique<base::WorkerPool>(true);
-  all_tasks_ = std::make_unique<Queue>(Seconds(conf.emitter().pop_timeout()));
+  all_tasks_ = std::make_unique<Queue>(
+      Seconds(conf.emitter().pop_timeout()),
+      conf.emitter().shard_lifo() ? Queue::LIFO : Queue::FIFO);
   cache_tasks_ = std::make_unique<Queue>();
   failed_tasks_ = std::make_unique<Queue>();
 
+  if (conf.emitter().longest_first() || conf.emitter().place_by_cost()) {
+    Path cost_model_path;
+    if (conf.has_cache()) {
+      cost_model_path = Path(conf.cache().path()) / "cost_model";
+    }
+    cost_model_ = std::make_unique<CostModel>(cost_model_path);
+  }
+
+  if (conf.emitter().longest_first()) {
+    auto cost = [this](const Task& task) {
+      return cost_model_->Predict(
+          CostModel::MakeKey(*std::get<MESSAGE>(task)));
+    };
+    all_tasks_->OrderByCost(cost);
+    failed_tasks_->OrderByCost(cost);
+  }
+
+  // Each queue has its own metric - a task may pass through several of them.
+  auto wait = [](Literal name, Metric::Name metric) {
+    return [name, metric](const Task& task, const Clock::duration& wait) {
+      base::Singleton<perf::StatService>::Get().Record(
+          metric, std::chrono::duration_cast<Milliseconds>(wait).count());
+
+      const auto now = Clock::now();
+      base::Singleton<perf::TraceService>::Get().Add(
+          name, std::get<MESSAGE>(task)->trace_id(), now - wait, now);
+    };
+  };
+  all_tasks_->ObserveWait(
+      wait("Shard queue"_l, Metric::SHARD_QUEUE_WAIT_TIME));
+  cache_tasks_->ObserveWait(
+      wait("Cache queue"_l, Metric::CACHE_QUEUE_WAIT_TIME));
+  failed_tasks_->ObserveWait(
+      wait("Local queue"_l, Metric::LOCAL_QUEUE_WAIT_TIME));
+
   local_tasks_ = std::make_unique<QueueAggregator>();
   local_tasks_->Aggregate(failed_tasks_.get());
   if (!conf.emitter().only_failed()) {
@@ -120,6 +414,26 @@ Emitter::Emitter(const proto::Configuration& conf) : CompilationDaemon(conf) {
   }
 
   if (conf.has_cache() && !conf.cache().disabled()) {
+    const auto& cache_server = conf.emitter().cache_server();
+    if (conf.emitter().has_cache_server() && !cache_server.disabled()) {
+      cache_server_resolver_ = [
+        this, host = cache_server.host(),
+        port = static_cast<ui16>(cache_server.port()),
+        ipv6 = cache_server.ipv6()
+      ]() {
+        auto optional = resolver_->Resolve(host, port, ipv6);
+        DCHECK(optional);
+        optional->Wait();
+        return optional->GetValue();
+      };
+
+      cache_server_tasks_ =
+          std::make_unique<CacheUpdateQueue>(conf.pool_capacity());
+      Worker worker = std::bind(&Emitter::DoUpdateCacheServer, this, _1);
+      workers_->AddWorker("Cache Server Update Worker"_l, worker,
+                          cache_server.threads());
+    }
+
     Worker worker = std::bind(&Emitter::DoCheckCache, this, _1);
     if (conf.cache().has_threads()) {
       workers_->AddWorker("Cache Worker"_l, worker, conf.cache().threads());
@@ -161,6 +475,9 @@ Emitter::~Emitter() {
   cache_tasks_->Close();
   failed_tasks_->Close();
   local_tasks_->Close();
+  if (cache_server_tasks_) {
+    cache_server_tasks_->Close();
+  }
   coordinator_workers_.reset();
   workers_.reset();
   remote_workers_.reset();
@@ -182,8 +499,76 @@ bool Emitter::Initialize() {
 // static
 ui32 Emitter::CalculateShard(const cache::string::HandledHash& handled_hash,
                              const ui32 total_shards) {
-  return (*reinterpret_cast<const ui32*>(handled_hash.str.Hash(4).c_str())) %
-         total_shards;
+  DCHECK(total_shards > 0);
+  return JumpConsistentHash(ShardKey(handled_hash), total_shards);
+}
+
+// static
+ui32 Emitter::CalculateShard(const cache::string::HandledHash& handled_hash,
+                             const ui32 total_shards,
+                             const ShardWeights& weights) {
+  if (weights.empty()) {
+    return CalculateShard(handled_hash, total_shards);
+  }
+
+  const ui64 key = ShardKey(handled_hash);
+  ui32 best_shard = total_shards;
+  double best_score = 0.;
+
+  for (ui32 shard = 0; shard < total_shards && shard < weights.size();
+       ++shard) {
+    if (!weights[shard]) {
+      continue;
+    }
+
+    // Uniform value in the range (0, 1) - it's never zero, so the logarithm is
+    // always finite and negative.
+    const double uniform =
+        (static_cast<double>(MixBucket(key, shard) >> 11) + 0.5) /
+        static_cast<double>(1LLU << 53);
+    const double score =
+        -static_cast<double>(weights[shard]) / std::log(uniform);
+    if (best_shard == total_shards || score > best_score) {
+      best_shard = shard;
+      best_score = score;
+    }
+  }
+
+  if (best_shard == total_shards) {
+    // All shards have zero weight - fall back to the equal shards.
+    return CalculateShard(handled_hash, total_shards);
+  }
+
+  return best_shard;
+}
+
+// static
+Emitter::ShardWeights Emitter::GetShardWeights(
+    const Configuration::Emitter& emitter) {
+  ShardWeights weights;
+
+  if (!emitter.has_total_shards()) {
+    return weights;
+  }
+
+  const bool has_weights =
+      std::any_of(emitter.remotes().begin(), emitter.remotes().end(),
+                  [](const auto& remote) {
+                    return !remote.disabled() && remote.has_weight();
+                  });
+  if (!has_weights) {
+    return weights;
+  }
+
+  weights.resize(emitter.total_shards(), 0u);
+  for (const auto& remote : emitter.remotes()) {
+    if (!remote.disabled() && remote.has_shard() &&
+        remote.shard() < weights.size()) {
+      weights[remote.shard()] += remote.weight();
+    }
+  }
+
+  return weights;
 }
 
 bool Emitter::HandleNewMessage(net::ConnectionPtr connection, Universal message,
@@ -203,17 +588,36 @@ bool Emitter::HandleNewMessage(net::ConnectionPtr connection, Universal message,
 
   if (message->HasExtension(base::proto::Local::extension)) {
     Message execute(message->ReleaseExtension(base::proto::Local::extension));
+
+    // The client's span lasts from its start till the task is received here.
+    if (execute->has_trace_start()) {
+      auto& trace_service = base::Singleton<perf::TraceService>::Get();
+      const ui64 now = trace_service.WallTime(Clock::now());
+      if (now > execute->trace_start()) {
+        trace_service.Add("Client"_l, execute->trace_id(),
+                          execute->trace_start(),
+                          now - execute->trace_start());
+      }
+    }
+
     if (conf->has_cache() && !conf->cache().disabled()) {
       return cache_tasks_->Push(
           std::make_tuple(connection, std::move(execute), HandledSource(),
-                          cache::ExtraFiles{}, HandledHash(), false));
+                          cache::ExtraFiles{}, HandledHash(), false,
+                          List<String>()));
     } else {
       return all_tasks_->Push(
           std::make_tuple(connection, std::move(execute), HandledSource(),
-                          cache::ExtraFiles{}, HandledHash(), false));
+                          cache::ExtraFiles{}, HandledHash(), false,
+                          List<String>()));
     }
   }
 
+  if (message->HasExtension(perf::proto::TraceDump::extension)) {
+    return DumpTrace(connection,
+                     message->GetExtension(perf::proto::TraceDump::extension));
+  }
+
   NOTREACHED();
   return false;
 }
@@ -228,17 +632,246 @@ void Emitter::SetExtraFiles(const cache::ExtraFiles& extra_files,
   }
 }
 
+bool Emitter::SearchCacheServer(net::EndPointPtr end_point,
+                                const cache::string::HandledHash& handled_hash,
+                                cache::FileCache::Entry* entry) {
+  DCHECK(entry);
+
+  Counter<> counter(Metric::SHARED_CACHE_LOOKUP_TIME);
+
+  String error;
+  auto connection = Connect(end_point, &error);
+  if (!connection) {
+    counter.ReportOnDestroy(false);
+    LOG(WARNING) << "Failed to connect to cache server " << end_point->Print()
+                 << ": " << error;
+    return false;
+  }
+
+  auto request = std::make_unique<proto::CacheRequest>();
+  request->set_handled_hash(handled_hash.str);
+  net::proto::Status status;
+  if (!connection->SendSync(std::move(request), &status)) {
+    counter.ReportOnDestroy(false);
+    LOG(WARNING) << "Failed to send request to cache server "
+                 << end_point->Print() << ": " << status.description();
+    return false;
+  }
+
+  auto reply = std::make_unique<net::proto::Universal>();
+  if (!connection->ReadSync(reply.get(), &status)) {
+    counter.ReportOnDestroy(false);
+    LOG(WARNING) << "Failed to read reply from cache server "
+                 << end_point->Print() << ": " << status.description();
+    return false;
+  }
+
+  if (!reply->HasExtension(proto::Result::extension)) {
+    return false;
+  }
+
+  auto* result = reply->MutableExtension(proto::Result::extension);
+  entry->object = result->release_obj();
+  if (result->has_deps()) {
+    entry->deps = result->release_deps();
+  }
+  GetOutputs(result, entry);
+  if (reply->HasExtension(net::proto::Status::extension)) {
+    const auto& status = reply->GetExtension(net::proto::Status::extension);
+    entry->stderr = Immutable(status.description());
+  }
+
+  return true;
+}
+
+bool Emitter::UploadFiles(net::ConnectionPtr connection,
+                          UniquePtr<proto::Remote> message,
+                          const String& current_dir,
+                          net::proto::Universal* reply) {
+  DCHECK(message);
+  DCHECK(reply);
+
+  const bool pump = !message->has_source();
+
+  // Keep the contents until we know which of them are missing on the remote.
+  Vector<Pair<proto::File*, Immutable>> files;
+  for (auto* message_files :
+       {message->mutable_files(), message->mutable_included_files(),
+        message->mutable_module_files()}) {
+    for (auto& file : *message_files) {
+      const Path full_path = Path(file.path()).is_absolute()
+                                 ? Path(file.path())
+                                 : Path(current_dir) / file.path();
+
+      String error;
+      Immutable contents;
+      if (!base::File::Read(full_path, &contents, &error)) {
+        LOG(WARNING) << "Failed to read " << full_path << " : " << error;
+        return false;
+      }
+
+      file.set_hash(base::Hexify(contents.Hash()));
+      files.emplace_back(&file, contents);
+    }
+  }
+  DCHECK(!files.empty());
+
+  if (pump) {
+    // The source is the first one, and most likely it's changed.
+    DCHECK(message->files_size());
+    message->mutable_files(0)->set_content(
+        files.front().second.string_copy(false));
+    message->set_current_dir(current_dir);
+
+    if (!connection->SendSync(std::make_unique<proto::Remote>(*message)) ||
+        !connection->ReadSync(reply)) {
+      return false;
+    }
+
+    if (!reply->HasExtension(proto::MissingFiles::extension)) {
+      return true;
+    }
+  } else {
+    // Probe first - so the source is uploaded only once, together with the
+    // PCH and PCM files, which the remote doesn't have.
+    auto probe = std::make_unique<proto::Remote>();
+    probe->mutable_flags()->CopyFrom(message->flags());
+    probe->set_handled_hash(message->handled_hash());
+    probe->set_trace_id(message->trace_id());
+    probe->mutable_included_files()->CopyFrom(message->included_files());
+    probe->mutable_module_files()->CopyFrom(message->module_files());
+    if (!connection->SendSync(std::move(probe)) ||
+        !connection->ReadSync(reply)) {
+      return false;
+    }
+
+    // A hit or an error is handled by the caller as usual.
+    const auto& status = reply->GetExtension(net::proto::Status::extension);
+    if (reply->HasExtension(proto::Result::extension) ||
+        status.code() != net::proto::Status::OK) {
+      return true;
+    }
+    STAT(REMOTE_PROBE_MISS);
+  }
+
+  const auto& missing = reply->GetExtension(proto::MissingFiles::extension);
+  HashSet<String> missing_hashes(missing.hashes().begin(),
+                                 missing.hashes().end());
+  for (auto& file : files) {
+    if (!file.first->has_content() &&
+        missing_hashes.count(file.first->hash())) {
+      file.first->set_content(file.second.string_copy(false));
+      if (pump) {
+        STAT(PUMP_FILES_UPLOADED);
+      } else {
+        STAT(PCH_FILES_UPLOADED);
+      }
+    }
+  }
+
+  reply->Clear();
+  if (!connection->SendSync(std::move(message)) ||
+      !connection->ReadSync(reply)) {
+    return false;
+  }
+
+  // The remote may have evicted some files after the probe.
+  if (reply->HasExtension(proto::MissingFiles::extension)) {
+    LOG(WARNING) << "Remote has lost the PCH or PCM files after the probe";
+    return false;
+  }
+
+  return true;
+}
+
+bool Emitter::GenerateModuleSource(const base::proto::Local* message,
+                                   cache::string::HandledSource* source) {
+  DCHECK(message);
+  DCHECK(source);
+
+  if (!message->flags().has_deps_file()) {
+    return false;
+  }
+
+  String error;
+  Immutable deps;
+  List<String> inputs;
+  if (!base::File::Read(GetDepsPath(message), &deps, &error) ||
+      !ParseDeps(deps, inputs)) {
+    LOG(CACHE_WARNING) << "Failed to read deps of module "
+                       << message->flags().input() << " : " << error;
+    return false;
+  }
+  inputs.push_back(message->flags().input());
+
+  // The same hashes as the ones of the files shipped in pump mode.
+  Vector<Pair<String, String>> hashed_inputs;
+  for (const auto& input : inputs) {
+    Immutable contents;
+    if (!base::File::Read(GetFullPath(message, input), &contents, &error)) {
+      LOG(CACHE_WARNING) << "Failed to read input of module " << input
+                         << " : " << error;
+      return false;
+    }
+    hashed_inputs.emplace_back(input, base::Hexify(contents.Hash()));
+  }
+
+  *source = CompilationDaemon::GenerateModuleSource(message->current_dir(),
+                                                    std::move(hashed_inputs));
+  return true;
+}
+
+void Emitter::UpdateCacheServer(const cache::string::HandledHash& handled_hash,
+                                const cache::FileCache::Entry& entry) {
+  if (!cache_server_tasks_) {
+    return;
+  }
+
+  // Drop the update if the cache server can't keep up with us.
+  if (!cache_server_tasks_->Push(std::make_tuple(handled_hash, entry))) {
+    LOG(CACHE_WARNING) << "Cache server update is dropped: "
+                       << handled_hash.str;
+  }
+}
+
+void Emitter::UpdateDependCache(const base::proto::Local* message,
+                                const cache::ExtraFiles& extra_files,
+                                const cache::FileCache::Entry& entry) {
+  CacheEntries entries;
+  CompilationDaemon::UpdateDependCache(message, extra_files, entry, &entries);
+  for (const auto& it : entries) {
+    UpdateCacheServer(it.first, it.second);
+  }
+}
+
+Milliseconds Emitter::PredictLocalTime(const Milliseconds& cost) const {
+  const ui32 threads = conf()->emitter().threads();
+  if (!threads) {
+    return Milliseconds::max();
+  }
+
+  // The queued local tasks go first. If there is no free worker, the task
+  // waits for an average task per each one ahead of it.
+  const ui64 tasks = failed_tasks_->Size() + local_tasks_running_;
+  if (tasks < threads) {
+    return cost;
+  }
+  return cost + cost_model_->Average() * (tasks - threads + 1) / threads;
+}
+
 void Emitter::DoCheckCache(const base::WorkerPool& pool) {
   using namespace cache::string;
 
-  while (!pool.IsShuttingDown()) {
-    auto conf = this->conf();
+  net::EndPointPtr cache_server;
 
+  while (!pool.IsShuttingDown()) {
     Optional&& task = cache_tasks_->Pop();
     if (!task) {
       break;
     }
 
+    auto conf = this->conf();
+
     if (std::get<CONNECTION>(*task)->IsClosed()) {
       continue;
     }
@@ -248,34 +881,54 @@ void Emitter::DoCheckCache(const base::WorkerPool& pool) {
 
     auto RestoreFromCache = [&](const HandledSource& source,
                                 const cache::ExtraFiles& extra_files) {
-      String error;
-      const String output_path = GetOutputPath(incoming);
+      Counter<> counter(Metric::CACHE_RESTORE_TIME);
+      Span span("Cache restore"_l, incoming->trace_id());
 
-      if (!base::File::Write(output_path, entry.object, &error)) {
-        LOG(ERROR) << "Failed to write file from cache: " << output_path
-                   << " : " << error;
+      // The compiler would fail the same way - so don't run it again.
+      if (entry.failed) {
+        net::proto::Status status;
+        status.set_code(net::proto::Status::EXECUTION);
+        status.set_description(entry.stderr);
+        std::get<CONNECTION>(*task)->ReportStatus(status);
+        LOG(INFO) << "Cached failure: " << incoming->flags().input();
+        STAT(FAILURE_CACHE_HIT);
+
+        return true;
+      }
+
+      if (!HasOutputs(incoming, entry)) {
+        LOG(INFO) << "Cached entry has no extra outputs: "
+                  << incoming->flags().input();
         return false;
       }
-      if (incoming->has_user_id() &&
-          !base::ChangeOwner(output_path, incoming->user_id(), &error)) {
-        LOG(ERROR) << "Failed to change owner for " << output_path << " : "
-                   << error;
+
+      if (!WriteObject(incoming, entry.object)) {
+        return false;
       }
 
+      String error;
+
       if (incoming->flags().has_deps_file()) {
         DCHECK(!entry.deps.empty());
 
         const String deps_path = GetDepsPath(incoming);
+        const auto deps = RewriteBaseDir(conf->cache().base_dir(),
+                                         incoming->current_dir(), entry.deps);
 
-        if (!base::File::Write(deps_path, entry.deps, &error)) {
+        if (!base::File::Write(deps_path, deps, &error)) {
           LOG(ERROR) << "Failed to write file from cache: " << deps_path
                      << " : " << error;
           return false;
         }
       }
 
+      if (!WriteOutputs(incoming, entry)) {
+        return false;
+      }
+
       if (!source.str.empty()) {
         UpdateDirectCache(incoming, source, extra_files, entry);
+        UpdateDependCache(incoming, extra_files, entry);
       }
 
       net::proto::Status status;
@@ -287,7 +940,31 @@ void Emitter::DoCheckCache(const base::WorkerPool& pool) {
       return true;
     };
 
-    if (SearchDirectCache(incoming->flags(), incoming->current_dir(), &entry) &&
+    // Looks up the hash locally - and then on the cache server, if any.
+    auto SearchSharedCache = [&](const HandledHash& hash,
+                                 cache::FileCache::Entry* entry) {
+      if (SearchSimpleCache(hash, entry)) {
+        return true;
+      }
+      if (!cache_server_resolver_) {
+        return false;
+      }
+      if (!cache_server) {
+        cache_server = cache_server_resolver_();
+      }
+      if (cache_server && SearchCacheServer(cache_server, hash, entry)) {
+        UpdateSimpleCache(hash, *entry);
+        return true;
+      }
+      return false;
+    };
+
+    const ui64 trace_id = incoming->trace_id();
+    if (Traced("Direct lookup"_l, trace_id,
+               [&] {
+                 return SearchDirectCache(incoming->flags(),
+                                          incoming->current_dir(), &entry);
+               }) &&
         RestoreFromCache(HandledSource(), cache::ExtraFiles{})) {
       STAT(DIRECT_CACHE_HIT);
       continue;
@@ -295,6 +972,21 @@ void Emitter::DoCheckCache(const base::WorkerPool& pool) {
 
     STAT(DIRECT_CACHE_MISS);
 
+    if (conf->has_cache() && conf->cache().depend()) {
+      if (Traced("Depend lookup"_l, trace_id,
+                 [&] {
+                   return SearchDependCache(incoming->flags(),
+                                            incoming->current_dir(),
+                                            SearchSharedCache, &entry);
+                 }) &&
+          RestoreFromCache(HandledSource(), cache::ExtraFiles{})) {
+        STAT(DEPEND_CACHE_HIT);
+        continue;
+      }
+
+      STAT(DEPEND_CACHE_MISS);
+    }
+
     // Check that we have a compiler of a requested version.
     net::proto::Status status;
     if (!SetupCompiler(incoming->mutable_flags(), &status)) {
@@ -302,8 +994,40 @@ void Emitter::DoCheckCache(const base::WorkerPool& pool) {
       continue;
     }
 
+    // Explicitly included PCH and PCM files are compiler-specific - so don't
+    // ship them. Without system headers in the deps we don't know, which of
+    // them should be shipped.
+    auto& pump_files = std::get<PUMP_FILES>(*task);
+    UnhandledHash unhandled_hash;
+    if (conf->emitter().pump() && !incoming->flags().included_files_size() &&
+        !incoming->flags().module_files_size() &&
+        HasSystemHeaderDeps(incoming->flags()) &&
+        SearchDirectHeaders(incoming->flags(), incoming->current_dir(),
+                            &unhandled_hash, &pump_files)) {
+      auto& extra_files = std::get<EXTRA_FILES>(*task);
+      if (!ReadExtraFiles(incoming->flags(), incoming->current_dir(),
+                          &extra_files)) {
+        failed_tasks_->Push(std::move(*task));
+        continue;
+      }
+
+      // The source itself is in the deps too - but make sure it goes first.
+      pump_files.remove(incoming->flags().input());
+      pump_files.push_front(incoming->flags().input());
+
+      PushToShard(std::move(*task), HandledHash(unhandled_hash.str));
+      continue;
+    }
+
+    // Without the inputs from the direct cache there is nothing to ship - the
+    // module gets built locally for the first time.
+    if (IsModuleBuild(incoming->flags())) {
+      failed_tasks_->Push(std::move(*task));
+      continue;
+    }
+
     auto& source = std::get<SOURCE>(*task);
-    if (!GenerateSource(incoming, &source)) {
+    if (!GenerateSource(incoming, conf->cache().base_dir(), &source)) {
       failed_tasks_->Push(std::move(*task));
       continue;
     }
@@ -317,7 +1041,8 @@ void Emitter::DoCheckCache(const base::WorkerPool& pool) {
 
     auto& handled_hash = std::get<HANDLED_HASH>(*task);
     handled_hash = GenerateHash(incoming->flags(), source, extra_files);
-    if (SearchSimpleCache(handled_hash, &entry) &&
+    if (Traced("Simple lookup"_l, trace_id,
+               [&] { return SearchSimpleCache(handled_hash, &entry); }) &&
         RestoreFromCache(source, extra_files)) {
       STAT(SIMPLE_CACHE_HIT);
       continue;
@@ -325,13 +1050,39 @@ void Emitter::DoCheckCache(const base::WorkerPool& pool) {
 
     STAT(SIMPLE_CACHE_MISS);
 
-    ui32 shard = Queue::DEFAULT_SHARD;
-    if (conf->emitter().has_total_shards()) {
-      DCHECK(conf->emitter().total_shards() > 0);
-      shard = CalculateShard(handled_hash, conf->emitter().total_shards());
+    if (cache_server_resolver_) {
+      if (!cache_server) {
+        cache_server = cache_server_resolver_();
+      }
+      if (cache_server &&
+          Traced("Shared lookup"_l, trace_id,
+                 [&] {
+                   return SearchCacheServer(cache_server, handled_hash,
+                                            &entry);
+                 }) &&
+          RestoreFromCache(source, extra_files)) {
+        UpdateSimpleCache(handled_hash, entry);
+        STAT(SHARED_CACHE_HIT);
+        continue;
+      }
+
+      STAT(SHARED_CACHE_MISS);
     }
-    all_tasks_->Push(std::move(*task), shard);
+
+    PushToShard(std::move(*task), handled_hash);
+  }
+}
+
+void Emitter::PushToShard(Task&& task,
+                          const cache::string::HandledHash& handled_hash) {
+  // The configuration may be updated by coordinator while the task is checked
+  // in cache - and the shard should be calculated with the most recent one.
+  UniqueLock lock(shards_mutex_);
+  ui32 shard = Queue::DEFAULT_SHARD;
+  if (total_shards_) {
+    shard = CalculateShard(handled_hash, total_shards_, shard_weights_);
   }
+  all_tasks_->Push(std::move(task), shard);
 }
 
 void Emitter::DoLocalExecute(const base::WorkerPool& pool) {
@@ -345,6 +1096,7 @@ void Emitter::DoLocalExecute(const base::WorkerPool& pool) {
       continue;
     }
 
+    auto conf = this->conf();
     base::proto::Local* incoming = std::get<MESSAGE>(*task).get();
 
     // Check that we have a compiler of a requested version.
@@ -354,14 +1106,30 @@ void Emitter::DoLocalExecute(const base::WorkerPool& pool) {
       continue;
     }
 
+    // The headers from the direct cache may be outdated, if the pump mode has
+    // failed - so preprocess locally to update the caches with correct ones.
+    const String& base_dir = conf->cache().base_dir();
+    auto& source = std::get<SOURCE>(*task);
+    if (source.str.empty() && !std::get<PUMP_FILES>(*task).empty() &&
+        !IsModuleBuild(incoming->flags()) &&
+        !GenerateSource(incoming, base_dir, &source)) {
+      LOG(WARNING) << "Failed to preprocess " << incoming->flags().input();
+    }
+
     String error;
 
     ui32 uid =
         incoming->has_user_id() ? incoming->user_id() : base::Process::SAME_UID;
     Counter<> counter(Metric::LOCAL_COMPILATION_TIME);
+    Span compile_span("Local compile"_l, incoming->trace_id());
     base::ProcessPtr process =
         CreateProcess(incoming->flags(), uid, Path(incoming->current_dir()));
-    if (!process->Run(base::Process::UNLIMITED, &error)) {
+    ++local_tasks_running_;
+    const bool process_succeeded =
+        process->Run(base::Process::UNLIMITED, &error);
+    --local_tasks_running_;
+    compile_span.Report();
+    if (!process_succeeded) {
       status.set_code(net::proto::Status::EXECUTION);
       if (!process->stderr().empty()) {
         status.set_description(process->stderr());
@@ -372,21 +1140,53 @@ void Emitter::DoLocalExecute(const base::WorkerPool& pool) {
       } else {
         status.set_description("without errors");
       }
+
+      if (!source.str.empty() && IsCacheableFailure(*process)) {
+        cache::FileCache::Entry entry;
+        entry.stderr = process->stderr();
+        entry.failed = true;
+        auto& handled_hash = std::get<HANDLED_HASH>(*task);
+        if (handled_hash.str.empty()) {
+          handled_hash = GenerateHash(incoming->flags(), source,
+                                      std::get<EXTRA_FILES>(*task));
+        }
+        UpdateSimpleCache(handled_hash, entry);
+      }
     } else {
       status.set_code(net::proto::Status::OK);
       status.set_description(process->stderr());
       LOG(INFO) << "Local compilation successful:  "
                 << incoming->flags().input();
 
-      const auto& source = std::get<SOURCE>(*task);
-      const auto& extra_files = std::get<EXTRA_FILES>(*task);
+      auto& extra_files = std::get<EXTRA_FILES>(*task);
+
+      // The inputs of a module are known only after the build.
+      cache::string::HandledSource module_source;
+      if (IsModuleBuild(incoming->flags()) &&
+          GenerateModuleSource(incoming, &module_source) &&
+          (!extra_files.empty() ||
+           ReadExtraFiles(incoming->flags(), incoming->current_dir(),
+                          &extra_files))) {
+        source.str.assign(module_source.str);
+      }
 
+      if (cost_model_) {
+        cost_model_->Update(
+            CostModel::MakeKey(*incoming),
+            std::chrono::duration_cast<Milliseconds>(counter.Elapsed()));
+      }
       counter.Report();
       if (!source.str.empty()) {
+        Span span("Cache store"_l, incoming->trace_id());
         cache::FileCache::Entry entry;
-        if (base::File::Read(GetOutputPath(incoming), &entry.object) &&
+        Immutable deps;
+        if ((!HasObject(incoming) ||
+             base::File::Read(GetOutputPath(incoming), &entry.object)) &&
             (!incoming->flags().has_deps_file() ||
-             base::File::Read(GetDepsPath(incoming), &entry.deps))) {
+             base::File::Read(GetDepsPath(incoming), &deps)) &&
+            ReadOutputs(incoming, &entry)) {
+          entry.deps =
+              RewriteBaseDir(base_dir, incoming->current_dir(), deps);
           entry.stderr = process->stderr();
           auto& handled_hash = std::get<HANDLED_HASH>(*task);
           if (handled_hash.str.empty()) {
@@ -394,6 +1194,8 @@ void Emitter::DoLocalExecute(const base::WorkerPool& pool) {
           }
           UpdateSimpleCache(handled_hash, entry);
           UpdateDirectCache(incoming, source, extra_files, entry);
+          UpdateCacheServer(handled_hash, entry);
+          UpdateDependCache(incoming, extra_files, entry);
         }
       }
 
@@ -405,7 +1207,8 @@ void Emitter::DoLocalExecute(const base::WorkerPool& pool) {
 }
 
 void Emitter::DoRemoteExecute(const base::WorkerPool& pool, ResolveFn resolver,
-                              const ui32 shard) {
+                              const ui32 shard, ProbeHistoryPtr probes,
+                              RemoteEstimatePtr estimate) {
   auto conf = this->conf();
 
   net::EndPointPtr end_point;
@@ -431,8 +1234,7 @@ void Emitter::DoRemoteExecute(const base::WorkerPool& pool, ResolveFn resolver,
       }
     }
 
-    Optional&& task =
-        all_tasks_->Pop(pool, conf->emitter().shard_queue_limit(), shard);
+    Optional&& task = all_tasks_->Pop(pool, shard);
     if (!task) {
       break;
     }
@@ -452,19 +1254,54 @@ void Emitter::DoRemoteExecute(const base::WorkerPool& pool, ResolveFn resolver,
       continue;
     }
 
-    // If we're using shards we should have generated source by now.
-    DCHECK(!conf->emitter().has_total_shards() || !source.str.empty());
+    // If we're using shards we should have generated source by now - unless
+    // it's in pump mode.
+    const auto& pump_files = std::get<PUMP_FILES>(*task);
+    const bool pump = !pump_files.empty();
+    DCHECK(!conf->emitter().has_total_shards() || !source.str.empty() || pump);
 
-    if (source.str.empty() && !GenerateSource(incoming, &source)) {
+    if (!pump && source.str.empty() &&
+        !GenerateSource(incoming, conf->cache().base_dir(), &source)) {
       failed_tasks_->Push(std::move(*task));
       continue;
     }
 
+    // Run the task locally, if it completes sooner there. In pump mode only
+    // the missing headers are uploaded - so the upload isn't known.
+    const ui64 upload_size = pump ? 0 : source.str.size();
+    Milliseconds cost = Milliseconds::zero();
+    if (estimate) {
+      cost = cost_model_->Predict(CostModel::MakeKey(*incoming));
+      const Milliseconds local_time = PredictLocalTime(cost);
+      Milliseconds remote_time;
+      if (!estimate->Predict(upload_size, cost, &remote_time)) {
+        LOG(VERBOSE) << "Remote compilation to measure " << end_point->Print()
+                     << ": " << incoming->flags().input();
+      } else if (local_time < remote_time) {
+        LOG(VERBOSE) << "Local compilation is sooner: "
+                     << incoming->flags().input() << " (" << local_time.count()
+                     << " ms locally, " << remote_time.count() << " ms on "
+                     << end_point->Print() << ")";
+        STAT(LOCAL_TASK_PLACED);
+        failed_tasks_->Push(std::move(*task));
+        continue;
+      } else {
+        LOG(VERBOSE) << "Remote compilation is sooner: "
+                     << incoming->flags().input() << " (" << local_time.count()
+                     << " ms locally, " << remote_time.count() << " ms on "
+                     << end_point->Print() << ")";
+      }
+    }
+
     String error;
     net::ConnectionPtr connection;
     {
       Counter<> counter(Metric::REMOTE_CONNECT_TIME);
+      Span span("Connect"_l, incoming->trace_id());
       connection = Connect(end_point, &error);
+      if (connection && estimate) {
+        estimate->UpdateConnect(counter.Elapsed());
+      }
       if (!connection) {
         counter.ReportOnDestroy(false);
         LOG(WARNING) << "Failed to connect to " << end_point->Print() << ": "
@@ -496,43 +1333,148 @@ void Emitter::DoRemoteExecute(const base::WorkerPool& pool, ResolveFn resolver,
 
     sleep_period = 1;
 
-    auto outgoing = std::make_unique<proto::Remote>();
-    outgoing->mutable_flags()->CopyFrom(incoming->flags());
-    outgoing->set_source(Immutable(source.str).string_copy(false));
-    SetExtraFiles(extra_files, outgoing.get());
+    // In pump mode the remote calculates the hash by itself.
     auto& handled_hash = std::get<HANDLED_HASH>(*task);
-    if (handled_hash.str.empty()) {
+    if (!pump && handled_hash.str.empty()) {
       handled_hash = GenerateHash(incoming->flags(), source, extra_files);
     }
-    outgoing->set_handled_hash(handled_hash.str);
-
-    // Filter outgoing flags.
-    auto* flags = outgoing->mutable_flags();
-    auto& plugins = *flags->mutable_compiler()->mutable_plugins();
-    for (auto& plugin : plugins) {
-      plugin.clear_path();
-    }
-    flags->mutable_compiler()->clear_path();
-    flags->clear_output();
-    flags->clear_input();
-    flags->clear_non_cached();
-    flags->clear_deps_file();
 
     Counter<false> counter(Metric::REMOTE_TIME_WASTED);
     Counter<false> compilation_time_counter(Metric::REMOTE_COMPILATION_TIME);
-    if (!connection->SendSync(std::move(outgoing))) {
-      all_tasks_->Push(std::move(*task), shard);
-      counter.ReportOnDestroy(true);
-      continue;
+    Span remote_span("Remote compile"_l, incoming->trace_id());
+    auto reply = std::make_unique<net::proto::Universal>();
+
+    // Stays zero, unless the source is sent and compiled right away.
+    Clock::duration reply_time = Clock::duration::zero();
+
+    // Ask the remote for a cached result before uploading the source.
+    bool upload_source = true;
+    if (pump) {
+      // Nothing to probe with.
+    } else if (incoming->flags().included_files_size() ||
+               incoming->flags().module_files_size()) {
+      // The upload of PCH and PCM files always starts with a probe.
+    } else if (probes && probes->ShouldProbe(handled_hash)) {
+      auto probe = std::make_unique<proto::Remote>();
+      probe->set_handled_hash(handled_hash.str);
+      probe->set_trace_id(incoming->trace_id());
+      if (!connection->SendSync(std::move(probe))) {
+        all_tasks_->Push(std::move(*task), shard);
+        counter.ReportOnDestroy(true);
+        continue;
+      }
+      if (!connection->ReadSync(reply.get())) {
+        failed_tasks_->Push(std::move(*task));
+        counter.ReportOnDestroy(true);
+        continue;
+      }
+
+      const bool probe_hit = reply->HasExtension(proto::Result::extension);
+      probes->Update(handled_hash, probe_hit);
+
+      // Only a clean miss means that the remote waits for the source. Errors
+      // are handled below as usual.
+      const auto& status = reply->GetExtension(net::proto::Status::extension);
+      if (!probe_hit && status.code() == net::proto::Status::OK) {
+        STAT(REMOTE_PROBE_MISS);
+        reply->Clear();
+      } else {
+        upload_source = false;
+      }
+    } else if (probes) {
+      STAT(REMOTE_PROBE_SKIPPED);
     }
 
-    auto reply = std::make_unique<net::proto::Universal>();
-    if (!connection->ReadSync(reply.get())) {
-      // Put into |failed_tasks_| in case an oversized protobuf message comes
-      // from a remote end.
-      failed_tasks_->Push(std::move(*task));
-      counter.ReportOnDestroy(true);
-      continue;
+    if (pump) {
+      auto outgoing = std::make_unique<proto::Remote>();
+      outgoing->mutable_flags()->CopyFrom(incoming->flags());
+      SetExtraFiles(extra_files, outgoing.get());
+      outgoing->set_trace_id(incoming->trace_id());
+
+      // Filter outgoing flags - the remote needs the input and include paths
+      // to preprocess the source.
+      auto* flags = outgoing->mutable_flags();
+      auto& plugins = *flags->mutable_compiler()->mutable_plugins();
+      for (auto& plugin : plugins) {
+        plugin.clear_path();
+      }
+      flags->mutable_compiler()->clear_path();
+      flags->clear_output();
+      flags->clear_deps_file();
+
+      for (const auto& path : pump_files) {
+        outgoing->add_files()->set_path(path);
+      }
+
+      STAT(REMOTE_PUMP_TASK);
+      if (!UploadFiles(connection, std::move(outgoing),
+                       incoming->current_dir(), reply.get())) {
+        failed_tasks_->Push(std::move(*task));
+        counter.ReportOnDestroy(true);
+        continue;
+      }
+    } else if (upload_source) {
+      auto outgoing = std::make_unique<proto::Remote>();
+      outgoing->mutable_flags()->CopyFrom(incoming->flags());
+      outgoing->set_source(Immutable(source.str).string_copy(false));
+      SetExtraFiles(extra_files, outgoing.get());
+      outgoing->set_handled_hash(handled_hash.str);
+      outgoing->set_trace_id(incoming->trace_id());
+
+      // Filter outgoing flags.
+      auto* flags = outgoing->mutable_flags();
+      auto& plugins = *flags->mutable_compiler()->mutable_plugins();
+      for (auto& plugin : plugins) {
+        plugin.clear_path();
+      }
+      flags->mutable_compiler()->clear_path();
+      flags->clear_output();
+      flags->clear_input();
+      flags->clear_non_cached();
+      flags->clear_deps_file();
+
+      // The remote gets the PCH and PCM files by their contents - their paths
+      // on the emitter don't mean anything there.
+      for (const auto& path : flags->included_files()) {
+        outgoing->add_included_files()->set_path(path);
+      }
+      for (const auto& path : flags->module_files()) {
+        outgoing->add_module_files()->set_path(path);
+      }
+      flags->clear_included_files();
+      flags->clear_module_files();
+
+      if (outgoing->included_files_size() || outgoing->module_files_size()) {
+        if (!UploadFiles(connection, std::move(outgoing),
+                         incoming->current_dir(), reply.get())) {
+          failed_tasks_->Push(std::move(*task));
+          counter.ReportOnDestroy(true);
+          continue;
+        }
+      } else {
+        Counter<false> upload_counter(Metric::REMOTE_UPLOAD_TIME);
+        if (!connection->SendSync(std::move(outgoing))) {
+          all_tasks_->Push(std::move(*task), shard);
+          counter.ReportOnDestroy(true);
+          continue;
+        }
+        const auto upload_time = upload_counter.Elapsed();
+        upload_counter.Report();
+
+        const auto reply_start = Clock::now();
+        if (!connection->ReadSync(reply.get())) {
+          // Put into |failed_tasks_| in case an oversized protobuf message
+          // comes from a remote end.
+          failed_tasks_->Push(std::move(*task));
+          counter.ReportOnDestroy(true);
+          continue;
+        }
+        reply_time = Clock::now() - reply_start;
+
+        if (estimate) {
+          estimate->UpdateUpload(upload_size, upload_time);
+        }
+      }
     }
 
     if (reply->HasExtension(net::proto::Status::extension)) {
@@ -560,42 +1502,94 @@ void Emitter::DoRemoteExecute(const base::WorkerPool& pool, ResolveFn resolver,
       if (result->has_hash_match() && !result->hash_match()) {
         STAT(HASH_MISMATCH);
       }
-      if (base::File::Write(output_path,
-                            Immutable::WrapString(result->obj()))) {
-        if (incoming->has_user_id() &&
-            !base::ChangeOwner(output_path, incoming->user_id(), &error)) {
-          LOG(ERROR) << "Failed to change owner for " << output_path << ": "
-                     << error;
+      for (const auto& span : result->trace().spans()) {
+        base::Singleton<perf::TraceService>::Get().Merge(span);
+      }
+      if (result->has_compilation_time() &&
+          reply_time != Clock::duration::zero()) {
+        const auto download_time =
+            std::chrono::duration_cast<Milliseconds>(reply_time) -
+            Milliseconds(result->compilation_time());
+        if (download_time >= Milliseconds::zero()) {
+          base::Singleton<perf::StatService>::Get().Record(
+              Metric::REMOTE_DOWNLOAD_TIME, download_time.count());
         }
+      }
 
+      // Older remotes don't know about the extra outputs.
+      cache::FileCache::Entry entry;
+      GetOutputs(result, &entry);
+      if (!HasOutputs(incoming, entry)) {
+        LOG(WARNING) << "Remote compilation has no extra outputs: "
+                     << incoming->flags().input();
+      } else if (WriteOutputs(incoming, entry) &&
+                 WriteObject(incoming, Immutable::WrapString(result->obj()))) {
         net::proto::Status status;
         status.set_code(net::proto::Status::OK);
         LOG(INFO) << "Remote compilation successful: "
                   << incoming->flags().input();
 
-        cache::FileCache::Entry entry;
         auto GenerateEntry = [&] {
           String error;
 
           entry.object = result->release_obj();
-          if (result->has_deps()) {
+          // Otherwise the local preprocessing has written the deps file of
+          // this checkout already - the remote ones may come from another.
+          if (pump && result->has_deps()) {
             entry.deps = result->release_deps();
-          } else if (incoming->flags().has_deps_file() &&
-                     !base::File::Read(GetDepsPath(incoming), &entry.deps,
-                                       &error)) {
-            LOG(CACHE_WARNING) << "Can't read deps file "
-                               << GetDepsPath(incoming) << " : " << error;
-            return false;
+
+            // There was no local preprocessing to write the deps file.
+            if (incoming->flags().has_deps_file() &&
+                !base::File::Write(GetDepsPath(incoming), entry.deps,
+                                   &error)) {
+              LOG(ERROR) << "Failed to write deps file "
+                         << GetDepsPath(incoming) << " : " << error;
+              return false;
+            }
+          } else if (incoming->flags().has_deps_file()) {
+            Immutable deps;
+            if (!base::File::Read(GetDepsPath(incoming), &deps, &error)) {
+              LOG(CACHE_WARNING) << "Can't read deps file "
+                                 << GetDepsPath(incoming) << " : " << error;
+              return false;
+            }
+            entry.deps = RewriteBaseDir(conf->cache().base_dir(),
+                                        incoming->current_dir(), deps);
           }
           entry.stderr = Immutable(status.description());
 
           return true;
         };
+        // The remote cache hits tell nothing about the compilation time.
+        if (estimate && !result->from_cache() &&
+            reply_time != Clock::duration::zero()) {
+          estimate->UpdateReply(cost, reply_time);
+        }
+        if (cost_model_ && !result->from_cache()) {
+          cost_model_->Update(CostModel::MakeKey(*incoming),
+                              std::chrono::duration_cast<Milliseconds>(
+                                  compilation_time_counter.Elapsed()));
+        }
         compilation_time_counter.Report();
+        remote_span.Report();
 
-        if (GenerateEntry()) {
+        if (pump && result->has_handled_hash()) {
+          handled_hash = cache::string::HandledHash(result->handled_hash());
+        }
+
+        const bool has_entry = GenerateEntry();
+        if (!has_entry && pump && incoming->flags().has_deps_file()) {
+          // There is no other way to get the deps file in pump mode.
+          failed_tasks_->Push(std::move(*task));
+          counter.ReportOnDestroy(true);
+          continue;
+        }
+
+        if (has_entry && !handled_hash.str.empty()) {
           UpdateSimpleCache(handled_hash, entry);
-          UpdateDirectCache(incoming, source, extra_files, entry);
+          UpdateDirectCache(incoming, handled_hash, extra_files, entry);
+          UpdateCacheServer(handled_hash, entry);
+          UpdateDependCache(incoming, extra_files, entry);
         }
 
         std::get<CONNECTION>(*task)->ReportStatus(status);
@@ -690,6 +1684,62 @@ void Emitter::DoPoll(const base::WorkerPool& pool,
   CHECK(BaseDaemon::Reload());
 }
 
+void Emitter::DoUpdateCacheServer(const base::WorkerPool& pool) {
+  net::EndPointPtr end_point;
+
+  while (!pool.IsShuttingDown()) {
+    CacheUpdateQueue::Optional&& update = cache_server_tasks_->Pop();
+    if (!update) {
+      break;
+    }
+
+    if (!end_point) {
+      end_point = cache_server_resolver_();
+      if (!end_point) {
+        continue;
+      }
+    }
+
+    String error;
+    auto connection = Connect(end_point, &error);
+    if (!connection) {
+      LOG(WARNING) << "Failed to connect to cache server " << end_point->Print()
+                   << ": " << error;
+      continue;
+    }
+
+    const auto& entry = std::get<1>(*update);
+    auto request = std::make_unique<proto::CacheRequest>();
+    request->set_handled_hash(std::get<0>(*update).str);
+    request->mutable_result()->set_obj(entry.object);
+    if (!entry.deps.empty()) {
+      request->mutable_result()->set_deps(entry.deps);
+    }
+    SetOutputs(entry, request->mutable_result());
+    if (!entry.stderr.empty()) {
+      request->set_stderr(entry.stderr);
+    }
+
+    net::proto::Status status;
+    if (!connection->SendSync(std::move(request), &status)) {
+      LOG(WARNING) << "Failed to update cache server: "
+                   << status.description();
+      continue;
+    }
+
+    // Wait for the reply to not overload the cache server.
+    auto reply = std::make_unique<net::proto::Universal>();
+    if (connection->ReadSync(reply.get()) &&
+        reply->HasExtension(net::proto::Status::extension)) {
+      const auto& status = reply->GetExtension(net::proto::Status::extension);
+      if (status.code() != net::proto::Status::OK) {
+        LOG(WARNING) << "Cache server rejected the update: "
+                     << status.description();
+      }
+    }
+  }
+}
+
 bool Emitter::Check(const Configuration& conf) const {
   if (!CompilationDaemon::Check(conf)) {
     return false;
@@ -720,11 +1770,34 @@ bool Emitter::Check(const Configuration& conf) const {
     }
   }
 
+  if (emitter.has_cache_server() && !emitter.cache_server().disabled() &&
+      (!conf.has_cache() || conf.cache().disabled())) {
+    LOG(ERROR) << "Can't use cache server with disabled local cache";
+    return false;
+  }
+
+  if (conf.has_cache() && conf.cache().has_base_dir() &&
+      !Path(conf.cache().base_dir()).is_absolute()) {
+    LOG(ERROR) << "Cache base directory must be absolute";
+    return false;
+  }
+
+  if (emitter.pump() && (!conf.has_cache() || conf.cache().disabled() ||
+                         !conf.cache().direct())) {
+    LOG(ERROR) << "Can't use pump mode with disabled direct cache";
+    return false;
+  }
+
   bool has_active_remote = false;
   for (const auto& remote : emitter.remotes()) {
     if (!remote.disabled()) {
       has_active_remote = true;
 
+      if (remote.has_weight() && remote.weight() == 0) {
+        LOG(ERROR) << "Remote's weight must be greater than 0";
+        return false;
+      }
+
       if (remote.has_shard()) {
         if (!emitter.has_total_shards()) {
           LOG(ERROR) << "Remote shouldn't have shard when the number of total "
@@ -757,6 +1830,8 @@ bool Emitter::Check(const Configuration& conf) const {
 bool Emitter::Reload(const proto::Configuration& conf) {
   using Worker = base::WorkerPool::SimpleWorker;
 
+  all_tasks_->SetShardQueueLimit(conf.emitter().shard_queue_limit());
+
   // Create new pool before swapping, so we won't postpone new tasks.
   auto new_pool = std::make_unique<base::WorkerPool>(!handle_all_tasks_);
   for (const auto& remote : conf.emitter().remotes()) {
@@ -774,40 +1849,51 @@ bool Emitter::Reload(const proto::Configuration& conf) {
       return optional->GetValue();
     };
 
+    ProbeHistoryPtr probes;
+    if (conf.emitter().probe_remotes()) {
+      probes = std::make_shared<ProbeHistory>();
+    }
+
+    // The cost model is created only on start.
+    RemoteEstimatePtr estimate;
+    if (conf.emitter().place_by_cost() && cost_model_) {
+      estimate = std::make_shared<RemoteEstimate>();
+    }
+
     ui32 shard = remote.has_shard() ? remote.shard() : Queue::DEFAULT_SHARD;
-    Worker worker =
-        std::bind(&Emitter::DoRemoteExecute, this, _1, resolver, shard);
+    Worker worker = std::bind(&Emitter::DoRemoteExecute, this, _1, resolver,
+                              shard, probes, estimate);
     new_pool->AddWorker("Remote Execute Worker"_l, worker, remote.threads());
   }
   std::swap(new_pool, remote_workers_);
 
   auto old_conf = this->conf();
 
+  UniqueLock lock(shards_mutex_);
+  total_shards_ =
+      conf.emitter().has_total_shards() ? conf.emitter().total_shards() : 0;
+  shard_weights_ = GetShardWeights(conf.emitter());
+
   // In case if new configurations honors strict sharding and has lower number
   // of total shards, make sure tasks from abandoned tasks get redistributed
-  // across new shards.
+  // across new shards. Thanks to the consistent hashing tasks from the
+  // remaining shards don't need to be moved.
   if (conf.emitter().shard_queue_limit() != Queue::NOT_STRICT_SHARDING &&
       conf.emitter().has_total_shards() &&
       old_conf->emitter().has_total_shards() &&
       conf.emitter().total_shards() < old_conf->emitter().total_shards()) {
+    // The tasks are moved inside the queue - so they keep their place by cost
+    // and the time they've waited.
+    auto new_shard = [this](const Task& task) {
+      return CalculateShard(std::get<HANDLED_HASH>(task), total_shards_,
+                            shard_weights_);
+    };
     for (ui32 shard = conf.emitter().total_shards();
          shard != old_conf->emitter().total_shards(); ++shard) {
-      bool shard_is_empty = false;
-      do {
-        Optional&& task = all_tasks_->Pop(
-            *remote_workers_, std::numeric_limits<ui32>::max(), shard, true);
-        if (task) {
-          // Once we popped a valid task - put it to appropriate shard according
-          // to new number of shards.
-          const ui32 new_shard = CalculateShard(std::get<HANDLED_HASH>(*task),
-                                                conf.emitter().total_shards());
-          all_tasks_->Push(std::move(*task), new_shard);
-        } else {
-          shard_is_empty = true;
-        }
-      } while (!shard_is_empty);
+      all_tasks_->Reshard(shard, new_shard);
     }
   }
+  lock.unlock();
 
   return CompilationDaemon::Reload(conf);
 }
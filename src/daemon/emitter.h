@@ -8,7 +8,14 @@
 
 namespace dist_clang {
 namespace daemon {
+
+class CostModel;
+
+FORWARD_TEST(EmitterTest, ConsistentShardsOnTotalShardsChange);
+FORWARD_TEST(EmitterTest, ProbeHistorySkipsLikelyMisses);
+FORWARD_TEST(EmitterTest, RemoteEstimateLearnsFromTasks);
 FORWARD_TEST(EmitterTest, TasksGetReshardedOnConfigurationUpdate);
+FORWARD_TEST(EmitterTest, WeightedShardsDistribution);
 
 class Emitter : public CompilationDaemon {
  public:
@@ -22,7 +29,11 @@ class Emitter : public CompilationDaemon {
   bool Reload(const Configuration& conf) override;
 
  private:
+  FRIEND_TEST(daemon::EmitterTest, ConsistentShardsOnTotalShardsChange);
+  FRIEND_TEST(daemon::EmitterTest, ProbeHistorySkipsLikelyMisses);
+  FRIEND_TEST(daemon::EmitterTest, RemoteEstimateLearnsFromTasks);
   FRIEND_TEST(daemon::EmitterTest, TasksGetReshardedOnConfigurationUpdate);
+  FRIEND_TEST(daemon::EmitterTest, WeightedShardsDistribution);
 
   enum TaskIndex {
     CONNECTION = 0,
@@ -36,19 +47,92 @@ class Emitter : public CompilationDaemon {
     // shard to a random one. This may happen in case of remote being down.
     // Also task shouldn't hop more than once to prevent instant hopping
     // between shards.
+
+    PUMP_FILES = 6,
+    // Paths of the source and headers to send to a remote in pump mode. Empty
+    // if the source should be preprocessed locally.
   };
 
   using Message = UniquePtr<base::proto::Local>;
   using Task = Tuple<net::ConnectionPtr, Message, cache::string::HandledSource,
-                     cache::ExtraFiles, cache::string::HandledHash, bool>;
+                     cache::ExtraFiles, cache::string::HandledHash, bool,
+                     List<String>>;
   using Queue = base::LockedQueue<Task, true>;
   using QueueAggregator = base::QueueAggregator<Task>;
   using Optional = Queue::Optional;
   using ResolveFn = Fn<net::EndPointPtr()>;
+  using ShardWeights = Vector<ui32>;
+
+  // Remembers recent probe misses of a single remote, so that we don't waste a
+  // round-trip on probes that are almost certainly going to miss.
+  class ProbeHistory {
+   public:
+    bool ShouldProbe(const cache::string::HandledHash& handled_hash)
+        THREAD_SAFE;
+    void Update(const cache::string::HandledHash& handled_hash,
+                bool hit) THREAD_SAFE;
+
+   private:
+    static constexpr ui32 kMaxConsecutiveMisses = 16;
+    static constexpr ui32 kMaxRememberedMisses = 1024;
+
+    Mutex mutex_;
+    HashSet<Immutable> misses_;
+    List<Immutable> misses_order_;
+    ui32 consecutive_misses_ = 0;
+    ui32 skipped_probes_ = 0;
+  };
+  using ProbeHistoryPtr = SharedPtr<ProbeHistory>;
+
+  // Estimates the link to a single remote and its speed online, so that we
+  // can tell, if a task completes sooner remotely or locally. Unlike the local
+  // compilation, the remote one pays for the connection and the upload.
+  class RemoteEstimate {
+   public:
+    // Returns |false| until the remote is measured - and from time to time
+    // after that, so the estimate doesn't get stale, while the tasks go
+    // elsewhere.
+    bool Predict(ui64 upload_size, const Milliseconds& cost,
+                 Milliseconds* time) THREAD_SAFE;
+
+    // The connection takes about one round-trip.
+    void UpdateConnect(const Clock::duration& time) THREAD_SAFE;
+    void UpdateUpload(ui64 size, const Clock::duration& time) THREAD_SAFE;
+    // The reply comes after the remote compilation of a task with the
+    // predicted |cost|.
+    void UpdateReply(const Milliseconds& cost,
+                     const Clock::duration& time) THREAD_SAFE;
+
+   private:
+    static constexpr ui32 kExplorationPeriod = 16;
+    static constexpr ui64 kMinUploadSize = 64 * 1024;
+
+    Mutex mutex_;
+    double round_trip_ = 0;  // in milliseconds.
+    double throughput_ = 0;  // in bytes per millisecond.
+    double slowdown_ = 0;    // the reply time per predicted cost.
+    ui32 predictions_ = 0;
+  };
+  using RemoteEstimatePtr = SharedPtr<RemoteEstimate>;
+  using CacheUpdate =
+      Tuple<cache::string::HandledHash, cache::FileCache::Entry>;
+  using CacheUpdateQueue = base::LockedQueue<CacheUpdate>;
 
+  // Maps the hash to a shard using the jump consistent hash: when the number of
+  // total shards changes by one, only about 1/N of hashes change their shard.
   static ui32 CalculateShard(const cache::string::HandledHash& handled_hash,
                              const ui32 total_shards);
 
+  // Maps the hash to a shard using the weighted rendezvous hashing: changing
+  // the weight of a shard moves hashes only from or to that shard.
+  // |weights| is indexed by shard number. Empty |weights| means that all shards
+  // are equal.
+  static ui32 CalculateShard(const cache::string::HandledHash& handled_hash,
+                             const ui32 total_shards,
+                             const ShardWeights& weights);
+
+  static ShardWeights GetShardWeights(const Configuration::Emitter& emitter);
+
   bool HandleNewMessage(net::ConnectionPtr connection, Universal message,
                         const net::proto::Status& status) override;
 
@@ -57,17 +141,72 @@ class Emitter : public CompilationDaemon {
 
   void SpawnRemoteWorkers();
 
+  // The time, in which a task with the predicted |cost| would complete
+  // locally - including the wait for a free local worker.
+  Milliseconds PredictLocalTime(const Milliseconds& cost) const;
+
+  // Looks up the hash on the cache server without uploading any source.
+  bool SearchCacheServer(net::EndPointPtr end_point,
+                         const cache::string::HandledHash& handled_hash,
+                         cache::FileCache::Entry* entry);
+
+  // Sends the |message| with hashes of its files, and then with contents of
+  // those, which the remote doesn't have yet. The files are the pump mode
+  // sources and headers - or the PCH and PCM files, if the |message| has a
+  // source: then a probe asks for the missing ones, so the source is sent only
+  // once. Only their paths are filled in beforehand.
+  bool UploadFiles(net::ConnectionPtr connection,
+                   UniquePtr<proto::Remote> message, const String& current_dir,
+                   net::proto::Universal* reply);
+
+  // Makes the handled source of an explicit module build from the deps, which
+  // it has just written.
+  bool GenerateModuleSource(const base::proto::Local* message,
+                            cache::string::HandledSource* source);
+
+  // Schedules an asynchronous update of the cache server - if there is any.
+  void UpdateCacheServer(const cache::string::HandledHash& handled_hash,
+                         const cache::FileCache::Entry& entry);
+
+  // Updates the depend cache and shares its entries with the cache server.
+  void UpdateDependCache(const base::proto::Local* message,
+                         const cache::ExtraFiles& extra_files,
+                         const cache::FileCache::Entry& entry);
+
+  // Pushes the |task| to the shard of |handled_hash| - with the most recent
+  // number of shards and their weights.
+  void PushToShard(Task&& task,
+                   const cache::string::HandledHash& handled_hash) THREAD_SAFE;
+
   void DoCheckCache(const base::WorkerPool&);
   void DoLocalExecute(const base::WorkerPool&);
-  void DoRemoteExecute(const base::WorkerPool&, ResolveFn resolver, ui32 shard);
+  void DoRemoteExecute(const base::WorkerPool&, ResolveFn resolver, ui32 shard,
+                       ProbeHistoryPtr probes, RemoteEstimatePtr estimate);
   void DoPoll(const base::WorkerPool&, Vector<ResolveFn> resolvers);
+  void DoUpdateCacheServer(const base::WorkerPool&);
 
   UniquePtr<Queue> all_tasks_, cache_tasks_, failed_tasks_;
   UniquePtr<QueueAggregator> local_tasks_;
+  UniquePtr<CacheUpdateQueue> cache_server_tasks_;
+  UniquePtr<CostModel> cost_model_;
+  // Only if the tasks are ordered or placed by cost.
+
+  Atomic<ui32> local_tasks_running_ = {0};
   UniquePtr<base::WorkerPool> workers_;
   UniquePtr<base::WorkerPool> coordinator_workers_;
   UniquePtr<base::WorkerPool> remote_workers_;
 
+  ResolveFn cache_server_resolver_;
+  // Empty if there is no enabled cache server.
+
+  Mutex shards_mutex_;
+  ui32 total_shards_ = 0;
+  ShardWeights shard_weights_;
+  // Set on reload, before the configuration - and the tasks are moved out of
+  // the abandoned shards under the same lock, which guards the pushes to the
+  // shards: so no task may be pushed to an abandoned shard after that. Zero
+  // total shards means no sharding.
+
   bool handle_all_tasks_ = true;
   // Indicates if we force shutdown of the remote workers pool: we shouldn't if
   // there is no coordinators, or if we stopped to poll coordinators.
@@ -2,10 +2,14 @@
 
 #include <base/file/file.h>
 #include <base/file_utils.h>
+#include <base/string_utils.h>
 #include <base/temporary_dir.h>
 #include <daemon/common_daemon_test.h>
+#include <daemon/cost_model.h>
 #include <net/test_connection.h>
 #include <perf/stat_service.h>
+#include <perf/trace.pb.h>
+#include <perf/trace_service.h>
 
 namespace dist_clang {
 namespace daemon {
@@ -215,8 +219,8 @@ String EndPointString(const String& host, const ui16 port = 0) {
 TEST_F(EmitterTest, ConfigurationUpdateFromCoordinator) {
   const base::TemporaryDir temp_dir;
   const auto action = "fake_action"_l;
-  const auto handled_source1 = "fake_source1"_l;
-  const auto handled_source2 = "fake_source2"_l;
+  const auto handled_source1 = "fake_source2"_l;
+  const auto handled_source2 = "fake_source5"_l;
   const String object_code = "fake_object_code";
   const String compiler_version = "fake_compiler_version";
   const String compiler_path = "fake_compiler_path";
@@ -231,6 +235,7 @@ TEST_F(EmitterTest, ConfigurationUpdateFromCoordinator) {
   const ui16 coordinator_port = 4;
   const ui32 old_total_shards = 5;
   const ui32 new_total_shards = 6;
+  bool task1_sent = false;  // Guarded by |send_mutex|.
 
   conf.mutable_emitter()->set_only_failed(true);
   conf.mutable_emitter()->set_poll_interval(1u);
@@ -274,7 +279,7 @@ TEST_F(EmitterTest, ConfigurationUpdateFromCoordinator) {
 
       EXPECT_EQ(EndPointString(coordinator_host, coordinator_port), end_point->Print());
 
-      connection->CallOnSend([this](const net::Connection::Message&) {
+      connection->CallOnSend([&](const net::Connection::Message&) {
         send_condition.notify_all();
         // Run the task #1 on old remote before sending anything to coordinator.
 
@@ -285,6 +290,9 @@ TEST_F(EmitterTest, ConfigurationUpdateFromCoordinator) {
         // Send #1: emitter → coordinator.
         // Send #2: emitter → coordinator (current one).
         // Send #3: emitter → remote.
+
+        task1_sent = true;
+        send_condition.notify_all();
       });
 
       connection->CallOnRead([&](net::Connection::Message* message) {
@@ -315,7 +323,11 @@ TEST_F(EmitterTest, ConfigurationUpdateFromCoordinator) {
 
       connection->CallOnRead([&](net::Connection::Message* message) {
         message->MutableExtension(proto::Result::extension)->set_obj(object_code);
+
+        UniqueLock lock(send_mutex);
         send_condition.notify_all();
+        // Don't reply to local client until the send #3 is seen - otherwise the send #4 may happen first.
+        EXPECT_TRUE(send_condition.wait_for(lock, Seconds(2), [&] { return task1_sent; }));
       });
     } else if (connect_count == 5) {
       // Connection from emitter to coordinator.
@@ -441,7 +453,7 @@ TEST_F(EmitterTest, ConfigurationUpdateFromCoordinator) {
 TEST_F(EmitterTest, TasksGetReshardedOnConfigurationUpdate) {
   const base::TemporaryDir temp_dir;
   const auto action = "fake_action"_l;
-  const auto handled_source = "fake_source1"_l;
+  const auto handled_source = "fake_source5"_l;
   const auto obj_code = "local_compilation_obj_code"_l;
   const String object_code = "fake_object_code";
   const String compiler_version = "fake_compiler_version";
@@ -661,7 +673,8 @@ TEST_F(EmitterTest, TasksGetReshardedOnConfigurationUpdate) {
 // redistributed between other shards.
 TEST_F(EmitterTest, TasksGetReshardedOnFailedRemote) {
   const base::TemporaryDir temp_dir;
-  const auto action = "fake_action"_l;
+  // The initial shard depends on the action too.
+  const auto action = "-emit-obj"_l;
   const auto handled_source = "fake_source"_l;
   const auto object_code = "fake_object_code"_l;
   const String compiler_version = "fake_compiler_version";
@@ -695,7 +708,7 @@ TEST_F(EmitterTest, TasksGetReshardedOnFailedRemote) {
   // emitter to absorber and abort that connection. Than wait for second
   // connection from emitter to another(!) remote and check that remote is from
   // another shard.
-  Atomic<ui32> initial_shard = {77};
+  Atomic<ui32> initial_shard = {51};
 
   connect_callback = [&](net::TestConnection* connection, net::EndPointPtr end_point) {
     // All connection callbacks are on emitter side.
@@ -777,6 +790,85 @@ TEST_F(EmitterTest, TasksGetReshardedOnFailedRemote) {
   EXPECT_EQ(1, connection.use_count()) << "Daemon must not store references to the connection";
 }
 
+TEST_F(EmitterTest, ConsistentShardsOnTotalShardsChange) {
+  const ui32 total_hashes = 10000u;
+  const ui32 old_total_shards = 10u;
+  const ui32 new_total_shards = 11u;
+
+  ui32 moved_hashes = 0u;
+  for (ui32 i = 0; i < total_hashes; ++i) {
+    const cache::string::HandledHash hash(Immutable(std::to_string(i)));
+    const ui32 old_shard = Emitter::CalculateShard(hash, old_total_shards);
+    const ui32 new_shard = Emitter::CalculateShard(hash, new_total_shards);
+
+    ASSERT_GT(old_total_shards, old_shard);
+    ASSERT_GT(new_total_shards, new_shard);
+    if (old_shard != new_shard) {
+      // Hashes may move only to the new shard.
+      EXPECT_EQ(old_total_shards, new_shard);
+      ++moved_hashes;
+    }
+
+    // Huge number of shards is fine too.
+    EXPECT_GT(1u << 16, Emitter::CalculateShard(hash, 1u << 16));
+  }
+
+  // Expect about 1/N of hashes to be moved.
+  EXPECT_LT(total_hashes / new_total_shards / 2, moved_hashes);
+  EXPECT_GT(total_hashes / new_total_shards * 2, moved_hashes);
+}
+
+TEST_F(EmitterTest, WeightedShardsDistribution) {
+  const ui32 total_hashes = 10000u;
+  const ui32 total_shards = 3u;
+  const Emitter::ShardWeights old_weights = {1u, 1u, 2u};
+  const Emitter::ShardWeights new_weights = {0u, 1u, 2u};
+
+  Array<ui32, total_shards> hashes_per_shard = {{0u, 0u, 0u}};
+  for (ui32 i = 0; i < total_hashes; ++i) {
+    const cache::string::HandledHash hash(Immutable(std::to_string(i)));
+    const ui32 old_shard =
+        Emitter::CalculateShard(hash, total_shards, old_weights);
+    const ui32 new_shard =
+        Emitter::CalculateShard(hash, total_shards, new_weights);
+
+    ASSERT_GT(total_shards, old_shard);
+    ++hashes_per_shard[old_shard];
+
+    // Only hashes from the disabled shard are moved.
+    EXPECT_NE(0u, new_shard);
+    if (old_shard != 0u) {
+      EXPECT_EQ(old_shard, new_shard);
+    }
+  }
+
+  // Expect shards to get 25%, 25% and 50% of hashes - with 20% tolerance.
+  EXPECT_NEAR(total_hashes / 4, hashes_per_shard[0], total_hashes / 20);
+  EXPECT_NEAR(total_hashes / 4, hashes_per_shard[1], total_hashes / 20);
+  EXPECT_NEAR(total_hashes / 2, hashes_per_shard[2], total_hashes / 10);
+
+  // Weights are taken from enabled remotes and summed up per shard.
+  proto::Configuration::Emitter emitter;
+  emitter.set_total_shards(total_shards);
+  for (ui32 shard = 0; shard < total_shards; ++shard) {
+    auto* remote = emitter.add_remotes();
+    remote->set_host("remote_host");
+    remote->set_shard(shard);
+  }
+  EXPECT_TRUE(Emitter::GetShardWeights(emitter).empty());
+
+  emitter.mutable_remotes(0)->set_weight(3u);
+  auto* remote = emitter.add_remotes();
+  remote->set_host("another_remote_host");
+  remote->set_shard(2u);
+  remote = emitter.add_remotes();
+  remote->set_host("disabled_remote_host");
+  remote->set_shard(1u);
+  remote->set_disabled(true);
+  EXPECT_EQ((Emitter::ShardWeights{3u, 1u, 2u}),
+            Emitter::GetShardWeights(emitter));
+}
+
 /*
  * Check that emitter doesn't enter infinite loop while polling coordinators.
  */
@@ -1655,6 +1747,59 @@ TEST_F(EmitterTest, LocalSuccessfulCompilation) {
   // TODO: check absolute output path.
 }
 
+/*
+ * The time of local compilation is remembered and persisted next to the cache, when the tasks are ordered by cost.
+ */
+TEST_F(EmitterTest, LocalCompilationTimeIsPersisted) {
+  const base::TemporaryDir temp_dir;
+  const String compiler_version = "fake_compiler_version";
+  const auto compiler_path = "fake_compiler_path"_l;
+  const String current_dir = "fake_current_dir";
+  const auto action = "fake_action"_l;
+  const auto input_path = "test.cc"_l;
+
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_disabled(true);
+  conf.mutable_emitter()->set_longest_first(true);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  run_callback = [&](base::TestProcess*) { std::this_thread::sleep_for(std::chrono::milliseconds(20)); };
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  base::proto::Local local;
+  auto connection = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(current_dir);
+    extension->mutable_flags()->mutable_compiler()->set_version(compiler_version);
+    extension->mutable_flags()->set_action(action);
+    extension->mutable_flags()->set_input(input_path);
+    local.CopyFrom(*extension);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+  }
+
+  emitter.reset();
+
+  EXPECT_EQ(1u, run_count);
+  EXPECT_EQ(1u, send_count);
+
+  CostModel cost_model(temp_dir.path() / "cost_model");
+  EXPECT_EQ(1u, cost_model.size());
+  EXPECT_LE(Milliseconds(20), cost_model.Predict(CostModel::MakeKey(local)));
+}
+
 TEST_F(EmitterTest, DISABLED_RemoteSuccessfulCompilation) {
   // TODO: implement this test.
   //       - Check the permissions of object and deps files, if the client
@@ -1824,6 +1969,18 @@ TEST_F(EmitterTest, StoreSimpleCacheForLocalResult) {
   base::Singleton<perf::StatService>::Get().Dump(metric);
   EXPECT_EQ(1u, metric.value());
 
+  // Both tasks have waited for the cache lookup, but only the first one - for
+  // a worker in the shard queue. No task has failed to the local queue.
+  metric.set_name(perf::proto::Metric::CACHE_QUEUE_WAIT_TIME);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(2u, metric.histogram().count());
+  metric.set_name(perf::proto::Metric::SHARD_QUEUE_WAIT_TIME);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.histogram().count());
+  metric.set_name(perf::proto::Metric::LOCAL_QUEUE_WAIT_TIME);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(0u, metric.histogram().count());
+
   Immutable cache_output;
   EXPECT_TRUE(base::File::Exists(output_path2));
   EXPECT_TRUE(base::File::Read(output_path2, &cache_output));
@@ -1842,81 +1999,40 @@ TEST_F(EmitterTest, StoreSimpleCacheForLocalResult) {
   // TODO: check that removal of original files doesn't fail cache filling.
 }
 
-TEST_F(EmitterTest, StoreSimpleCacheForRemoteResult) {
+/*
+ * 1. Store the failure of a local compilation in the cache.
+ * 2. Try to compile the same preprocessed source locally.
+ * 3. Replay the failure from the cache without compilation.
+ */
+TEST_F(EmitterTest, RestoreExtraOutputsFromCache) {
   const base::TemporaryDir temp_dir;
-  const String host = "fake_host";
-  const ui16 port = 12345;
   const String compiler_version = "fake_compiler_version";
   const String compiler_path = "fake_compiler_path";
-  const auto object_code = "fake_object_code"_l;
   const auto source = "fake_source"_l;
   const auto language = "fake_language"_l;
-  const String action = "fake_action";
+  const auto action = "fake_action"_l;
   const auto input_path1 = "test1.cc"_l;
   const auto input_path2 = "test2.cc"_l;
-  const String output_path1 = "test1.o";
-  const auto plugin_name = "fake_plugin"_l;
-  const auto plugin_path = "fake_plugin_path"_l;
-  const auto remote_compilation_time = std::chrono::milliseconds(10);
-
-  const auto output_path2 = temp_dir.path() / "test2.o";
-  // |output_path2| checks that everything works fine with absolute paths.
+  const auto output_path = "test.o"_l;
+  const auto notes_path = "test.gcno"_l;
+  const auto object_code = "fake_object_code"_l;
+  const auto notes = "fake_coverage_notes"_l;
 
-  conf.mutable_emitter()->set_only_failed(true);
   conf.mutable_cache()->set_path(temp_dir);
-  conf.mutable_cache()->set_direct(false);
   conf.mutable_cache()->set_clean_period(1);
 
-  auto* remote = conf.mutable_emitter()->add_remotes();
-  remote->set_host(host);
-  remote->set_port(port);
-  remote->set_threads(1);
-
   auto* version = conf.add_versions();
   version->set_version(compiler_version);
   version->set_path(compiler_path);
-  auto* plugin = version->add_plugins();
-  plugin->set_name(plugin_name);
-  plugin->set_path(plugin_path);
 
   connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
-    if (connect_count == 1) {
-      // Connection from client to local daemon.
-
-      connection->CallOnSend([&](const net::Connection::Message& message) {
-        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
-        const auto& status = message.GetExtension(net::proto::Status::extension);
-        EXPECT_EQ(expected_code, status.code()) << status.description();
-
-        send_condition.notify_all();
-      });
-    } else if (connect_count == 2) {
-      // Connection from local daemon to remote daemon.
-
-      connection->CallOnSend([&](const net::Connection::Message& message) {
-        EXPECT_TRUE(message.HasExtension(proto::Remote::extension));
-        const auto& command = message.GetExtension(proto::Remote::extension);
-        EXPECT_EQ(source, command.source());
-
-        send_condition.notify_all();
-      });
-
-      connection->CallOnRead([&](net::Connection::Message* message) {
-        // Used to check remote compilation timing statistics.
-        std::this_thread::sleep_for(remote_compilation_time);
-        message->MutableExtension(proto::Result::extension)->set_obj(object_code);
-      });
-    } else if (connect_count == 3) {
-      // Connection from client to local daemon.
-
-      connection->CallOnSend([&](const net::Connection::Message& message) {
-        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
-        const auto& status = message.GetExtension(net::proto::Status::extension);
-        EXPECT_EQ(expected_code, status.code()) << status.description();
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(expected_code, status.code()) << status.description();
 
-        send_condition.notify_all();
-      });
-    }
+      send_condition.notify_all();
+    });
     return true;
   };
 
@@ -1925,6 +2041,12 @@ TEST_F(EmitterTest, StoreSimpleCacheForRemoteResult) {
       EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path1}), process->args_);
       process->stdout_ = source;
     } else if (run_count == 2) {
+      EXPECT_EQ((Immutable::Rope{action, "-x"_l, language, "-coverage-notes-file"_l, notes_path, "-o"_l, output_path,
+                                 input_path1}),
+                process->args_);
+      EXPECT_TRUE(base::File::Write(temp_dir.path() / output_path, object_code));
+      EXPECT_TRUE(base::File::Write(temp_dir.path() / notes_path, notes));
+    } else if (run_count == 3) {
       EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path2}), process->args_);
       process->stdout_ = source;
     }
@@ -1933,45 +2055,111 @@ TEST_F(EmitterTest, StoreSimpleCacheForRemoteResult) {
   emitter = std::make_unique<Emitter>(conf);
   ASSERT_TRUE(emitter->Initialize());
 
-  auto connection1 = test_service->TriggerListen(socket_path);
-  {
-    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
+  Vector<net::ConnectionPtr> connections;
+  for (const auto& input_path : {input_path1, input_path2}) {
+    connections.push_back(test_service->TriggerListen(socket_path));
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connections.back());
 
     net::Connection::ScopedMessage message(new net::Connection::Message);
     auto* extension = message->MutableExtension(base::proto::Local::extension);
-
     extension->set_current_dir(temp_dir);
-    extension->mutable_flags()->set_input(input_path1);
-    extension->mutable_flags()->set_output(output_path1);
-    auto* compiler = extension->mutable_flags()->mutable_compiler();
-    compiler->set_version(compiler_version);
-    compiler->add_plugins()->set_name(plugin_name);
+
+    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_output(output_path);
+    extension->mutable_flags()->mutable_compiler()->set_version(compiler_version);
     extension->mutable_flags()->set_action(action);
     extension->mutable_flags()->set_language(language);
 
+    auto* output = extension->mutable_flags()->add_outputs();
+    output->set_name("gcno");
+    output->set_flag("-coverage-notes-file");
+    output->set_path(notes_path);
+
     net::proto::Status status;
     status.set_code(net::proto::Status::OK);
 
     EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
 
+    const auto expected_count = connections.size();
     UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
-    // FIXME: describe, why |send_count == 2| ?
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [&] { return send_count == expected_count; }));
+
+    Immutable written_notes;
+    EXPECT_TRUE(base::File::Read(temp_dir.path() / notes_path, &written_notes));
+    EXPECT_EQ(notes, written_notes);
+
+    // The second task should restore both outputs from the cache.
+    ASSERT_TRUE(base::File::Delete(temp_dir.path() / output_path));
+    ASSERT_TRUE(base::File::Delete(temp_dir.path() / notes_path));
   }
 
-  auto connection2 = test_service->TriggerListen(socket_path);
-  {
-    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection2);
+  emitter.reset();
+
+  EXPECT_EQ(3u, run_count);
+  EXPECT_EQ(2u, send_count);
+  for (const auto& connection : connections) {
+    EXPECT_EQ(1, connection.use_count()) << "Daemon must not store references to the connection";
+  }
+}
+
+TEST_F(EmitterTest, CacheSyntaxOnlyDiagnostics) {
+  const base::TemporaryDir temp_dir;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const auto source = "fake_source"_l;
+  const auto language = "fake_language"_l;
+  const auto action = "-fsyntax-only"_l;
+  const auto input_path1 = "test1.cc"_l;
+  const auto input_path2 = "test2.cc"_l;
+  const auto compiler_warning = "test1.cc:1:1: warning: unused variable"_l;
+
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(expected_code, status.code()) << status.description();
+      EXPECT_EQ(compiler_warning, status.description());
+
+      send_condition.notify_all();
+    });
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    if (run_count == 1) {
+      EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path1}), process->args_);
+      process->stdout_ = source;
+    } else if (run_count == 2) {
+      EXPECT_EQ((Immutable::Rope{action, "-x"_l, language, input_path1}), process->args_);
+      process->stderr_ = compiler_warning;
+    } else if (run_count == 3) {
+      EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path2}), process->args_);
+      process->stdout_ = source;
+    }
+  };
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  Vector<net::ConnectionPtr> connections;
+  for (const auto& input_path : {input_path1, input_path2}) {
+    connections.push_back(test_service->TriggerListen(socket_path));
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connections.back());
 
     net::Connection::ScopedMessage message(new net::Connection::Message);
     auto* extension = message->MutableExtension(base::proto::Local::extension);
     extension->set_current_dir(temp_dir);
 
-    extension->mutable_flags()->set_input(input_path2);
-    extension->mutable_flags()->set_output(output_path2);
-    auto* compiler = extension->mutable_flags()->mutable_compiler();
-    compiler->set_version(compiler_version);
-    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->mutable_compiler()->set_version(compiler_version);
     extension->mutable_flags()->set_action(action);
     extension->mutable_flags()->set_language(language);
 
@@ -1980,8 +2168,10 @@ TEST_F(EmitterTest, StoreSimpleCacheForRemoteResult) {
 
     EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
 
+    const auto expected_count = connections.size();
     UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 3; }));
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [&] { return send_count == expected_count; }));
   }
 
   emitter.reset();
@@ -1991,130 +2181,76 @@ TEST_F(EmitterTest, StoreSimpleCacheForRemoteResult) {
   base::Singleton<perf::StatService>::Get().Dump(metric);
   EXPECT_EQ(1u, metric.value());
 
-  perf::proto::Metric remote_compilation_time_metric;
-  remote_compilation_time_metric.set_name(perf::proto::Metric::REMOTE_COMPILATION_TIME);
-  base::Singleton<perf::StatService>::Get().Dump(remote_compilation_time_metric);
-  EXPECT_GE(remote_compilation_time_metric.value(), static_cast<ui64>(remote_compilation_time.count()));
-
-  Immutable cache_output;
-  ASSERT_TRUE(base::File::Exists(output_path2));
-  ASSERT_TRUE(base::File::Read(output_path2, &cache_output));
-  EXPECT_EQ(object_code, cache_output);
-
-  EXPECT_EQ(2u, run_count);
-  EXPECT_EQ(1u, listen_count);
-  EXPECT_EQ(3u, connect_count);
-  EXPECT_EQ(3u, connections_created);
-  EXPECT_EQ(3u, read_count);
-  EXPECT_EQ(3u, send_count) << "There should be only these transmissions:" << std::endl
-                            << "  1. Local daemon -> remote daemon." << std::endl
-                            << "  2. Local daemon -> 1st client." << std::endl
-                            << "  3. Local daemon -> 2nd client.";
-  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
-  EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
-
-  // TODO: check that original files are not moved.
-  // TODO: check that removal of original files doesn't fail cache filling.
+  EXPECT_EQ(3u, run_count);
+  EXPECT_EQ(2u, send_count);
+  for (const auto& connection : connections) {
+    EXPECT_EQ(1, connection.use_count()) << "Daemon must not store references to the connection";
+  }
 }
 
-/*
- * 1. Trigger compilation on remote
- * 2. Remote fails compilation
- * 3. Run local compilation.
- */
-TEST_F(EmitterTest, FallbackToLocalCompilationAfterRemoteFail) {
+TEST_F(EmitterTest, ReplayCachedLocalFailure) {
   const base::TemporaryDir temp_dir;
-  const String host = "fake_host";
-  const ui16 port = 12345;
   const String compiler_version = "fake_compiler_version";
   const String compiler_path = "fake_compiler_path";
-  const auto object_code = "fake_object_code"_l;
   const auto source = "fake_source"_l;
   const auto language = "fake_language"_l;
   const auto action = "fake_action"_l;
   const auto input_path1 = "test1.cc"_l;
-  const auto output_path1 = "test1.o"_l;
-  const auto plugin_name = "fake_plugin"_l;
-  const auto plugin_path = "fake_plugin_path"_l;
-  const auto local_compilation_time = std::chrono::milliseconds(10);
+  const auto input_path2 = "test2.cc"_l;
+  const auto output_path = "test.o"_l;
+  const auto compiler_error = "test1.cc:1:1: error: unknown type name"_l;
+
+  expected_code = net::proto::Status::EXECUTION;
 
-  conf.mutable_emitter()->set_only_failed(true);
   conf.mutable_cache()->set_path(temp_dir);
-  conf.mutable_cache()->set_direct(false);
   conf.mutable_cache()->set_clean_period(1);
-
-  auto* remote = conf.mutable_emitter()->add_remotes();
-  remote->set_host(host);
-  remote->set_port(port);
-  remote->set_threads(1);
+  conf.mutable_cache()->set_failure_ttl(60);
 
   auto* version = conf.add_versions();
   version->set_version(compiler_version);
   version->set_path(compiler_path);
-  auto* plugin = version->add_plugins();
-  plugin->set_name(plugin_name);
-  plugin->set_path(plugin_path);
 
   connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
-    if (connect_count == 1) {
-      // Connection from client to local daemon.
-
-      connection->CallOnSend([&](const net::Connection::Message& message) {
-        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
-        const auto& status = message.GetExtension(net::proto::Status::extension);
-        EXPECT_EQ(expected_code, status.code()) << status.description();
-
-        send_condition.notify_all();
-      });
-    } else if (connect_count == 2) {
-      // Connection from local daemon to remote daemon.
-
-      connection->CallOnSend([&](const net::Connection::Message& message) {
-        EXPECT_TRUE(message.HasExtension(proto::Remote::extension));
-        const auto& command = message.GetExtension(proto::Remote::extension);
-        EXPECT_EQ(source, command.source());
-
-        EXPECT_TRUE(command.flags().rewrite_includes());
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(expected_code, status.code()) << status.description();
+      EXPECT_EQ(compiler_error, status.description());
 
-        send_condition.notify_all();
-      });
-      connection->CallOnRead([&](net::Connection::Message* message) {
-        message->MutableExtension(net::proto::Status::extension)->set_code(net::proto::Status::EXECUTION);
-      });
-    }
+      send_condition.notify_all();
+    });
     return true;
   };
 
   run_callback = [&](base::TestProcess* process) {
+    // Only the preprocessing succeeds.
+    do_run = run_count != 2;
     if (run_count == 1) {
       EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path1}), process->args_);
       process->stdout_ = source;
     } else if (run_count == 2) {
-      // Used to check local compilation timing statistics.
-      std::this_thread::sleep_for(local_compilation_time);
-      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-x"_l, language, "-o"_l, output_path1, input_path1}),
-                process->args_);
-      EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path1, object_code));
+      process->stderr_ = compiler_error;
+    } else if (run_count == 3) {
+      EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path2}), process->args_);
+      process->stdout_ = source;
     }
   };
 
   emitter = std::make_unique<Emitter>(conf);
   ASSERT_TRUE(emitter->Initialize());
 
-  auto connection1 = test_service->TriggerListen(socket_path);
-  {
-    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
+  Vector<net::ConnectionPtr> connections;
+  for (const auto& input_path : {input_path1, input_path2}) {
+    connections.push_back(test_service->TriggerListen(socket_path));
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connections.back());
 
     net::Connection::ScopedMessage message(new net::Connection::Message);
     auto* extension = message->MutableExtension(base::proto::Local::extension);
-
     extension->set_current_dir(temp_dir);
-    extension->mutable_flags()->set_input(input_path1);
-    extension->mutable_flags()->set_output(output_path1);
-    extension->mutable_flags()->set_rewrite_includes(true);
-    auto* compiler = extension->mutable_flags()->mutable_compiler();
-    compiler->set_version(compiler_version);
-    compiler->add_plugins()->set_name(plugin_name);
+
+    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_output(output_path);
+    extension->mutable_flags()->mutable_compiler()->set_version(compiler_version);
     extension->mutable_flags()->set_action(action);
     extension->mutable_flags()->set_language(language);
 
@@ -2123,129 +2259,88 @@ TEST_F(EmitterTest, FallbackToLocalCompilationAfterRemoteFail) {
 
     EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
 
+    const auto expected_count = connections.size();
     UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
-    // FIXME: describe, why |send_count == 2| ?
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [&] { return send_count == expected_count; }));
   }
 
   emitter.reset();
 
-  perf::proto::Metric remote_compilation_failed_metric;
-  remote_compilation_failed_metric.set_name(perf::proto::Metric::REMOTE_COMPILATION_FAILED);
-  base::Singleton<perf::StatService>::Get().Dump(remote_compilation_failed_metric);
-  EXPECT_EQ(1u, remote_compilation_failed_metric.value());
-
-  perf::proto::Metric local_compilation_time_metric;
-  local_compilation_time_metric.set_name(perf::proto::Metric::LOCAL_COMPILATION_TIME);
-  base::Singleton<perf::StatService>::Get().Dump(local_compilation_time_metric);
-  EXPECT_GE(local_compilation_time_metric.value(), static_cast<ui64>(local_compilation_time.count()));
+  perf::proto::Metric metric;
+  metric.set_name(perf::proto::Metric::FAILURE_CACHE_HIT);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
 
-  EXPECT_EQ(2u, run_count);
-  EXPECT_EQ(1u, listen_count);
-  EXPECT_EQ(2u, connect_count);
-  EXPECT_EQ(2u, connections_created);
-  EXPECT_EQ(2u, read_count);
-  EXPECT_EQ(2u, send_count) << "There should be only two transmissions:" << std::endl
-                            << "  1. From client -> local daemon." << std::endl
-                            << "  2. Local daemon -> remote daemon." << std::endl;
-  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
+  EXPECT_FALSE(base::File::Exists(temp_dir.path() / output_path));
+  EXPECT_EQ(3u, run_count);
+  EXPECT_EQ(2u, send_count);
+  for (const auto& connection : connections) {
+    EXPECT_EQ(1, connection.use_count()) << "Daemon must not store references to the connection";
+  }
 }
 
-/*
- * 1. Trigger compilation on remote
- * 2. Remote rejects compilation
- * 3. Run local compilation.
- */
-TEST_F(EmitterTest, FallbackToLocalCompilationAfterRemoteRejects) {
+TEST_F(EmitterTest, DoNotCacheLocalEnvironmentFailure) {
   const base::TemporaryDir temp_dir;
-  const String host = "fake_host";
-  const ui16 port = 12345;
   const String compiler_version = "fake_compiler_version";
   const String compiler_path = "fake_compiler_path";
-  const auto object_code = "fake_object_code"_l;
   const auto source = "fake_source"_l;
   const auto language = "fake_language"_l;
   const auto action = "fake_action"_l;
   const auto input_path1 = "test1.cc"_l;
-  const auto output_path1 = "test1.o"_l;
-  const auto plugin_name = "fake_plugin"_l;
-  const auto plugin_path = "fake_plugin_path"_l;
-  const auto preprocess_time = std::chrono::milliseconds(10);
+  const auto input_path2 = "test2.cc"_l;
+  const auto output_path = "test.o"_l;
+  const auto compiler_error = "error: unable to open output file 'test.o': 'No space left on device'"_l;
+
+  expected_code = net::proto::Status::EXECUTION;
 
-  conf.mutable_emitter()->set_only_failed(true);
   conf.mutable_cache()->set_path(temp_dir);
-  conf.mutable_cache()->set_direct(false);
   conf.mutable_cache()->set_clean_period(1);
-
-  auto* remote = conf.mutable_emitter()->add_remotes();
-  remote->set_host(host);
-  remote->set_port(port);
-  remote->set_threads(1);
+  conf.mutable_cache()->set_failure_ttl(60);
 
   auto* version = conf.add_versions();
   version->set_version(compiler_version);
   version->set_path(compiler_path);
-  auto* plugin = version->add_plugins();
-  plugin->set_name(plugin_name);
-  plugin->set_path(plugin_path);
 
   connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
-    if (connect_count == 1) {
-      // Connection from client to local daemon.
-
-      connection->CallOnSend([&](const net::Connection::Message& message) {
-        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
-        const auto& status = message.GetExtension(net::proto::Status::extension);
-        EXPECT_EQ(expected_code, status.code()) << status.description();
-
-        send_condition.notify_all();
-      });
-    } else if (connect_count == 2) {
-      // Connection from local daemon to remote daemon.
-
-      connection->CallOnSend([&](const net::Connection::Message& message) {
-        EXPECT_TRUE(message.HasExtension(proto::Remote::extension));
-        const auto& command = message.GetExtension(proto::Remote::extension);
-        EXPECT_EQ(source, command.source());
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(expected_code, status.code()) << status.description();
+      EXPECT_EQ(compiler_error, status.description());
 
-        send_condition.notify_all();
-      });
-      connection->CallOnRead([&](net::Connection::Message* message) {
-        message->MutableExtension(net::proto::Status::extension)->set_code(net::proto::Status::OVERLOAD);
-      });
-    }
+      send_condition.notify_all();
+    });
     return true;
   };
 
   run_callback = [&](base::TestProcess* process) {
-    if (run_count == 1) {
-      // Used to check preprocess timing statistics.
-      std::this_thread::sleep_for(preprocess_time);
-      EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path1}), process->args_);
+    // Only the preprocessing succeeds - the compilation fails to write the output twice.
+    do_run = run_count % 2 == 1;
+    if (run_count % 2 == 1) {
+      const auto& input_path = run_count == 1 ? input_path1 : input_path2;
+      EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path}), process->args_);
       process->stdout_ = source;
-    } else if (run_count == 2) {
-      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-x"_l, language, "-o"_l, output_path1, input_path1}),
-                process->args_);
-      EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path1, object_code));
+    } else {
+      process->stderr_ = compiler_error;
     }
   };
 
   emitter = std::make_unique<Emitter>(conf);
   ASSERT_TRUE(emitter->Initialize());
 
-  auto connection1 = test_service->TriggerListen(socket_path);
-  {
-    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
+  Vector<net::ConnectionPtr> connections;
+  for (const auto& input_path : {input_path1, input_path2}) {
+    connections.push_back(test_service->TriggerListen(socket_path));
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connections.back());
 
     net::Connection::ScopedMessage message(new net::Connection::Message);
     auto* extension = message->MutableExtension(base::proto::Local::extension);
-
     extension->set_current_dir(temp_dir);
-    extension->mutable_flags()->set_input(input_path1);
-    extension->mutable_flags()->set_output(output_path1);
-    auto* compiler = extension->mutable_flags()->mutable_compiler();
-    compiler->set_version(compiler_version);
-    compiler->add_plugins()->set_name(plugin_name);
+
+    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_output(output_path);
+    extension->mutable_flags()->mutable_compiler()->set_version(compiler_version);
     extension->mutable_flags()->set_action(action);
     extension->mutable_flags()->set_language(language);
 
@@ -2254,90 +2349,116 @@ TEST_F(EmitterTest, FallbackToLocalCompilationAfterRemoteRejects) {
 
     EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
 
+    const auto expected_count = connections.size();
     UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
-    // FIXME: describe, why |send_count == 2| ?
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [&] { return send_count == expected_count; }));
   }
 
   emitter.reset();
 
-  perf::proto::Metric remote_compilation_failed_metric;
-  remote_compilation_failed_metric.set_name(perf::proto::Metric::REMOTE_COMPILATION_FAILED);
-  base::Singleton<perf::StatService>::Get().Dump(remote_compilation_failed_metric);
-  EXPECT_EQ(0u, remote_compilation_failed_metric.value());
-
-  perf::proto::Metric remote_compilation_rejected_metric;
-  remote_compilation_rejected_metric.set_name(perf::proto::Metric::REMOTE_COMPILATION_REJECTED);
-  base::Singleton<perf::StatService>::Get().Dump(remote_compilation_rejected_metric);
-  EXPECT_EQ(1u, remote_compilation_rejected_metric.value());
-
-  perf::proto::Metric preprocess_time_metric;
-  preprocess_time_metric.set_name(perf::proto::Metric::PREPROCESS_TIME);
-  base::Singleton<perf::StatService>::Get().Dump(preprocess_time_metric);
-  EXPECT_GE(preprocess_time_metric.value(), static_cast<ui64>(preprocess_time.count()));
+  perf::proto::Metric metric;
+  metric.set_name(perf::proto::Metric::FAILURE_CACHE_HIT);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(0u, metric.value());
 
-  EXPECT_EQ(2u, run_count);
-  EXPECT_EQ(1u, listen_count);
-  EXPECT_EQ(2u, connect_count);
-  EXPECT_EQ(2u, connections_created);
-  EXPECT_EQ(2u, read_count);
-  EXPECT_EQ(2u, send_count) << "There should be only these transmissions:" << std::endl
-                            << "  1. Local daemon -> remote daemon." << std::endl
-                            << "  2. Local daemon -> client." << std::endl;
-  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
+  EXPECT_FALSE(base::File::Exists(temp_dir.path() / output_path));
+  EXPECT_EQ(4u, run_count);
+  EXPECT_EQ(2u, send_count);
+  for (const auto& connection : connections) {
+    EXPECT_EQ(1, connection.use_count()) << "Daemon must not store references to the connection";
+  }
 }
 
-TEST_F(EmitterTest, StoreSimpleCacheForLocalResultWithAndWithoutBlacklist) {
+TEST_F(EmitterTest, HitAndUpdateCacheServer) {
   const base::TemporaryDir temp_dir;
   const String compiler_version = "fake_compiler_version";
   const String compiler_path = "fake_compiler_path";
-  const auto source = "fake_source"_l;
-  const auto language = "fake_language"_l;
+  const String cache_server_host = "cache_server_host";
+  const ui16 cache_server_port = 12345;
+  const auto object_code1 = "fake_object_code1"_l;
+  const auto object_code2 = "fake_object_code2"_l;
+  const auto source1 = "fake_source1"_l;
+  const auto source2 = "fake_source2"_l;
   const auto action = "fake_action"_l;
-  const auto input_path = "test.cc"_l;
+  const auto input_path1 = "test1.cc"_l;
+  const auto input_path2 = "test2.cc"_l;
   const auto output_path1 = "test1.o"_l;
-  const auto output_path2 = "test2.o"_l;
-  const auto plugin_name = "fake_plugin"_l;
-  const auto plugin_path = "fake_plugin_path"_l;
-  const auto sanitize_blacklist_path = "asan-blacklist.txt"_l;
+  const auto output_path2 = temp_dir.path() / "test2.o";
 
   conf.mutable_cache()->set_path(temp_dir);
   conf.mutable_cache()->set_direct(false);
   conf.mutable_cache()->set_clean_period(1);
 
+  auto* cache_server = conf.mutable_emitter()->mutable_cache_server();
+  cache_server->set_host(cache_server_host);
+  cache_server->set_port(cache_server_port);
+  cache_server->set_threads(1);
+
   auto* version = conf.add_versions();
   version->set_version(compiler_version);
   version->set_path(compiler_path);
-  auto* plugin = version->add_plugins();
-  plugin->set_name(plugin_name);
-  plugin->set_path(plugin_path);
 
-  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
-    connection->CallOnSend([&](const net::Connection::Message& message) {
-      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
-      const auto& status = message.GetExtension(net::proto::Status::extension);
-      EXPECT_EQ(expected_code, status.code()) << status.description();
+  Atomic<ui32> client_replies = {0}, cache_server_lookups = {0}, cache_server_updates = {0};
 
-      send_condition.notify_all();
-    });
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr end_point) {
+    if (EndPointString(cache_server_host, cache_server_port) == end_point->Print()) {
+      // Connection from emitter to cache server.
+
+      auto is_update = std::make_shared<bool>(false);
+      connection->CallOnSend([&, is_update](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(proto::CacheRequest::extension));
+        const auto& request = message.GetExtension(proto::CacheRequest::extension);
+        EXPECT_FALSE(request.handled_hash().empty());
+
+        *is_update = request.has_result();
+        if (*is_update) {
+          // Only the result of local compilation is sent to cache server.
+          EXPECT_EQ(object_code1, request.result().obj());
+          ++cache_server_updates;
+        } else {
+          ++cache_server_lookups;
+        }
+
+        send_condition.notify_all();
+      });
+
+      connection->CallOnRead([&, is_update](net::Connection::Message* message) {
+        auto* status = message->MutableExtension(net::proto::Status::extension);
+        status->set_code(net::proto::Status::OK);
+
+        // The first lookup misses, and the second one hits.
+        if (!*is_update && cache_server_lookups == 2) {
+          message->MutableExtension(proto::Result::extension)->set_obj(object_code2);
+        }
+      });
+    } else {
+      // Connection from client to emitter.
+
+      EXPECT_EQ(EndPointString(socket_path), end_point->Print());
+
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status = message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(expected_code, status.code()) << status.description();
+
+        ++client_replies;
+        send_condition.notify_all();
+      });
+    }
     return true;
   };
 
   run_callback = [&](base::TestProcess* process) {
     if (run_count == 1) {
-      EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path}), process->args_);
-      process->stdout_ = source;
+      EXPECT_EQ((Immutable::Rope{"-E"_l, "-o"_l, "-"_l, input_path1}), process->args_);
+      process->stdout_ = source1;
     } else if (run_count == 2) {
-      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-x"_l, language, "-o"_l, output_path1, input_path}),
-                process->args_);
+      EXPECT_EQ((Immutable::Rope{action, "-o"_l, output_path1, input_path1}), process->args_);
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path1, object_code1));
     } else if (run_count == 3) {
-      EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path}), process->args_);
-      process->stdout_ = source;
-    } else if (run_count == 4) {
-      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-x"_l, language,
-                                 Immutable("-fsanitize-blacklist="_l) + sanitize_blacklist_path, "-o"_l, output_path2,
-                                 input_path}),
-                process->args_);
+      EXPECT_EQ((Immutable::Rope{"-E"_l, "-o"_l, "-"_l, input_path2}), process->args_);
+      process->stdout_ = source2;
     }
   };
 
@@ -2352,13 +2473,10 @@ TEST_F(EmitterTest, StoreSimpleCacheForLocalResultWithAndWithoutBlacklist) {
     auto* extension = message->MutableExtension(base::proto::Local::extension);
     extension->set_current_dir(temp_dir);
 
-    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_input(input_path1);
     extension->mutable_flags()->set_output(output_path1);
-    auto* compiler = extension->mutable_flags()->mutable_compiler();
-    compiler->set_version(compiler_version);
-    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->mutable_compiler()->set_version(compiler_version);
     extension->mutable_flags()->set_action(action);
-    extension->mutable_flags()->set_language(language);
 
     net::proto::Status status;
     status.set_code(net::proto::Status::OK);
@@ -2366,7 +2484,8 @@ TEST_F(EmitterTest, StoreSimpleCacheForLocalResultWithAndWithoutBlacklist) {
     EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
 
     UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 1; }));
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [&] { return client_replies == 1 && cache_server_updates == 1; }));
   }
 
   auto connection2 = test_service->TriggerListen(socket_path);
@@ -2377,14 +2496,10 @@ TEST_F(EmitterTest, StoreSimpleCacheForLocalResultWithAndWithoutBlacklist) {
     auto* extension = message->MutableExtension(base::proto::Local::extension);
     extension->set_current_dir(temp_dir);
 
-    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_input(input_path2);
     extension->mutable_flags()->set_output(output_path2);
-    auto* compiler = extension->mutable_flags()->mutable_compiler();
-    compiler->set_version(compiler_version);
-    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->mutable_compiler()->set_version(compiler_version);
     extension->mutable_flags()->set_action(action);
-    extension->mutable_flags()->set_language(language);
-    extension->mutable_flags()->set_sanitize_blacklist(sanitize_blacklist_path);
 
     net::proto::Status status;
     status.set_code(net::proto::Status::OK);
@@ -2392,114 +2507,134 @@ TEST_F(EmitterTest, StoreSimpleCacheForLocalResultWithAndWithoutBlacklist) {
     EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
 
     UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [&] { return client_replies == 2; }));
   }
 
   emitter.reset();
 
-  EXPECT_EQ(4u, run_count);
-  EXPECT_EQ(1u, listen_count);
-  EXPECT_EQ(2u, connect_count);
-  EXPECT_EQ(2u, connections_created);
-  EXPECT_EQ(2u, read_count);
-  EXPECT_EQ(2u, send_count);
+  perf::proto::Metric metric;
+  metric.set_name(perf::proto::Metric::SHARED_CACHE_HIT);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+
+  metric.set_name(perf::proto::Metric::SHARED_CACHE_MISS);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+
+  Immutable cache_output;
+  EXPECT_TRUE(base::File::Read(output_path2, &cache_output));
+  EXPECT_EQ(object_code2, cache_output);
+
+  EXPECT_EQ(3u, run_count);
+  EXPECT_EQ(2u, cache_server_lookups);
+  EXPECT_EQ(1u, cache_server_updates);
   EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
   EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
-
-  // TODO: check that original files are not moved.
-  // TODO: check that removal of original files doesn't fail cache filling.
 }
 
-TEST_F(EmitterTest, StoreDirectCacheForLocalResult) {
-  // Prepare environment.
+TEST_F(EmitterTest, ProbeRemoteBeforeUpload) {
   const base::TemporaryDir temp_dir;
-  const auto input1_path = temp_dir.path() / "test1.cc";
-  const auto input2_path = temp_dir.path() / "test2.cc";
-  const auto header1_path = temp_dir.path() / "header1.h";
-  const auto header2_path = temp_dir.path() / "header2.h";
-  const auto source_code = "int main() {}"_l;
-
-  ASSERT_TRUE(base::File::Write(input1_path, source_code));
-  ASSERT_TRUE(base::File::Write(input2_path, source_code));
-  ASSERT_TRUE(base::File::Write(header1_path, "#define A"_l));
-  ASSERT_TRUE(base::File::Write(header2_path, "#define B"_l));
-
-  // Prepare configuration.
   const String compiler_version = "fake_compiler_version";
   const String compiler_path = "fake_compiler_path";
-  const String plugin_name = "fake_plugin";
-  const auto plugin_path = "fake_plugin_path"_l;
+  const String remote_host = "remote_host";
+  const ui16 remote_port = 12345;
+  const auto object_code1 = "fake_object_code1"_l;
+  const auto object_code2 = "fake_object_code2"_l;
+  const auto source1 = "fake_source1"_l;
+  const auto source2 = "fake_source2"_l;
+  const auto action = "fake_action"_l;
+  const auto input_path1 = "test1.cc"_l;
+  const auto input_path2 = "test2.cc"_l;
+  const auto output_path1 = temp_dir.path() / "test1.o";
+  const auto output_path2 = temp_dir.path() / "test2.o";
 
+  conf.mutable_emitter()->set_only_failed(true);
+  conf.mutable_emitter()->set_probe_remotes(true);
   conf.mutable_cache()->set_path(temp_dir);
-  conf.mutable_cache()->set_direct(true);
+  conf.mutable_cache()->set_direct(false);
   conf.mutable_cache()->set_clean_period(1);
 
+  auto* remote = conf.mutable_emitter()->add_remotes();
+  remote->set_host(remote_host);
+  remote->set_port(remote_port);
+  remote->set_threads(1);
+
   auto* version = conf.add_versions();
   version->set_version(compiler_version);
   version->set_path(compiler_path);
-  auto* plugin = version->add_plugins();
-  plugin->set_name(plugin_name);
-  plugin->set_path(plugin_path);
 
-  // Prepare callbacks.
-  const auto deps1_path = "test1.d"_l;
-  const auto deps2_path = temp_dir.path() / "test2.d";
-  const auto language = "fake_language"_l;
-  const auto preprocessed_source = "fake_source"_l;
-  const auto action = "fake_action"_l;
-  const auto output1_path = "test1.o"_l;
-  const auto object_code = "fake_object_code"_l;
-  const auto deps_contents = "test1.o: test1.cc header1.h header2.h"_l;
+  Atomic<ui32> client_replies = {0}, probes = {0}, uploads = {0};
 
-  const auto output2_path = temp_dir.path() / "test2.o";
-  // |output_path2| checks that everything works fine with absolute paths.
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr end_point) {
+    if (EndPointString(remote_host, remote_port) == end_point->Print()) {
+      // Connection from emitter to remote absorber.
 
-  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
-    connection->CallOnSend([&](const net::Connection::Message& message) {
-      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
-      const auto& status = message.GetExtension(net::proto::Status::extension);
-      EXPECT_EQ(expected_code, status.code()) << status.description();
+      auto reads = std::make_shared<ui32>(0);
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(proto::Remote::extension));
+        const auto& outgoing = message.GetExtension(proto::Remote::extension);
+        EXPECT_FALSE(outgoing.handled_hash().empty());
 
-      send_condition.notify_all();
-    });
+        if (outgoing.has_source()) {
+          EXPECT_EQ(source2, outgoing.source()) << "Only a probe miss should upload the source";
+          ++uploads;
+        } else {
+          ++probes;
+        }
+      });
+
+      connection->CallOnRead([&, reads](net::Connection::Message* message) {
+        ++*reads;
+        message->MutableExtension(net::proto::Status::extension)->set_code(net::proto::Status::OK);
+
+        if (probes == 1) {
+          // The first probe hits.
+          message->MutableExtension(proto::Result::extension)->set_obj(object_code1);
+          message->MutableExtension(proto::Result::extension)->set_from_cache(true);
+        } else if (*reads == 2) {
+          // The second probe misses - reply to the upload on the same connection.
+          message->MutableExtension(proto::Result::extension)->set_obj(object_code2);
+        }
+      });
+    } else {
+      // Connection from client to emitter.
+
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status = message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(expected_code, status.code()) << status.description();
+
+        ++client_replies;
+        send_condition.notify_all();
+      });
+    }
     return true;
   };
 
   run_callback = [&](base::TestProcess* process) {
+    // Only preprocessing happens locally.
     if (run_count == 1) {
-      EXPECT_EQ(
-          (Immutable::Rope{"-E"_l, "-dependency-file"_l, deps1_path, "-x"_l, language, "-o"_l, "-"_l, input1_path}),
-          process->args_);
-      process->stdout_ = preprocessed_source;
-      EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps1_path, deps_contents));
+      process->stdout_ = source1;
     } else if (run_count == 2) {
-      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-dependency-file"_l, deps1_path, "-x"_l, language,
-                                 "-o"_l, output1_path, input1_path}),
-                process->args_)
-          << process->PrintArgs();
-      EXPECT_TRUE(base::File::Write(process->cwd_path_ / output1_path, object_code));
+      process->stdout_ = source2;
     }
   };
 
   emitter = std::make_unique<Emitter>(conf);
   ASSERT_TRUE(emitter->Initialize());
 
-  auto connection1 = test_service->TriggerListen(socket_path);
-  {
-    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
+  auto SendTask = [&](Immutable input_path, const Path& output_path, ui32 expected_replies) {
+    auto connection = test_service->TriggerListen(socket_path);
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection);
 
     net::Connection::ScopedMessage message(new net::Connection::Message);
     auto* extension = message->MutableExtension(base::proto::Local::extension);
     extension->set_current_dir(temp_dir);
 
-    extension->mutable_flags()->set_input(input1_path);
-    extension->mutable_flags()->set_output(output1_path);
-    extension->mutable_flags()->set_deps_file(deps1_path);
-    auto* compiler = extension->mutable_flags()->mutable_compiler();
-    compiler->set_version(compiler_version);
-    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_output(output_path);
+    extension->mutable_flags()->mutable_compiler()->set_version(compiler_version);
     extension->mutable_flags()->set_action(action);
-    extension->mutable_flags()->set_language(language);
 
     net::proto::Status status;
     status.set_code(net::proto::Status::OK);
@@ -2507,25 +2642,133 @@ TEST_F(EmitterTest, StoreDirectCacheForLocalResult) {
     EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
 
     UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 1; }));
-  }
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [&] { return client_replies == expected_replies; }));
+  };
 
-  auto connection2 = test_service->TriggerListen(socket_path);
+  SendTask(input_path1, output_path1, 1u);
+  SendTask(input_path2, output_path2, 2u);
+
+  emitter.reset();
+
+  Immutable output1, output2;
+  EXPECT_TRUE(base::File::Read(output_path1, &output1));
+  EXPECT_EQ(object_code1, output1);
+  EXPECT_TRUE(base::File::Read(output_path2, &output2));
+  EXPECT_EQ(object_code2, output2);
+
+  perf::proto::Metric metric;
+  metric.set_name(perf::proto::Metric::REMOTE_CACHE_HIT);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+
+  metric.set_name(perf::proto::Metric::REMOTE_PROBE_MISS);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+
+  EXPECT_EQ(2u, run_count);
+  EXPECT_EQ(2u, probes);
+  EXPECT_EQ(1u, uploads);
+}
+
+TEST_F(EmitterTest, UploadSourceOnceWithPCHFiles) {
+  const base::TemporaryDir temp_dir;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const String remote_host = "remote_host";
+  const ui16 remote_port = 12345;
+  const auto object_code = "fake_object_code"_l;
+  const auto source = "fake_source"_l;
+  const auto action = "fake_action"_l;
+  const auto input_path = "test.cc"_l;
+  const auto output_path = temp_dir.path() / "test.o";
+  const auto pch_path = temp_dir.path() / "test.pch";
+  const auto pch = "fake_pch_contents"_l;
+  const String pch_hash = base::Hexify(Immutable(pch).Hash());
+
+  ASSERT_TRUE(base::File::Write(pch_path, pch));
+
+  // The PCH mode probes even without |probe_remotes|.
+  conf.mutable_emitter()->set_only_failed(true);
+
+  auto* remote = conf.mutable_emitter()->add_remotes();
+  remote->set_host(remote_host);
+  remote->set_port(remote_port);
+  remote->set_threads(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  Atomic<ui32> client_replies = {0}, probes = {0}, uploads = {0};
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr end_point) {
+    if (EndPointString(remote_host, remote_port) == end_point->Print()) {
+      // Connection from emitter to remote absorber.
+
+      auto reads = std::make_shared<ui32>(0);
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        ASSERT_TRUE(message.HasExtension(proto::Remote::extension));
+        const auto& outgoing = message.GetExtension(proto::Remote::extension);
+        ASSERT_EQ(1, outgoing.included_files_size());
+        EXPECT_EQ(pch_hash, outgoing.included_files(0).hash());
+
+        if (outgoing.has_source()) {
+          EXPECT_EQ(source, outgoing.source());
+          // The probe has told that the remote doesn't have the PCH file.
+          EXPECT_EQ(pch, outgoing.included_files(0).content());
+          ++uploads;
+        } else {
+          EXPECT_FALSE(outgoing.included_files(0).has_content());
+          ++probes;
+        }
+      });
+
+      connection->CallOnRead([&, reads](net::Connection::Message* message) {
+        message->MutableExtension(net::proto::Status::extension)->set_code(net::proto::Status::OK);
+
+        if (++*reads == 1) {
+          message->MutableExtension(proto::MissingFiles::extension)->add_hashes(pch_hash);
+        } else {
+          message->MutableExtension(proto::Result::extension)->set_obj(object_code);
+        }
+      });
+    } else {
+      // Connection from client to emitter.
+
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status = message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(expected_code, status.code()) << status.description();
+
+        ++client_replies;
+        send_condition.notify_all();
+      });
+    }
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    // Only preprocessing happens locally.
+    process->stdout_ = source;
+  };
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  auto connection = test_service->TriggerListen(socket_path);
   {
-    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection2);
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection);
 
     net::Connection::ScopedMessage message(new net::Connection::Message);
     auto* extension = message->MutableExtension(base::proto::Local::extension);
     extension->set_current_dir(temp_dir);
 
-    extension->mutable_flags()->set_input(input2_path);
-    extension->mutable_flags()->set_output(output2_path);
-    extension->mutable_flags()->set_deps_file(deps2_path);
-    auto* compiler = extension->mutable_flags()->mutable_compiler();
-    compiler->set_version(compiler_version);
-    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_output(output_path);
+    extension->mutable_flags()->add_included_files(pch_path);
+    extension->mutable_flags()->mutable_compiler()->set_version(compiler_version);
     extension->mutable_flags()->set_action(action);
-    extension->mutable_flags()->set_language(language);
 
     net::proto::Status status;
     status.set_code(net::proto::Status::OK);
@@ -2533,66 +2776,1780 @@ TEST_F(EmitterTest, StoreDirectCacheForLocalResult) {
     EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
 
     UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [&] { return client_replies == 1u; }));
   }
 
   emitter.reset();
 
+  Immutable output;
+  EXPECT_TRUE(base::File::Read(output_path, &output));
+  EXPECT_EQ(object_code, output);
+
   perf::proto::Metric metric;
-  metric.set_name(perf::proto::Metric::DIRECT_CACHE_HIT);
+  metric.set_name(perf::proto::Metric::PCH_FILES_UPLOADED);
   base::Singleton<perf::StatService>::Get().Dump(metric);
   EXPECT_EQ(1u, metric.value());
 
-  Immutable cache_output;
-  EXPECT_TRUE(base::File::Exists(output2_path));
-  EXPECT_TRUE(base::File::Read(output2_path, &cache_output));
-  EXPECT_EQ(object_code, cache_output);
+  EXPECT_EQ(1u, run_count);
+  EXPECT_EQ(1u, probes);
+  EXPECT_EQ(1u, uploads);
+}
 
-  Immutable cache_deps;
-  EXPECT_TRUE(base::File::Exists(deps2_path));
-  EXPECT_TRUE(base::File::Read(deps2_path, &cache_deps));
-  EXPECT_EQ(deps_contents, cache_deps);
+TEST_F(EmitterTest, ProbeHistorySkipsLikelyMisses) {
+  Emitter::ProbeHistory history;
 
-  EXPECT_EQ(2u, run_count);
-  EXPECT_EQ(1u, listen_count);
-  EXPECT_EQ(2u, connect_count);
-  EXPECT_EQ(2u, connections_created);
-  EXPECT_EQ(2u, read_count);
-  EXPECT_EQ(2u, send_count);
-  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
-  EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
+  auto Hash = [](ui32 i) { return cache::string::HandledHash(Immutable(std::to_string(i))); };
 
-  // TODO: check that original files are not moved.
-  // TODO: check that removal of original files doesn't fail cache filling.
-  // TODO: check situations about deps file:
-  //       - deps file is in cache, but not requested.
+  EXPECT_TRUE(history.ShouldProbe(Hash(0)));
+  history.Update(Hash(0), false);
+  EXPECT_FALSE(history.ShouldProbe(Hash(0))) << "The same hash has just missed";
+
+  for (ui32 i = 1; i < 16; ++i) {
+    EXPECT_TRUE(history.ShouldProbe(Hash(i)));
+    history.Update(Hash(i), false);
+  }
+
+  // After many misses in a row only each 16th task is probed.
+  ui32 probes = 0;
+  for (ui32 i = 16; i < 48; ++i) {
+    if (history.ShouldProbe(Hash(i))) {
+      ++probes;
+    }
+  }
+  EXPECT_EQ(2u, probes);
+
+  // A single hit restores probing.
+  history.Update(Hash(48), true);
+  EXPECT_TRUE(history.ShouldProbe(Hash(49)));
+  EXPECT_TRUE(history.ShouldProbe(Hash(50)));
 }
 
-TEST_F(EmitterTest, StoreDirectCacheForLocalResultWithAndWithoutIncludedHeaders) {
+TEST_F(EmitterTest, RemoteEstimateLearnsFromTasks) {
+  Emitter::RemoteEstimate estimate;
+  Milliseconds time;
+
+  EXPECT_FALSE(estimate.Predict(0, Milliseconds(1000), &time)) << "The remote isn't measured yet";
+
+  estimate.UpdateConnect(Milliseconds(10));
+  estimate.UpdateUpload(1024 * 1024, Milliseconds(100));
+  estimate.UpdateReply(Milliseconds(1000), Milliseconds(2000));
+
+  // The small uploads tell nothing about the link.
+  estimate.UpdateUpload(1024, Milliseconds(100));
+
+  ASSERT_TRUE(estimate.Predict(1024 * 1024, Milliseconds(1000), &time));
+  EXPECT_EQ(Milliseconds(10 + 100 + 2000), time);
+
+  estimate.UpdateReply(Milliseconds(1000), Milliseconds(6000));
+  ASSERT_TRUE(estimate.Predict(0, Milliseconds(1000), &time));
+  EXPECT_EQ(Milliseconds(10 + 3000), time) << "The samples are averaged";
+
+  // The remote is measured again from time to time.
+  ui32 predictions = 2;
+  while (estimate.Predict(0, Milliseconds(1000), &time)) {
+    ++predictions;
+  }
+  EXPECT_EQ(16u, predictions + 1);
+}
+
+TEST_F(EmitterTest, CacheServerWithDisabledCache) {
+  conf.mutable_emitter()->mutable_cache_server()->set_host("cache_server_host");
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_FALSE(emitter->Initialize());
+}
+
+TEST_F(EmitterTest, StoreSimpleCacheForRemoteResult) {
+  const base::TemporaryDir temp_dir;
+  const String host = "fake_host";
+  const ui16 port = 12345;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const auto object_code = "fake_object_code"_l;
+  const auto source = "fake_source"_l;
+  const auto language = "fake_language"_l;
+  const String action = "fake_action";
+  const auto input_path1 = "test1.cc"_l;
+  const auto input_path2 = "test2.cc"_l;
+  const String output_path1 = "test1.o";
+  const auto plugin_name = "fake_plugin"_l;
+  const auto plugin_path = "fake_plugin_path"_l;
+  const auto remote_compilation_time = std::chrono::milliseconds(10);
+
+  const auto output_path2 = temp_dir.path() / "test2.o";
+  // |output_path2| checks that everything works fine with absolute paths.
+
+  conf.mutable_emitter()->set_only_failed(true);
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_direct(false);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* remote = conf.mutable_emitter()->add_remotes();
+  remote->set_host(host);
+  remote->set_port(port);
+  remote->set_threads(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+  auto* plugin = version->add_plugins();
+  plugin->set_name(plugin_name);
+  plugin->set_path(plugin_path);
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    if (connect_count == 1) {
+      // Connection from client to local daemon.
+
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status = message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(expected_code, status.code()) << status.description();
+
+        send_condition.notify_all();
+      });
+    } else if (connect_count == 2) {
+      // Connection from local daemon to remote daemon.
+
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(proto::Remote::extension));
+        const auto& command = message.GetExtension(proto::Remote::extension);
+        EXPECT_EQ(source, command.source());
+
+        send_condition.notify_all();
+      });
+
+      connection->CallOnRead([&](net::Connection::Message* message) {
+        // Used to check remote compilation timing statistics.
+        std::this_thread::sleep_for(remote_compilation_time);
+        message->MutableExtension(proto::Result::extension)->set_obj(object_code);
+      });
+    } else if (connect_count == 3) {
+      // Connection from client to local daemon.
+
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status = message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(expected_code, status.code()) << status.description();
+
+        send_condition.notify_all();
+      });
+    }
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    if (run_count == 1) {
+      EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path1}), process->args_);
+      process->stdout_ = source;
+    } else if (run_count == 2) {
+      EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path2}), process->args_);
+      process->stdout_ = source;
+    }
+  };
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  auto connection1 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+
+    extension->set_current_dir(temp_dir);
+    extension->mutable_flags()->set_input(input_path1);
+    extension->mutable_flags()->set_output(output_path1);
+    auto* compiler = extension->mutable_flags()->mutable_compiler();
+    compiler->set_version(compiler_version);
+    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_action(action);
+    extension->mutable_flags()->set_language(language);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
+    // FIXME: describe, why |send_count == 2| ?
+  }
+
+  auto connection2 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection2);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(temp_dir);
+
+    extension->mutable_flags()->set_input(input_path2);
+    extension->mutable_flags()->set_output(output_path2);
+    auto* compiler = extension->mutable_flags()->mutable_compiler();
+    compiler->set_version(compiler_version);
+    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_action(action);
+    extension->mutable_flags()->set_language(language);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 3; }));
+  }
+
+  emitter.reset();
+
+  perf::proto::Metric metric;
+  metric.set_name(perf::proto::Metric::SIMPLE_CACHE_HIT);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+
+  perf::proto::Metric remote_compilation_time_metric;
+  remote_compilation_time_metric.set_name(perf::proto::Metric::REMOTE_COMPILATION_TIME);
+  base::Singleton<perf::StatService>::Get().Dump(remote_compilation_time_metric);
+  EXPECT_GE(remote_compilation_time_metric.value(), static_cast<ui64>(remote_compilation_time.count()));
+
+  Immutable cache_output;
+  ASSERT_TRUE(base::File::Exists(output_path2));
+  ASSERT_TRUE(base::File::Read(output_path2, &cache_output));
+  EXPECT_EQ(object_code, cache_output);
+
+  EXPECT_EQ(2u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(3u, connect_count);
+  EXPECT_EQ(3u, connections_created);
+  EXPECT_EQ(3u, read_count);
+  EXPECT_EQ(3u, send_count) << "There should be only these transmissions:" << std::endl
+                            << "  1. Local daemon -> remote daemon." << std::endl
+                            << "  2. Local daemon -> 1st client." << std::endl
+                            << "  3. Local daemon -> 2nd client.";
+  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
+
+  // TODO: check that original files are not moved.
+  // TODO: check that removal of original files doesn't fail cache filling.
+}
+
+TEST_F(EmitterTest, TraceSpansFromClientToRemote) {
+  const base::TemporaryDir temp_dir;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const auto source = "fake_source"_l;
+  const ui64 trace_id = 0xdeadbeef;
+  const ui64 remote_pid = 777;
+  const auto trace_path = temp_dir.path() / "trace.json";
+
+  conf.mutable_emitter()->set_only_failed(true);
+
+  auto* remote = conf.mutable_emitter()->add_remotes();
+  remote->set_host("fake_host");
+  remote->set_port(12345);
+  remote->set_threads(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    if (connect_count == 2) {
+      // Connection from local daemon to remote daemon.
+
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(proto::Remote::extension));
+        EXPECT_EQ(trace_id, message.GetExtension(proto::Remote::extension).trace_id());
+      });
+
+      connection->CallOnRead([&](net::Connection::Message* message) {
+        auto* result = message->MutableExtension(proto::Result::extension);
+        result->set_obj("fake_object_code");
+
+        auto* span = result->mutable_trace()->add_spans();
+        span->set_name("Compile");
+        span->set_trace_id(trace_id);
+        span->set_start(1000);
+        span->set_duration(10);
+        span->set_pid(remote_pid);
+      });
+    } else {
+      // Connections from client and from trace dumper to local daemon.
+
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status = message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(net::proto::Status::OK, status.code()) << status.description();
+
+        send_condition.notify_all();
+      });
+    }
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) { process->stdout_ = source; };
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  auto& trace_service = base::Singleton<perf::TraceService>::Get();
+  {
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(test_service->TriggerListen(socket_path));
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(temp_dir);
+    extension->set_trace_id(trace_id);
+    extension->set_trace_start(trace_service.WallTime(Clock::now()) - 1000);
+    extension->mutable_flags()->set_input("test.cc");
+    extension->mutable_flags()->set_output("test.o");
+    extension->mutable_flags()->mutable_compiler()->set_version(compiler_version);
+    extension->mutable_flags()->set_action("fake_action");
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
+  }
+
+  {
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(test_service->TriggerListen(socket_path));
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(perf::proto::TraceDump::extension);
+    extension->set_path(trace_path.string());
+    extension->set_trace_id(trace_id);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 3; }));
+  }
+
+  emitter.reset();
+
+  perf::proto::Trace trace;
+  trace_service.Dump(trace_id, &trace);
+  List<String> names;
+  for (const auto& span : trace.spans()) {
+    names.push_back(span.name());
+    EXPECT_EQ(span.name() == "Compile" ? remote_pid : static_cast<ui64>(getpid()), span.pid());
+  }
+  EXPECT_EQ((List<String>{"Client", "Shard queue", "Preprocess", "Connect", "Compile", "Remote compile"}), names);
+
+  Immutable json;
+  ASSERT_TRUE(base::File::Read(trace_path, &json));
+  EXPECT_EQ(perf::TraceService::ToChromeTrace(trace), json.string_copy());
+}
+
+/*
+ * 1. Trigger compilation on remote
+ * 2. Remote fails compilation
+ * 3. Run local compilation.
+ */
+TEST_F(EmitterTest, FallbackToLocalCompilationAfterRemoteFail) {
+  const base::TemporaryDir temp_dir;
+  const String host = "fake_host";
+  const ui16 port = 12345;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const auto object_code = "fake_object_code"_l;
+  const auto source = "fake_source"_l;
+  const auto language = "fake_language"_l;
+  const auto action = "fake_action"_l;
+  const auto input_path1 = "test1.cc"_l;
+  const auto output_path1 = "test1.o"_l;
+  const auto plugin_name = "fake_plugin"_l;
+  const auto plugin_path = "fake_plugin_path"_l;
+  const auto local_compilation_time = std::chrono::milliseconds(10);
+
+  conf.mutable_emitter()->set_only_failed(true);
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_direct(false);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* remote = conf.mutable_emitter()->add_remotes();
+  remote->set_host(host);
+  remote->set_port(port);
+  remote->set_threads(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+  auto* plugin = version->add_plugins();
+  plugin->set_name(plugin_name);
+  plugin->set_path(plugin_path);
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    if (connect_count == 1) {
+      // Connection from client to local daemon.
+
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status = message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(expected_code, status.code()) << status.description();
+
+        send_condition.notify_all();
+      });
+    } else if (connect_count == 2) {
+      // Connection from local daemon to remote daemon.
+
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(proto::Remote::extension));
+        const auto& command = message.GetExtension(proto::Remote::extension);
+        EXPECT_EQ(source, command.source());
+
+        EXPECT_TRUE(command.flags().rewrite_includes());
+
+        send_condition.notify_all();
+      });
+      connection->CallOnRead([&](net::Connection::Message* message) {
+        message->MutableExtension(net::proto::Status::extension)->set_code(net::proto::Status::EXECUTION);
+      });
+    }
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    if (run_count == 1) {
+      EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path1}), process->args_);
+      process->stdout_ = source;
+    } else if (run_count == 2) {
+      // Used to check local compilation timing statistics.
+      std::this_thread::sleep_for(local_compilation_time);
+      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-x"_l, language, "-o"_l, output_path1, input_path1}),
+                process->args_);
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path1, object_code));
+    }
+  };
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  auto connection1 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+
+    extension->set_current_dir(temp_dir);
+    extension->mutable_flags()->set_input(input_path1);
+    extension->mutable_flags()->set_output(output_path1);
+    extension->mutable_flags()->set_rewrite_includes(true);
+    auto* compiler = extension->mutable_flags()->mutable_compiler();
+    compiler->set_version(compiler_version);
+    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_action(action);
+    extension->mutable_flags()->set_language(language);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
+    // FIXME: describe, why |send_count == 2| ?
+  }
+
+  emitter.reset();
+
+  perf::proto::Metric remote_compilation_failed_metric;
+  remote_compilation_failed_metric.set_name(perf::proto::Metric::REMOTE_COMPILATION_FAILED);
+  base::Singleton<perf::StatService>::Get().Dump(remote_compilation_failed_metric);
+  EXPECT_EQ(1u, remote_compilation_failed_metric.value());
+
+  perf::proto::Metric local_compilation_time_metric;
+  local_compilation_time_metric.set_name(perf::proto::Metric::LOCAL_COMPILATION_TIME);
+  base::Singleton<perf::StatService>::Get().Dump(local_compilation_time_metric);
+  EXPECT_GE(local_compilation_time_metric.value(), static_cast<ui64>(local_compilation_time.count()));
+
+  EXPECT_EQ(2u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(2u, connect_count);
+  EXPECT_EQ(2u, connections_created);
+  EXPECT_EQ(2u, read_count);
+  EXPECT_EQ(2u, send_count) << "There should be only two transmissions:" << std::endl
+                            << "  1. From client -> local daemon." << std::endl
+                            << "  2. Local daemon -> remote daemon." << std::endl;
+  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
+}
+
+/*
+ * 1. Trigger compilation on remote
+ * 2. Remote rejects compilation
+ * 3. Run local compilation.
+ */
+TEST_F(EmitterTest, FallbackToLocalCompilationAfterRemoteRejects) {
+  const base::TemporaryDir temp_dir;
+  const String host = "fake_host";
+  const ui16 port = 12345;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const auto object_code = "fake_object_code"_l;
+  const auto source = "fake_source"_l;
+  const auto language = "fake_language"_l;
+  const auto action = "fake_action"_l;
+  const auto input_path1 = "test1.cc"_l;
+  const auto output_path1 = "test1.o"_l;
+  const auto plugin_name = "fake_plugin"_l;
+  const auto plugin_path = "fake_plugin_path"_l;
+  const auto preprocess_time = std::chrono::milliseconds(10);
+
+  conf.mutable_emitter()->set_only_failed(true);
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_direct(false);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* remote = conf.mutable_emitter()->add_remotes();
+  remote->set_host(host);
+  remote->set_port(port);
+  remote->set_threads(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+  auto* plugin = version->add_plugins();
+  plugin->set_name(plugin_name);
+  plugin->set_path(plugin_path);
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    if (connect_count == 1) {
+      // Connection from client to local daemon.
+
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status = message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(expected_code, status.code()) << status.description();
+
+        send_condition.notify_all();
+      });
+    } else if (connect_count == 2) {
+      // Connection from local daemon to remote daemon.
+
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(proto::Remote::extension));
+        const auto& command = message.GetExtension(proto::Remote::extension);
+        EXPECT_EQ(source, command.source());
+
+        send_condition.notify_all();
+      });
+      connection->CallOnRead([&](net::Connection::Message* message) {
+        message->MutableExtension(net::proto::Status::extension)->set_code(net::proto::Status::OVERLOAD);
+      });
+    }
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    if (run_count == 1) {
+      // Used to check preprocess timing statistics.
+      std::this_thread::sleep_for(preprocess_time);
+      EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path1}), process->args_);
+      process->stdout_ = source;
+    } else if (run_count == 2) {
+      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-x"_l, language, "-o"_l, output_path1, input_path1}),
+                process->args_);
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path1, object_code));
+    }
+  };
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  auto connection1 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+
+    extension->set_current_dir(temp_dir);
+    extension->mutable_flags()->set_input(input_path1);
+    extension->mutable_flags()->set_output(output_path1);
+    auto* compiler = extension->mutable_flags()->mutable_compiler();
+    compiler->set_version(compiler_version);
+    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_action(action);
+    extension->mutable_flags()->set_language(language);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
+    // FIXME: describe, why |send_count == 2| ?
+  }
+
+  emitter.reset();
+
+  perf::proto::Metric remote_compilation_failed_metric;
+  remote_compilation_failed_metric.set_name(perf::proto::Metric::REMOTE_COMPILATION_FAILED);
+  base::Singleton<perf::StatService>::Get().Dump(remote_compilation_failed_metric);
+  EXPECT_EQ(0u, remote_compilation_failed_metric.value());
+
+  perf::proto::Metric remote_compilation_rejected_metric;
+  remote_compilation_rejected_metric.set_name(perf::proto::Metric::REMOTE_COMPILATION_REJECTED);
+  base::Singleton<perf::StatService>::Get().Dump(remote_compilation_rejected_metric);
+  EXPECT_EQ(1u, remote_compilation_rejected_metric.value());
+
+  perf::proto::Metric preprocess_time_metric;
+  preprocess_time_metric.set_name(perf::proto::Metric::PREPROCESS_TIME);
+  base::Singleton<perf::StatService>::Get().Dump(preprocess_time_metric);
+  EXPECT_GE(preprocess_time_metric.value(), static_cast<ui64>(preprocess_time.count()));
+
+  EXPECT_EQ(2u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(2u, connect_count);
+  EXPECT_EQ(2u, connections_created);
+  EXPECT_EQ(2u, read_count);
+  EXPECT_EQ(2u, send_count) << "There should be only these transmissions:" << std::endl
+                            << "  1. Local daemon -> remote daemon." << std::endl
+                            << "  2. Local daemon -> client." << std::endl;
+  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
+}
+
+TEST_F(EmitterTest, StoreSimpleCacheForLocalResultWithAndWithoutBlacklist) {
+  const base::TemporaryDir temp_dir;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const auto source = "fake_source"_l;
+  const auto language = "fake_language"_l;
+  const auto action = "fake_action"_l;
+  const auto input_path = "test.cc"_l;
+  const auto output_path1 = "test1.o"_l;
+  const auto output_path2 = "test2.o"_l;
+  const auto plugin_name = "fake_plugin"_l;
+  const auto plugin_path = "fake_plugin_path"_l;
+  const auto sanitize_blacklist_path = "asan-blacklist.txt"_l;
+
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_direct(false);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+  auto* plugin = version->add_plugins();
+  plugin->set_name(plugin_name);
+  plugin->set_path(plugin_path);
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(expected_code, status.code()) << status.description();
+
+      send_condition.notify_all();
+    });
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    if (run_count == 1) {
+      EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path}), process->args_);
+      process->stdout_ = source;
+    } else if (run_count == 2) {
+      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-x"_l, language, "-o"_l, output_path1, input_path}),
+                process->args_);
+    } else if (run_count == 3) {
+      EXPECT_EQ((Immutable::Rope{"-E"_l, "-x"_l, language, "-o"_l, "-"_l, input_path}), process->args_);
+      process->stdout_ = source;
+    } else if (run_count == 4) {
+      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-x"_l, language,
+                                 Immutable("-fsanitize-blacklist="_l) + sanitize_blacklist_path, "-o"_l, output_path2,
+                                 input_path}),
+                process->args_);
+    }
+  };
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  auto connection1 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(temp_dir);
+
+    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_output(output_path1);
+    auto* compiler = extension->mutable_flags()->mutable_compiler();
+    compiler->set_version(compiler_version);
+    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_action(action);
+    extension->mutable_flags()->set_language(language);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 1; }));
+  }
+
+  auto connection2 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection2);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(temp_dir);
+
+    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_output(output_path2);
+    auto* compiler = extension->mutable_flags()->mutable_compiler();
+    compiler->set_version(compiler_version);
+    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_action(action);
+    extension->mutable_flags()->set_language(language);
+    extension->mutable_flags()->set_sanitize_blacklist(sanitize_blacklist_path);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
+  }
+
+  emitter.reset();
+
+  EXPECT_EQ(4u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(2u, connect_count);
+  EXPECT_EQ(2u, connections_created);
+  EXPECT_EQ(2u, read_count);
+  EXPECT_EQ(2u, send_count);
+  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
+
+  // TODO: check that original files are not moved.
+  // TODO: check that removal of original files doesn't fail cache filling.
+}
+
+TEST_F(EmitterTest, StoreDirectCacheForLocalResult) {
+  // Prepare environment.
+  const base::TemporaryDir temp_dir;
+  const auto input1_path = temp_dir.path() / "test1.cc";
+  const auto input2_path = temp_dir.path() / "test2.cc";
+  const auto header1_path = temp_dir.path() / "header1.h";
+  const auto header2_path = temp_dir.path() / "header2.h";
+  const auto source_code = "int main() {}"_l;
+
+  ASSERT_TRUE(base::File::Write(input1_path, source_code));
+  ASSERT_TRUE(base::File::Write(input2_path, source_code));
+  ASSERT_TRUE(base::File::Write(header1_path, "#define A"_l));
+  ASSERT_TRUE(base::File::Write(header2_path, "#define B"_l));
+
+  // Prepare configuration.
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const String plugin_name = "fake_plugin";
+  const auto plugin_path = "fake_plugin_path"_l;
+
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_direct(true);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+  auto* plugin = version->add_plugins();
+  plugin->set_name(plugin_name);
+  plugin->set_path(plugin_path);
+
+  // Prepare callbacks.
+  const auto deps1_path = "test1.d"_l;
+  const auto deps2_path = temp_dir.path() / "test2.d";
+  const auto language = "fake_language"_l;
+  const auto preprocessed_source = "fake_source"_l;
+  const auto action = "fake_action"_l;
+  const auto output1_path = "test1.o"_l;
+  const auto object_code = "fake_object_code"_l;
+  const auto deps_contents = "test1.o: test1.cc header1.h header2.h"_l;
+
+  const auto output2_path = temp_dir.path() / "test2.o";
+  // |output_path2| checks that everything works fine with absolute paths.
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(expected_code, status.code()) << status.description();
+
+      send_condition.notify_all();
+    });
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    if (run_count == 1) {
+      EXPECT_EQ(
+          (Immutable::Rope{"-E"_l, "-dependency-file"_l, deps1_path, "-x"_l, language, "-o"_l, "-"_l, input1_path}),
+          process->args_);
+      process->stdout_ = preprocessed_source;
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps1_path, deps_contents));
+    } else if (run_count == 2) {
+      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-dependency-file"_l, deps1_path, "-x"_l, language,
+                                 "-o"_l, output1_path, input1_path}),
+                process->args_)
+          << process->PrintArgs();
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / output1_path, object_code));
+    }
+  };
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  auto connection1 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(temp_dir);
+
+    extension->mutable_flags()->set_input(input1_path);
+    extension->mutable_flags()->set_output(output1_path);
+    extension->mutable_flags()->set_deps_file(deps1_path);
+    auto* compiler = extension->mutable_flags()->mutable_compiler();
+    compiler->set_version(compiler_version);
+    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_action(action);
+    extension->mutable_flags()->set_language(language);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 1; }));
+  }
+
+  auto connection2 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection2);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(temp_dir);
+
+    extension->mutable_flags()->set_input(input2_path);
+    extension->mutable_flags()->set_output(output2_path);
+    extension->mutable_flags()->set_deps_file(deps2_path);
+    auto* compiler = extension->mutable_flags()->mutable_compiler();
+    compiler->set_version(compiler_version);
+    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_action(action);
+    extension->mutable_flags()->set_language(language);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
+  }
+
+  emitter.reset();
+
+  perf::proto::Metric metric;
+  metric.set_name(perf::proto::Metric::DIRECT_CACHE_HIT);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+
+  Immutable cache_output;
+  EXPECT_TRUE(base::File::Exists(output2_path));
+  EXPECT_TRUE(base::File::Read(output2_path, &cache_output));
+  EXPECT_EQ(object_code, cache_output);
+
+  Immutable cache_deps;
+  EXPECT_TRUE(base::File::Exists(deps2_path));
+  EXPECT_TRUE(base::File::Read(deps2_path, &cache_deps));
+  EXPECT_EQ(deps_contents, cache_deps);
+
+  EXPECT_EQ(2u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(2u, connect_count);
+  EXPECT_EQ(2u, connections_created);
+  EXPECT_EQ(2u, read_count);
+  EXPECT_EQ(2u, send_count);
+  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
+
+  // TODO: check that original files are not moved.
+  // TODO: check that removal of original files doesn't fail cache filling.
+  // TODO: check situations about deps file:
+  //       - deps file is in cache, but not requested.
+}
+
+TEST_F(EmitterTest, StoreDirectCacheForLocalResultWithAndWithoutIncludedHeaders) {
+  // Prepare environment.
+  const base::TemporaryDir temp_dir;
+  const auto input_path = temp_dir.path() / "test.cc";
+  const auto header1_path = temp_dir.path() / "header1.h";
+  const auto header2_path = temp_dir.path() / "header2.h";
+  const auto source_code = "int main() {}"_l;
+  const auto deps_path = "test.d"_l;
+  const auto language = "fake_language"_l;
+  const auto preprocessed_source = "fake_source"_l;
+  const auto action = "fake_action"_l;
+  const auto output_path = "test.o"_l;
+  const auto object_code = "fake_object_code"_l;
+  const auto preprocessed_header_path = temp_dir.path() / "header1.h.pth";
+  const auto deps_contents = "test.o: test.cc header1.h header2.h"_l;
+
+  // Clang outputs headers included using "-include-pth/pch" as absolute paths.
+  const auto preprocessed_deps_contents = Immutable("test.o: test.cc header1.h header2.h "_l) + header1_path;
+  const auto preprocessed_contents = "Any content should work"_l;
+
+  ASSERT_TRUE(base::File::Write(preprocessed_header_path, preprocessed_contents));
+
+  ASSERT_TRUE(base::File::Write(input_path, source_code));
+  ASSERT_TRUE(base::File::Write(header1_path, "#define A"_l));
+  ASSERT_TRUE(base::File::Write(header2_path, "#define B"_l));
+
+  // Prepare configuration.
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const String plugin_name = "fake_plugin";
+  const auto plugin_path = "fake_plugin_path"_l;
+
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_direct(true);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+  auto* plugin = version->add_plugins();
+  plugin->set_name(plugin_name);
+  plugin->set_path(plugin_path);
+
+  // Prepare callbacks.
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(expected_code, status.code()) << status.description();
+
+      send_condition.notify_all();
+    });
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    if (run_count == 1) {
+      EXPECT_EQ((Immutable::Rope{"-E"_l, "-dependency-file"_l, deps_path, "-x"_l, language, "-o"_l, "-"_l, input_path}),
+                process->args_);
+      process->stdout_ = preprocessed_source;
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps_path, deps_contents));
+    } else if (run_count == 2) {
+      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-dependency-file"_l, deps_path, "-x"_l, language,
+                                 "-o"_l, output_path, input_path}),
+                process->args_)
+          << process->PrintArgs();
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path, object_code));
+    } else if (run_count == 3) {
+      EXPECT_EQ((Immutable::Rope{"-include-pth"_l, preprocessed_header_path, "-E"_l, "-dependency-file"_l, deps_path,
+                                 "-x"_l, language, "-o"_l, "-"_l, input_path}),
+                process->args_)
+          << process->PrintArgs();
+      process->stdout_ = preprocessed_source;
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps_path, preprocessed_deps_contents));
+    } else if (run_count == 4) {
+      // The contents of the PTH file are a part of the hash - so the result of the first compilation doesn't match.
+      EXPECT_EQ((Immutable::Rope{"-include-pth"_l, preprocessed_header_path, action, "-load"_l, plugin_path,
+                                 "-dependency-file"_l, deps_path, "-x"_l, language, "-o"_l, output_path, input_path}),
+                process->args_)
+          << process->PrintArgs();
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path, object_code));
+    }
+  };
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  auto connection1 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(temp_dir);
+
+    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_output(output_path);
+    extension->mutable_flags()->set_deps_file(deps_path);
+    auto* compiler = extension->mutable_flags()->mutable_compiler();
+    compiler->set_version(compiler_version);
+    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_action(action);
+    extension->mutable_flags()->set_language(language);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 1; }));
+  }
+
+  auto connection2 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection2);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(temp_dir);
+
+    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_output(output_path);
+    extension->mutable_flags()->add_included_files(preprocessed_header_path);
+
+    auto* new_arg = extension->mutable_flags()->add_non_cached();
+    new_arg->add_values("-include-pth");
+    new_arg->add_values(preprocessed_header_path);
+
+    extension->mutable_flags()->set_deps_file(deps_path);
+    auto* compiler = extension->mutable_flags()->mutable_compiler();
+    compiler->set_version(compiler_version);
+    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_action(action);
+    extension->mutable_flags()->set_language(language);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
+  }
+
+  auto connection3 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection3);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(temp_dir);
+
+    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_output(output_path);
+    extension->mutable_flags()->add_included_files(preprocessed_header_path);
+
+    auto* new_arg = extension->mutable_flags()->add_non_cached();
+    new_arg->add_values("-include-pth");
+    new_arg->add_values(preprocessed_header_path);
+
+    extension->mutable_flags()->set_deps_file(deps_path);
+    auto* compiler = extension->mutable_flags()->mutable_compiler();
+    compiler->set_version(compiler_version);
+    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_action(action);
+    extension->mutable_flags()->set_language(language);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 3; }));
+  }
+
+  emitter.reset();
+
+  EXPECT_EQ(4u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(3u, connect_count);
+  EXPECT_EQ(3u, connections_created);
+  EXPECT_EQ(3u, read_count);
+  EXPECT_EQ(3u, send_count);
+  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection3.use_count()) << "Daemon must not store references to the connection";
+}
+
+TEST_F(EmitterTest, StoreDirectCacheForRemoteResult) {
+  // Prepare environment.
+  const base::TemporaryDir temp_dir;
+  const auto input1_path = temp_dir.path() / "test1.cc";
+  const auto input2_path = temp_dir.path() / "test2.cc";
+  const auto header1_path = temp_dir.path() / "header1.h";
+  const auto header2_path = temp_dir.path() / "header2.h";
+  const auto source_code = "int main() {}"_l;
+
+  ASSERT_TRUE(base::File::Write(input1_path, source_code));
+  ASSERT_TRUE(base::File::Write(input2_path, source_code));
+  ASSERT_TRUE(base::File::Write(header1_path, "#define A"_l));
+  ASSERT_TRUE(base::File::Write(header2_path, "#define B"_l));
+
+  // Prepare configuration.
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const String plugin_name = "fake_plugin";
+  const auto plugin_path = "fake_plugin_path"_l;
+  const String host = "fake_host";
+  const ui16 port = 12345;
+
+  conf.mutable_emitter()->set_only_failed(true);
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_direct(true);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* remote = conf.mutable_emitter()->add_remotes();
+  remote->set_host(host);
+  remote->set_port(port);
+  remote->set_threads(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+  auto* plugin = version->add_plugins();
+  plugin->set_name(plugin_name);
+  plugin->set_path(plugin_path);
+
+  // Prepare callbacks.
+  const auto deps1_path = "test1.d"_l;
+  const auto language = "fake_language"_l;
+  const auto preprocessed_source = "fake_source"_l;
+  const auto action = "fake_action"_l;
+  const auto output1_path = "test1.o"_l;
+  const auto object_code = "fake_object_code"_l;
+
+  const auto output2_path = temp_dir.path() / "test2.o";
+  // |output_path2| checks that everything works fine with absolute paths.
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    if (connect_count == 1) {
+      // Connection from client to local daemon.
+
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status = message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(expected_code, status.code()) << status.description();
+
+        send_condition.notify_all();
+      });
+    } else if (connect_count == 2) {
+      // Connection from local daemon to remote daemon.
+
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(proto::Remote::extension));
+        const auto& command = message.GetExtension(proto::Remote::extension);
+        EXPECT_EQ(preprocessed_source, command.source());
+
+        send_condition.notify_all();
+      });
+
+      connection->CallOnRead([&](net::Connection::Message* message) {
+        message->MutableExtension(proto::Result::extension)->set_obj(object_code);
+      });
+    } else if (connect_count == 3) {
+      // Connection from client to local daemon.
+
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status = message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(expected_code, status.code()) << status.description();
+
+        send_condition.notify_all();
+      });
+    }
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    EXPECT_EQ((Immutable::Rope{"-E"_l, "-dependency-file"_l, deps1_path, "-x"_l, language, "-o"_l, "-"_l, input1_path}),
+              process->args_);
+    process->stdout_ = preprocessed_source;
+    EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps1_path, "test1.o: test1.cc header1.h header2.h"_l));
+  };
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  auto connection1 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(temp_dir);
+
+    extension->mutable_flags()->set_input(input1_path);
+    extension->mutable_flags()->set_output(output1_path);
+    extension->mutable_flags()->set_deps_file(deps1_path);
+    auto* compiler = extension->mutable_flags()->mutable_compiler();
+    compiler->set_version(compiler_version);
+    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_action(action);
+    extension->mutable_flags()->set_language(language);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
+  }
+
+  auto connection2 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection2);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(temp_dir);
+
+    extension->mutable_flags()->set_input(input2_path);
+    extension->mutable_flags()->set_output(output2_path);
+    auto* compiler = extension->mutable_flags()->mutable_compiler();
+    compiler->set_version(compiler_version);
+    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->set_action(action);
+    extension->mutable_flags()->set_language(language);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 3; }));
+  }
+
+  emitter.reset();
+
+  perf::proto::Metric metric;
+  metric.set_name(perf::proto::Metric::DIRECT_CACHE_HIT);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+
+  Immutable cache_output;
+  EXPECT_TRUE(base::File::Exists(output2_path));
+  EXPECT_TRUE(base::File::Read(output2_path, &cache_output));
+  EXPECT_EQ(object_code, cache_output);
+
+  EXPECT_EQ(1u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(3u, connect_count);
+  EXPECT_EQ(3u, connections_created);
+  EXPECT_EQ(3u, read_count);
+  EXPECT_EQ(3u, send_count);
+  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
+
+  // TODO: check that original files are not moved.
+  // TODO: check that removal of original files doesn't fail cache filling.
+}
+
+TEST_F(EmitterTest, PumpModeAfterDirectCacheMiss) {
+  // Prepare environment.
+  const base::TemporaryDir temp_dir;
+  const auto input_path = "test.cc"_l;
+  const auto header_path = "header.h"_l;
+  const auto source_code = "#include \"header.h\""_l;
+  const auto header_code = "#define A"_l;
+  const auto new_header_code = "#define B"_l;
+
+  ASSERT_TRUE(base::File::Write(temp_dir.path() / input_path, source_code));
+  ASSERT_TRUE(base::File::Write(temp_dir.path() / header_path, header_code));
+
+  // Prepare configuration.
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const String host = "fake_host";
+  const ui16 port = 12345;
+
+  conf.mutable_emitter()->set_only_failed(true);
+  conf.mutable_emitter()->set_pump(true);
+  conf.mutable_cache()->set_path(temp_dir.path() / "cache");
+  conf.mutable_cache()->set_direct(true);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* remote = conf.mutable_emitter()->add_remotes();
+  remote->set_host(host);
+  remote->set_port(port);
+  remote->set_threads(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  // Prepare callbacks.
+  const auto deps_path = "test.d"_l;
+  const auto deps = "test.o: test.cc header.h"_l;
+  const auto preprocessed_source = "fake_source"_l;
+  const auto action = "fake_action"_l;
+  const auto output_path = "test.o"_l;
+  const auto object_code = "fake_object_code"_l;
+  const auto handled_hash = "fake_handled_hash"_l;
+  const auto new_header_hash = base::Hexify(Immutable(new_header_code).Hash());
+
+  ui32 pump_reads = 0;
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    if (connect_count == 2) {
+      // Connection from local daemon to remote daemon - the first compilation is preprocessed locally.
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(proto::Remote::extension));
+        const auto& command = message.GetExtension(proto::Remote::extension);
+        EXPECT_EQ(preprocessed_source, command.source());
+        EXPECT_EQ(0, command.files_size());
+
+        send_condition.notify_all();
+      });
+
+      connection->CallOnRead([&](net::Connection::Message* message) {
+        message->MutableExtension(proto::Result::extension)->set_obj(object_code);
+      });
+    } else if (connect_count == 4) {
+      // Connection from local daemon to remote daemon in pump mode.
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(proto::Remote::extension));
+        const auto& command = message.GetExtension(proto::Remote::extension);
+        EXPECT_FALSE(command.has_source());
+        EXPECT_EQ(String(temp_dir.path()), command.current_dir());
+        EXPECT_EQ(input_path, command.flags().input());
+        EXPECT_FALSE(command.flags().has_deps_file());
+
+        ASSERT_EQ(2, command.files_size());
+        EXPECT_EQ(input_path, command.files(0).path());
+        EXPECT_EQ(source_code, command.files(0).content());
+        EXPECT_EQ(header_path, command.files(1).path());
+        EXPECT_EQ(new_header_hash, command.files(1).hash());
+        // The header is sent only after the remote asks for it.
+        EXPECT_EQ(send_count == 4, command.files(1).has_content());
+
+        send_condition.notify_all();
+      });
+
+      connection->CallOnRead([&](net::Connection::Message* message) {
+        if (++pump_reads == 1) {
+          message->MutableExtension(proto::MissingFiles::extension)->add_hashes(new_header_hash);
+          return;
+        }
+
+        auto* result = message->MutableExtension(proto::Result::extension);
+        result->set_obj(object_code);
+        result->set_deps(deps);
+        result->set_handled_hash(handled_hash);
+      });
+    } else {
+      // Connection from client to local daemon.
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status = message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(expected_code, status.code()) << status.description();
+
+        send_condition.notify_all();
+      });
+    }
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    process->stdout_ = preprocessed_source;
+    EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps_path, deps));
+  };
+
+  auto CreateMessage = [&] {
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(temp_dir.path());
+
+    auto* flags = extension->mutable_flags();
+    flags->set_input(input_path);
+    flags->set_output(output_path);
+    flags->set_deps_file(deps_path);
+    flags->mutable_compiler()->set_version(compiler_version);
+    flags->set_action(action);
+    auto* arg = flags->add_other();
+    arg->set_index(1);
+    arg->add_values("-sys-header-deps");
+    return message;
+  };
+
+  net::proto::Status status;
+  status.set_code(net::proto::Status::OK);
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  auto connection1 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
+    EXPECT_TRUE(test_connection->TriggerReadAsync(CreateMessage(), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
+  }
+
+  // The direct cache misses now, but still has the list of headers.
+  ASSERT_TRUE(base::File::Write(temp_dir.path() / header_path, new_header_code));
+  ASSERT_TRUE(base::File::Delete(temp_dir.path() / deps_path));
+
+  auto connection2 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection2);
+    EXPECT_TRUE(test_connection->TriggerReadAsync(CreateMessage(), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 5; }));
+  }
+
+  // The direct cache is updated with the result of pump mode.
+  auto connection3 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection3);
+    EXPECT_TRUE(test_connection->TriggerReadAsync(CreateMessage(), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 6; }));
+  }
+
+  emitter.reset();
+
+  perf::proto::Metric metric;
+  metric.set_name(perf::proto::Metric::REMOTE_PUMP_TASK);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+  metric.set_name(perf::proto::Metric::DIRECT_CACHE_HIT);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+
+  // There was no local preprocessing to write the deps file.
+  Immutable deps_output;
+  EXPECT_TRUE(base::File::Read(temp_dir.path() / deps_path, &deps_output));
+  EXPECT_EQ(deps, deps_output);
+
+  EXPECT_EQ(1u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(5u, connect_count);
+  EXPECT_EQ(5u, connections_created);
+  EXPECT_EQ(6u, read_count);
+  EXPECT_EQ(6u, send_count);
+  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection3.use_count()) << "Daemon must not store references to the connection";
+}
+
+TEST_F(EmitterTest, ModuleBuildInPumpModeAfterLocalBuild) {
+  // Prepare environment.
+  const base::TemporaryDir temp_dir;
+  const auto input_path = "module.modulemap"_l;
+  const auto header_path = "a.h"_l;
+  const auto module_map = "module A { header \"a.h\" }"_l;
+  const auto header_code = "#define A"_l;
+  const auto new_header_code = "#define B"_l;
+
+  ASSERT_TRUE(base::File::Write(temp_dir.path() / input_path, module_map));
+  ASSERT_TRUE(base::File::Write(temp_dir.path() / header_path, header_code));
+
+  // Prepare configuration.
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+  const String host = "fake_host";
+  const ui16 port = 12345;
+
+  conf.mutable_emitter()->set_only_failed(true);
+  conf.mutable_emitter()->set_pump(true);
+  conf.mutable_cache()->set_path(temp_dir.path() / "cache");
+  conf.mutable_cache()->set_direct(true);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* remote = conf.mutable_emitter()->add_remotes();
+  remote->set_host(host);
+  remote->set_port(port);
+  remote->set_threads(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  // Prepare callbacks.
+  const auto deps_path = "a.d"_l;
+  const auto deps = "a.pcm: module.modulemap a.h"_l;
+  const auto action = "-emit-module"_l;
+  const auto output_path = "a.pcm"_l;
+  const auto module_code = "fake_module_code"_l;
+  const auto handled_hash = "fake_handled_hash"_l;
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    if (connect_count == 3) {
+      // Connection from local daemon to remote daemon in pump mode - the module map goes first.
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(proto::Remote::extension));
+        const auto& command = message.GetExtension(proto::Remote::extension);
+        EXPECT_FALSE(command.has_source());
+        EXPECT_EQ(action, command.flags().action());
+
+        ASSERT_EQ(2, command.files_size());
+        EXPECT_EQ(input_path, command.files(0).path());
+        EXPECT_EQ(module_map, command.files(0).content());
+        EXPECT_EQ(header_path, command.files(1).path());
+
+        send_condition.notify_all();
+      });
+
+      connection->CallOnRead([&](net::Connection::Message* message) {
+        auto* result = message->MutableExtension(proto::Result::extension);
+        result->set_obj(module_code);
+        result->set_deps(deps);
+        result->set_handled_hash(handled_hash);
+      });
+    } else {
+      // Connection from client to local daemon.
+      connection->CallOnSend([&](const net::Connection::Message& message) {
+        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+        const auto& status = message.GetExtension(net::proto::Status::extension);
+        EXPECT_EQ(expected_code, status.code()) << status.description();
+
+        send_condition.notify_all();
+      });
+    }
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    // Module maps can't be preprocessed - the first build is local.
+    EXPECT_EQ(process->args_.end(), std::find(process->args_.begin(), process->args_.end(), "-E"_l));
+    EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path, module_code));
+    EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps_path, deps));
+  };
+
+  auto CreateMessage = [&] {
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(temp_dir.path());
+
+    auto* flags = extension->mutable_flags();
+    flags->set_input(input_path);
+    flags->set_output(output_path);
+    flags->set_deps_file(deps_path);
+    flags->mutable_compiler()->set_version(compiler_version);
+    flags->set_action(action);
+    auto* arg = flags->add_other();
+    arg->set_index(1);
+    arg->add_values("-sys-header-deps");
+    return message;
+  };
+
+  net::proto::Status status;
+  status.set_code(net::proto::Status::OK);
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  auto connection1 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
+    EXPECT_TRUE(test_connection->TriggerReadAsync(CreateMessage(), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 1; }));
+  }
+
+  // The direct cache misses now, but still has the inputs of the module.
+  ASSERT_TRUE(base::File::Write(temp_dir.path() / header_path, new_header_code));
+  ASSERT_TRUE(base::File::Delete(temp_dir.path() / deps_path));
+
+  auto connection2 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection2);
+    EXPECT_TRUE(test_connection->TriggerReadAsync(CreateMessage(), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 3; }));
+  }
+
+  // The direct cache is updated with the result of pump mode.
+  auto connection3 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection3);
+    EXPECT_TRUE(test_connection->TriggerReadAsync(CreateMessage(), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 4; }));
+  }
+
+  emitter.reset();
+
+  perf::proto::Metric metric;
+  metric.set_name(perf::proto::Metric::REMOTE_PUMP_TASK);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+  metric.set_name(perf::proto::Metric::DIRECT_CACHE_HIT);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+
+  Immutable module_output;
+  EXPECT_TRUE(base::File::Read(temp_dir.path() / output_path, &module_output));
+  EXPECT_EQ(module_code, module_output);
+
+  EXPECT_EQ(1u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(4u, connect_count);
+  EXPECT_EQ(4u, connections_created);
+  EXPECT_EQ(4u, read_count);
+  EXPECT_EQ(4u, send_count);
+  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection3.use_count()) << "Daemon must not store references to the connection";
+}
+
+TEST_F(EmitterTest, DISABLED_UpdateDirectCacheFromLocalCache) {
+  // TODO: implement this test.
+  //       - Check that direct cache gets updated, if there is direct cache
+  //         miss, but there is hit in normal cache.
+}
+
+TEST_F(EmitterTest, DISABLED_SkipTaskWithClosedConnection) {
+  // TODO: implement this test.
+  //       - Tasks should be skipped before any execution or sending attempt.
+  //       - Tasks should be skipped during the cache check, local and remote
+  //         executions.
+}
+
+/*
+ * If |conf_| has no version requested by connection,
+ * |connection| should return |message| with bad status,
+ * but if then |conf_| has been updated with a missing version,
+ * |connection| should return |message| with ok status.
+ */
+TEST_F(EmitterTest, ConfigurationUpdateCompiler) {
+  const auto expected_code_no_version = net::proto::Status::NO_VERSION;
+  const auto expected_code_ok = net::proto::Status::OK;
+  const String compiler_version = "fake_compiler_version";
+  const String bad_version = "another_compiler_version";
+  const auto compiler_path = "fake_compiler_path"_l;
+  const String plugin_name = "test_plugin";
+  const auto plugin_path = "fake_plugin_path"_l;
+  const String current_dir = "fake_current_dir";
+  const auto action = "fake_action"_l;
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+  auto* plugin = version->add_plugins();
+  plugin->set_name(plugin_name);
+  plugin->set_path(plugin_path);
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(expected_code_no_version, status.code());
+    });
+    return true;
+  };
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  auto connection1 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(current_dir);
+    extension->mutable_flags()->mutable_compiler()->set_version(bad_version);
+    extension->mutable_flags()->set_action("fake_action");
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+  }
+
+  version = conf.add_versions();
+  version->set_version(bad_version);
+  version->set_path(compiler_path);
+
+  // TODO: replace |sleep_for()| with some sync event.
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  emitter->Update(conf);
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(expected_code_ok, status.code());
+    });
+    return true;
+  };
+  run_callback = [&](base::TestProcess* process) {
+    EXPECT_EQ(Path(compiler_path), process->exec_path_);
+    EXPECT_EQ((Immutable::Rope{action}), process->args_) << process->PrintArgs();
+  };
+
+  auto connection2 = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection2);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(current_dir);
+    extension->mutable_flags()->mutable_compiler()->set_version(bad_version);
+    extension->mutable_flags()->set_action(action);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+  }
+
+  emitter.reset();
+
+  EXPECT_EQ(1u, run_count);
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(2u, connect_count);
+  EXPECT_EQ(2u, connections_created);
+  EXPECT_EQ(2u, read_count);
+  EXPECT_EQ(2u, send_count);
+  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
+  EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
+}
+
+TEST_F(EmitterTest, HitDirectCacheFromTwoLocations) {
   // Prepare environment.
-  const base::TemporaryDir temp_dir;
-  const auto input_path = temp_dir.path() / "test.cc";
-  const auto header1_path = temp_dir.path() / "header1.h";
-  const auto header2_path = temp_dir.path() / "header2.h";
+  const base::TemporaryDir temp_dir1, temp_dir2;
+  const auto input_path = temp_dir1.path() / "test.cc";
+  const auto header_path = temp_dir1.path() / "header.h";
+  const auto preprocessed_header_path = temp_dir1.path() / "header.h.pth";
+  const auto sanitize_blacklist_path = temp_dir1.path() / "asan-blacklist.txt";
   const auto source_code = "int main() {}"_l;
-  const auto deps_path = "test.d"_l;
-  const auto language = "fake_language"_l;
-  const auto preprocessed_source = "fake_source"_l;
-  const auto action = "fake_action"_l;
-  const auto output_path = "test.o"_l;
-  const auto object_code = "fake_object_code"_l;
-  const auto preprocessed_header_path = temp_dir.path() / "header1.h.pth";
-  const auto deps_contents = "test.o: test.cc header1.h header2.h"_l;
-
-  // Clang outputs headers included using "-include-pth/pch" as absolute paths.
-  const auto preprocessed_deps_contents = Immutable("test.o: test.cc header1.h header2.h "_l) + header1_path;
+  const auto header_contents = "#define A"_l;
   const auto preprocessed_contents = "Any content should work"_l;
-
-  ASSERT_TRUE(base::File::Write(preprocessed_header_path, preprocessed_contents));
+  const auto sanitize_blacklist_contents = "fun:main"_l;
 
   ASSERT_TRUE(base::File::Write(input_path, source_code));
-  ASSERT_TRUE(base::File::Write(header1_path, "#define A"_l));
-  ASSERT_TRUE(base::File::Write(header2_path, "#define B"_l));
+  ASSERT_TRUE(base::File::Write(header_path, header_contents));
+  ASSERT_TRUE(base::File::Write(preprocessed_header_path, preprocessed_contents));
+  ASSERT_TRUE(base::File::Write(sanitize_blacklist_path, sanitize_blacklist_contents));
 
   // Prepare configuration.
   const String compiler_version = "fake_compiler_version";
@@ -2600,7 +4557,7 @@ TEST_F(EmitterTest, StoreDirectCacheForLocalResultWithAndWithoutIncludedHeaders)
   const String plugin_name = "fake_plugin";
   const auto plugin_path = "fake_plugin_path"_l;
 
-  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_path(temp_dir1);
   conf.mutable_cache()->set_direct(true);
   conf.mutable_cache()->set_clean_period(1);
 
@@ -2612,6 +4569,16 @@ TEST_F(EmitterTest, StoreDirectCacheForLocalResultWithAndWithoutIncludedHeaders)
   plugin->set_path(plugin_path);
 
   // Prepare callbacks.
+  const auto deps_path = "test.d"_l;
+  const auto language = "fake_language"_l;
+  const auto preprocessed_source = "fake_source"_l;
+  const auto action = "fake_action"_l;
+  const auto output_path = "test.o"_l;
+  const auto object_code = "fake_object_code"_l;
+
+  // Clang outputs headers included using "-include-pth/pch" as absolute paths.
+  const auto deps_contents = Immutable("test.o: test.cc header.h"_l) + header_path;
+
   connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
     connection->CallOnSend([&](const net::Connection::Message& message) {
       EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
@@ -2625,23 +4592,20 @@ TEST_F(EmitterTest, StoreDirectCacheForLocalResultWithAndWithoutIncludedHeaders)
 
   run_callback = [&](base::TestProcess* process) {
     if (run_count == 1) {
-      EXPECT_EQ((Immutable::Rope{"-E"_l, "-dependency-file"_l, deps_path, "-x"_l, language, "-o"_l, "-"_l, input_path}),
-                process->args_);
+      EXPECT_EQ((Immutable::Rope{"-include-pth"_l, preprocessed_header_path, "-E"_l, "-dependency-file"_l, deps_path,
+                                 "-x"_l, language, "-o"_l, "-"_l, input_path}),
+                process->args_)
+          << process->PrintArgs();
       process->stdout_ = preprocessed_source;
       EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps_path, deps_contents));
     } else if (run_count == 2) {
-      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-dependency-file"_l, deps_path, "-x"_l, language,
-                                 "-o"_l, output_path, input_path}),
+      EXPECT_EQ((Immutable::Rope{"-include-pth"_l, preprocessed_header_path, action, "-load"_l, plugin_path,
+                                 "-dependency-file"_l, deps_path, "-x"_l, language,
+                                 Immutable("-fsanitize-blacklist="_l) + sanitize_blacklist_path, "-o"_l, output_path,
+                                 input_path}),
                 process->args_)
           << process->PrintArgs();
       EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path, object_code));
-    } else if (run_count == 3) {
-      EXPECT_EQ((Immutable::Rope{"-include-pth"_l, preprocessed_header_path, "-E"_l, "-dependency-file"_l, deps_path,
-                                 "-x"_l, language, "-o"_l, "-"_l, input_path}),
-                process->args_)
-          << process->PrintArgs();
-      process->stdout_ = preprocessed_source;
-      EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps_path, preprocessed_deps_contents));
     }
   };
 
@@ -2654,33 +4618,7 @@ TEST_F(EmitterTest, StoreDirectCacheForLocalResultWithAndWithoutIncludedHeaders)
 
     net::Connection::ScopedMessage message(new net::Connection::Message);
     auto* extension = message->MutableExtension(base::proto::Local::extension);
-    extension->set_current_dir(temp_dir);
-
-    extension->mutable_flags()->set_input(input_path);
-    extension->mutable_flags()->set_output(output_path);
-    extension->mutable_flags()->set_deps_file(deps_path);
-    auto* compiler = extension->mutable_flags()->mutable_compiler();
-    compiler->set_version(compiler_version);
-    compiler->add_plugins()->set_name(plugin_name);
-    extension->mutable_flags()->set_action(action);
-    extension->mutable_flags()->set_language(language);
-
-    net::proto::Status status;
-    status.set_code(net::proto::Status::OK);
-
-    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
-
-    UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 1; }));
-  }
-
-  auto connection2 = test_service->TriggerListen(socket_path);
-  {
-    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection2);
-
-    net::Connection::ScopedMessage message(new net::Connection::Message);
-    auto* extension = message->MutableExtension(base::proto::Local::extension);
-    extension->set_current_dir(temp_dir);
+    extension->set_current_dir(temp_dir1);
 
     extension->mutable_flags()->set_input(input_path);
     extension->mutable_flags()->set_output(output_path);
@@ -2696,6 +4634,7 @@ TEST_F(EmitterTest, StoreDirectCacheForLocalResultWithAndWithoutIncludedHeaders)
     compiler->add_plugins()->set_name(plugin_name);
     extension->mutable_flags()->set_action(action);
     extension->mutable_flags()->set_language(language);
+    extension->mutable_flags()->set_sanitize_blacklist(sanitize_blacklist_path);
 
     net::proto::Status status;
     status.set_code(net::proto::Status::OK);
@@ -2703,16 +4642,24 @@ TEST_F(EmitterTest, StoreDirectCacheForLocalResultWithAndWithoutIncludedHeaders)
     EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
 
     UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 1; }));
   }
 
-  auto connection3 = test_service->TriggerListen(socket_path);
+  auto connection2 = test_service->TriggerListen(socket_path);
   {
-    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection3);
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection2);
+
+    const auto input_path = temp_dir2.path() / "test.cc";
+    const auto header_path = temp_dir2.path() / "header.h";
+    const auto sanitize_blacklist_path = temp_dir2.path() / "asan-blacklist.txt";
+
+    ASSERT_TRUE(base::File::Write(input_path, source_code));
+    ASSERT_TRUE(base::File::Write(header_path, header_contents));
+    ASSERT_TRUE(base::File::Write(sanitize_blacklist_path, sanitize_blacklist_contents));
 
     net::Connection::ScopedMessage message(new net::Connection::Message);
     auto* extension = message->MutableExtension(base::proto::Local::extension);
-    extension->set_current_dir(temp_dir);
+    extension->set_current_dir(temp_dir2);
 
     extension->mutable_flags()->set_input(input_path);
     extension->mutable_flags()->set_output(output_path);
@@ -2728,6 +4675,7 @@ TEST_F(EmitterTest, StoreDirectCacheForLocalResultWithAndWithoutIncludedHeaders)
     compiler->add_plugins()->set_name(plugin_name);
     extension->mutable_flags()->set_action(action);
     extension->mutable_flags()->set_language(language);
+    extension->mutable_flags()->set_sanitize_blacklist(sanitize_blacklist_path);
 
     net::proto::Status status;
     status.set_code(net::proto::Status::OK);
@@ -2735,54 +4683,77 @@ TEST_F(EmitterTest, StoreDirectCacheForLocalResultWithAndWithoutIncludedHeaders)
     EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
 
     UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 3; }));
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
   }
 
   emitter.reset();
 
-  EXPECT_EQ(3u, run_count);
+  perf::proto::Metric metric;
+  metric.set_name(perf::proto::Metric::DIRECT_CACHE_HIT);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+
+  Immutable cache_output;
+  const auto output2_path = temp_dir2.path() / output_path;
+  EXPECT_TRUE(base::File::Exists(output2_path));
+  EXPECT_TRUE(base::File::Read(output2_path, &cache_output));
+  EXPECT_EQ(object_code, cache_output);
+
+  Immutable cache_deps;
+  const auto deps2_path = temp_dir2.path() / deps_path;
+  EXPECT_TRUE(base::File::Exists(deps2_path));
+  EXPECT_TRUE(base::File::Read(deps2_path, &cache_deps));
+  EXPECT_EQ(deps_contents, cache_deps);
+
+  EXPECT_EQ(2u, run_count);
   EXPECT_EQ(1u, listen_count);
-  EXPECT_EQ(3u, connect_count);
-  EXPECT_EQ(3u, connections_created);
-  EXPECT_EQ(3u, read_count);
-  EXPECT_EQ(3u, send_count);
+  EXPECT_EQ(2u, connect_count);
+  EXPECT_EQ(2u, connections_created);
+  EXPECT_EQ(2u, read_count);
+  EXPECT_EQ(2u, send_count);
   EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
   EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
-  EXPECT_EQ(1, connection3.use_count()) << "Daemon must not store references to the connection";
+
+  // TODO: check that original files are not moved.
+  // TODO: check that removal of original files doesn't fail cache filling.
+  // TODO: check situations about deps file:
+  //       - deps file is in cache, but not requested.
 }
 
-TEST_F(EmitterTest, StoreDirectCacheForRemoteResult) {
+TEST_F(EmitterTest, DontHitDirectCacheFromTwoRelativeSources) {
   // Prepare environment.
   const base::TemporaryDir temp_dir;
-  const auto input1_path = temp_dir.path() / "test1.cc";
-  const auto input2_path = temp_dir.path() / "test2.cc";
-  const auto header1_path = temp_dir.path() / "header1.h";
-  const auto header2_path = temp_dir.path() / "header2.h";
+  const auto relpath = temp_dir.path() / "path1";
+  ASSERT_TRUE(base::CreateDirectory(relpath));
+
+  const auto input_path = relpath / "test.cc";
+  const auto header_path = relpath / "header.h";
   const auto source_code = "int main() {}"_l;
+  const auto header_contents = "#define A"_l;
+  const auto header_contents2 = "#define B"_l;
 
-  ASSERT_TRUE(base::File::Write(input1_path, source_code));
-  ASSERT_TRUE(base::File::Write(input2_path, source_code));
-  ASSERT_TRUE(base::File::Write(header1_path, "#define A"_l));
-  ASSERT_TRUE(base::File::Write(header2_path, "#define B"_l));
+  const auto relpath2 = temp_dir.path() / "path2";
+  ASSERT_TRUE(base::CreateDirectory(relpath2));
+
+  const auto input_path2 = relpath2 / "test.cc";
+  const auto header_path2 = relpath2 / "header.h";
+
+  ASSERT_TRUE(base::File::Write(input_path, source_code));
+  ASSERT_TRUE(base::File::Write(header_path, header_contents));
+
+  ASSERT_TRUE(base::File::Write(input_path2, source_code));
+  ASSERT_TRUE(base::File::Write(header_path2, header_contents2));
 
   // Prepare configuration.
   const String compiler_version = "fake_compiler_version";
   const String compiler_path = "fake_compiler_path";
   const String plugin_name = "fake_plugin";
   const auto plugin_path = "fake_plugin_path"_l;
-  const String host = "fake_host";
-  const ui16 port = 12345;
 
-  conf.mutable_emitter()->set_only_failed(true);
   conf.mutable_cache()->set_path(temp_dir);
   conf.mutable_cache()->set_direct(true);
   conf.mutable_cache()->set_clean_period(1);
 
-  auto* remote = conf.mutable_emitter()->add_remotes();
-  remote->set_host(host);
-  remote->set_port(port);
-  remote->set_threads(1);
-
   auto* version = conf.add_versions();
   version->set_version(compiler_version);
   version->set_path(compiler_path);
@@ -2791,60 +4762,59 @@ TEST_F(EmitterTest, StoreDirectCacheForRemoteResult) {
   plugin->set_path(plugin_path);
 
   // Prepare callbacks.
-  const auto deps1_path = "test1.d"_l;
+  const auto deps_path = "path1/test.d"_l;
+  const auto deps_path2 = "path2/test.d"_l;
+
   const auto language = "fake_language"_l;
   const auto preprocessed_source = "fake_source"_l;
+  const auto preprocessed_source2 = "fake_source2"_l;
   const auto action = "fake_action"_l;
-  const auto output1_path = "test1.o"_l;
-  const auto object_code = "fake_object_code"_l;
-
-  const auto output2_path = temp_dir.path() / "test2.o";
-  // |output_path2| checks that everything works fine with absolute paths.
-
-  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
-    if (connect_count == 1) {
-      // Connection from client to local daemon.
-
-      connection->CallOnSend([&](const net::Connection::Message& message) {
-        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
-        const auto& status = message.GetExtension(net::proto::Status::extension);
-        EXPECT_EQ(expected_code, status.code()) << status.description();
-
-        send_condition.notify_all();
-      });
-    } else if (connect_count == 2) {
-      // Connection from local daemon to remote daemon.
 
-      connection->CallOnSend([&](const net::Connection::Message& message) {
-        EXPECT_TRUE(message.HasExtension(proto::Remote::extension));
-        const auto& command = message.GetExtension(proto::Remote::extension);
-        EXPECT_EQ(preprocessed_source, command.source());
+  const auto output_path = "path1/test.o"_l;
+  const auto output_path2 = "path2/test.o"_l;
 
-        send_condition.notify_all();
-      });
+  const auto object_code = "fake_object_code1"_l;
+  const auto object_code2 = "fake_object_code2"_l;
 
-      connection->CallOnRead([&](net::Connection::Message* message) {
-        message->MutableExtension(proto::Result::extension)->set_obj(object_code);
-      });
-    } else if (connect_count == 3) {
-      // Connection from client to local daemon.
+  const auto deps_contents = "path1/test.o: path1/test.cc path1/header.h"_l;
+  const auto deps_contents2 = "path2/test.o: path2/test.cc path2/header.h"_l;
 
-      connection->CallOnSend([&](const net::Connection::Message& message) {
-        EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
-        const auto& status = message.GetExtension(net::proto::Status::extension);
-        EXPECT_EQ(expected_code, status.code()) << status.description();
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(expected_code, status.code()) << status.description();
 
-        send_condition.notify_all();
-      });
-    }
+      send_condition.notify_all();
+    });
     return true;
   };
 
   run_callback = [&](base::TestProcess* process) {
-    EXPECT_EQ((Immutable::Rope{"-E"_l, "-dependency-file"_l, deps1_path, "-x"_l, language, "-o"_l, "-"_l, input1_path}),
-              process->args_);
-    process->stdout_ = preprocessed_source;
-    EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps1_path, "test1.o: test1.cc header1.h header2.h"_l));
+    if (run_count == 1) {
+      EXPECT_EQ((Immutable::Rope{"-E"_l, "-dependency-file"_l, deps_path, "-x"_l, language, "-o"_l, "-"_l, input_path}),
+                process->args_);
+      process->stdout_ = preprocessed_source;
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps_path, deps_contents));
+    } else if (run_count == 2) {
+      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-dependency-file"_l, deps_path, "-x"_l, language,
+                                 "-o"_l, output_path, input_path}),
+                process->args_)
+          << process->PrintArgs();
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path, object_code));
+    } else if (run_count == 3) {
+      EXPECT_EQ(
+          (Immutable::Rope{"-E"_l, "-dependency-file"_l, deps_path2, "-x"_l, language, "-o"_l, "-"_l, input_path2}),
+          process->args_);
+      process->stdout_ = preprocessed_source2;
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps_path2, deps_contents2));
+    } else if (run_count == 4) {
+      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-dependency-file"_l, deps_path2, "-x"_l, language,
+                                 "-o"_l, output_path2, input_path2}),
+                process->args_)
+          << process->PrintArgs();
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path2, object_code2));
+    }
   };
 
   emitter = std::make_unique<Emitter>(conf);
@@ -2858,9 +4828,9 @@ TEST_F(EmitterTest, StoreDirectCacheForRemoteResult) {
     auto* extension = message->MutableExtension(base::proto::Local::extension);
     extension->set_current_dir(temp_dir);
 
-    extension->mutable_flags()->set_input(input1_path);
-    extension->mutable_flags()->set_output(output1_path);
-    extension->mutable_flags()->set_deps_file(deps1_path);
+    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_output(output_path);
+    extension->mutable_flags()->set_deps_file(deps_path);
     auto* compiler = extension->mutable_flags()->mutable_compiler();
     compiler->set_version(compiler_version);
     compiler->add_plugins()->set_name(plugin_name);
@@ -2873,7 +4843,7 @@ TEST_F(EmitterTest, StoreDirectCacheForRemoteResult) {
     EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
 
     UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 1; }));
   }
 
   auto connection2 = test_service->TriggerListen(socket_path);
@@ -2884,8 +4854,9 @@ TEST_F(EmitterTest, StoreDirectCacheForRemoteResult) {
     auto* extension = message->MutableExtension(base::proto::Local::extension);
     extension->set_current_dir(temp_dir);
 
-    extension->mutable_flags()->set_input(input2_path);
-    extension->mutable_flags()->set_output(output2_path);
+    extension->mutable_flags()->set_input(input_path2);
+    extension->mutable_flags()->set_output(output_path2);
+    extension->mutable_flags()->set_deps_file(deps_path2);
     auto* compiler = extension->mutable_flags()->mutable_compiler();
     compiler->set_version(compiler_version);
     compiler->add_plugins()->set_name(plugin_name);
@@ -2898,139 +4869,36 @@ TEST_F(EmitterTest, StoreDirectCacheForRemoteResult) {
     EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
 
     UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 3; }));
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
   }
 
   emitter.reset();
 
-  perf::proto::Metric metric;
-  metric.set_name(perf::proto::Metric::DIRECT_CACHE_HIT);
-  base::Singleton<perf::StatService>::Get().Dump(metric);
-  EXPECT_EQ(1u, metric.value());
-
   Immutable cache_output;
+  const auto output2_path = temp_dir.path() / output_path;
   EXPECT_TRUE(base::File::Exists(output2_path));
   EXPECT_TRUE(base::File::Read(output2_path, &cache_output));
   EXPECT_EQ(object_code, cache_output);
 
-  EXPECT_EQ(1u, run_count);
-  EXPECT_EQ(1u, listen_count);
-  EXPECT_EQ(3u, connect_count);
-  EXPECT_EQ(3u, connections_created);
-  EXPECT_EQ(3u, read_count);
-  EXPECT_EQ(3u, send_count);
-  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
-  EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
-
-  // TODO: check that original files are not moved.
-  // TODO: check that removal of original files doesn't fail cache filling.
-}
-
-TEST_F(EmitterTest, DISABLED_UpdateDirectCacheFromLocalCache) {
-  // TODO: implement this test.
-  //       - Check that direct cache gets updated, if there is direct cache
-  //         miss, but there is hit in normal cache.
-}
-
-TEST_F(EmitterTest, DISABLED_SkipTaskWithClosedConnection) {
-  // TODO: implement this test.
-  //       - Tasks should be skipped before any execution or sending attempt.
-  //       - Tasks should be skipped during the cache check, local and remote
-  //         executions.
-}
-
-/*
- * If |conf_| has no version requested by connection,
- * |connection| should return |message| with bad status,
- * but if then |conf_| has been updated with a missing version,
- * |connection| should return |message| with ok status.
- */
-TEST_F(EmitterTest, ConfigurationUpdateCompiler) {
-  const auto expected_code_no_version = net::proto::Status::NO_VERSION;
-  const auto expected_code_ok = net::proto::Status::OK;
-  const String compiler_version = "fake_compiler_version";
-  const String bad_version = "another_compiler_version";
-  const auto compiler_path = "fake_compiler_path"_l;
-  const String plugin_name = "test_plugin";
-  const auto plugin_path = "fake_plugin_path"_l;
-  const String current_dir = "fake_current_dir";
-  const auto action = "fake_action"_l;
-
-  auto* version = conf.add_versions();
-  version->set_version(compiler_version);
-  version->set_path(compiler_path);
-  auto* plugin = version->add_plugins();
-  plugin->set_name(plugin_name);
-  plugin->set_path(plugin_path);
-
-  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
-    connection->CallOnSend([&](const net::Connection::Message& message) {
-      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
-      const auto& status = message.GetExtension(net::proto::Status::extension);
-      EXPECT_EQ(expected_code_no_version, status.code());
-    });
-    return true;
-  };
-
-  emitter = std::make_unique<Emitter>(conf);
-  ASSERT_TRUE(emitter->Initialize());
-
-  auto connection1 = test_service->TriggerListen(socket_path);
-  {
-    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
-
-    net::Connection::ScopedMessage message(new net::Connection::Message);
-    auto* extension = message->MutableExtension(base::proto::Local::extension);
-    extension->set_current_dir(current_dir);
-    extension->mutable_flags()->mutable_compiler()->set_version(bad_version);
-    extension->mutable_flags()->set_action("fake_action");
-
-    net::proto::Status status;
-    status.set_code(net::proto::Status::OK);
-
-    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
-  }
-
-  version = conf.add_versions();
-  version->set_version(bad_version);
-  version->set_path(compiler_path);
-
-  // TODO: replace |sleep_for()| with some sync event.
-  std::this_thread::sleep_for(std::chrono::seconds(1));
-  emitter->Update(conf);
-
-  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
-    connection->CallOnSend([&](const net::Connection::Message& message) {
-      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
-      const auto& status = message.GetExtension(net::proto::Status::extension);
-      EXPECT_EQ(expected_code_ok, status.code());
-    });
-    return true;
-  };
-  run_callback = [&](base::TestProcess* process) {
-    EXPECT_EQ(Path(compiler_path), process->exec_path_);
-    EXPECT_EQ((Immutable::Rope{action}), process->args_) << process->PrintArgs();
-  };
-
-  auto connection2 = test_service->TriggerListen(socket_path);
-  {
-    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection2);
-
-    net::Connection::ScopedMessage message(new net::Connection::Message);
-    auto* extension = message->MutableExtension(base::proto::Local::extension);
-    extension->set_current_dir(current_dir);
-    extension->mutable_flags()->mutable_compiler()->set_version(bad_version);
-    extension->mutable_flags()->set_action(action);
-
-    net::proto::Status status;
-    status.set_code(net::proto::Status::OK);
+  Immutable cache_deps;
+  const auto deps2_path = temp_dir.path() / deps_path;
+  EXPECT_TRUE(base::File::Exists(deps2_path));
+  EXPECT_TRUE(base::File::Read(deps2_path, &cache_deps));
+  EXPECT_EQ(deps_contents, cache_deps);
 
-    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
-  }
+  Immutable cache_output2;
+  const auto output2_path2 = temp_dir.path() / output_path2;
+  EXPECT_TRUE(base::File::Exists(output2_path2));
+  EXPECT_TRUE(base::File::Read(output2_path2, &cache_output2));
+  EXPECT_EQ(object_code2, cache_output2);
 
-  emitter.reset();
+  Immutable cache_deps2;
+  const auto deps2_path2 = temp_dir.path() / deps_path2;
+  EXPECT_TRUE(base::File::Exists(deps2_path2));
+  EXPECT_TRUE(base::File::Read(deps2_path2, &cache_deps2));
+  EXPECT_EQ(deps_contents2, cache_deps2);
 
-  EXPECT_EQ(1u, run_count);
+  EXPECT_EQ(4u, run_count);
   EXPECT_EQ(1u, listen_count);
   EXPECT_EQ(2u, connect_count);
   EXPECT_EQ(2u, connections_created);
@@ -3038,53 +4906,49 @@ TEST_F(EmitterTest, ConfigurationUpdateCompiler) {
   EXPECT_EQ(2u, send_count);
   EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
   EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
+
+  // TODO: check that original files are not moved.
+  // TODO: check that removal of original files doesn't fail cache filling.
+  // TODO: check situations about deps file:
+  //       - deps file is in cache, but not requested.
 }
 
-TEST_F(EmitterTest, HitDirectCacheFromTwoLocations) {
+TEST_F(EmitterTest, HitDependCacheFromAnotherCheckout) {
   // Prepare environment.
-  const base::TemporaryDir temp_dir1, temp_dir2;
-  const auto input_path = temp_dir1.path() / "test.cc";
-  const auto header_path = temp_dir1.path() / "header.h";
-  const auto preprocessed_header_path = temp_dir1.path() / "header.h.pth";
-  const auto sanitize_blacklist_path = temp_dir1.path() / "asan-blacklist.txt";
+  const base::TemporaryDir temp_dir;
+  const auto cache_path = temp_dir.path() / "cache";
+  const Path checkout_paths[] = {temp_dir.path() / "checkout1", temp_dir.path() / "checkout2",
+                                 temp_dir.path() / "checkout3"};
   const auto source_code = "int main() {}"_l;
-  const auto header_contents = "#define A"_l;
-  const auto preprocessed_contents = "Any content should work"_l;
-  const auto sanitize_blacklist_contents = "fun:main"_l;
 
-  ASSERT_TRUE(base::File::Write(input_path, source_code));
-  ASSERT_TRUE(base::File::Write(header_path, header_contents));
-  ASSERT_TRUE(base::File::Write(preprocessed_header_path, preprocessed_contents));
-  ASSERT_TRUE(base::File::Write(sanitize_blacklist_path, sanitize_blacklist_contents));
+  for (const auto& checkout_path : checkout_paths) {
+    ASSERT_TRUE(base::CreateDirectory(checkout_path));
+    ASSERT_TRUE(base::File::Write(checkout_path / "test.cc", source_code));
+    ASSERT_TRUE(base::File::Write(checkout_path / "header.h", "#define A"_l));
+  }
+  // The third checkout has a different header.
+  ASSERT_TRUE(base::File::Write(checkout_paths[2] / "header.h", "#define B"_l));
 
   // Prepare configuration.
   const String compiler_version = "fake_compiler_version";
   const String compiler_path = "fake_compiler_path";
-  const String plugin_name = "fake_plugin";
-  const auto plugin_path = "fake_plugin_path"_l;
 
-  conf.mutable_cache()->set_path(temp_dir1);
-  conf.mutable_cache()->set_direct(true);
+  conf.mutable_cache()->set_path(cache_path);
+  conf.mutable_cache()->set_depend(true);
   conf.mutable_cache()->set_clean_period(1);
 
   auto* version = conf.add_versions();
   version->set_version(compiler_version);
   version->set_path(compiler_path);
-  auto* plugin = version->add_plugins();
-  plugin->set_name(plugin_name);
-  plugin->set_path(plugin_path);
 
   // Prepare callbacks.
   const auto deps_path = "test.d"_l;
+  const auto output_path = "test.o"_l;
   const auto language = "fake_language"_l;
   const auto preprocessed_source = "fake_source"_l;
   const auto action = "fake_action"_l;
-  const auto output_path = "test.o"_l;
   const auto object_code = "fake_object_code"_l;
 
-  // Clang outputs headers included using "-include-pth/pch" as absolute paths.
-  const auto deps_contents = Immutable("test.o: test.cc header.h"_l) + header_path;
-
   connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
     connection->CallOnSend([&](const net::Connection::Message& message) {
       EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
@@ -3097,20 +4961,16 @@ TEST_F(EmitterTest, HitDirectCacheFromTwoLocations) {
   };
 
   run_callback = [&](base::TestProcess* process) {
-    if (run_count == 1) {
-      EXPECT_EQ((Immutable::Rope{"-include-pth"_l, preprocessed_header_path, "-E"_l, "-dependency-file"_l, deps_path,
-                                 "-x"_l, language, "-o"_l, "-"_l, input_path}),
-                process->args_)
-          << process->PrintArgs();
+    if (run_count % 2 == 1) {
+      // The deps have an absolute path to the source - like with an absolute input.
+      const auto input_path = process->cwd_path_ / "test.cc";
+      EXPECT_EQ((Immutable::Rope{"-sys-header-deps"_l, "-E"_l, "-dependency-file"_l, deps_path, "-x"_l, language,
+                                 "-o"_l, "-"_l, Immutable(input_path.string())}),
+                process->args_);
       process->stdout_ = preprocessed_source;
-      EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps_path, deps_contents));
-    } else if (run_count == 2) {
-      EXPECT_EQ((Immutable::Rope{"-include-pth"_l, preprocessed_header_path, action, "-load"_l, plugin_path,
-                                 "-dependency-file"_l, deps_path, "-x"_l, language,
-                                 Immutable("-fsanitize-blacklist="_l) + sanitize_blacklist_path, "-o"_l, output_path,
-                                 input_path}),
-                process->args_)
-          << process->PrintArgs();
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps_path,
+                                    Immutable("test.o: " + input_path.string() + " header.h")));
+    } else {
       EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path, object_code));
     }
   };
@@ -3118,172 +4978,93 @@ TEST_F(EmitterTest, HitDirectCacheFromTwoLocations) {
   emitter = std::make_unique<Emitter>(conf);
   ASSERT_TRUE(emitter->Initialize());
 
-  auto connection1 = test_service->TriggerListen(socket_path);
-  {
-    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
-
-    net::Connection::ScopedMessage message(new net::Connection::Message);
-    auto* extension = message->MutableExtension(base::proto::Local::extension);
-    extension->set_current_dir(temp_dir1);
-
-    extension->mutable_flags()->set_input(input_path);
-    extension->mutable_flags()->set_output(output_path);
-    extension->mutable_flags()->add_included_files(preprocessed_header_path);
-
-    auto* new_arg = extension->mutable_flags()->add_non_cached();
-    new_arg->add_values("-include-pth");
-    new_arg->add_values(preprocessed_header_path);
-
-    extension->mutable_flags()->set_deps_file(deps_path);
-    auto* compiler = extension->mutable_flags()->mutable_compiler();
-    compiler->set_version(compiler_version);
-    compiler->add_plugins()->set_name(plugin_name);
-    extension->mutable_flags()->set_action(action);
-    extension->mutable_flags()->set_language(language);
-    extension->mutable_flags()->set_sanitize_blacklist(sanitize_blacklist_path);
-
-    net::proto::Status status;
-    status.set_code(net::proto::Status::OK);
-
-    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
-
-    UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 1; }));
-  }
-
-  auto connection2 = test_service->TriggerListen(socket_path);
-  {
-    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection2);
-
-    const auto input_path = temp_dir2.path() / "test.cc";
-    const auto header_path = temp_dir2.path() / "header.h";
-    const auto sanitize_blacklist_path = temp_dir2.path() / "asan-blacklist.txt";
+  Vector<net::ConnectionPtr> connections;
+  for (const auto& checkout_path : checkout_paths) {
+    // The entries are shared only between checkouts inside the base directory.
+    conf.mutable_cache()->set_base_dir(checkout_path);
+    emitter->Update(conf);
 
-    ASSERT_TRUE(base::File::Write(input_path, source_code));
-    ASSERT_TRUE(base::File::Write(header_path, header_contents));
-    ASSERT_TRUE(base::File::Write(sanitize_blacklist_path, sanitize_blacklist_contents));
+    connections.push_back(test_service->TriggerListen(socket_path));
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connections.back());
 
     net::Connection::ScopedMessage message(new net::Connection::Message);
     auto* extension = message->MutableExtension(base::proto::Local::extension);
-    extension->set_current_dir(temp_dir2);
+    extension->set_current_dir(checkout_path);
 
-    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_input(checkout_path / "test.cc");
     extension->mutable_flags()->set_output(output_path);
-    extension->mutable_flags()->add_included_files(preprocessed_header_path);
-
-    auto* new_arg = extension->mutable_flags()->add_non_cached();
-    new_arg->add_values("-include-pth");
-    new_arg->add_values(preprocessed_header_path);
-
     extension->mutable_flags()->set_deps_file(deps_path);
-    auto* compiler = extension->mutable_flags()->mutable_compiler();
-    compiler->set_version(compiler_version);
-    compiler->add_plugins()->set_name(plugin_name);
+    extension->mutable_flags()->mutable_compiler()->set_version(compiler_version);
     extension->mutable_flags()->set_action(action);
     extension->mutable_flags()->set_language(language);
-    extension->mutable_flags()->set_sanitize_blacklist(sanitize_blacklist_path);
+    auto* arg = extension->mutable_flags()->add_other();
+    arg->set_index(1);
+    arg->add_values("-sys-header-deps");
 
     net::proto::Status status;
     status.set_code(net::proto::Status::OK);
 
     EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
 
+    const auto expected_count = connections.size();
     UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [&] { return send_count == expected_count; }));
   }
 
   emitter.reset();
 
   perf::proto::Metric metric;
-  metric.set_name(perf::proto::Metric::DIRECT_CACHE_HIT);
+  metric.set_name(perf::proto::Metric::DEPEND_CACHE_HIT);
   base::Singleton<perf::StatService>::Get().Dump(metric);
   EXPECT_EQ(1u, metric.value());
 
+  metric.set_name(perf::proto::Metric::DEPEND_CACHE_MISS);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(2u, metric.value());
+
+  // The second checkout gets the result without preprocessing.
   Immutable cache_output;
-  const auto output2_path = temp_dir2.path() / output_path;
-  EXPECT_TRUE(base::File::Exists(output2_path));
-  EXPECT_TRUE(base::File::Read(output2_path, &cache_output));
+  EXPECT_TRUE(base::File::Read(checkout_paths[1] / output_path, &cache_output));
   EXPECT_EQ(object_code, cache_output);
 
+  // The deps don't point to the first checkout.
   Immutable cache_deps;
-  const auto deps2_path = temp_dir2.path() / deps_path;
-  EXPECT_TRUE(base::File::Exists(deps2_path));
-  EXPECT_TRUE(base::File::Read(deps2_path, &cache_deps));
-  EXPECT_EQ(deps_contents, cache_deps);
-
-  EXPECT_EQ(2u, run_count);
-  EXPECT_EQ(1u, listen_count);
-  EXPECT_EQ(2u, connect_count);
-  EXPECT_EQ(2u, connections_created);
-  EXPECT_EQ(2u, read_count);
-  EXPECT_EQ(2u, send_count);
-  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
-  EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
+  EXPECT_TRUE(base::File::Read(checkout_paths[1] / deps_path, &cache_deps));
+  EXPECT_EQ(String::npos, cache_deps.find(checkout_paths[0].c_str()));
 
-  // TODO: check that original files are not moved.
-  // TODO: check that removal of original files doesn't fail cache filling.
-  // TODO: check situations about deps file:
-  //       - deps file is in cache, but not requested.
+  // The third checkout falls back to preprocessing - and hits the simple cache.
+  EXPECT_EQ(3u, run_count);
+  EXPECT_EQ(3u, send_count);
+  for (const auto& connection : connections) {
+    EXPECT_EQ(1, connection.use_count()) << "Daemon must not store references to the connection";
+  }
 }
 
-TEST_F(EmitterTest, DontHitDirectCacheFromTwoRelativeSources) {
+TEST_F(EmitterTest, DependEntriesAreEvictedAfterRestart) {
   // Prepare environment.
   const base::TemporaryDir temp_dir;
-  const auto relpath = temp_dir.path() / "path1";
-  ASSERT_TRUE(base::CreateDirectory(relpath));
-
-  const auto input_path = relpath / "test.cc";
-  const auto header_path = relpath / "header.h";
+  const auto cache_path = temp_dir.path() / "cache";
   const auto source_code = "int main() {}"_l;
-  const auto header_contents = "#define A"_l;
-  const auto header_contents2 = "#define B"_l;
-
-  const auto relpath2 = temp_dir.path() / "path2";
-  ASSERT_TRUE(base::CreateDirectory(relpath2));
-
-  const auto input_path2 = relpath2 / "test.cc";
-  const auto header_path2 = relpath2 / "header.h";
-
-  ASSERT_TRUE(base::File::Write(input_path, source_code));
-  ASSERT_TRUE(base::File::Write(header_path, header_contents));
 
-  ASSERT_TRUE(base::File::Write(input_path2, source_code));
-  ASSERT_TRUE(base::File::Write(header_path2, header_contents2));
+  ASSERT_TRUE(base::File::Write(temp_dir.path() / "test.cc", source_code));
+  ASSERT_TRUE(base::File::Write(temp_dir.path() / "header.h", "#define A"_l));
 
   // Prepare configuration.
   const String compiler_version = "fake_compiler_version";
   const String compiler_path = "fake_compiler_path";
-  const String plugin_name = "fake_plugin";
-  const auto plugin_path = "fake_plugin_path"_l;
 
-  conf.mutable_cache()->set_path(temp_dir);
-  conf.mutable_cache()->set_direct(true);
+  conf.mutable_cache()->set_path(cache_path);
+  conf.mutable_cache()->set_depend(true);
   conf.mutable_cache()->set_clean_period(1);
 
   auto* version = conf.add_versions();
   version->set_version(compiler_version);
   version->set_path(compiler_path);
-  auto* plugin = version->add_plugins();
-  plugin->set_name(plugin_name);
-  plugin->set_path(plugin_path);
 
   // Prepare callbacks.
-  const auto deps_path = "path1/test.d"_l;
-  const auto deps_path2 = "path2/test.d"_l;
-
-  const auto language = "fake_language"_l;
-  const auto preprocessed_source = "fake_source"_l;
-  const auto preprocessed_source2 = "fake_source2"_l;
-  const auto action = "fake_action"_l;
-
-  const auto output_path = "path1/test.o"_l;
-  const auto output_path2 = "path2/test.o"_l;
-
-  const auto object_code = "fake_object_code1"_l;
-  const auto object_code2 = "fake_object_code2"_l;
-
-  const auto deps_contents = "path1/test.o: path1/test.cc path1/header.h"_l;
-  const auto deps_contents2 = "path2/test.o: path2/test.cc path2/header.h"_l;
+  const auto deps_path = "test.d"_l;
+  const auto output_path = "test.o"_l;
 
   connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
     connection->CallOnSend([&](const net::Connection::Message& message) {
@@ -3298,50 +5079,33 @@ TEST_F(EmitterTest, DontHitDirectCacheFromTwoRelativeSources) {
 
   run_callback = [&](base::TestProcess* process) {
     if (run_count == 1) {
-      EXPECT_EQ((Immutable::Rope{"-E"_l, "-dependency-file"_l, deps_path, "-x"_l, language, "-o"_l, "-"_l, input_path}),
-                process->args_);
-      process->stdout_ = preprocessed_source;
-      EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps_path, deps_contents));
-    } else if (run_count == 2) {
-      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-dependency-file"_l, deps_path, "-x"_l, language,
-                                 "-o"_l, output_path, input_path}),
-                process->args_)
-          << process->PrintArgs();
-      EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path, object_code));
-    } else if (run_count == 3) {
-      EXPECT_EQ(
-          (Immutable::Rope{"-E"_l, "-dependency-file"_l, deps_path2, "-x"_l, language, "-o"_l, "-"_l, input_path2}),
-          process->args_);
-      process->stdout_ = preprocessed_source2;
-      EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps_path2, deps_contents2));
-    } else if (run_count == 4) {
-      EXPECT_EQ((Immutable::Rope{action, "-load"_l, plugin_path, "-dependency-file"_l, deps_path2, "-x"_l, language,
-                                 "-o"_l, output_path2, input_path2}),
-                process->args_)
-          << process->PrintArgs();
-      EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path2, object_code2));
+      process->stdout_ = "fake_source"_l;
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps_path, "test.o: test.cc header.h"_l));
+    } else {
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path, "fake_object_code"_l));
     }
   };
 
   emitter = std::make_unique<Emitter>(conf);
   ASSERT_TRUE(emitter->Initialize());
 
-  auto connection1 = test_service->TriggerListen(socket_path);
+  net::ConnectionPtr connection = test_service->TriggerListen(socket_path);
   {
-    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection1);
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection);
 
     net::Connection::ScopedMessage message(new net::Connection::Message);
     auto* extension = message->MutableExtension(base::proto::Local::extension);
     extension->set_current_dir(temp_dir);
 
-    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_input("test.cc");
     extension->mutable_flags()->set_output(output_path);
     extension->mutable_flags()->set_deps_file(deps_path);
-    auto* compiler = extension->mutable_flags()->mutable_compiler();
-    compiler->set_version(compiler_version);
-    compiler->add_plugins()->set_name(plugin_name);
-    extension->mutable_flags()->set_action(action);
-    extension->mutable_flags()->set_language(language);
+    extension->mutable_flags()->mutable_compiler()->set_version(compiler_version);
+    extension->mutable_flags()->set_action("fake_action");
+    extension->mutable_flags()->set_language("fake_language");
+    auto* arg = extension->mutable_flags()->add_other();
+    arg->set_index(1);
+    arg->add_values("-sys-header-deps");
 
     net::proto::Status status;
     status.set_code(net::proto::Status::OK);
@@ -3352,71 +5116,251 @@ TEST_F(EmitterTest, DontHitDirectCacheFromTwoRelativeSources) {
     EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 1; }));
   }
 
-  auto connection2 = test_service->TriggerListen(socket_path);
-  {
-    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connection2);
+  emitter.reset();
+
+  auto CountManifests = [&cache_path] {
+    ui32 manifests = 0;
+    base::WalkDirectory(cache_path, [&manifests](const Path& file_path, ui64, ui64) {
+      if (file_path.extension() == ".manifest") {
+        ++manifests;
+      }
+    });
+    return manifests;
+  };
+
+  // The simple entry, the list of headers and the depend entry.
+  EXPECT_EQ(3u, CountManifests());
+
+  // After a restart all entries are counted - and evicted, since none fits.
+  cache::FileCache cache(cache_path, 1, false, false);
+  ASSERT_TRUE(cache.Run(1));
+  for (int i = 0; i < 50 && CountManifests(); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  EXPECT_EQ(0u, CountManifests());
+
+  EXPECT_EQ(2u, run_count);
+  EXPECT_EQ(1u, send_count);
+  EXPECT_EQ(1, connection.use_count()) << "Daemon must not store references to the connection";
+}
+
+TEST_F(EmitterTest, DontStoreDependCacheWithoutSystemHeaderDeps) {
+  // Prepare environment.
+  const base::TemporaryDir temp_dir;
+  const auto cache_path = temp_dir.path() / "cache";
+  const auto source_code = "int main() {}"_l;
+
+  ASSERT_TRUE(base::File::Write(temp_dir.path() / "test.cc", source_code));
+  ASSERT_TRUE(base::File::Write(temp_dir.path() / "header.h", "#define A"_l));
+
+  // Prepare configuration.
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+
+  conf.mutable_cache()->set_path(cache_path);
+  conf.mutable_cache()->set_depend(true);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  // Prepare callbacks.
+  const auto deps_path = "test.d"_l;
+  const auto output_path = "test.o"_l;
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(expected_code, status.code()) << status.description();
+
+      send_condition.notify_all();
+    });
+    return true;
+  };
+
+  run_callback = [&](base::TestProcess* process) {
+    if (run_count != 2) {
+      process->stdout_ = "fake_source"_l;
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / deps_path, "test.o: test.cc header.h"_l));
+    } else {
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ / output_path, "fake_object_code"_l));
+    }
+  };
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  // With "-MMD" the deps don't have the system headers - so the changes of them
+  // would be missed by the depend cache.
+  Vector<net::ConnectionPtr> connections;
+  for (ui32 i = 0; i < 2; ++i) {
+    connections.push_back(test_service->TriggerListen(socket_path));
+    SharedPtr<net::TestConnection> test_connection = std::static_pointer_cast<net::TestConnection>(connections.back());
 
     net::Connection::ScopedMessage message(new net::Connection::Message);
     auto* extension = message->MutableExtension(base::proto::Local::extension);
     extension->set_current_dir(temp_dir);
 
-    extension->mutable_flags()->set_input(input_path2);
-    extension->mutable_flags()->set_output(output_path2);
-    extension->mutable_flags()->set_deps_file(deps_path2);
-    auto* compiler = extension->mutable_flags()->mutable_compiler();
-    compiler->set_version(compiler_version);
-    compiler->add_plugins()->set_name(plugin_name);
-    extension->mutable_flags()->set_action(action);
-    extension->mutable_flags()->set_language(language);
+    extension->mutable_flags()->set_input("test.cc");
+    extension->mutable_flags()->set_output(output_path);
+    extension->mutable_flags()->set_deps_file(deps_path);
+    extension->mutable_flags()->mutable_compiler()->set_version(compiler_version);
+    extension->mutable_flags()->set_action("fake_action");
+    extension->mutable_flags()->set_language("fake_language");
 
     net::proto::Status status;
     status.set_code(net::proto::Status::OK);
 
     EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
 
+    const auto expected_count = connections.size();
     UniqueLock lock(send_mutex);
-    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1), [this] { return send_count == 2; }));
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [&] { return send_count == expected_count; }));
   }
 
   emitter.reset();
 
-  Immutable cache_output;
-  const auto output2_path = temp_dir.path() / output_path;
-  EXPECT_TRUE(base::File::Exists(output2_path));
-  EXPECT_TRUE(base::File::Read(output2_path, &cache_output));
-  EXPECT_EQ(object_code, cache_output);
+  perf::proto::Metric metric;
+  metric.set_name(perf::proto::Metric::DEPEND_CACHE_HIT);
+  base::Singleton<perf::StatService>::Get().Dump(metric);
+  EXPECT_EQ(0u, metric.value());
 
-  Immutable cache_deps;
-  const auto deps2_path = temp_dir.path() / deps_path;
-  EXPECT_TRUE(base::File::Exists(deps2_path));
-  EXPECT_TRUE(base::File::Read(deps2_path, &cache_deps));
-  EXPECT_EQ(deps_contents, cache_deps);
+  // Only the simple entry is stored.
+  ui32 manifests = 0;
+  base::WalkDirectory(cache_path, [&manifests](const Path& file_path, ui64, ui64) {
+    if (file_path.extension() == ".manifest") {
+      ++manifests;
+    }
+  });
+  EXPECT_EQ(1u, manifests);
 
-  Immutable cache_output2;
-  const auto output2_path2 = temp_dir.path() / output_path2;
-  EXPECT_TRUE(base::File::Exists(output2_path2));
-  EXPECT_TRUE(base::File::Read(output2_path2, &cache_output2));
-  EXPECT_EQ(object_code2, cache_output2);
+  // The second compilation is preprocessed - and hits the simple cache.
+  EXPECT_EQ(3u, run_count);
+  EXPECT_EQ(2u, send_count);
+  for (const auto& connection : connections) {
+    EXPECT_EQ(1, connection.use_count()) << "Daemon must not store references to the connection";
+  }
+}
 
-  Immutable cache_deps2;
-  const auto deps2_path2 = temp_dir.path() / deps_path2;
-  EXPECT_TRUE(base::File::Exists(deps2_path2));
-  EXPECT_TRUE(base::File::Read(deps2_path2, &cache_deps2));
-  EXPECT_EQ(deps_contents2, cache_deps2);
+TEST_F(EmitterTest, PushMetricsToCollector) {
+  const String collector_host = "collector_host";
+  const ui16 collector_port = 1;
+  const String reporter_host = "reporter_host";
 
-  EXPECT_EQ(4u, run_count);
-  EXPECT_EQ(1u, listen_count);
-  EXPECT_EQ(2u, connect_count);
-  EXPECT_EQ(2u, connections_created);
-  EXPECT_EQ(2u, read_count);
-  EXPECT_EQ(2u, send_count);
-  EXPECT_EQ(1, connection1.use_count()) << "Daemon must not store references to the connection";
-  EXPECT_EQ(1, connection2.use_count()) << "Daemon must not store references to the connection";
+  auto* reporter = conf.mutable_reporter();
+  reporter->set_host(reporter_host);
+  reporter->set_interval(3600);
+  auto* collector = reporter->add_collectors();
+  collector->set_host(collector_host);
+  collector->set_port(collector_port);
 
-  // TODO: check that original files are not moved.
-  // TODO: check that removal of original files doesn't fail cache filling.
-  // TODO: check situations about deps file:
-  //       - deps file is in cache, but not requested.
+  // Drop the metrics of previous tests.
+  perf::proto::Report old_report;
+  CompilationDaemon::DumpMetrics(&old_report);
+
+  STAT(DIRECT_CACHE_HIT, 2);
+  base::Singleton<perf::StatService>::Get().Record(perf::proto::Metric::SHARD_QUEUE_WAIT_TIME, 10);
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr end_point) {
+    EXPECT_EQ(EndPointString(collector_host, collector_port), end_point->Print());
+
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      ASSERT_TRUE(message.HasExtension(perf::proto::Report::extension));
+      const auto& report = message.GetExtension(perf::proto::Report::extension);
+      EXPECT_EQ(reporter_host, report.host());
+      EXPECT_LT(0u, report.time());
+      ASSERT_EQ(2, report.metric_size());
+      EXPECT_EQ(perf::proto::Metric::DIRECT_CACHE_HIT, report.metric(0).name());
+      EXPECT_EQ(2u, report.metric(0).value());
+      EXPECT_EQ(perf::proto::Metric::SHARD_QUEUE_WAIT_TIME, report.metric(1).name());
+      EXPECT_EQ(10u, report.metric(1).value());
+      EXPECT_EQ(1u, report.metric(1).histogram().count());
+    });
+    connection->CallOnRead([](net::Connection::Message* message) {
+      message->MutableExtension(net::proto::Status::extension)->set_code(net::proto::Status::OK);
+    });
+    return true;
+  };
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  // The deltas are pushed once more on shutdown.
+  emitter.reset();
+
+  EXPECT_EQ(1u, connect_count);
+  EXPECT_EQ(1u, send_count);
+  EXPECT_EQ(1u, read_count);
+
+  // The pushed deltas aren't kept.
+  perf::proto::Report report;
+  CompilationDaemon::DumpMetrics(&report);
+  EXPECT_EQ(0, report.metric_size());
+}
+
+TEST_F(EmitterTest, ZeroReportInterval) {
+  auto* reporter = conf.mutable_reporter();
+  reporter->set_interval(0);
+  auto* collector = reporter->add_collectors();
+  collector->set_host("collector_host");
+  collector->set_port(1);
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_FALSE(emitter->Initialize());
+}
+
+TEST_F(EmitterTest, ReporterFollowsConfigurationUpdate) {
+  const String collector_host = "collector_host";
+  const ui16 collector_port = 1;
+
+  // Drop the metrics of previous tests.
+  perf::proto::Report old_report;
+  CompilationDaemon::DumpMetrics(&old_report);
+
+  connect_callback = [&](net::TestConnection* connection, net::EndPointPtr end_point) {
+    EXPECT_EQ(EndPointString(collector_host, collector_port), end_point->Print());
+
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      ASSERT_TRUE(message.HasExtension(perf::proto::Report::extension));
+      const auto& report = message.GetExtension(perf::proto::Report::extension);
+      ASSERT_EQ(1, report.metric_size());
+      EXPECT_EQ(perf::proto::Metric::DIRECT_CACHE_HIT, report.metric(0).name());
+      EXPECT_EQ(1u, report.metric(0).value());
+    });
+    connection->CallOnRead([](net::Connection::Message* message) {
+      message->MutableExtension(net::proto::Status::extension)->set_code(net::proto::Status::OK);
+    });
+    return true;
+  };
+
+  emitter = std::make_unique<Emitter>(conf);
+  ASSERT_TRUE(emitter->Initialize());
+
+  // The reporter starts with the first collector.
+  proto::Configuration new_conf(conf);
+  auto* reporter = new_conf.mutable_reporter();
+  reporter->set_interval(3600);
+  auto* collector = reporter->add_collectors();
+  collector->set_host(collector_host);
+  collector->set_port(collector_port);
+  ASSERT_TRUE(emitter->Update(new_conf));
+
+  STAT(DIRECT_CACHE_HIT);
+
+  // And stops without collectors - after it pushes the last deltas to the
+  // old ones.
+  ASSERT_TRUE(emitter->Update(conf));
+  EXPECT_EQ(1u, send_count);
+
+  STAT(DIRECT_CACHE_HIT);
+  emitter.reset();
+
+  EXPECT_EQ(1u, connect_count);
+  EXPECT_EQ(1u, send_count);
+  EXPECT_EQ(1u, read_count);
 }
 
 }  // namespace daemon
@@ -18,6 +18,10 @@ class Connection : public std::enable_shared_from_this<Connection> {
 
   virtual bool IsClosed() const = 0;
 
+  // Returns the numeric IP address of the other side - or an empty string, if
+  // it's unknown, like for the Unix sockets.
+  virtual String PeerAddress() const = 0;
+
   virtual bool ReadAsync(ReadCallback callback) = 0;
   virtual bool ReadSync(Message* message, Status* status = nullptr) = 0;
 
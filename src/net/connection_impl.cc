@@ -5,6 +5,7 @@
 #include <base/logging.h>
 #include <net/event_loop.h>
 
+#include <netdb.h>
 #include <sys/socket.h>
 
 #include <base/using_log.h>
@@ -39,6 +40,32 @@ ConnectionImpl::~ConnectionImpl() {
   Close();
 }
 
+String ConnectionImpl::PeerAddress() const {
+  sockaddr_storage address;
+  socklen_t size = sizeof(address);
+  if (getpeername(fd_.native(), reinterpret_cast<sockaddr*>(&address),
+                  &size) == -1) {
+    return String();
+  }
+
+  char host[NI_MAXHOST];
+  if (getnameinfo(reinterpret_cast<sockaddr*>(&address), size, host,
+                  sizeof(host), nullptr, 0, NI_NUMERICHOST) != 0) {
+    return String();
+  }
+
+  // The IPv4 peers of IPv6 sockets have mapped addresses.
+  const String mapped_prefix = "::ffff:";
+  String result = host;
+  if (address.ss_family == AF_INET6 &&
+      result.compare(0, mapped_prefix.size(), mapped_prefix) == 0 &&
+      result.find('.') != String::npos) {
+    result.erase(0, mapped_prefix.size());
+  }
+
+  return result;
+}
+
 bool ConnectionImpl::ReadAsync(ReadCallback callback) {
   auto shared = std::static_pointer_cast<ConnectionImpl>(shared_from_this());
   read_callback_ = std::bind(callback, shared_from_this(), _1, _2);
@@ -25,6 +25,7 @@ class ConnectionImpl : public Connection {
   ~ConnectionImpl();
 
   inline bool IsClosed() const override { return is_closed_; }
+  String PeerAddress() const override;
 
   bool ReadAsync(ReadCallback callback) override;
   bool ReadSync(Message* message, Status* status = nullptr) override;
@@ -7,6 +7,7 @@
 #include <net/passive.h>
 
 #include <arpa/inet.h>
+#include <ifaddrs.h>
 #include <netdb.h>
 #include <sys/un.h>
 
@@ -135,5 +136,57 @@ String EndPoint::Print() const {
   return String();
 }
 
+bool EndPoint::IsLocal() const {
+  switch (address_.ss_family) {
+    case AF_INET: {
+      auto* addr = reinterpret_cast<const struct sockaddr_in*>(&address_);
+      if (ntohl(addr->sin_addr.s_addr) >> IN_CLASSA_NSHIFT == IN_LOOPBACKNET) {
+        return true;
+      }
+      break;
+    }
+    case AF_INET6: {
+      auto* addr = reinterpret_cast<const struct sockaddr_in6*>(&address_);
+      if (IN6_IS_ADDR_LOOPBACK(&addr->sin6_addr)) {
+        return true;
+      }
+      break;
+    }
+    case AF_UNIX:
+      return true;
+    default:
+      return false;
+  }
+
+  struct ifaddrs* interfaces = nullptr;
+  if (getifaddrs(&interfaces) == -1) {
+    String error;
+    base::GetLastError(&error);
+    LOG(WARNING) << "Failed to get addresses of network interfaces: " << error;
+    return false;
+  }
+
+  bool found = false;
+  for (auto* it = interfaces; it && !found; it = it->ifa_next) {
+    if (!it->ifa_addr || it->ifa_addr->sa_family != domain()) {
+      continue;
+    }
+
+    if (domain() == AF_INET) {
+      auto* addr = reinterpret_cast<const struct sockaddr_in*>(&address_);
+      auto* other = reinterpret_cast<const struct sockaddr_in*>(it->ifa_addr);
+      found = addr->sin_addr.s_addr == other->sin_addr.s_addr;
+    } else {
+      auto* addr = reinterpret_cast<const struct sockaddr_in6*>(&address_);
+      auto* other = reinterpret_cast<const struct sockaddr_in6*>(it->ifa_addr);
+      found = !memcmp(&addr->sin6_addr, &other->sin6_addr,
+                      sizeof(addr->sin6_addr));
+    }
+  }
+  freeifaddrs(interfaces);
+
+  return found;
+}
+
 }  // namespace net
 }  // namespace dist_clang
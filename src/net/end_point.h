@@ -30,6 +30,10 @@ class EndPoint : public std::enable_shared_from_this<EndPoint> {
 
   virtual String Print() const;
 
+  // Tells if the address belongs to this host: a loopback, a Unix socket or
+  // an address of one of the network interfaces.
+  virtual bool IsLocal() const;
+
  private:
   sockaddr_storage address_;
   socklen_t size_ = 0;
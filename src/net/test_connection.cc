@@ -65,6 +65,14 @@ void TestConnection::CallOnRead(Fn<void(Message*)> callback) {
   on_read_ = callback;
 }
 
+void TestConnection::CompleteAsyncSends() {
+  complete_async_sends_ = true;
+}
+
+void TestConnection::SetPeerAddress(const String& address) {
+  peer_address_ = address;
+}
+
 bool TestConnection::TriggerReadAsync(UniquePtr<proto::Universal> message,
                                       const proto::Status& status) {
   message->CheckInitialized();
@@ -85,6 +93,13 @@ bool TestConnection::SendAsyncImpl(SendCallback callback) {
   }
 
   on_send_(*message_.get());
+
+  if (complete_async_sends_) {
+    Status status;
+    status.set_code(Status::OK);
+    callback(shared_from_this(), status);
+  }
+
   return true;
 }
 
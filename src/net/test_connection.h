@@ -12,6 +12,7 @@ class TestConnection : public Connection {
   TestConnection();
 
   inline bool IsClosed() const override { return false; }
+  inline String PeerAddress() const override { return peer_address_; }
 
   bool ReadAsync(ReadCallback callback) override;
   bool ReadSync(Message* message, Status* status) override;
@@ -29,6 +30,11 @@ class TestConnection : public Connection {
   void CountReadAttempts(Atomic<ui32>* counter);
   void CallOnSend(Fn<void(const Message&)> callback);
   void CallOnRead(Fn<void(Message*)> callback);
+  void SetPeerAddress(const String& address);
+
+  // Makes |SendAsync()| call back with the OK status - like the real connection
+  // does after sending. The callback may read from the connection again.
+  void CompleteAsyncSends();
 
   bool TriggerReadAsync(UniquePtr<proto::Universal> message,
                         const proto::Status& status);
@@ -43,6 +49,8 @@ class TestConnection : public Connection {
   Fn<void(const Message&)> on_send_;
   Fn<void(Message*)> on_read_;
   ReadCallback read_callback_;
+  String peer_address_;
+  bool complete_async_sends_ = false;
 };
 
 }  // namespace net
@@ -10,6 +10,7 @@ class TestEndPoint : public EndPoint {
  public:
   TestEndPoint(const String& host, ui16 port = 0u) : host_(host), port_(port) {}
   String Print() const override { return host_ + ":" + std::to_string(port_); }
+  bool IsLocal() const override { return host_ == "localhost"; }
 
  private:
   const String host_;
@@ -27,6 +27,7 @@ class Counter final {
   Counter(const Counter&) = delete;
 
   inline ui64 Id() const { return id_; }
+  inline Clock::duration Elapsed() const { return Clock::now() - start_; }
   inline void ReportOnDestroy(bool report) { report_on_destroy_ = report; }
   inline void Report() {
     DCHECK(reporter_);
@@ -0,0 +1,114 @@
+#include <perf/histogram.h>
+
+#include <base/assert.h>
+#include <perf/stat.pb.h>
+
+#include STL(algorithm)
+#include STL(cmath)
+#include STL(limits)
+
+namespace dist_clang {
+namespace perf {
+
+namespace {
+
+// The powers of two for |kLinearLimit| and |kSubBuckets|.
+constexpr ui32 kLinearBits = 4;
+constexpr ui32 kSubBits = 3;
+
+}  // namespace
+
+// static
+ui32 Histogram::Bucket(ui64 value) {
+  static_assert(1u << kLinearBits == kLinearLimit, "Fix the linear bits");
+  static_assert(1u << kSubBits == kSubBuckets, "Fix the sub-bucket bits");
+
+  if (value < kLinearLimit) {
+    return value;
+  }
+
+  const ui32 power = 63 - __builtin_clzll(value);
+  if (power >= kLinearBits + kPowers) {
+    return kBuckets - 1;
+  }
+  return kLinearLimit + (power - kLinearBits) * kSubBuckets +
+         ((value >> (power - kSubBits)) & (kSubBuckets - 1));
+}
+
+// static
+ui64 Histogram::LowerBound(ui32 bucket) {
+  DCHECK(bucket < kBuckets);
+
+  if (bucket < kLinearLimit) {
+    return bucket;
+  }
+
+  const ui32 power = kLinearBits + (bucket - kLinearLimit) / kSubBuckets;
+  const ui64 sub_bucket = (bucket - kLinearLimit) % kSubBuckets;
+  return (kSubBuckets + sub_bucket) << (power - kSubBits);
+}
+
+// static
+ui64 Histogram::UpperBound(ui32 bucket) {
+  DCHECK(bucket < kBuckets);
+
+  if (bucket + 1 == kBuckets) {
+    return std::numeric_limits<ui64>::max();
+  }
+  return LowerBound(bucket + 1);
+}
+
+// static
+ui64 Histogram::Percentile(const proto::Metric_Histogram& histogram,
+                           double percentile) {
+  DCHECK(percentile >= 0 && percentile <= 100);
+
+  const ui64 rank = std::max<ui64>(
+      1, std::ceil(histogram.count() * percentile / 100));
+  ui64 count = 0;
+  for (const auto& bucket : histogram.buckets()) {
+    count += bucket.count();
+    if (count >= rank) {
+      return std::min(bucket.upper_bound() - 1, histogram.max());
+    }
+  }
+
+  return histogram.max();
+}
+
+void Histogram::Add(ui64 value) {
+  // The maximum goes first - so the drained bucket never has a value above the
+  // drained maximum.
+  ui64 max = max_;
+  while (value > max && !max_.compare_exchange_weak(max, value)) {
+  }
+
+  buckets_[Bucket(value)].fetch_add(1);
+}
+
+void Histogram::Drain(proto::Metric_Histogram* histogram) {
+  Array<ui64, kBuckets> counts = {};
+  for (const auto& bucket : histogram->buckets()) {
+    counts[Bucket(bucket.lower_bound())] += bucket.count();
+  }
+  for (ui32 i = 0; i < kBuckets; ++i) {
+    counts[i] += buckets_[i].exchange(0);
+  }
+
+  histogram->clear_buckets();
+  ui64 count = 0;
+  for (ui32 i = 0; i < kBuckets; ++i) {
+    if (counts[i]) {
+      auto* bucket = histogram->add_buckets();
+      bucket->set_lower_bound(LowerBound(i));
+      bucket->set_upper_bound(UpperBound(i));
+      bucket->set_count(counts[i]);
+      count += counts[i];
+    }
+  }
+  histogram->set_count(count);
+  histogram->set_max(std::max(histogram->max(), max_.exchange(0)));
+}
+
+}  // namespace perf
+}  // namespace dist_clang
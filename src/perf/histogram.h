@@ -0,0 +1,48 @@
+#pragma once
+
+#include <base/attributes.h>
+#include <base/types.h>
+
+namespace dist_clang {
+namespace perf {
+
+namespace proto {
+class Metric_Histogram;
+}  // namespace proto
+
+// Counts the values in log-linear buckets: each value below |kLinearLimit| has
+// its own bucket, and each next power of two is split into |kSubBuckets| equal
+// buckets - so the bucket is never wider than 1/8 of its lower bound. The
+// values from the last power of two and above fall into the last bucket.
+//
+// The counters are atomic, so the values may be added concurrently with the
+// draining - each one is drained exactly once.
+class Histogram {
+ public:
+  enum : ui32 {
+    kLinearLimit = 16,
+    kSubBuckets = 8,
+    kPowers = 28,  // From 2^4 up to 2^31.
+    kBuckets = kLinearLimit + kSubBuckets * kPowers,
+  };
+
+  static ui32 Bucket(ui64 value);
+  static ui64 LowerBound(ui32 bucket);
+  static ui64 UpperBound(ui32 bucket);
+
+  // Returns the upper estimate of the |percentile| of values - from 0 to 100.
+  static ui64 Percentile(const proto::Metric_Histogram& histogram,
+                         double percentile);
+
+  void Add(ui64 value) THREAD_SAFE;
+
+  // Moves the counters into |histogram|, merging them with the present ones.
+  void Drain(proto::Metric_Histogram* histogram) THREAD_SAFE;
+
+ private:
+  Array<Atomic<ui64>, kBuckets> buckets_ = {};
+  Atomic<ui64> max_ = {0};
+};
+
+}  // namespace perf
+}  // namespace dist_clang
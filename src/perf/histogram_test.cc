@@ -0,0 +1,71 @@
+#include <perf/histogram.h>
+
+#include <perf/stat.pb.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+namespace dist_clang {
+namespace perf {
+
+TEST(HistogramTest, BucketBounds) {
+  for (ui64 value = 0; value < Histogram::kLinearLimit; ++value) {
+    EXPECT_EQ(value, Histogram::Bucket(value));
+    EXPECT_EQ(value, Histogram::LowerBound(value));
+    EXPECT_EQ(value + 1, Histogram::UpperBound(value));
+  }
+
+  EXPECT_EQ(16u, Histogram::Bucket(16));
+  EXPECT_EQ(16u, Histogram::Bucket(17));
+  EXPECT_EQ(17u, Histogram::Bucket(18));
+  EXPECT_EQ(23u, Histogram::Bucket(31));
+  EXPECT_EQ(24u, Histogram::Bucket(32));
+  EXPECT_EQ(Histogram::kBuckets - 1, Histogram::Bucket(1ull << 40));
+
+  // The buckets go one after another - and are at most 1/8 as wide as their
+  // lower bound.
+  for (ui32 bucket = 0; bucket + 1 < Histogram::kBuckets; ++bucket) {
+    const ui64 lower = Histogram::LowerBound(bucket);
+    const ui64 upper = Histogram::UpperBound(bucket);
+    EXPECT_EQ(upper, Histogram::LowerBound(bucket + 1));
+    EXPECT_EQ(bucket, Histogram::Bucket(lower));
+    EXPECT_EQ(bucket, Histogram::Bucket(upper - 1));
+    EXPECT_LE(upper - lower, std::max<ui64>(1, lower / 8));
+  }
+}
+
+TEST(HistogramTest, DrainMergesAndResets) {
+  Histogram first, second;
+  for (ui64 value = 1; value <= 100; ++value) {
+    (value % 2 ? first : second).Add(value);
+  }
+
+  proto::Metric::Histogram histogram;
+  first.Drain(&histogram);
+  second.Drain(&histogram);
+  EXPECT_EQ(100u, histogram.count());
+  EXPECT_EQ(100u, histogram.max());
+
+  ui64 count = 0, previous_bound = 0;
+  for (const auto& bucket : histogram.buckets()) {
+    EXPECT_LE(previous_bound, bucket.lower_bound());
+    previous_bound = bucket.upper_bound();
+    count += bucket.count();
+  }
+  EXPECT_EQ(100u, count);
+
+  // The percentiles are overestimated by the bucket width at most.
+  EXPECT_EQ(1u, Histogram::Percentile(histogram, 0));
+  EXPECT_LE(50u, Histogram::Percentile(histogram, 50));
+  EXPECT_GE(55u, Histogram::Percentile(histogram, 50));
+  EXPECT_LE(99u, Histogram::Percentile(histogram, 99));
+  EXPECT_EQ(100u, Histogram::Percentile(histogram, 100));
+
+  proto::Metric::Histogram empty;
+  first.Drain(&empty);
+  EXPECT_EQ(0u, empty.count());
+  EXPECT_EQ(0u, empty.max());
+  EXPECT_EQ(0, empty.buckets_size());
+}
+
+}  // namespace perf
+}  // namespace dist_clang
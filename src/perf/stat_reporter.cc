@@ -6,11 +6,9 @@ namespace perf {
 StatReporter::StatReporter(proto::Metric::Name name) : name_(name) {}
 
 void StatReporter::Report(const TimePoint& start, const TimePoint& end) const {
-  // TODO: implement different types of metrics. Right now just report the time
-  //       difference in milliseconds.
   using namespace std::chrono;
 
-  base::Singleton<StatService>::Get().Add(
+  base::Singleton<StatService>::Get().Record(
       name_, duration_cast<milliseconds>(end - start).count());
 }
 
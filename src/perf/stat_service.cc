@@ -2,6 +2,8 @@
 
 #include <base/assert.h>
 
+#include STL(thread)
+
 namespace dist_clang {
 
 DEFINE_SINGLETON(perf::StatService)
@@ -9,23 +11,65 @@ DEFINE_SINGLETON(perf::StatService)
 namespace perf {
 
 StatService::StatService() {
-  for (auto& ptr : values_) {
-    ptr.reset(new Atomic<ui64>(0u));
+  for (auto& value : values_) {
+    value = 0u;
+  }
+  for (auto& shards : histograms_) {
+    for (auto& histogram : shards) {
+      histogram = nullptr;
+    }
+  }
+}
+
+StatService::~StatService() {
+  for (auto& shards : histograms_) {
+    for (auto& histogram : shards) {
+      delete histogram.load();
+    }
   }
 }
 
 void StatService::Add(proto::Metric::Name name, ui64 value) {
-  values_[name]->fetch_add(value);
+  values_[name].fetch_add(value);
+}
+
+void StatService::Record(proto::Metric::Name name, ui64 value) {
+  auto& shard = histograms_[name][ThreadShard()];
+  Histogram* histogram = shard;
+  if (!histogram) {
+    UniquePtr<Histogram> new_histogram(new Histogram);
+    if (shard.compare_exchange_strong(histogram, new_histogram.get())) {
+      histogram = new_histogram.release();
+    }
+  }
+
+  histogram->Add(value);
+  values_[name].fetch_add(value);
 }
 
 void StatService::Dump(proto::Metric& report) {
   CHECK(report.has_name());
 
-  auto name = report.name();
-  auto old_value = values_[name];
-  values_[name].reset(new Atomic<ui64>(0u));
+  const auto name = report.name();
+  report.set_value(values_[name].exchange(0));
+
+  report.clear_histogram();
+  for (auto& shard : histograms_[name]) {
+    Histogram* histogram = shard;
+    if (histogram) {
+      histogram->Drain(report.mutable_histogram());
+    }
+  }
+  if (report.has_histogram() && !report.histogram().count()) {
+    report.clear_histogram();
+  }
+}
 
-  report.set_value(*old_value);
+// static
+ui32 StatService::ThreadShard() {
+  thread_local const ui32 shard =
+      std::hash<std::thread::id>()(std::this_thread::get_id()) % kShards;
+  return shard;
 }
 
 }  // namespace perf
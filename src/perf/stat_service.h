@@ -1,6 +1,7 @@
 #pragma once
 
 #include <base/singleton.h>
+#include <perf/histogram.h>
 #include <perf/stat.pb.h>
 
 #pragma clang diagnostic push
@@ -13,15 +14,35 @@
 namespace dist_clang {
 namespace perf {
 
+// The histograms are sharded by threads - so the threads, which record the
+// same metric, don't fight for the same counters. The shards are merged on
+// dump.
 class StatService {
  public:
   StatService();
+  ~StatService();
 
-  void Add(proto::Metric::Name name, ui64 value = 1);
-  void Dump(proto::Metric& report);
+  void Add(proto::Metric::Name name, ui64 value = 1) THREAD_SAFE;
+
+  // Adds the |value| to the sum - and to the histogram of |name|.
+  void Record(proto::Metric::Name name, ui64 value) THREAD_SAFE;
+
+  // Moves the sum and the histogram - if there are recorded values - into the
+  // |report| and resets them. The concurrent records may get into the next
+  // dump, but none is lost or dumped twice.
+  void Dump(proto::Metric& report) THREAD_SAFE;
 
  private:
-  Array<SharedPtr<Atomic<ui64>>, proto::Metric::Name_ARRAYSIZE> values_;
+  enum : ui32 { kShards = 16 };
+
+  using Shards = Array<Atomic<Histogram*>, kShards>;
+
+  static ui32 ThreadShard();
+
+  Array<Atomic<ui64>, proto::Metric::Name_ARRAYSIZE> values_;
+
+  // The histogram of a shard is allocated on the first record.
+  Array<Shards, proto::Metric::Name_ARRAYSIZE> histograms_;
 };
 
 }  // namespace perf
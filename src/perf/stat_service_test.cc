@@ -1,5 +1,7 @@
 #include <perf/stat_service.h>
 
+#include <base/thread.h>
+
 #include <third_party/gtest/exported/include/gtest/gtest.h>
 
 namespace dist_clang {
@@ -30,5 +32,42 @@ TEST(StatServiceTest, AddAndDump) {
   EXPECT_EQ(0u, metric.value());
 }
 
+TEST(StatServiceTest, RecordAndDumpHistogram) {
+  proto::Metric metric;
+  metric.set_name(proto::Metric::SHARD_QUEUE_WAIT_TIME);
+  base::Singleton<StatService>::Get().Dump(metric);
+
+  // Each thread records into its own shard.
+  List<Thread> threads;
+  for (ui32 i = 0; i < 4; ++i) {
+    threads.emplace_back("Record"_l, [] {
+      for (ui64 value = 1; value <= 1000; ++value) {
+        base::Singleton<StatService>::Get().Record(
+            proto::Metric::SHARD_QUEUE_WAIT_TIME, value);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  base::Singleton<StatService>::Get().Dump(metric);
+  EXPECT_EQ(4 * 500500u, metric.value());
+  ASSERT_TRUE(metric.has_histogram());
+  EXPECT_EQ(4000u, metric.histogram().count());
+  EXPECT_EQ(1000u, metric.histogram().max());
+
+  base::Singleton<StatService>::Get().Dump(metric);
+  EXPECT_EQ(0u, metric.value());
+  EXPECT_FALSE(metric.has_histogram());
+
+  // The plain counters don't have a histogram.
+  metric.set_name(proto::Metric::DIRECT_CACHE_HIT);
+  base::Singleton<StatService>::Get().Add(proto::Metric::DIRECT_CACHE_HIT);
+  base::Singleton<StatService>::Get().Dump(metric);
+  EXPECT_EQ(1u, metric.value());
+  EXPECT_FALSE(metric.has_histogram());
+}
+
 }  // namespace perf
 }  // namespace dist_clang
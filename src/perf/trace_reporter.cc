@@ -0,0 +1,16 @@
+#include <perf/trace_reporter.h>
+
+#include <perf/trace_service.h>
+
+namespace dist_clang {
+namespace perf {
+
+TraceReporter::TraceReporter(Literal name, ui64 trace_id)
+    : name_(name), trace_id_(trace_id) {}
+
+void TraceReporter::Report(const TimePoint& start, const TimePoint& end) const {
+  base::Singleton<TraceService>::Get().Add(name_, trace_id_, start, end);
+}
+
+}  // namespace perf
+}  // namespace dist_clang
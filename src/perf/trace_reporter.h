@@ -0,0 +1,22 @@
+#pragma once
+
+#include <base/const_string.h>
+#include <perf/counter.h>
+
+namespace dist_clang {
+namespace perf {
+
+// Adds a span to the |TraceService| - if the task is traced.
+class TraceReporter : public Reporter {
+ public:
+  TraceReporter(Literal name, ui64 trace_id);
+
+ private:
+  void Report(const TimePoint& start, const TimePoint& end) const override;
+
+  const Literal name_;
+  const ui64 trace_id_;
+};
+
+}  // namespace perf
+}  // namespace dist_clang
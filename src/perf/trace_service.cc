@@ -0,0 +1,176 @@
+#include <perf/trace_service.h>
+
+#include <base/assert.h>
+#include <perf/trace.pb.h>
+
+#include STL(cstdio)
+
+#include <unistd.h>
+
+namespace dist_clang {
+
+DEFINE_SINGLETON(perf::TraceService)
+
+namespace perf {
+
+namespace {
+
+i64 ToMicroseconds(const std::chrono::nanoseconds& time) {
+  return std::chrono::duration_cast<Microseconds>(time).count();
+}
+
+// The steady clock doesn't tell the wall time - but it's needed to compare
+// the spans of different hosts.
+i64 WallOffset() {
+  const auto wall_time = std::chrono::system_clock::now().time_since_epoch();
+  return ToMicroseconds(wall_time) -
+         ToMicroseconds(Clock::now().time_since_epoch());
+}
+
+void AppendJsonString(const String& str, String* json) {
+  json->push_back('"');
+  for (const char c : str) {
+    if (c == '"' || c == '\\') {
+      json->push_back('\\');
+      json->push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      json->append(escaped);
+    } else {
+      json->push_back(c);
+    }
+  }
+  json->push_back('"');
+}
+
+}  // namespace
+
+TraceService::TraceService(ui32 capacity)
+    : slots_(capacity),
+      pid_(getpid()),
+      wall_offset_(WallOffset()) {
+  DCHECK(capacity > 0);
+}
+
+void TraceService::Add(Literal name, ui64 trace_id, ui64 start,
+                       ui64 duration) {
+  Put(name, trace_id, start, duration, pid_, ThreadId());
+}
+
+void TraceService::Add(Literal name, ui64 trace_id, const TimePoint& start,
+                       const TimePoint& end) {
+  Add(name, trace_id, WallTime(start), ToMicroseconds(end - start));
+}
+
+void TraceService::Merge(const proto::Span& span) {
+  if (!span.trace_id()) {
+    return;
+  }
+  Put(Intern(span.name()), span.trace_id(), span.start(), span.duration(),
+      span.pid(), span.tid());
+}
+
+void TraceService::Dump(ui64 trace_id, proto::Trace* trace) const {
+  DCHECK(trace);
+
+  const ui64 end = next_;
+  const ui64 begin = end > slots_.size() ? end - slots_.size() : 0;
+  for (ui64 index = begin; index < end; ++index) {
+    const Slot& slot = slots_[index % slots_.size()];
+
+    // The slot may be overwritten by a newer span - or still be written.
+    const ui64 sequence = slot.sequence;
+    if (sequence != 2 * index + 2) {
+      continue;
+    }
+    const char* name = slot.name;
+    const ui64 span_trace_id = slot.trace_id;
+    const ui64 start = slot.start;
+    const ui64 duration = slot.duration;
+    const ui64 pid = slot.pid;
+    const ui64 tid = slot.tid;
+    if (slot.sequence != sequence) {
+      continue;
+    }
+
+    if (trace_id && trace_id != span_trace_id) {
+      continue;
+    }
+
+    auto* span = trace->add_spans();
+    span->set_name(name);
+    span->set_trace_id(span_trace_id);
+    span->set_start(start);
+    span->set_duration(duration);
+    span->set_pid(pid);
+    span->set_tid(tid);
+  }
+}
+
+ui64 TraceService::WallTime(const TimePoint& time) const {
+  return ToMicroseconds(time.time_since_epoch()) + wall_offset_;
+}
+
+// static
+String TraceService::ToChromeTrace(const proto::Trace& trace) {
+  String json = "{\"traceEvents\":[";
+  bool first = true;
+  for (const auto& span : trace.spans()) {
+    if (!first) {
+      json += ",";
+    }
+    first = false;
+
+    json += "\n{\"name\":";
+    AppendJsonString(span.name(), &json);
+    json += ",\"ph\":\"X\",\"ts\":" + std::to_string(span.start()) +
+            ",\"dur\":" + std::to_string(span.duration()) +
+            ",\"pid\":" + std::to_string(span.pid()) +
+            ",\"tid\":" + std::to_string(span.tid()) +
+            ",\"args\":{\"trace_id\":\"" + std::to_string(span.trace_id()) +
+            "\"}}";
+  }
+  json += "\n]}\n";
+  return json;
+}
+
+// static
+ui64 TraceService::ThreadId() {
+  static Atomic<ui64> next_id = {1};
+  thread_local const ui64 id = next_id++;
+  return id;
+}
+
+void TraceService::Put(const char* name, ui64 trace_id, ui64 start,
+                       ui64 duration, ui64 pid, ui64 tid) {
+  if (!trace_id) {
+    return;
+  }
+
+  const ui64 index = next_++;
+  Slot& slot = slots_[index % slots_.size()];
+  slot.sequence = 2 * index + 1;
+  slot.name = name;
+  slot.trace_id = trace_id;
+  slot.start = start;
+  slot.duration = duration;
+  slot.pid = pid;
+  slot.tid = tid;
+  slot.sequence = 2 * index + 2;
+}
+
+const char* TraceService::Intern(const String& name) {
+  UniqueLock lock(names_mutex_);
+  auto it = names_.find(name);
+  if (it == names_.end()) {
+    if (names_.size() == kMaxMergedNames) {
+      return "Unknown";
+    }
+    it = names_.insert(name).first;
+  }
+  return it->c_str();
+}
+
+}  // namespace perf
+}  // namespace dist_clang
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <base/const_string.h>
+#include <base/singleton.h>
+
+namespace dist_clang {
+namespace perf {
+
+namespace proto {
+class Span;
+class Trace;
+}  // namespace proto
+
+// Keeps the recent spans of traced tasks in a ring buffer - the oldest spans
+// get overwritten. The spans are added without locks: each slot has its own
+// sequence number, and the readers skip the slots, which are being written.
+class TraceService {
+ public:
+  enum : ui32 { kDefaultCapacity = 1u << 14 };
+
+  explicit TraceService(ui32 capacity = kDefaultCapacity);
+
+  // The spans without a trace id aren't kept. The |start| and |duration| are
+  // in microseconds - see |WallTime()|.
+  void Add(Literal name, ui64 trace_id, ui64 start,
+           ui64 duration) THREAD_SAFE;
+  void Add(Literal name, ui64 trace_id, const TimePoint& start,
+           const TimePoint& end) THREAD_SAFE;
+
+  // Keeps the span of another process - like the ones returned by remotes.
+  void Merge(const proto::Span& span) THREAD_SAFE;
+
+  // Appends the kept spans of |trace_id| - or all of them, if it's zero - in
+  // the order of addition.
+  void Dump(ui64 trace_id, proto::Trace* trace) const THREAD_SAFE;
+
+  // Returns the microseconds since the Unix epoch.
+  ui64 WallTime(const TimePoint& time) const;
+
+  // Renders the spans as the Chrome trace JSON - it's loaded by
+  // chrome://tracing and Perfetto.
+  static String ToChromeTrace(const proto::Trace& trace);
+
+ private:
+  enum : ui32 { kMaxMergedNames = 1024 };
+
+  struct Slot {
+    Atomic<ui64> sequence = {0};  // Odd while the slot is being written.
+    Atomic<const char*> name = {nullptr};
+    Atomic<ui64> trace_id = {0};
+    Atomic<ui64> start = {0};
+    Atomic<ui64> duration = {0};
+    Atomic<ui64> pid = {0};
+    Atomic<ui64> tid = {0};
+  };
+
+  static ui64 ThreadId();
+
+  void Put(const char* name, ui64 trace_id, ui64 start, ui64 duration,
+           ui64 pid, ui64 tid) THREAD_SAFE;
+
+  // The slots keep only pointers - so the names of merged spans are kept
+  // forever. There are few of them, unless the remotes go wild.
+  const char* Intern(const String& name) THREAD_SAFE;
+
+  Vector<Slot> slots_;
+  Atomic<ui64> next_ = {0};
+
+  const ui64 pid_;
+  const i64 wall_offset_;  // in microseconds.
+
+  Mutex names_mutex_;
+  HashSet<String> names_;
+};
+
+}  // namespace perf
+
+DECLARE_SINGLETON(perf::TraceService)
+
+}  // namespace dist_clang
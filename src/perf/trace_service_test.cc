@@ -0,0 +1,98 @@
+#include <perf/trace_service.h>
+
+#include <base/thread.h>
+#include <perf/trace.pb.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+#include <unistd.h>
+
+namespace dist_clang {
+namespace perf {
+
+TEST(TraceServiceTest, AddAndDump) {
+  TraceService service(4);
+
+  const auto start = Clock::now();
+  service.Add("First"_l, 1, start, start + Milliseconds(2));
+  service.Add("Second"_l, 2, start, start + Milliseconds(3));
+  service.Add("Untraced"_l, 0, start, start + Milliseconds(4));
+
+  proto::Span remote;
+  remote.set_name("Remote");
+  remote.set_trace_id(1);
+  remote.set_start(service.WallTime(start) + 1000);
+  remote.set_duration(500);
+  remote.set_pid(12345);
+  remote.set_tid(1);
+  service.Merge(remote);
+
+  proto::Trace trace;
+  service.Dump(1, &trace);
+  ASSERT_EQ(2, trace.spans_size());
+  EXPECT_EQ("First", trace.spans(0).name());
+  EXPECT_EQ(service.WallTime(start), trace.spans(0).start());
+  EXPECT_EQ(2000u, trace.spans(0).duration());
+  EXPECT_EQ(static_cast<ui64>(getpid()), trace.spans(0).pid());
+  EXPECT_EQ(remote.SerializeAsString(), trace.spans(1).SerializeAsString());
+
+  trace.Clear();
+  service.Dump(0, &trace);
+  EXPECT_EQ(3, trace.spans_size());
+
+  // The oldest spans get overwritten.
+  service.Add("Third"_l, 2, start, start);
+  service.Add("Fourth"_l, 2, start, start);
+  trace.Clear();
+  service.Dump(1, &trace);
+  ASSERT_EQ(1, trace.spans_size());
+  EXPECT_EQ("Remote", trace.spans(0).name());
+}
+
+TEST(TraceServiceTest, ConcurrentAdds) {
+  TraceService service(1024);
+
+  List<Thread> threads;
+  for (ui64 trace_id = 1; trace_id <= 4; ++trace_id) {
+    threads.emplace_back("Trace"_l, [&service, trace_id] {
+      for (ui32 i = 0; i < 1000; ++i) {
+        const auto now = Clock::now();
+        service.Add("Span"_l, trace_id, now, now);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // Only the last spans are kept - and they're consistent.
+  proto::Trace trace;
+  service.Dump(0, &trace);
+  EXPECT_EQ(1024, trace.spans_size());
+  for (const auto& span : trace.spans()) {
+    EXPECT_EQ("Span", span.name());
+    EXPECT_LE(1u, span.trace_id());
+    EXPECT_GE(4u, span.trace_id());
+  }
+}
+
+TEST(TraceServiceTest, ChromeTrace) {
+  proto::Trace trace;
+  auto* span = trace.add_spans();
+  span->set_name("Say \"hi\"");
+  span->set_trace_id(42);
+  span->set_start(1000);
+  span->set_duration(20);
+  span->set_pid(1);
+  span->set_tid(2);
+
+  EXPECT_EQ(
+      "{\"traceEvents\":[\n"
+      "{\"name\":\"Say \\\"hi\\\"\",\"ph\":\"X\",\"ts\":1000,\"dur\":20,"
+      "\"pid\":1,\"tid\":2,\"args\":{\"trace_id\":\"42\"}}\n"
+      "]}\n",
+      TraceService::ToChromeTrace(trace));
+}
+
+}  // namespace perf
+}  // namespace dist_clang
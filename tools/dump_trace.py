@@ -0,0 +1,80 @@
+from net import universal_pb2
+from perf import trace_pb2
+from google.protobuf import text_format
+
+import socket
+import struct
+import sys
+import zlib
+
+
+def varint_encode(n):
+    result = ''
+    while n > 0x7f:
+        result += chr(0x80 | (n & 0x7f))
+        n >>= 7
+    return result + chr(n & 0x7f)
+
+
+def varint_decode(buf):
+    result = 0
+    i = 0
+    while ord(buf[i]) > 0x7f:
+        result += (ord(buf[i]) & 0x7f) << 7 * i
+        i += 1
+    result += ord(buf[i]) << 7 * i
+    i += 1
+    return result, buf[i:]
+
+
+def get_message(sock, msgtype):
+    data = ''
+    buf = ''
+    while True:
+        buf = sock.recv(1024)
+        if not buf:
+            break
+        data += buf
+    msg_buf = zlib.decompress(data)
+    packed_len, msg_buf = varint_decode(msg_buf)
+
+    msg = msgtype()
+    msg.ParseFromString(msg_buf)
+    return msg
+
+
+def send_message(sock, message):
+    s = message.SerializeToString()
+    packed_len = varint_encode(len(s))
+    sock.sendall(zlib.compress(packed_len + s))
+
+
+# Usage: dump_trace.py <host> <port> <path> [trace_id]
+#        dump_trace.py <unix socket> <path> [trace_id]
+#
+# The daemon writes the trace to the |path| on its own host - open it with
+# chrome://tracing or Perfetto.
+def Main(args):
+    if args[0].startswith('/'):
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.connect(args[0])
+        args = args[1:]
+    else:
+        s = socket.create_connection((args[0], args[1]))
+        args = args[2:]
+
+    m = universal_pb2.Universal()
+    dump = m.Extensions[trace_pb2.TraceDump.extension]
+    dump.path = args[0]
+    if len(args) > 1:
+        dump.trace_id = int(args[1])
+    send_message(s, m)
+
+    m = get_message(s, universal_pb2.Universal)
+    print text_format.MessageToString(m)
+
+    s.close()
+
+
+if __name__ == '__main__':
+    Main(sys.argv[1:])
@@ -0,0 +1,125 @@
+from net import universal_pb2
+from perf import stat_pb2
+
+import math
+import socket
+import struct
+import sys
+import time
+import zlib
+
+
+def varint_encode(n):
+    result = ''
+    while n > 0x7f:
+        result += chr(0x80 | (n & 0x7f))
+        n >>= 7
+    return result + chr(n & 0x7f)
+
+
+def varint_decode(buf):
+    result = 0
+    i = 0
+    while ord(buf[i]) > 0x7f:
+        result += (ord(buf[i]) & 0x7f) << 7 * i
+        i += 1
+    result += ord(buf[i]) << 7 * i
+    i += 1
+    return result, buf[i:]
+
+
+def get_message(sock, msgtype):
+    data = ''
+    buf = ''
+    while True:
+        buf = sock.recv(1024)
+        if not buf:
+            break
+        data += buf
+    msg_buf = zlib.decompress(data)
+    packed_len, msg_buf = varint_decode(msg_buf)
+
+    msg = msgtype()
+    msg.ParseFromString(msg_buf)
+    return msg
+
+
+def send_message(sock, message):
+    s = message.SerializeToString()
+    packed_len = varint_encode(len(s))
+    sock.sendall(zlib.compress(packed_len + s))
+
+
+def percentile(buckets, count, maximum, pct):
+    rank = max(1, int(math.ceil(count * pct / 100.0)))
+    seen = 0
+    for lower_bound in sorted(buckets):
+        upper_bound, bucket_count = buckets[lower_bound]
+        seen += bucket_count
+        if seen >= rank:
+            return min(upper_bound - 1, maximum)
+    return maximum
+
+
+# Usage: query_report.py <host> <port> [seconds] [reporter host]
+#
+# Sums up the metrics, which the daemons pushed to the collector in the last
+# |seconds| (an hour by default), and prints the cache hit rates and the
+# percentiles of timings - for the whole fleet or for a single reporter.
+def Main(args):
+    s = socket.create_connection((args[0], args[1]))
+    seconds = int(args[2]) if len(args) > 2 else 3600
+
+    m = universal_pb2.Universal()
+    query = m.Extensions[stat_pb2.Query.extension]
+    query.to = int(time.time()) + 1
+    setattr(query, 'from', query.to - seconds - 1)
+    if len(args) > 3:
+        query.host = args[3]
+    send_message(s, m)
+
+    m = get_message(s, universal_pb2.Universal)
+    s.close()
+
+    hosts = set()
+    values = {}
+    histograms = {}
+    for report in m.Extensions[stat_pb2.Query.extension].report:
+        hosts.add(report.host)
+        for metric in report.metric:
+            values[metric.name] = values.get(metric.name, 0) + metric.value
+            if not metric.HasField('histogram'):
+                continue
+            buckets, count, maximum = histograms.get(metric.name, ({}, 0, 0))
+            for bucket in metric.histogram.buckets:
+                old = buckets.get(bucket.lower_bound, (bucket.upper_bound, 0))
+                buckets[bucket.lower_bound] = (bucket.upper_bound,
+                                               old[1] + bucket.count)
+            histograms[metric.name] = (buckets,
+                                       count + metric.histogram.count,
+                                       max(maximum, metric.histogram.max))
+
+    print 'Hosts: %d' % len(hosts)
+    for name, value in sorted(values.items()):
+        print '%s: %d' % (stat_pb2.Metric.Name.Name(name), value)
+
+    for cache in ('DIRECT', 'SIMPLE'):
+        hits = values.get(stat_pb2.Metric.Name.Value(cache + '_CACHE_HIT'), 0)
+        misses = values.get(stat_pb2.Metric.Name.Value(cache + '_CACHE_MISS'),
+                            0)
+        if hits + misses:
+            print '%s cache hit rate: %.1f%%' % (
+                cache.lower(), 100.0 * hits / (hits + misses))
+
+    for name, (buckets, count, maximum) in sorted(histograms.items()):
+        if not count:
+            continue
+        print '%s: avg %d, p50 %d, p90 %d, p99 %d, max %d' % (
+            stat_pb2.Metric.Name.Name(name), values.get(name, 0) / count,
+            percentile(buckets, count, maximum, 50),
+            percentile(buckets, count, maximum, 90),
+            percentile(buckets, count, maximum, 99), maximum)
+
+
+if __name__ == '__main__':
+    Main(sys.argv[1:])